@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ALIGN_UP(size) (((size) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+#define BLOCK_HEADER_SIZE ALIGN_UP(sizeof(struct arena_block))
+
+static struct arena_block* arena_new_block(size_t capacity);
+
+static struct arena_block* arena_new_block(size_t capacity) {
+    struct arena_block *block = malloc(BLOCK_HEADER_SIZE + capacity);
+    if (!block) return NULL;
+    block->next = NULL;
+    block->used = 0;
+    block->capacity = capacity;
+    return block;
+}
+
+struct arena* arena_new(void) {
+    struct arena *arena = malloc(sizeof(struct arena));
+    if (!arena) return NULL;
+    arena->current = arena_new_block(ARENA_BLOCK_SIZE);
+    if (!arena->current) {
+        free(arena);
+        return NULL;
+    }
+    arena->total_allocated = 0;
+    return arena;
+}
+
+void arena_free(struct arena *arena) {
+    if (!arena) return;
+    struct arena_block *block = arena->current;
+    while (block) {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena);
+}
+
+/* Releases everything allocated from the arena while keeping it usable. The
+ * most recent full sized block is kept so that an arena reused for short
+ * lived allocations settles into a single block.
+ */
+void arena_reset(struct arena *arena) {
+    if (!arena) return;
+    struct arena_block *block = arena->current->next;
+    while (block) {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->current->next = NULL;
+    arena->current->used = 0;
+    arena->total_allocated = 0;
+}
+
+void* arena_alloc(struct arena *arena, size_t size) {
+    if (!arena) return NULL;
+    size = ALIGN_UP(size);
+
+    struct arena_block *block = arena->current;
+    if (block->capacity - block->used < size) {
+        if (size > ARENA_BLOCK_SIZE / 4) {
+            // oversized requests get a block of their own; it is placed
+            // behind the current block so the rest of that stays usable
+            block = arena_new_block(size);
+            if (!block) return NULL;
+            block->next = arena->current->next;
+            arena->current->next = block;
+        } else {
+            block = arena_new_block(ARENA_BLOCK_SIZE);
+            if (!block) return NULL;
+            block->next = arena->current;
+            arena->current = block;
+        }
+    }
+
+    void *result = (char*)block + BLOCK_HEADER_SIZE + block->used;
+    block->used += size;
+    arena->total_allocated += size;
+    return result;
+}
+
+void* arena_calloc(struct arena *arena, size_t size) {
+    void *result = arena_alloc(arena, size);
+    if (result) memset(result, 0, size);
+    return result;
+}
+
+char* arena_strdup(struct arena *arena, const char *text) {
+    size_t length = strlen(text);
+    char *new_str = arena_alloc(arena, length + 1);
+    if (new_str == NULL) return NULL;
+    memcpy(new_str, text, length + 1);
+    return new_str;
+}
+
+/* Copies the first *length* bytes of *text*, which need not be NUL
+ * terminated, and adds a terminator.
+ */
+char* arena_strndup(struct arena *arena, const char *text, size_t length) {
+    char *new_str = arena_alloc(arena, length + 1);
+    if (new_str == NULL) return NULL;
+    memcpy(new_str, text, length);
+    new_str[length] = 0;
+    return new_str;
+}
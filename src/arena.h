@@ -0,0 +1,31 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE    65536
+#define ARENA_ALIGNMENT     16
+
+/* A region allocator. Memory is handed out from large blocks and is only
+ * ever released all at once by arena_free.
+ */
+struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t capacity;
+};
+
+struct arena {
+    struct arena_block *current;
+    size_t total_allocated;
+};
+
+struct arena* arena_new(void);
+void arena_free(struct arena *arena);
+void arena_reset(struct arena *arena);
+void* arena_alloc(struct arena *arena, size_t size);
+void* arena_calloc(struct arena *arena, size_t size);
+char* arena_strdup(struct arena *arena, const char *text);
+char* arena_strndup(struct arena *arena, const char *text, size_t length);
+
+#endif
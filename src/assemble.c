@@ -20,6 +20,7 @@ int main(int argc, char *argv[]) {
     int flag_dump_patches = FALSE;
     int flag_dump_stringtable = FALSE;
     int flag_dump_debug = FALSE;
+    int flag_stream = FALSE;
     int filename_counter = 0;
     size_t timestamp_length = 0;
 
@@ -36,8 +37,28 @@ int main(int argc, char *argv[]) {
             flag_dump_stringtable = TRUE;
         } else if (strcmp(argv[i], "-dump-debug") == 0) {
             flag_dump_debug = TRUE;
+        } else if (strcmp(argv[i], "-stream") == 0) {
+            flag_stream = TRUE;
         } else if (strcmp(argv[i], "-no-time") == 0) {
             flag_timestamp_type = ts_notime;
+        } else if (strcmp(argv[i], "-threads") == 0) {
+            ++i;
+            if (i >= argc) {
+                fprintf(stderr, "-threads passed but no thread count provided\n");
+                return 1;
+            }
+            info.thread_count = atoi(argv[i]);
+            if (info.thread_count < 1) {
+                fprintf(stderr, "thread count must be at least 1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-token-cache") == 0) {
+            ++i;
+            if (i >= argc) {
+                fprintf(stderr, "-token-cache passed but no directory provided\n");
+                return 1;
+            }
+            info.token_cache = argv[i];
         } else if (strcmp(argv[i], "-start") == 0) {
             ++i;
             if (i >= argc) {
@@ -78,34 +99,73 @@ int main(int argc, char *argv[]) {
         case ts_custom:
             break;
         case ts_standard:
-            snprintf(info.timestamp, MAX_TIMESTAMP_SIZE,
-                    "%d%02d%02d%02d%02d",
-                    tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
-                    tm.tm_hour, tm.tm_min);
+            strftime(info.timestamp, MAX_TIMESTAMP_SIZE, "%Y%m%d%H%M", &tm);
             break;
         case ts_notime:
-            snprintf(info.timestamp, MAX_TIMESTAMP_SIZE,
-                    "%d%02d%02d",
-                    tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+            strftime(info.timestamp, MAX_TIMESTAMP_SIZE, "%Y%m%d", &tm);
             break;
     }
 
-    struct token_list *tokens = lex_file(infile);
-    if (tokens == NULL) {
-        printf("Errors occured during lexing.\n");
+    info.arena = arena_new();
+    if (info.arena == NULL) {
+        fprintf(stderr, "Could not allocate memory.\n");
         return 1;
     }
 
-    if (flag_dump_pretokens) {
-        FILE *tokens_file = fopen("out_pretokens.txt", "wt");
-        dump_token_list(tokens_file, tokens);
-        fclose(tokens_file);
+    if (flag_stream && strcmp(infile, "-") == 0) {
+        fprintf(stderr, "-stream cannot be used when reading from stdin\n");
+        arena_free(info.arena);
+        return 1;
     }
 
-    if (!parse_preprocess(tokens, &info)) {
-        printf("Errors occured during preprocessing.\n");
+    info.symbols = symbol_table_new(info.arena);
+    if (info.symbols == NULL) {
+        fprintf(stderr, "Could not allocate memory.\n");
+        arena_free(info.arena);
         return 1;
     }
+
+    struct token_list *tokens = NULL;
+    if (flag_stream) {
+        // the program is read twice, a line at a time, and never held
+        // in memory as a whole
+        if (flag_dump_pretokens) {
+            fprintf(stderr, "-dump-pretokens is not available with -stream\n");
+        }
+        if (!stream_preprocess(infile, &info)) {
+            printf("Errors occured during preprocessing.\n");
+            free_string_table(&info.strings);
+            lex_close_sources(&info);
+            symbol_table_free(info.symbols);
+            arena_free(info.arena);
+            return 1;
+        }
+    } else {
+        tokens = lex_file(infile, &info);
+        if (tokens == NULL) {
+            printf("Errors occured during lexing.\n");
+            lex_close_sources(&info);
+            symbol_table_free(info.symbols);
+            arena_free(info.arena);
+            return 1;
+        }
+
+        if (flag_dump_pretokens) {
+            FILE *tokens_file = fopen("out_pretokens.txt", "wt");
+            dump_token_list(tokens_file, tokens);
+            fclose(tokens_file);
+        }
+
+        if (!parse_preprocess(tokens, &info)) {
+            printf("Errors occured during preprocessing.\n");
+            free_string_table(&info.strings);
+            free_token_list(tokens);
+            lex_close_sources(&info);
+            symbol_table_free(info.symbols);
+            arena_free(info.arena);
+            return 1;
+        }
+    }
     string_build_tree(&info.strings);
 
     if (flag_dump_stringtable) {
@@ -114,10 +174,12 @@ int main(int argc, char *argv[]) {
         fclose(strings_file);
     }
 
+    FILE *tokens_file = NULL;
     if (flag_dump_tokens) {
-        FILE *tokens_file = fopen("out_tokens.txt", "wt");
-        dump_token_list(tokens_file, tokens);
-        fclose(tokens_file);
+        tokens_file = fopen("out_tokens.txt", "wt");
+        if (tokens && tokens_file) {
+            dump_token_list(tokens_file, tokens);
+        }
     }
 
     if (flag_dump_debug) {
@@ -128,15 +190,28 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if (!parse_tokens(tokens, &info)) {
-        printf("Errors occured during parse & build.\n");
-        if (remove(info.output_file) != 0) {
-            perror("Could not remove failed build file");
-        }
+    // keep messages out of the program when it is sent to stdout
+    FILE *messages = strcmp(info.output_file, "-") == 0 ? stderr : stdout;
+    int result;
+    if (flag_stream) {
+        result = stream_parse(infile, &info, tokens_file);
+    } else {
+        result = parse_tokens(tokens, &info);
+    }
+    if (tokens_file) {
+        fclose(tokens_file);
+    }
+
+    // the output file is only written once the program has been built, so
+    // there is nothing to clean up if it failed
+    if (!result) {
+        fprintf(messages, "Errors occured during parse & build.\n");
         free_string_table(&info.strings);
-        free_patches(info.patch_list);
-        free_labels(info.first_label);
         free_token_list(tokens);
+        labels_free(&info);
+        lex_close_sources(&info);
+        symbol_table_free(info.symbols);
+        arena_free(info.arena);
         return 1;
     }
 
@@ -157,14 +232,16 @@ int main(int argc, char *argv[]) {
     }
 
     if (info.strings.input_bytes > 0) {
-        printf("Compressed %d bytes of text into %d bytes.\n",
+        fprintf(messages, "Compressed %d bytes of text into %d bytes.\n",
                 info.strings.input_bytes,
                 info.strings.output_bytes);
     }
 
     free_string_table(&info.strings);
-    free_patches(info.patch_list);
-    free_labels(info.first_label);
     free_token_list(tokens);
+    labels_free(&info);
+    lex_close_sources(&info);
+    symbol_table_free(info.symbols);
+    arena_free(info.arena);
     return 0;
 }
@@ -1,13 +1,20 @@
 #ifndef ASSEMBLE_H
 #define ASSEMBLE_H
 
+#include <stdarg.h>
 #include <stdio.h>
+#include "arena.h"
 #include "utility.h"
 
 #define MAX_TIMESTAMP_SIZE  13
 #define HEADER_SIZE     64
 #define MAX_OPERANDS    12
 #define STRING_TABLE_BUCKETS    127
+#define INITIAL_TOKEN_CAPACITY  64
+
+#define EVAL_KNOWN      1
+#define EVAL_UNKNOWN    0
+#define EVAL_INVALID    -1
 
 #ifndef TRUE
 #define TRUE 1
@@ -16,6 +23,12 @@
 #define FALSE 0
 #endif
 
+struct mapped_file;
+struct symbol_table;
+struct source_file;
+struct include_set;
+struct vbuffer;
+
 enum token_type {
     tt_bad,
     tt_identifier,
@@ -27,7 +40,10 @@ enum token_type {
     tt_colon,
     tt_indirect,
     tt_comma,
-    tt_eol
+    tt_open_paren,
+    tt_close_paren,
+    tt_eol,
+    tt_eof      // marks the end of a token list; never produced by the lexer
 };
 
 enum operator_type {
@@ -52,6 +68,39 @@ enum operand_type {
     ot_afterram
 };
 
+/* Symbols entered into every symbol table, in this order, so that their IDs
+ * are fixed. The mnemonics follow, in the order they appear in codes[].
+ */
+enum builtin_symbol {
+    sym_define,
+    sym_cstring,
+    sym_string,
+    sym_unicode,
+    sym_encoded,
+    sym_byte,
+    sym_short,
+    sym_word,
+    sym_pad,
+    sym_zero,
+    sym_function,
+    sym_end_header,
+    sym_extra_memory,
+    sym_stack_size,
+    sym_include,
+    sym_include_binary,
+    sym_include_once,
+    sym_string_table,
+    sym_last_directive = sym_string_table,
+    sym_sp,
+    sym_stk,
+    sym_opcode,
+    sym_rel,
+    sym_ramstart,
+    sym_extstart,
+    sym_endmem,
+    sym_first_mnemonic
+};
+
 enum string_node_type {
     nt_branch   = 0,
     nt_end      = 1,
@@ -63,33 +112,70 @@ enum string_node_type {
  * originated from.
  */
 struct origin {
-    char *filename;     // name of the file item originated on
-    int line, column;   // line and column item originated on
-    int dynamic;        // item was dynamically generated; no origin file exists
+    const char *filename;   // name of the file item originated on (shared)
+    int line, column;       // line and column item originated on
 };
 
 struct local_list {
-    char *name;
+    int symbol;
     struct local_list *next;
 };
 
-struct token {
+struct local_label {
+    int symbol;
+    int pos;
+};
+
+/* A .define whose value was not known when it was reached. It waits on the
+ * first undefined name in its value and is tried again when that name is
+ * defined.
+ */
+struct pending_define {
+    int symbol;
+    int value;              // offset of the value in the expression code
+    int waiting_on;         // symbol ID of the name it last waited on
     struct origin origin;
+    int resolved;           // defined, or given up on
+    int failed;
+    int visited;            // used when looking for cycles
+    struct pending_define *next;            // every pending define
+    struct pending_define *next_waiting;    // others waiting on the same name
+};
 
+struct define_slot {
+    struct pending_define *define;      // pending define of this symbol
+    struct pending_define *waiting;     // pending defines that use it
+};
+
+/* A single token. These are stored by value in a token_list, so the token
+ * following any token other than tt_eof is always at token + 1. For
+ * identifiers and directives, i holds the symbol ID of the text and the text
+ * is the symbol's name. For strings, i holds the length of the text in bytes;
+ * the text is not NUL terminated and usually points straight into the source
+ * file, which is kept open until assembly is finished.
+ */
+struct token {
     enum token_type type;
-    char *text;
     int i;
-
-    struct token *prev;
-    struct token *next;
+    const char *text;
+    struct origin origin;
 };
 
+/* Current position of the lexer within a source buffer. The text does not
+ * need to be NUL terminated; the lexer treats text_length as the end.
+ */
 struct lexer_state {
     struct origin origin;
 
     size_t text_pos;
     size_t text_length;
-    char *text;
+    const char *text;
+
+    struct arena *arena;    // storage for the tokens created
+    struct symbol_table *symbols;
+    struct vbuffer *diagnostics;    // if not NULL, errors are kept here
+                                    // rather than printed
+    int error_count;        // number of lines containing errors
 };
 
 struct operand {
@@ -97,17 +183,23 @@ struct operand {
     enum operand_type type;
     int value;
     int known_value;
-    int force_4byte;
-    char *name;
+    int size;               // encoding: 0, 1 or 2 bytes, or 3 for four
+    int code;               // expression code, if the value is not known
+    int symbol;             // symbol ID of the identifier, or -1
     enum operator_type op_type;
     struct operand *left, *right;
     struct operand *next;
-    int dont_free;
 };
 
+/* A contiguous array of tokens. tokens[count] always exists and is a tt_eof
+ * token, so code walking the list can stop on that instead of checking the
+ * count. Token text is allocated from the list's arena.
+ */
 struct token_list {
-    struct token *first;
-    struct token *last;
+    struct token *tokens;
+    size_t count;
+    size_t capacity;
+    struct arena *arena;
 };
 
 struct backpatch {
@@ -116,17 +208,42 @@ struct backpatch {
     int position_after;
     int value_final;
     int max_width;
-    struct operand *operand_chain;
+    int sign_extended;      // the value is read back sign extended
+    int code;               // offset of the value in the expression code
+    int operand_number;     // the relative operand the value belongs to,
+                            // counted as in layout_state
     struct backpatch *next;
 };
 
 struct label_def {
-    char *name;
+    const char *name;
+    int symbol;
     int pos;
     struct label_def *next;
 };
 
 
+/* The program is assembled in passes until no label moves, so that every
+ * operand can be given the smallest encoding that holds its value. Operand
+ * sizes only ever grow from one pass to the next, which guarantees that
+ * the passes settle. Each pass sizes operands it cannot yet evaluate from
+ * the labels of the pass before.
+ */
+struct layout_state {
+    int pass;               // passes begun so far
+    int changed;            // a label moved during the latest pass
+    unsigned char *operand_sizes;       // encoding of each instruction
+                                        // operand, in the order reached
+    int operand_size_count, operand_size_capacity;
+    struct local_label *local_labels;   // local labels defined, in order;
+                                        // a symbol of -1 ends each scope
+    int local_label_count, local_label_capacity;
+    struct local_label *previous_local_labels;
+    int previous_local_label_count;
+    FILE *debug_file;       // where the listing of the last pass goes;
+                            // each pass lists to a scratch file
+};
+
 struct mnemonic {
     const char *name;
     int opcode;
@@ -134,6 +251,24 @@ struct mnemonic {
     int last_operand_is_relative;
 };
 
+/* Maps names to small integer IDs, so that names can be compared by ID. The
+ * names are stored in the table's arena and remain valid for its lifetime.
+ */
+struct symbol {
+    const char *name;
+    size_t length;
+    unsigned hash;
+};
+struct symbol_table {
+    struct symbol *symbols;
+    int count;
+    int capacity;
+    int *buckets;           // open addressed; -1 marks an empty bucket
+    int bucket_mask;
+    int mnemonic_end;       // first ID after the mnemonics
+    struct arena *arena;
+};
+
 
 struct string_node;
 struct string_node_branch {
@@ -178,71 +313,204 @@ struct program_info {
 
     struct string_table strings;
 
+    // all tokens, operands, labels, and backpatches are allocated from here
+    // and released together once assembly is finished
+    struct arena *arena;
+    struct symbol_table *symbols;
+    struct source_file *sources;    // files whose text tokens refer to
+    int thread_count;       // threads used to lex included files; 0 means
+                            // one per processor
+    const char *token_cache;    // directory for saved tokens of included
+                                // files, or NULL to always lex them
+
     struct label_def *first_label;
+    struct label_def **label_index;     // labels by symbol ID
+    int label_index_size;
+    struct label_def **previous_labels; // label_index of the previous pass
+    int previous_label_index_size;
     struct backpatch *patch_list;
+    struct layout_state layout;
 
     FILE *debug_out;
 };
 
+/* Produces the tokens of a program one line at a time, following .include
+ * directives as they are reached. Only the current line is kept; its tokens
+ * and their text are discarded by the next call to stream_next_line.
+ */
+struct stream_frame;
+struct stream_name;
+struct source_stream {
+    struct stream_frame *top;   // innermost file being read
+    struct stream_name *included;   // every file read so far
+    struct stream_frame *finished;  // file the current line came from, if
+                                    // it has been read to the end
+    struct arena *arena;        // storage for filenames
+    struct symbol_table *symbols;
+    struct arena *scratch;      // storage for the text of the current line
+    struct token_list *line;
+    int error_count;
+};
+
+/* Operand expressions that could not be evaluated when they were parsed,
+ * stored one after another as postfix code. They are evaluated with a
+ * small stack machine once the names they use are defined. Identical
+ * expressions are stored once and found through a hash of their code.
+ */
+struct expr_entry {
+    int start;
+    int length;
+    unsigned hash;
+};
+struct expr_code {
+    struct vbuffer *code;
+    int *stack;
+    int stack_size;
+    struct expr_entry *entries;     // each distinct expression
+    int entry_count, entry_capacity;
+    int *buckets;           // open addressed; -1 marks an empty bucket
+    int bucket_mask;
+};
+
 struct output_state {
     struct program_info *info;
     int in_header;
+    struct arena *operands;     // operand trees of the current line
+    struct expr_code code;      // expressions of backpatches and defines
 
     int code_position;
     const char *current_function;
     struct local_list *local_names;
     int local_count;
-
-    FILE *out;
+    int *local_index;       // local number + 1 for each symbol, indexed by ID
+    int local_index_size;
+    struct local_label *local_labels;   // labels defined in the current function
+    int local_label_count, local_label_capacity;
+    int *local_label_index; // position in local_labels + 1, indexed by ID
+    int local_label_index_size;
+    int *local_label_uses;  // expression code naming undefined local labels
+    int local_label_use_count, local_label_use_capacity;
+    struct define_slot *define_slots;   // indexed by symbol ID
+    int define_slot_count;
+    struct pending_define *first_define;
+
+    int operand_number;     // instruction operands reached so far this pass
+    int estimate_is_exact;  // the latest estimate used nothing from the
+                            // previous pass
+    int *local_estimate_index;  // position in the previous pass's local
+                                // labels + 1, for the current scope
+    int local_estimate_index_size;
+    int previous_scope;     // start of the current scope in the previous
+                            // pass's local labels
+
+    struct vbuffer *image;  // the program as assembled so far
 };
 
 void copy_origin(struct origin *dest, struct origin *src);
-void copy_origin(struct origin *dest, struct origin *src);
-void free_origin(struct origin *origin);
 
 void free_string_table(struct string_table *table);
 void string_table_add(struct string_table *table, unsigned c);
-void string_add_to_frequencies(struct string_table *table, const char *string);
+void string_add_to_frequencies(struct string_table *table, const char *string, size_t length);
 int node_list_size(struct string_node *node);
 int node_size(struct string_node *node);
 void string_build_tree(struct string_table *table);
-int encode_string(FILE *out, struct string_table *table, const char *text);
+int encode_string(struct vbuffer *out, struct string_table *table, const char *text, size_t length);
 void dump_string_frequencies(FILE *dest, struct string_table *table);
 
-struct token* new_token(enum token_type type, const char *text, struct lexer_state *state);
-struct token* new_rawint_token(int value, struct lexer_state *state);
+struct token* new_token(struct token_list *list, enum token_type type, const char *text, struct lexer_state *state);
+struct token* new_rawint_token(struct token_list *list, int value, struct lexer_state *state);
+struct token* new_text_token(struct token_list *list, enum token_type type, const char *text, int i, struct lexer_state *state);
 const char *token_name(struct token *t);
 const char *token_type_name(enum token_type type);
-struct token_list* init_token_list(void);
-void add_token(struct token_list *list, struct token *new_token);
-void remove_token(struct token_list *list, struct token *token);
-void free_token(struct token *token);
+struct token_list* init_token_list(struct arena *arena);
 void free_token_list(struct token_list *list);
-void merge_token_list(struct token_list *dest, struct token_list *src, struct token *after);
+struct token_list* copy_token_list(struct token_list *list);
+int token_list_reserve(struct token_list *list, size_t capacity);
+struct token* add_token(struct token_list *list, const struct token *token);
+void remove_tokens(struct token_list *list, size_t start, size_t count);
+int merge_token_list(struct token_list *dest, struct token_list *src, size_t position);
 void dump_token_list(FILE *dest, struct token_list *list);
 
-struct token_list* lex_file(const char *filename);
+int lex_open(struct lexer_state *state, struct mapped_file *source,
+             const char *filename, struct arena *arena, struct symbol_table *symbols);
+struct token_list* lex_source(const char *filename, struct arena *arena, struct symbol_table *symbols,
+                              struct vbuffer *diagnostics, const char *cache_dir,
+                              struct source_file **file);
+struct token_list* lex_file(const char *filename, struct program_info *info);
+void lex_add_source(struct program_info *info, struct source_file *file, struct arena *arena);
+void lex_close_sources(struct program_info *info);
 struct token_list* lex_core(struct lexer_state *state);
-
-int add_label(struct label_def **first_lbl, const char *name, int value);
-struct label_def* get_label(struct label_def *first, const char *name);
+int lex_line(struct lexer_state *state, struct token_list *tokens);
+
+char* tokcache_filename(const char *cache_dir, const char *text, size_t text_length);
+struct token_list* tokcache_load(const char *cache_dir, struct lexer_state *state);
+int tokcache_save(const char *cache_dir, struct lexer_state *state, struct token_list *tokens);
+
+struct symbol_table* symbol_table_new(struct arena *arena);
+void symbol_table_free(struct symbol_table *table);
+int symbol_lookup(struct symbol_table *table, const char *text, size_t length);
+int symbol_intern(struct symbol_table *table, const char *text, size_t length);
+const char* symbol_name(struct symbol_table *table, int id);
+struct mnemonic* symbol_mnemonic(struct symbol_table *table, int id);
+
+int add_label(struct program_info *info, int symbol, int value);
+struct label_def* get_label(struct program_info *info, int symbol);
+void labels_begin_pass(struct program_info *info);
+void labels_free(struct program_info *info);
+struct label_def* get_previous_label(struct program_info *info, int symbol);
+int labels_moved(struct program_info *info);
 void dump_labels(FILE *dest, struct label_def *first);
-void free_labels(struct label_def *first);
 void dump_patches(FILE *dest, struct program_info *info);
-void free_patches(struct backpatch *first);
 
 int expect_eol(struct token **current);
 int expect_type(struct token *current, enum token_type type);
 struct token* remove_line(struct token_list *list, struct token *start);
 void skip_line(struct token **current);
 void report_error(struct origin *origin, const char *err_text, ...);
-int matches_text(struct token *token, enum token_type type, const char *text);
+void vreport_error(struct vbuffer *log, struct origin *origin, const char *err_text, va_list args);
+int matches_symbol(struct token *token, enum token_type type, int symbol);
 
 int parse_preprocess(struct token_list *tokens, struct program_info *info);
-int parse_tokens(struct token_list *list, struct program_info *info);
+int preprocess_encoded(struct token *here, struct program_info *info);
+int preprocess_check_include(struct token *here, int report);
+int is_include_directive(struct token *here);
+const char* include_canonical_name(const char *filename, struct arena *arena);
+struct include_set* lex_includes(struct token_list *tokens, struct program_info *info);
+struct token_list* include_next(struct include_set *set, struct token *here, struct program_info *info);
+void include_set_free(struct include_set *set, struct program_info *info);
 
-void free_operands(struct operand *first_operand);
-struct operand* new_operand();
+int parse_tokens(struct token_list *list, struct program_info *info);
+int parse_begin(struct output_state *output);
+int parse_line(struct token **current, struct output_state *output);
+int parse_finish(struct output_state *output, int has_errors);
+int parse_next_pass(struct program_info *info);
+
+int stream_open(struct source_stream *stream, const char *filename,
+                struct arena *arena, struct symbol_table *symbols);
+struct token_list* stream_next_line(struct source_stream *stream);
+void stream_close(struct source_stream *stream);
+int stream_preprocess(const char *filename, struct program_info *info);
+int stream_parse(const char *filename, struct program_info *info, FILE *tokens_out);
+
+struct operand* new_operand(struct arena *arena);
+
+int exprcode_length(const struct expr_code *code);
+int exprcode_constant(struct expr_code *code, int value);
+int exprcode_symbol(struct expr_code *code, int symbol);
+int exprcode_operator(struct expr_code *code, enum operator_type op_type);
+int exprcode_end(struct expr_code *code);
+int exprcode_share(struct expr_code *code, int start);
+void exprcode_bind(struct expr_code *code, int offset, int value);
+void exprcode_free(struct expr_code *code);
+int exprcode_symbol_at(const struct expr_code *code, int offset);
+int exprcode_next_symbol(const struct expr_code *code, int *offset);
+int exprcode_apply(enum operator_type op_type, int left, int right, int *result);
+const char* exprcode_apply_error(enum operator_type op_type, int right);
+int exprcode_negate(int value);
+int exprcode_eval(struct expr_code *code, struct program_info *info, int start,
+                  struct origin *origin, int *value, int *unknown);
+int exprcode_estimate(struct expr_code *code, int start, int (*lookup)(void*, int, int*),
+                      void *context, int *value);
 
 extern struct mnemonic codes[];
 
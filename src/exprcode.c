@@ -0,0 +1,392 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assemble.h"
+#include "vbuffer.h"
+
+/* Operand expressions that cannot be evaluated when they are parsed are
+ * stored as postfix code in a single buffer shared by every expression.
+ * Each instruction is one byte, followed by a four byte argument for
+ * constants and symbols. Operators use their operator_type as their code;
+ * the other instructions use codes above those.
+ */
+#define XC_END          0x40
+#define XC_CONSTANT     0x41    // followed by the value
+#define XC_SYMBOL       0x42    // followed by the symbol ID
+#define XC_ARG_SIZE     4
+#define INITIAL_STACK_SIZE  32
+#define INITIAL_ENTRY_CAPACITY  128
+
+static int emit(struct expr_code *code, int instruction, int has_argument, int argument);
+static unsigned code_hash(const char *text, int length);
+static int grow_entries(struct expr_code *code);
+static int read_argument(const struct expr_code *code, int offset);
+static int push_value(struct expr_code *code, int depth, int value);
+static int lookup_label(void *context, int symbol, int *value);
+static int run_code(struct expr_code *code, int start, int (*lookup)(void*, int, int*), void *context,
+                    struct origin *origin, int *value, int *unknown);
+
+/* ************************************************************************** *
+ * BUILDING CODE                                                              *
+ * ************************************************************************** */
+
+/* Adds an instruction to the end of *code*. Returns its offset, or -1 if
+ * memory runs out.
+ */
+static int emit(struct expr_code *code, int instruction, int has_argument, int argument) {
+    if (!code->code) {
+        code->code = vbuffer_new();
+        if (!code->code) return -1;
+    }
+    int offset = code->code->length;
+    int result = vbuffer_pushchar(code->code, instruction)
+              && (!has_argument || vbuffer_pushword(code->code, argument));
+    if (!result) {
+        code->code->length = offset;
+        return -1;
+    }
+    return offset;
+}
+
+/* Returns the offset at which the next instruction will be added. */
+int exprcode_length(const struct expr_code *code) {
+    return code->code ? code->code->length : 0;
+}
+
+int exprcode_constant(struct expr_code *code, int value) {
+    return emit(code, XC_CONSTANT, TRUE, value);
+}
+
+int exprcode_symbol(struct expr_code *code, int symbol) {
+    return emit(code, XC_SYMBOL, TRUE, symbol);
+}
+
+int exprcode_operator(struct expr_code *code, enum operator_type op_type) {
+    return emit(code, op_type, FALSE, 0);
+}
+
+int exprcode_end(struct expr_code *code) {
+    return emit(code, XC_END, FALSE, 0);
+}
+
+/* Replaces the symbol instruction at *offset* with the constant *value*. */
+void exprcode_bind(struct expr_code *code, int offset, int value) {
+    unsigned char *here = (unsigned char*)&code->code->data[offset];
+    unsigned bits = value;
+    here[0] = XC_CONSTANT;
+    here[1] = (bits >> 24) & 0xFF;
+    here[2] = (bits >> 16) & 0xFF;
+    here[3] = (bits >> 8) & 0xFF;
+    here[4] = bits & 0xFF;
+}
+
+void exprcode_free(struct expr_code *code) {
+    vbuffer_free(code->code);
+    free(code->stack);
+    free(code->entries);
+    free(code->buckets);
+    memset(code, 0, sizeof(struct expr_code));
+}
+
+/* ************************************************************************** *
+ * SHARING EXPRESSIONS                                                        *
+ * ************************************************************************** */
+
+/* Generated code often uses the same forward expression in many places, as
+ * with "object_table + 12". Each expression is entered in a hash table once
+ * it is complete, and an expression already in the table is removed again
+ * in favour of the earlier copy. Every backpatch using an expression then
+ * refers to the same code, which is evaluated only once; see exprcode_eval.
+ */
+
+static unsigned code_hash(const char *text, int length) {
+    unsigned hash = 2166136261u;
+    for (int i = 0; i < length; ++i) {
+        hash ^= (unsigned char)text[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Doubles the number of expressions the table can hold and rebuilds the
+ * hash buckets, which are kept at no more than half full.
+ */
+static int grow_entries(struct expr_code *code) {
+    int new_capacity = code->entry_capacity ? code->entry_capacity * 2 : INITIAL_ENTRY_CAPACITY;
+    struct expr_entry *new_entries = realloc(code->entries, sizeof(struct expr_entry) * new_capacity);
+    if (!new_entries) return FALSE;
+    code->entries = new_entries;
+
+    int *new_buckets = malloc(sizeof(int) * new_capacity * 2);
+    if (!new_buckets) return FALSE;
+    for (int i = 0; i < new_capacity * 2; ++i) {
+        new_buckets[i] = -1;
+    }
+    free(code->buckets);
+    code->buckets = new_buckets;
+    code->bucket_mask = new_capacity * 2 - 1;
+    code->entry_capacity = new_capacity;
+
+    for (int i = 0; i < code->entry_count; ++i) {
+        unsigned bucket = code->entries[i].hash & code->bucket_mask;
+        while (code->buckets[bucket] >= 0) {
+            bucket = (bucket + 1) & code->bucket_mask;
+        }
+        code->buckets[bucket] = i;
+    }
+    return TRUE;
+}
+
+/* Looks for an earlier copy of the expression that starts at *start* and
+ * runs to the end of the code. If there is one the new copy is discarded
+ * and the offset of the earlier one returned; otherwise the expression is
+ * entered in the table and *start* returned. An expression that will be
+ * changed later, by exprcode_bind, must not be shared.
+ */
+int exprcode_share(struct expr_code *code, int start) {
+    const char *text = &code->code->data[start];
+    int length = code->code->length - start;
+    unsigned hash = code_hash(text, length);
+
+    if (code->buckets) {
+        unsigned bucket = hash & code->bucket_mask;
+        while (code->buckets[bucket] >= 0) {
+            struct expr_entry *entry = &code->entries[code->buckets[bucket]];
+            if (entry->hash == hash && entry->length == length
+                    && memcmp(&code->code->data[entry->start], text, length) == 0) {
+                code->code->length = start;
+                return entry->start;
+            }
+            bucket = (bucket + 1) & code->bucket_mask;
+        }
+    }
+
+    // an expression that cannot be entered is still usable, just not shared
+    if (code->entry_count >= code->entry_capacity && !grow_entries(code)) {
+        return start;
+    }
+    int id = code->entry_count++;
+    struct expr_entry *entry = &code->entries[id];
+    entry->start = start;
+    entry->length = length;
+    entry->hash = hash;
+
+    unsigned bucket = hash & code->bucket_mask;
+    while (code->buckets[bucket] >= 0) {
+        bucket = (bucket + 1) & code->bucket_mask;
+    }
+    code->buckets[bucket] = id;
+    return start;
+}
+
+/* ************************************************************************** *
+ * READING CODE                                                               *
+ * ************************************************************************** */
+
+static int read_argument(const struct expr_code *code, int offset) {
+    const unsigned char *here = (const unsigned char*)&code->code->data[offset + 1];
+    unsigned value = ((unsigned)here[0] << 24) | ((unsigned)here[1] << 16)
+                   | ((unsigned)here[2] << 8) | here[3];
+    return (int)value;
+}
+
+/* Returns the symbol ID used by the instruction at *offset*, or -1 if it
+ * is not a symbol.
+ */
+int exprcode_symbol_at(const struct expr_code *code, int offset) {
+    if ((unsigned char)code->code->data[offset] != XC_SYMBOL) {
+        return -1;
+    }
+    return read_argument(code, offset);
+}
+
+/* Finds the next symbol instruction in the expression, starting at
+ * *offset*. Returns its symbol ID and leaves *offset* just after it, or
+ * returns -1 at the end of the expression.
+ */
+int exprcode_next_symbol(const struct expr_code *code, int *offset) {
+    while (TRUE) {
+        int instruction = (unsigned char)code->code->data[*offset];
+        if (instruction == XC_END) {
+            return -1;
+        }
+        if (instruction == XC_CONSTANT || instruction == XC_SYMBOL) {
+            *offset += 1 + XC_ARG_SIZE;
+            if (instruction == XC_SYMBOL) {
+                return read_argument(code, *offset - 1 - XC_ARG_SIZE);
+            }
+        } else {
+            ++*offset;
+        }
+    }
+}
+
+/* ************************************************************************** *
+ * EVALUATION                                                                 *
+ * ************************************************************************** */
+
+/* Applies the binary operator *op_type* to *left* and *right*. Arithmetic
+ * wraps around at 32 bits, as it does in glulx. Returns FALSE if the
+ * operation is undefined, as for division by zero; exprcode_apply_error
+ * says why.
+ */
+int exprcode_apply(enum operator_type op_type, int left, int right, int *result) {
+    unsigned uleft = left, uright = right;
+    switch(op_type) {
+        case op_add:            *result = uleft + uright;   break;
+        case op_subtract:       *result = uleft - uright;   break;
+        case op_multiply:       *result = uleft * uright;   break;
+        case op_divide:
+            if (right == 0 || (left == INT_MIN && right == -1)) return FALSE;
+            *result = left / right;
+            break;
+        case op_shift_left:
+            if (right < 0 || right > 31) return FALSE;
+            *result = uleft << right;
+            break;
+        case op_shift_right:
+            if (right < 0 || right > 31) return FALSE;
+            *result = left >> right;
+            break;
+        case op_bit_and:        *result = left & right;     break;
+        case op_bit_or:         *result = left | right;     break;
+        case op_bit_xor:        *result = left ^ right;     break;
+        default:
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Returns the message for an *op_type* operation with the right-hand value
+ * *right* that exprcode_apply refused, or NULL if the operator is unknown.
+ */
+const char* exprcode_apply_error(enum operator_type op_type, int right) {
+    switch(op_type) {
+        case op_divide:
+            return right == 0 ? "division by zero" : "division overflow";
+        case op_shift_left:
+        case op_shift_right:
+            return "shift count out of range";
+        default:
+            return NULL;
+    }
+}
+
+/* Returns -*value*, wrapping around as exprcode_apply does. */
+int exprcode_negate(int value) {
+    return 0u - (unsigned)value;
+}
+
+static int push_value(struct expr_code *code, int depth, int value) {
+    if (depth >= code->stack_size) {
+        int new_size = code->stack_size ? code->stack_size * 2 : INITIAL_STACK_SIZE;
+        int *new_stack = realloc(code->stack, sizeof(int) * new_size);
+        if (!new_stack) return FALSE;
+        code->stack = new_stack;
+        code->stack_size = new_size;
+    }
+    code->stack[depth] = value;
+    return TRUE;
+}
+
+static int lookup_label(void *context, int symbol, int *value) {
+    struct label_def *label = get_label(context, symbol);
+    if (!label) return FALSE;
+    *value = label->pos;
+    return TRUE;
+}
+
+/* Runs the expression starting at *start*, finding the value of each
+ * symbol with *lookup*. Returns EVAL_KNOWN and sets *value* if every symbol
+ * has a value. Otherwise returns EVAL_UNKNOWN and sets *unknown* to the
+ * first symbol without one, or returns EVAL_INVALID after reporting the
+ * problem at *origin*, if it is not NULL. The stack is kept in *code*
+ * rather than on the C stack, so deeply nested expressions are safe.
+ */
+static int run_code(struct expr_code *code, int start, int (*lookup)(void*, int, int*), void *context,
+                    struct origin *origin, int *value, int *unknown) {
+    int depth = 0;
+    int offset = start;
+    while (TRUE) {
+        int instruction = (unsigned char)code->code->data[offset];
+        if (instruction == XC_END) {
+            break;
+        }
+
+        if (instruction == XC_CONSTANT || instruction == XC_SYMBOL) {
+            int argument = read_argument(code, offset);
+            offset += 1 + XC_ARG_SIZE;
+            if (instruction == XC_SYMBOL) {
+                int symbol = argument;
+                if (!lookup(context, symbol, &argument)) {
+                    *unknown = symbol;
+                    return EVAL_UNKNOWN;
+                }
+            }
+            if (!push_value(code, depth, argument)) {
+                if (origin) report_error(origin, "could not evaluate expression (out of memory?)");
+                return EVAL_INVALID;
+            }
+            ++depth;
+            continue;
+        }
+
+        ++offset;
+        if (instruction == op_negate) {
+            if (depth < 1) break;
+            code->stack[depth - 1] = exprcode_negate(code->stack[depth - 1]);
+            continue;
+        }
+        if (depth < 2) break;
+        if (!exprcode_apply(instruction, code->stack[depth - 2], code->stack[depth - 1],
+                            &code->stack[depth - 2])) {
+            const char *message = exprcode_apply_error(instruction, code->stack[depth - 1]);
+            if (!origin) {
+                // nothing to report
+            } else if (message) {
+                report_error(origin, "%s", message);
+            } else {
+                report_error(origin, "(internal) bad expression code %d", instruction);
+            }
+            return EVAL_INVALID;
+        }
+        --depth;
+    }
+
+    if (depth != 1 || (unsigned char)code->code->data[offset] != XC_END) {
+        if (origin) report_error(origin, "(internal) malformed expression code");
+        return EVAL_INVALID;
+    }
+    *value = code->stack[0];
+    return EVAL_KNOWN;
+}
+
+/* Evaluates the expression starting at *start*, looking symbols up as
+ * labels, as described for run_code.
+ *
+ * Labels never change once defined, so a known expression is replaced by
+ * its value; running a shared expression again costs a single step.
+ */
+int exprcode_eval(struct expr_code *code, struct program_info *info, int start,
+                  struct origin *origin, int *value, int *unknown) {
+    int result = run_code(code, start, lookup_label, info, origin, value, unknown);
+    if (result == EVAL_KNOWN) {
+        // every expression is at least one operand and an end, which is
+        // room enough for a constant and an end
+        exprcode_bind(code, start, *value);
+        code->code->data[start + 1 + XC_ARG_SIZE] = XC_END;
+    }
+    return result;
+}
+
+/* Works out a likely value for the expression starting at *start*, finding
+ * the value of each symbol with *lookup*, which is given *context*. Returns
+ * FALSE if some symbol has no value or the expression is invalid; nothing
+ * is reported.
+ */
+int exprcode_estimate(struct expr_code *code, int start, int (*lookup)(void*, int, int*),
+                      void *context, int *value) {
+    int unknown;
+    return run_code(code, start, lookup, context, NULL, value, &unknown) == EVAL_KNOWN;
+}
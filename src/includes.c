@@ -0,0 +1,542 @@
+#if defined(__unix__) || defined(__APPLE__)
+#define _XOPEN_SOURCE 700
+#define HAVE_PTHREADS 1
+#define HAVE_REALPATH 1
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "assemble.h"
+#include "vbuffer.h"
+
+#define MAX_POOL_THREADS    64
+#define INCLUDE_CACHE_BUCKETS   61
+
+/* One included file. Each job has its own arena and symbol table so that
+ * jobs never share anything while they are being lexed; the symbols are
+ * moved into the program's table when the job's tokens are spliced in.
+ * Each file is only lexed once; later includes of the same file get a job
+ * that refers back to the first.
+ */
+struct include_job {
+    const char *filename;
+    const char *canonical_name;
+    int once;                   // named by .include_once
+    struct include_job *original;   // earlier job for the same file, if any
+    struct token_list *tokens;
+    struct source_file *file;
+    struct arena *arena;
+    struct symbol_table *symbols;
+    struct vbuffer *diagnostics;
+
+    // the files this one includes, in the order they appear
+    struct include_job **children;
+    int child_count, child_capacity;
+
+    struct include_job *next_queued;
+    struct include_job *next_cached;
+
+    // used while working out the include order
+    int active;                 // currently being spliced in
+    int included;               // spliced in at least once
+    int uses_left;              // times the tokens will still be handed out
+    int reached;                // handed out by include_next at least once
+};
+
+enum include_action {
+    ia_splice,
+    ia_skip,                    // .include_once of a file already included
+    ia_loop                     // file includes itself
+};
+
+struct include_step {
+    struct include_job *job;
+    enum include_action action;
+};
+
+/* Every .include in a program, in the order parse_preprocess will reach
+ * them.
+ */
+struct include_set {
+    struct include_job root;
+    struct include_step *order;
+    int count, capacity;
+    int next;
+};
+
+struct lex_pool {
+#ifdef HAVE_PTHREADS
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // a job was queued or the last one finished
+#endif
+    struct include_job *queue_head, *queue_tail;
+    int outstanding;            // jobs queued or being lexed
+    const char *cache_dir;
+    struct include_job *cache[INCLUDE_CACHE_BUCKETS];
+};
+
+#ifdef HAVE_PTHREADS
+#define pool_lock(pool)         pthread_mutex_lock(&(pool)->lock)
+#define pool_unlock(pool)       pthread_mutex_unlock(&(pool)->lock)
+#define pool_wait(pool)         pthread_cond_wait(&(pool)->changed, &(pool)->lock)
+#define pool_broadcast(pool)    pthread_cond_broadcast(&(pool)->changed)
+#else
+#define pool_lock(pool)
+#define pool_unlock(pool)
+#define pool_wait(pool)
+#define pool_broadcast(pool)
+#endif
+
+static unsigned name_hash(const char *name);
+static int add_child_job(struct include_job *parent, const char *filename, int once, struct arena *arena);
+static int find_includes(struct token_list *tokens, struct include_job *parent, struct arena *arena);
+static void job_error(struct include_job *job, const char *err_text, ...);
+static void run_job(struct include_job *job, const char *cache_dir);
+static void pool_queue(struct lex_pool *pool, struct include_job *job);
+static void pool_add(struct lex_pool *pool, struct include_job *job);
+static void* pool_worker(void *data);
+static int pool_thread_count(int requested);
+static void run_jobs(struct include_job *root, int thread_count, const char *cache_dir);
+static int add_step(struct include_set *set, struct include_job *job, enum include_action action);
+static int order_jobs(struct include_set *set, struct include_job *job);
+static int adopt_symbols(struct include_job *job, struct program_info *info);
+static void free_job(struct include_job *job, struct program_info *info);
+static void free_job_tree(struct include_job *job, struct program_info *info);
+
+/* ************************************************************************** *
+ * FINDING INCLUDES                                                           *
+ * ************************************************************************** */
+
+/* Returns a name for *filename* that is the same however the file is
+ * reached, so that a file included by different paths is still recognized.
+ * If the file does not exist, the name is returned as it is.
+ */
+const char* include_canonical_name(const char *filename, struct arena *arena) {
+#ifdef HAVE_REALPATH
+    char *resolved = realpath(filename, NULL);
+    if (resolved) {
+        const char *name = arena_strdup(arena, resolved);
+        free(resolved);
+        return name;
+    }
+#endif
+    return arena_strdup(arena, filename);
+}
+
+/* FNV-1a */
+static unsigned name_hash(const char *name) {
+    unsigned hash = 2166136261u;
+    for (; *name; ++name) {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int add_child_job(struct include_job *parent, const char *filename, int once, struct arena *arena) {
+    if (parent->child_count >= parent->child_capacity) {
+        int new_capacity = parent->child_capacity ? parent->child_capacity * 2 : 8;
+        struct include_job **new_children = realloc(parent->children, sizeof(struct include_job*) * new_capacity);
+        if (!new_children) return FALSE;
+        parent->children = new_children;
+        parent->child_capacity = new_capacity;
+    }
+
+    struct include_job *job = calloc(1, sizeof(struct include_job));
+    if (!job) return FALSE;
+    job->filename = filename;
+    job->canonical_name = include_canonical_name(filename, arena);
+    job->once = once;
+    parent->children[parent->child_count++] = job;
+    if (!job->canonical_name) return FALSE;
+    return TRUE;
+}
+
+/* Adds a job to *parent* for each .include or .include_once directive in
+ * *tokens* that parse_preprocess will act on. Invalid directives are skipped quietly here;
+ * parse_preprocess reports them when it reaches them.
+ */
+static int find_includes(struct token_list *tokens, struct include_job *parent, struct arena *arena) {
+    struct token *here = tokens->tokens;
+
+    while (here->type != tt_eof) {
+        while (here->type == tt_identifier && here[1].type == tt_colon) {
+            here += 2;
+        }
+        if (is_include_directive(here) && preprocess_check_include(here, FALSE)) {
+            const char *filename = arena_strndup(arena, here[1].text, here[1].i);
+            int once = here->i == sym_include_once;
+            if (!filename || !add_child_job(parent, filename, once, arena)) {
+                return FALSE;
+            }
+        }
+        skip_line(&here);
+    }
+    return TRUE;
+}
+
+static void job_error(struct include_job *job, const char *err_text, ...) {
+    va_list args;
+    va_start(args, err_text);
+    vreport_error(job->diagnostics, NULL, err_text, args);
+    va_end(args);
+}
+
+/* Lexes the file for a job and finds the files it includes in turn. This
+ * runs on a worker thread and so only touches the job itself.
+ */
+static void run_job(struct include_job *job, const char *cache_dir) {
+    job->diagnostics = vbuffer_new();
+    job->arena = arena_new();
+    job->symbols = job->arena ? symbol_table_new(job->arena) : NULL;
+    if (!job->diagnostics || !job->symbols) {
+        return;
+    }
+
+    job->tokens = lex_source(job->filename, job->arena, job->symbols, job->diagnostics,
+                             cache_dir, &job->file);
+    if (job->tokens && !find_includes(job->tokens, job, job->arena)) {
+        // treat the whole file as unreadable so that no include goes
+        // missing from the order parse_preprocess expects
+        job_error(job, "Could not allocate memory for includes of ~%s~.", job->filename);
+        for (int i = 0; i < job->child_count; ++i) {
+            free(job->children[i]);
+        }
+        job->child_count = 0;
+        free_token_list(job->tokens);
+        job->tokens = NULL;
+    }
+}
+
+/* ************************************************************************** *
+ * WORKER POOL                                                                *
+ * ************************************************************************** */
+
+static void pool_queue(struct lex_pool *pool, struct include_job *job) {
+    job->next_queued = NULL;
+    if (pool->queue_tail) {
+        pool->queue_tail->next_queued = job;
+    } else {
+        pool->queue_head = job;
+    }
+    pool->queue_tail = job;
+    ++pool->outstanding;
+}
+
+/* Queues *job* to be lexed, unless its file has already been seen, in which
+ * case the job is pointed at the earlier one instead.
+ */
+static void pool_add(struct lex_pool *pool, struct include_job *job) {
+    unsigned bucket = name_hash(job->canonical_name) % INCLUDE_CACHE_BUCKETS;
+    for (struct include_job *cached = pool->cache[bucket]; cached; cached = cached->next_cached) {
+        if (strcmp(cached->canonical_name, job->canonical_name) == 0) {
+            job->original = cached;
+            return;
+        }
+    }
+    job->next_cached = pool->cache[bucket];
+    pool->cache[bucket] = job;
+    if (job->filename) {
+        pool_queue(pool, job);
+    }
+}
+
+/* Takes jobs from the queue until every job, including those discovered
+ * along the way, has been lexed.
+ */
+static void* pool_worker(void *data) {
+    struct lex_pool *pool = data;
+
+    pool_lock(pool);
+    while (TRUE) {
+        while (!pool->queue_head && pool->outstanding > 0) {
+            pool_wait(pool);
+        }
+        if (!pool->queue_head) break;
+
+        struct include_job *job = pool->queue_head;
+        pool->queue_head = job->next_queued;
+        if (!pool->queue_head) {
+            pool->queue_tail = NULL;
+        }
+        pool_unlock(pool);
+
+        run_job(job, pool->cache_dir);
+
+        pool_lock(pool);
+        int old_outstanding = pool->outstanding;
+        for (int i = 0; i < job->child_count; ++i) {
+            pool_add(pool, job->children[i]);
+        }
+        --pool->outstanding;
+        if (pool->outstanding >= old_outstanding || pool->outstanding == 0) {
+            pool_broadcast(pool);
+        }
+    }
+    pool_unlock(pool);
+    return NULL;
+}
+
+static int pool_thread_count(int requested) {
+#ifdef HAVE_PTHREADS
+    if (requested <= 0) {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        requested = processors > 0 ? processors : 1;
+    }
+    if (requested > MAX_POOL_THREADS) {
+        requested = MAX_POOL_THREADS;
+    }
+    return requested;
+#else
+    return 1;
+#endif
+}
+
+/* Lexes every file included below *root*. The calling thread works through
+ * the queue along with *thread_count* - 1 others. The root itself is never
+ * queued; it is only entered in the cache so that includes of the main file
+ * are recognized.
+ */
+static void run_jobs(struct include_job *root, int thread_count, const char *cache_dir) {
+    struct lex_pool pool = { .queue_head = NULL };
+    pool.cache_dir = cache_dir;
+    pool_add(&pool, root);
+    for (int i = 0; i < root->child_count; ++i) {
+        pool_add(&pool, root->children[i]);
+    }
+    if (pool.outstanding == 0) {
+        return;
+    }
+
+#ifdef HAVE_PTHREADS
+    pthread_t threads[MAX_POOL_THREADS];
+    int started = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.changed, NULL);
+    for (int i = 1; i < thread_count; ++i) {
+        if (pthread_create(&threads[started], NULL, pool_worker, &pool) != 0) {
+            break;
+        }
+        ++started;
+    }
+    pool_worker(&pool);
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool.changed);
+    pthread_mutex_destroy(&pool.lock);
+#else
+    (void)thread_count;
+    pool_worker(&pool);
+#endif
+}
+
+/* ************************************************************************** *
+ * INCLUDE SETS                                                               *
+ * ************************************************************************** */
+
+static int add_step(struct include_set *set, struct include_job *job, enum include_action action) {
+    if (set->count >= set->capacity) {
+        int new_capacity = set->capacity ? set->capacity * 2 : 16;
+        struct include_step *new_order = realloc(set->order, sizeof(struct include_step) * new_capacity);
+        if (!new_order) return FALSE;
+        set->order = new_order;
+        set->capacity = new_capacity;
+    }
+    set->order[set->count].job = job;
+    set->order[set->count].action = action;
+    ++set->count;
+    return TRUE;
+}
+
+/* Lists the includes below *job* depth first, which is the order that
+ * parse_preprocess reaches them in as it splices each file in turn. A file
+ * included more than once has its own includes listed again each time.
+ */
+static int order_jobs(struct include_set *set, struct include_job *job) {
+    job->active = TRUE;
+    job->included = TRUE;
+    for (int i = 0; i < job->child_count; ++i) {
+        struct include_job *child = job->children[i];
+        struct include_job *target = child->original ? child->original : child;
+        int result;
+
+        if (child->once && target->included) {
+            result = add_step(set, target, ia_skip);
+        } else if (target->active) {
+            result = add_step(set, target, ia_loop);
+        } else {
+            ++target->uses_left;
+            result = add_step(set, target, ia_splice) && order_jobs(set, target);
+        }
+        if (!result) return FALSE;
+    }
+    job->active = FALSE;
+    return TRUE;
+}
+
+/* Lexes every file that *tokens* includes, directly or through other files,
+ * using info->thread_count threads. Each file is lexed only once, however
+ * many times it is included. The results are handed out in order by
+ * include_next. Returns NULL only if memory runs out.
+ */
+struct include_set* lex_includes(struct token_list *tokens, struct program_info *info) {
+    struct include_set *set = calloc(1, sizeof(struct include_set));
+    if (!set) return NULL;
+
+    // the main file's name is taken from its tokens, which always end with
+    // a tt_eol
+    struct include_job *root = &set->root;
+    root->canonical_name = include_canonical_name(tokens->tokens[0].origin.filename, info->arena);
+    if (!root->canonical_name || !find_includes(tokens, root, info->arena)) {
+        include_set_free(set, info);
+        return NULL;
+    }
+
+    if (root->child_count > 0) {
+        run_jobs(root, pool_thread_count(info->thread_count), info->token_cache);
+    }
+    if (!order_jobs(set, root)) {
+        include_set_free(set, info);
+        return NULL;
+    }
+    return set;
+}
+
+/* Moves the symbols a job's file uses into the program's symbol table and
+ * updates its tokens to match. Done on the main thread, in include order,
+ * so symbols are numbered exactly as if the files were lexed one by one.
+ */
+static int adopt_symbols(struct include_job *job, struct program_info *info) {
+    struct symbol_table *symbols = job->symbols;
+    int *new_ids = malloc(sizeof(int) * symbols->count);
+    if (!new_ids) return FALSE;
+
+    for (int i = 0; i < symbols->count; ++i) {
+        if (i < symbols->mnemonic_end) {
+            new_ids[i] = i;
+        } else {
+            new_ids[i] = symbol_intern(info->symbols, symbols->symbols[i].name, symbols->symbols[i].length);
+            if (new_ids[i] < 0) {
+                free(new_ids);
+                return FALSE;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < job->tokens->count; ++i) {
+        struct token *token = &job->tokens->tokens[i];
+        if (token->type == tt_identifier || token->type == tt_directive) {
+            token->i = new_ids[token->i];
+            token->text = symbol_name(info->symbols, token->i);
+        }
+    }
+    free(new_ids);
+    return TRUE;
+}
+
+/* Returns the tokens of the next included file, which must be the one named
+ * by the .include directive at *here*. Errors found while lexing the file
+ * are printed the first time it is reached, so they appear in the same order
+ * every time. A file skipped by .include_once gives an empty list. Returns
+ * NULL if the file could not be lexed.
+ */
+struct token_list* include_next(struct include_set *set, struct token *here, struct program_info *info) {
+    if (!set || set->next >= set->count) {
+        // not found in advance; shouldn't happen, but lex it here instead
+        const char *filename = arena_strndup(info->arena, here[1].text, here[1].i);
+        return filename ? lex_file(filename, info) : NULL;
+    }
+
+    struct include_step *step = &set->order[set->next++];
+    struct include_job *job = step->job;
+    if (step->action == ia_skip) {
+        return init_token_list(info->arena);
+    }
+    if (step->action == ia_loop) {
+        report_error(&here->origin, "File ~%.*s~ includes itself.", here[1].i, here[1].text);
+        return NULL;
+    }
+
+    --job->uses_left;
+    if (!job->reached) {
+        // errors are only reported the first time the file is reached
+        job->reached = TRUE;
+        if (job->diagnostics && job->diagnostics->length > 0) {
+            fwrite(job->diagnostics->data, 1, job->diagnostics->length, stderr);
+        }
+        if (!job->diagnostics || !job->symbols) {
+            report_error(&here->origin, "Could not allocate memory to read ~%s~.", job->filename);
+            return NULL;
+        }
+        if (!job->tokens) {
+            return NULL;
+        }
+        if (!adopt_symbols(job, info)) {
+            report_error(&here->origin, "Could not allocate memory for symbols of ~%s~.", job->filename);
+            free_token_list(job->tokens);
+            job->tokens = NULL;
+            return NULL;
+        }
+        symbol_table_free(job->symbols);
+        job->symbols = NULL;
+
+        lex_add_source(info, job->file, job->arena);
+        job->file = NULL;
+        job->arena = NULL;
+    }
+    if (!job->tokens) {
+        return NULL;
+    }
+
+    // the last use of the file takes its tokens; the others get a copy
+    struct token_list *tokens = job->tokens;
+    if (job->uses_left > 0) {
+        tokens = copy_token_list(tokens);
+        if (!tokens) {
+            report_error(&here->origin, "Could not allocate memory for tokens of ~%s~.", job->filename);
+        }
+    } else {
+        job->tokens = NULL;
+    }
+    return tokens;
+}
+
+static void free_job(struct include_job *job, struct program_info *info) {
+    if (job->file) {
+        // the tokens were never used, but the file is closed in the usual way
+        lex_add_source(info, job->file, job->arena);
+        job->arena = NULL;
+    }
+    free_token_list(job->tokens);
+    symbol_table_free(job->symbols);
+    arena_free(job->arena);
+    vbuffer_free(job->diagnostics);
+    free(job->children);
+    free(job);
+}
+
+static void free_job_tree(struct include_job *job, struct program_info *info) {
+    for (int i = 0; i < job->child_count; ++i) {
+        free_job_tree(job->children[i], info);
+    }
+    free_job(job, info);
+}
+
+void include_set_free(struct include_set *set, struct program_info *info) {
+    if (!set) return;
+    for (int i = 0; i < set->root.child_count; ++i) {
+        free_job_tree(set->root.children[i], info);
+    }
+    free(set->root.children);
+    free(set->order);
+    free(set);
+}
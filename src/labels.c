@@ -4,23 +4,54 @@
 
 #include "assemble.h"
 
+#define INITIAL_LABEL_INDEX_SIZE    256
+
+static int grow_label_index(struct program_info *info, int symbol);
+
 /* ************************************************************************** *
  * LABEL FUNCTIONS                                                            *
  * ************************************************************************** */
 
-int add_label(struct label_def **first_lbl, const char *name, int value) {
-    struct label_def *cur = *first_lbl;
+/* Labels are found through info->label_index, which is indexed by symbol ID
+ * and so needs no hashing or comparisons. The list starting at first_label
+ * holds the same labels, most recent first, for dump_labels. The index is
+ * kept on the heap rather than in the arena, so that growing it or starting
+ * a new pass does not leave old copies behind; labels_free releases it.
+ */
+static int grow_label_index(struct program_info *info, int symbol) {
+    int new_size = info->label_index_size ? info->label_index_size * 2 : INITIAL_LABEL_INDEX_SIZE;
+    while (new_size <= symbol) {
+        new_size *= 2;
+    }
+
+    struct label_def **new_index = realloc(info->label_index, sizeof(struct label_def*) * new_size);
+    if (!new_index) return 0;
+    memset(new_index + info->label_index_size, 0,
+           sizeof(struct label_def*) * (new_size - info->label_index_size));
+    info->label_index = new_index;
+    info->label_index_size = new_size;
+    return 1;
+}
 
-    struct label_def *existing = get_label(*first_lbl, name);
-    if (existing) {
+int add_label(struct program_info *info, int symbol, int value) {
+    struct label_def *cur = info->first_label;
+
+    if (symbol < 0) {
+        return 0;
+    }
+    if (symbol >= info->label_index_size && !grow_label_index(info, symbol)) {
+        return 0;
+    }
+    if (info->label_index[symbol]) {
         return 0;
     }
 
-    struct label_def *new_lbl = malloc(sizeof(struct label_def));
+    struct label_def *new_lbl = arena_alloc(info->arena, sizeof(struct label_def));
     if (!new_lbl) {
         return 0;
     }
-    new_lbl->name = str_dup(name);
+    new_lbl->name = symbol_name(info->symbols, symbol);
+    new_lbl->symbol = symbol;
     new_lbl->pos = value;
 
     if (cur == NULL) {
@@ -28,38 +59,71 @@ int add_label(struct label_def **first_lbl, const char *name, int value) {
     } else {
         new_lbl->next = cur;
     }
-    *first_lbl = new_lbl;
+    info->first_label = new_lbl;
+    info->label_index[symbol] = new_lbl;
     return 1;
 }
 
-struct label_def* get_label(struct label_def *first, const char *name) {
-    struct label_def *current = first;
+struct label_def* get_label(struct program_info *info, int symbol) {
+    if (symbol < 0 || symbol >= info->label_index_size) {
+        return NULL;
+    }
+    return info->label_index[symbol];
+}
 
-    while (current) {
-        if (strcmp(name, current->name) == 0) {
-            return current;
-        }
-        current = current->next;
+/* Starts an empty set of labels for another pass over the program. The
+ * labels of the pass before are kept, so that get_previous_label can give
+ * an estimate for names the new pass has not reached yet. The index of the
+ * pass before that is cleared and reused for the new pass.
+ */
+void labels_begin_pass(struct program_info *info) {
+    struct label_def **spare = info->previous_labels;
+    int spare_size = info->previous_label_index_size;
+    if (spare) {
+        memset(spare, 0, sizeof(struct label_def*) * spare_size);
     }
+    info->previous_labels = info->label_index;
+    info->previous_label_index_size = info->label_index_size;
+    info->label_index = spare;
+    info->label_index_size = spare_size;
+    info->first_label = NULL;
+}
 
-    return NULL;
+/* Frees the label indexes. The labels themselves are in the arena. */
+void labels_free(struct program_info *info) {
+    free(info->label_index);
+    free(info->previous_labels);
+    info->label_index = NULL;
+    info->label_index_size = 0;
+    info->previous_labels = NULL;
+    info->previous_label_index_size = 0;
 }
 
-void dump_labels(FILE *dest, struct label_def *first) {
-    struct label_def *cur = first;
-    while (cur) {
-        fprintf(dest, "0x%08X  %s\n", cur->pos, cur->name);
-        cur = cur->next;
+struct label_def* get_previous_label(struct program_info *info, int symbol) {
+    if (symbol < 0 || symbol >= info->previous_label_index_size) {
+        return NULL;
+    }
+    return info->previous_labels[symbol];
+}
+
+/* Returns TRUE if any label of the current pass was missing from the
+ * previous pass or had a different value there.
+ */
+int labels_moved(struct program_info *info) {
+    for (struct label_def *label = info->first_label; label; label = label->next) {
+        struct label_def *previous = get_previous_label(info, label->symbol);
+        if (!previous || previous->pos != label->pos) {
+            return TRUE;
+        }
     }
+    return FALSE;
 }
 
-void free_labels(struct label_def *first) {
+void dump_labels(FILE *dest, struct label_def *first) {
     struct label_def *cur = first;
     while (cur) {
-        struct label_def *next = cur->next;
-        free(cur->name);
-        free(cur);
-        cur = next;
+        fprintf(dest, "0x%08X  %s\n", cur->pos, cur->name);
+        cur = cur->next;
     }
 }
 
@@ -80,13 +144,3 @@ void dump_patches(FILE *dest, struct program_info *info) {
         patch = patch->next;
     }
 }
-
-void free_patches(struct backpatch *first) {
-    struct backpatch *cur = first;
-    while (cur) {
-        struct backpatch *next = cur->next;
-        free_operands(cur->operand_chain);
-        free(cur);
-        cur = next;
-    }
-}
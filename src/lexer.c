@@ -1,17 +1,93 @@
 #include <ctype.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "assemble.h"
+#include "mapfile.h"
+#include "scan.h"
 #include "vbuffer.h"
 
 #define TOKEN_BUF_LEN 2048
 
 static int next_char(struct lexer_state *state);
 static int peek_char(struct lexer_state *state);
-static char* lexer_read_string(int quote_char, struct lexer_state *state);
-static int is_identifier(int ch);
+static void lexer_advance(struct lexer_state *state, size_t new_pos);
+static void lexer_skip_within_line(struct lexer_state *state, size_t new_pos);
+static void lexer_error(struct lexer_state *state, struct origin *origin, const char *err_text, ...);
+static const char* lexer_read_string(int quote_char, struct lexer_state *state,
+                                     size_t *length, const char *what, int *has_errors);
+
+/* A source file that stays open until assembly is finished, since the text
+ * of tokens lexed from it may point into its contents. Files lexed away from
+ * the main thread also own the arena their tokens' text was stored in.
+ */
+struct source_file {
+    struct mapped_file source;
+    struct arena *arena;
+    struct source_file *next;
+};
+
+/* ************************************************************************* *
+ * Character Classes                                                         *
+ * ************************************************************************* */
+
+/* The lexer dispatches on the class of each input byte. Bytes that are not
+ * listed in char_class are cc_invalid.
+ */
+enum char_class {
+    cc_invalid,
+    cc_eol,
+    cc_blank,
+    cc_continuation,
+    cc_comment,
+    cc_comma,
+    cc_colon,
+    cc_open_paren,
+    cc_close_paren,
+    cc_operator,        // single character operator; see operator_code
+    cc_double_operator, // operator written as a doubled character: << >>
+    cc_ampersand,       // & (indirect) or && (bitwise and)
+    cc_hex_prefix,
+    cc_digit,
+    cc_identifier,
+    cc_directive,
+    cc_string,
+    cc_character
+};
+
+static const unsigned char char_class[256] = {
+    ['\n'] = cc_eol, ['\r'] = cc_eol,
+    [' '] = cc_blank, ['\t'] = cc_blank, ['\v'] = cc_blank, ['\f'] = cc_blank,
+    ['\\'] = cc_continuation, [';'] = cc_comment,
+    [','] = cc_comma, [':'] = cc_colon,
+    ['('] = cc_open_paren, [')'] = cc_close_paren,
+    ['+'] = cc_operator, ['-'] = cc_operator, ['*'] = cc_operator,
+    ['/'] = cc_operator, ['|'] = cc_operator, ['^'] = cc_operator,
+    ['<'] = cc_double_operator, ['>'] = cc_double_operator,
+    ['&'] = cc_ampersand, ['$'] = cc_hex_prefix,
+    ['.'] = cc_directive, ['"'] = cc_string, ['\''] = cc_character,
+    ['0'] = cc_digit, ['1'] = cc_digit, ['2'] = cc_digit, ['3'] = cc_digit, ['4'] = cc_digit,
+    ['5'] = cc_digit, ['6'] = cc_digit, ['7'] = cc_digit, ['8'] = cc_digit, ['9'] = cc_digit,
+    ['a'] = cc_identifier, ['b'] = cc_identifier, ['c'] = cc_identifier, ['d'] = cc_identifier, ['e'] = cc_identifier, ['f'] = cc_identifier,
+    ['g'] = cc_identifier, ['h'] = cc_identifier, ['i'] = cc_identifier, ['j'] = cc_identifier, ['k'] = cc_identifier, ['l'] = cc_identifier,
+    ['m'] = cc_identifier, ['n'] = cc_identifier, ['o'] = cc_identifier, ['p'] = cc_identifier, ['q'] = cc_identifier, ['r'] = cc_identifier,
+    ['s'] = cc_identifier, ['t'] = cc_identifier, ['u'] = cc_identifier, ['v'] = cc_identifier, ['w'] = cc_identifier, ['x'] = cc_identifier,
+    ['y'] = cc_identifier, ['z'] = cc_identifier,
+    ['A'] = cc_identifier, ['B'] = cc_identifier, ['C'] = cc_identifier, ['D'] = cc_identifier, ['E'] = cc_identifier, ['F'] = cc_identifier,
+    ['G'] = cc_identifier, ['H'] = cc_identifier, ['I'] = cc_identifier, ['J'] = cc_identifier, ['K'] = cc_identifier, ['L'] = cc_identifier,
+    ['M'] = cc_identifier, ['N'] = cc_identifier, ['O'] = cc_identifier, ['P'] = cc_identifier, ['Q'] = cc_identifier, ['R'] = cc_identifier,
+    ['S'] = cc_identifier, ['T'] = cc_identifier, ['U'] = cc_identifier, ['V'] = cc_identifier, ['W'] = cc_identifier, ['X'] = cc_identifier,
+    ['Y'] = cc_identifier, ['Z'] = cc_identifier,
+    ['_'] = cc_identifier, ['@'] = cc_identifier,
+};
+
+static const unsigned char operator_code[256] = {
+    ['+'] = op_add,         ['-'] = op_subtract,    ['*'] = op_multiply,
+    ['/'] = op_divide,      ['|'] = op_bit_or,      ['^'] = op_bit_xor,
+    ['<'] = op_shift_left,  ['>'] = op_shift_right, ['&'] = op_bit_and,
+};
 
 /* ************************************************************************* *
  * Core Lexer                                                                *
@@ -22,7 +98,7 @@ static int next_char(struct lexer_state *state) {
         return 0;
     }
 
-    int old_here = state->text[state->text_pos];
+    int old_here = (unsigned char)state->text[state->text_pos];
     ++state->text_pos;
 
     if (old_here == '\n') {
@@ -39,282 +115,438 @@ static int peek_char(struct lexer_state *state) {
         return 0;
     }
 
-    return state->text[state->text_pos];
+    return (unsigned char)state->text[state->text_pos];
 }
 
-static char* lexer_read_string(int quote_char, struct lexer_state *state) {
+/* Moves the lexer forward to *new_pos* in a single step. The line and column
+ * are worked out from the newlines in the skipped text rather than by
+ * stepping through it a character at a time.
+ */
+static void lexer_advance(struct lexer_state *state, size_t new_pos) {
+    size_t last_newline = 0;
+    size_t newlines = scan_newlines(state->text, state->text_pos, new_pos, &last_newline);
+
+    if (newlines > 0) {
+        state->origin.line += newlines;
+        state->origin.column = new_pos - last_newline - 1;
+    } else {
+        state->origin.column += new_pos - state->text_pos;
+    }
+    state->text_pos = new_pos;
+}
+
+/* Reports an error, or adds it to state->diagnostics if that is set.
+ */
+static void lexer_error(struct lexer_state *state, struct origin *origin, const char *err_text, ...) {
+    va_list args;
+    va_start(args, err_text);
+    vreport_error(state->diagnostics, origin, err_text, args);
+    va_end(args);
+}
+
+/* As lexer_advance, for spans the caller knows contain no newlines.
+ */
+static void lexer_skip_within_line(struct lexer_state *state, size_t new_pos) {
+    state->origin.column += new_pos - state->text_pos;
+    state->text_pos = new_pos;
+}
+
+/* Reads a string or character literal, leaving the lexer just past the
+ * closing quote. Most literals are returned as a slice of the source text;
+ * only those containing escapes or line breaks are decoded into a copy in the
+ * lexer's arena. Invalid escapes are reported at their exact position, using
+ * *what* to describe the literal, and set *has_errors*. Returns NULL if the
+ * literal is unterminated.
+ */
+static const char* lexer_read_string(int quote_char, struct lexer_state *state,
+                                     size_t *length, const char *what, int *has_errors) {
     struct lexer_state start = *state;
-    int prev = 0, in;
-    size_t string_start, string_end, string_size;
-    char *string_start_ptr;
-
-    string_start_ptr = &state->text[state->text_pos];
-    string_start = state->text_pos;
-    in = next_char(state);
-    while (in != 0 && (in != quote_char || prev == '\\')) {
-        if (prev == '\\')   prev = 0;
-        else                prev = in;
-        in = next_char(state);
+    size_t string_start = state->text_pos;
+    size_t string_end = string_start;
+    int has_escapes = FALSE;
+
+    while (TRUE) {
+        string_end = scan_until(state->text, string_end, state->text_length,
+                                quote_char, '\\');
+        if (string_end >= state->text_length || state->text[string_end] == quote_char) {
+            break;
+        }
+        // skip over the escaped character
+        has_escapes = TRUE;
+        string_end += 2;
     }
-    string_end = state->text_pos;
-    string_size = string_end - string_start - 1;
 
-    if (in == 0) {
-        report_error(&start.origin, "unterminated string");
+    if (string_end >= state->text_length) {
+        lexer_advance(state, state->text_length);
+        lexer_error(state, &start.origin, "unterminated string");
         return NULL;
-    } else {
-        char *string_text = malloc(string_size + 1);
-        if (string_size > 0) {
-            strncpy(string_text, string_start_ptr, string_size);
-            string_text[string_size] = 0;
-        }
+    }
+
+    const char *string_text = &state->text[string_start];
+    *length = string_end - string_start;
+    lexer_advance(state, string_end + 1);
+    if (!has_escapes && state->origin.line == start.origin.line) {
         return string_text;
     }
-}
 
-static int is_identifier(int ch) {
-    return isalnum(ch) || ch == '_';
+    char *decoded = arena_alloc(state->arena, *length + 1);
+    if (!decoded) {
+        lexer_error(state, &start.origin, "Could not allocate memory for string.");
+        return NULL;
+    }
+    size_t bad_pos;
+    int decoded_length = decode_string(string_text, *length, decoded, &bad_pos);
+    if (decoded_length < 0) {
+        // work out where the escape is from the line breaks before it
+        struct origin bad_origin = start.origin;
+        size_t last_newline = 0;
+        size_t newlines = scan_newlines(state->text, string_start, string_start + bad_pos, &last_newline);
+        if (newlines > 0) {
+            bad_origin.line += newlines;
+            bad_origin.column = string_start + bad_pos - last_newline;
+        } else {
+            bad_origin.column += bad_pos + 1;
+        }
+        lexer_error(state, &bad_origin, "%s contains invalid escape code '\\%c'", what, string_text[bad_pos + 1]);
+        *has_errors = TRUE;
+        return string_text;
+    }
+    *length = decoded_length;
+    return decoded;
 }
 
-struct token_list* lex_file(const char *filename) {
-    struct lexer_state state = { { NULL, 1, 1 } };
-    struct vbuffer *buffer = vbuffer_new();
+/* Opens *filename* (or stdin, if the name is "-") and points *state* at the
+ * start of its contents. The filename recorded in token origins is copied
+ * into *arena*, which is also used for the tokens' text. Identifiers and
+ * directives are entered into *symbols*. Errors go to state->diagnostics,
+ * which the caller must set beforehand.
+ */
+int lex_open(struct lexer_state *state, struct mapped_file *source,
+             const char *filename, struct arena *arena, struct symbol_table *symbols) {
     int from_stdin = FALSE;
+    state->origin.line = 1;
+    state->origin.column = 1;
+    state->text_pos = 0;
+    state->arena = arena;
+    state->symbols = symbols;
+    state->error_count = 0;
     if (strcmp(filename, "-") == 0) {
-        state.origin.filename = str_dup("(stdin)");
+        state->origin.filename = "(stdin)";
         from_stdin =  TRUE;
     } else {
-        state.origin.filename = str_dup(filename);
+        state->origin.filename = arena_strdup(arena, filename);
     }
 
-    int result = vbuffer_readfile(buffer, from_stdin ? NULL : filename);
+    int result = mapfile_open(source, from_stdin ? NULL : filename);
     if (!result) {
-        report_error(NULL, "Could not open source file ~%s~.\n", filename);
-        vbuffer_free(buffer);
+        lexer_error(state, NULL, "Could not open source file ~%s~.\n", filename);
+        return FALSE;
+    }
+
+    // the lexer stops at text_length, so the source doesn't need a NUL
+    // terminator appended to it
+    state->text = source->data;
+    state->text_length = source->length;
+    return TRUE;
+}
+
+/* Lexes the whole of *filename* using only the storage passed in, so it is
+ * safe to call on any thread as long as no other thread is using *arena* or
+ * *symbols*. Errors are added to *diagnostics* if it is not NULL. The opened
+ * file is returned in *file* and must be passed to lex_add_source once its
+ * tokens are in use; if lexing fails it is closed and *file* is set to NULL.
+ * If *cache_dir* is not NULL, tokens saved there by an earlier run are used
+ * when the file hasn't changed, and newly lexed tokens are saved there.
+ */
+struct token_list* lex_source(const char *filename, struct arena *arena, struct symbol_table *symbols,
+                              struct vbuffer *diagnostics, const char *cache_dir,
+                              struct source_file **file) {
+    struct lexer_state state;
+    state.diagnostics = diagnostics;
+    *file = malloc(sizeof(struct source_file));
+    if (!*file) {
+        lexer_error(&state, NULL, "Could not allocate memory for source file ~%s~.", filename);
         return NULL;
     }
-    vbuffer_pushchar(buffer, '\0');
+    (*file)->arena = NULL;
+    (*file)->next = NULL;
 
-    state.text = buffer->data;
-    state.text_length = buffer->length;
-    struct token_list *tokens = lex_core(&state);
-    free_origin(&state.origin);
-    vbuffer_free(buffer);
+    if (!lex_open(&state, &(*file)->source, filename, arena, symbols)) {
+        free(*file);
+        *file = NULL;
+        return NULL;
+    }
+    struct token_list *tokens = cache_dir ? tokcache_load(cache_dir, &state) : NULL;
+    if (!tokens) {
+        size_t old_length = diagnostics ? diagnostics->length : 0;
+        tokens = lex_core(&state);
+        // files that gave any diagnostics are lexed every time, so that the
+        // messages are never lost
+        if (tokens && cache_dir && diagnostics && diagnostics->length == old_length) {
+            tokcache_save(cache_dir, &state, tokens);
+        }
+    }
+    if (!tokens) {
+        mapfile_close(&(*file)->source);
+        free(*file);
+        *file = NULL;
+    }
     return tokens;
 }
 
+/* Lexes the whole of *filename*. The file is added to info->sources and
+ * stays open until lex_close_sources is called.
+ */
+struct token_list* lex_file(const char *filename, struct program_info *info) {
+    struct source_file *file;
+    struct token_list *tokens = lex_source(filename, info->arena, info->symbols, NULL, NULL, &file);
+    if (tokens) {
+        lex_add_source(info, file, NULL);
+    }
+    return tokens;
+}
+
+/* Keeps *file* open until lex_close_sources is called. If *arena* is not
+ * NULL, it is freed along with the file.
+ */
+void lex_add_source(struct program_info *info, struct source_file *file, struct arena *arena) {
+    file->arena = arena;
+    file->next = info->sources;
+    info->sources = file;
+}
+
+void lex_close_sources(struct program_info *info) {
+    struct source_file *file = info->sources;
+    while (file) {
+        struct source_file *next = file->next;
+        mapfile_close(&file->source);
+        arena_free(file->arena);
+        free(file);
+        file = next;
+    }
+    info->sources = NULL;
+}
+
 struct token_list* lex_core(struct lexer_state *state) {
-    struct token_list *tokens = NULL;
+    struct token_list *tokens = init_token_list(state->arena);
+    if (!tokens) return NULL;
+
+    while (lex_line(state, tokens)) {
+        // keep going until the end of the text
+    }
+
+    if (state->error_count > 0) {
+        free_token_list(tokens);
+        return NULL;
+    }
+    new_token(tokens, tt_eol, NULL, state);
+    return tokens;
+}
+
+/* Lexes the next line of the text, appending its tokens and the tt_eol that
+ * ends it to *tokens*. Returns FALSE once the end of the text has been reached
+ * or an unrecoverable error occurs; tokens from a final line that has no
+ * newline are still appended, but without a tt_eol. Errors are reported as
+ * they are found and counted in state->error_count.
+ */
+int lex_line(struct lexer_state *state, struct token_list *tokens) {
     struct token *a_token;
     int has_errors = 0;
     char token_buf[TOKEN_BUF_LEN];
     int buf_pos = 0;
+    const char *text;
+    size_t length;
 
-    tokens = init_token_list();
     int in = next_char(state);
     while (in != 0) {
-        if (in == '\n' || in == '\r') {
-            a_token = new_token(tt_eol, NULL, state);
-            add_token(tokens, a_token);
-            do {
+        switch (char_class[in]) {
+            case cc_eol:
+                new_token(tokens, tt_eol, NULL, state);
+                while (char_class[peek_char(state)] == cc_eol) {
+                    next_char(state);
+                }
+                state->error_count += has_errors;
+                return TRUE;
+
+            case cc_continuation:
                 in = next_char(state);
-            } while (in == '\n' || in == '\r');
-        } else if (in == '\\') {
-            in = next_char(state);
-            if (in != '\n' && in != '\r') {
-                report_error(&state->origin, "unexpected character; \\ only permitted at end of line");
-            } else {
+                if (char_class[in] != cc_eol) {
+                    lexer_error(state, &state->origin, "unexpected character; \\ only permitted at end of line");
+                } else {
+                    in = next_char(state);
+                }
+                break;
+
+            case cc_comment:
+                lexer_skip_within_line(state, scan_line(state->text, state->text_pos, state->text_length));
                 in = next_char(state);
-            }
-        } else if (in == ';') {
-            while (in != 0 && in != '\n') {
+                break;
+
+            case cc_blank:
+                lexer_skip_within_line(state, scan_blanks(state->text, state->text_pos, state->text_length));
                 in = next_char(state);
-            }
-        } else if (isspace(in)) {
-            while (isspace(in)) {
+                break;
+
+            case cc_comma:
+                new_token(tokens, tt_comma, NULL, state);
                 in = next_char(state);
-            }
-        } else if (in == ',') {
-            a_token = new_token(tt_comma, NULL, state);
-            add_token(tokens, a_token);
-            in = next_char(state);
-        } else if (in == '+') {
-            a_token = new_token(tt_operator, NULL, state);
-            a_token->i = op_add;
-            add_token(tokens, a_token);
-            in = next_char(state);
-        } else if (in == '-') {
-            a_token = new_token(tt_operator, NULL, state);
-            a_token->i = op_subtract;
-            add_token(tokens, a_token);
-            in = next_char(state);
-        } else if (in == '*') {
-            a_token = new_token(tt_operator, NULL, state);
-            a_token->i = op_multiply;
-            add_token(tokens, a_token);
-            in = next_char(state);
-        } else if (in == '/') {
-            a_token = new_token(tt_operator, NULL, state);
-            a_token->i = op_divide;
-            add_token(tokens, a_token);
-            in = next_char(state);
-        } else if (in == '>' && peek_char(state) == '>') {
-            a_token = new_token(tt_operator, NULL, state);
-            a_token->i = op_shift_right;
-            add_token(tokens, a_token);
-            next_char(state); in = next_char(state);
-        } else if (in == '<' && peek_char(state) == '<') {
-            a_token = new_token(tt_operator, NULL, state);
-            a_token->i = op_shift_left;
-            add_token(tokens, a_token);
-            next_char(state); in = next_char(state);
-        } else if (in == '|') {
-            a_token = new_token(tt_operator, NULL, state);
-            a_token->i = op_bit_or;
-            add_token(tokens, a_token);
-            next_char(state); in = next_char(state);
-        } else if (in == '^') {
-            a_token = new_token(tt_operator, NULL, state);
-            a_token->i = op_bit_xor;
-            add_token(tokens, a_token);
-            next_char(state); in = next_char(state);
-        } else if (in == '&' && peek_char(state) == '&') {
-            a_token = new_token(tt_operator, NULL, state);
-            a_token->i = op_bit_and;
-            add_token(tokens, a_token);
-            next_char(state); in = next_char(state);
-        } else if (in == '&') {
-            a_token = new_token(tt_indirect, NULL, state);
-            add_token(tokens, a_token);
-            in = next_char(state);
-        } else if (in == ':') {
-            a_token = new_token(tt_colon, NULL, state);
-            add_token(tokens, a_token);
-            in = next_char(state);
-        } else if (in == '$') {
-            struct lexer_state start = *state;
-            token_buf[0] = '$';
-            buf_pos = 1;
-            in = next_char(state);
-            while (isxdigit(in)) {
-                token_buf[buf_pos] = in;
-                ++buf_pos;
+                break;
+
+            case cc_colon:
+                new_token(tokens, tt_colon, NULL, state);
                 in = next_char(state);
-            }
-            token_buf[buf_pos] = 0;
-            a_token = new_token(tt_integer, token_buf, &start);
-            add_token(tokens, a_token);
-        } else if (isdigit(in) || in == '-') {
-            struct lexer_state start = *state;
-            int found_dot = FALSE, bad_dot = FALSE;
-            buf_pos = 0;
-            if (in == '-') {
-                token_buf[0] = '-';
-                buf_pos = 1;
+                break;
+
+            case cc_open_paren:
+                new_token(tokens, tt_open_paren, NULL, state);
+                in = next_char(state);
+                break;
+
+            case cc_close_paren:
+                new_token(tokens, tt_close_paren, NULL, state);
+                in = next_char(state);
+                break;
+
+            case cc_operator:
+                a_token = new_token(tokens, tt_operator, NULL, state);
+                a_token->i = operator_code[in];
                 in = next_char(state);
-                if (!isdigit(in)) {
-                    report_error(&start.origin, "expected numeric value after '-'");
+                break;
+
+            case cc_double_operator:
+                if (peek_char(state) != in) {
+                    lexer_error(state, &state->origin, "unexpected character '%c' (%d).", in, in);
                     has_errors = 1;
+                    in = next_char(state);
+                    break;
                 }
-            }
-            while (isdigit(in) || in == '.') {
-                if (in == '.') {
-                    if (found_dot) {
-                        bad_dot = TRUE;
-                        report_error(&start.origin, "malformed floating point number");
-                        has_errors = 1;
-                    } else {
-                        found_dot = TRUE;
-                    }
+                a_token = new_token(tokens, tt_operator, NULL, state);
+                a_token->i = operator_code[in];
+                next_char(state); in = next_char(state);
+                break;
+
+            case cc_ampersand:
+                if (peek_char(state) == '&') {
+                    a_token = new_token(tokens, tt_operator, NULL, state);
+                    a_token->i = operator_code[in];
+                    next_char(state);
+                } else {
+                    new_token(tokens, tt_indirect, NULL, state);
                 }
-                token_buf[buf_pos] = in;
-                ++buf_pos;
                 in = next_char(state);
-            }
-            if (!bad_dot) {
+                break;
+
+            case cc_hex_prefix: {
+                struct lexer_state start = *state;
+                token_buf[0] = '$';
+                buf_pos = 1;
+                in = next_char(state);
+                while (isxdigit(in) && buf_pos < TOKEN_BUF_LEN - 1) {
+                    token_buf[buf_pos] = in;
+                    ++buf_pos;
+                    in = next_char(state);
+                }
                 token_buf[buf_pos] = 0;
-                a_token = new_token(found_dot ? tt_float : tt_integer, token_buf, &start);
-                add_token(tokens, a_token);
-            }
-        } else if (is_identifier(in) || in == '.') {
-            struct lexer_state start = *state;
-            buf_pos = 0;
-            do {
-                token_buf[buf_pos] = in;
-                ++buf_pos;
+                new_token(tokens, tt_integer, token_buf, &start);
+                break; }
+
+            case cc_digit: {
+                struct lexer_state start = *state;
+                int found_dot = FALSE, bad_dot = FALSE;
+                buf_pos = 0;
+                while ((char_class[in] == cc_digit || in == '.') && buf_pos < TOKEN_BUF_LEN - 1) {
+                    if (in == '.') {
+                        if (found_dot) {
+                            bad_dot = TRUE;
+                            lexer_error(state, &start.origin, "malformed floating point number");
+                            has_errors = 1;
+                        } else {
+                            found_dot = TRUE;
+                        }
+                    }
+                    token_buf[buf_pos] = in;
+                    ++buf_pos;
+                    in = next_char(state);
+                }
+                if (!bad_dot) {
+                    token_buf[buf_pos] = 0;
+                    new_token(tokens, found_dot ? tt_float : tt_integer, token_buf, &start);
+                }
+                break; }
+
+            case cc_identifier:
+            case cc_directive: {
+                struct lexer_state start = *state;
+                size_t word_start = state->text_pos - 1;
+                size_t word_end = scan_identifier(state->text, state->text_pos, state->text_length);
+                lexer_skip_within_line(state, word_end);
                 in = next_char(state);
-            } while (is_identifier(in));
-            token_buf[buf_pos] = 0;
-            if (token_buf[0] == '.' && token_buf[1] == 0) {
-                report_error(&start.origin, "found zero length directive");
-                has_errors = 1;
-            }
-            if (token_buf[0] == '.') {
-                a_token = new_token(tt_directive, token_buf, &start);
-            } else {
-                a_token = new_token(tt_identifier, token_buf, &start);
-            }
-            add_token(tokens, a_token);
-        } else if (in == '"') {
-            struct lexer_state start = *state;
-            char *text = lexer_read_string(in, state);
-            in = next_char(state);
-            if (text == NULL) {
-                has_errors = TRUE;
-                return NULL;
-            } else {
-                int bad_escape = cleanup_string(text);
-                if (bad_escape) {
-                    report_error(&start.origin, "string contains invalid escape code '\\%c'", text[bad_escape]);
+
+                // the token's text is the interned name, so nothing is copied
+                // unless this is the first time the name has been seen
+                length = word_end - word_start;
+                if (length >= TOKEN_BUF_LEN) {
+                    lexer_error(state, &start.origin, "identifier too long");
                     has_errors = 1;
+                    length = TOKEN_BUF_LEN - 1;
                 }
-                a_token = new_token(tt_string, text, &start);
-                free(text);
-                add_token(tokens, a_token);
-            }
-        } else if (in == '\'') {
-            struct lexer_state start = *state;
-            char *text = lexer_read_string(in, state);
-            in = next_char(state);
-            if (text == NULL) {
-                has_errors = TRUE;
-                return NULL;
-            } else if (strlen(text) == 0) {
-                report_error(&start.origin, "empty character literal");
-                free(text);
-                has_errors = TRUE;
-            } else {
-                int bad_escape = cleanup_string(text);
-                if (bad_escape) {
-                    report_error(&start.origin, "character literal contains invalid escape code '\\%c'", text[bad_escape]);
+                if (length == 1 && state->text[word_start] == '.') {
+                    lexer_error(state, &start.origin, "found zero length directive");
                     has_errors = 1;
                 }
+                int symbol = symbol_intern(state->symbols, &state->text[word_start], length);
+                if (symbol < 0) {
+                    lexer_error(state, &start.origin, "Could not allocate memory for symbol.");
+                    ++state->error_count;
+                    return FALSE;
+                }
+                new_text_token(tokens, state->text[word_start] == '.' ? tt_directive : tt_identifier,
+                               symbol_name(state->symbols, symbol), symbol, &start);
+                break; }
+
+            case cc_string: {
+                struct lexer_state start = *state;
+                text = lexer_read_string(in, state, &length, "string", &has_errors);
+                in = next_char(state);
+                if (text == NULL) {
+                    ++state->error_count;
+                    return FALSE;
+                }
+                new_text_token(tokens, tt_string, text, length, &start);
+                break; }
+
+            case cc_character: {
+                struct lexer_state start = *state;
+                text = lexer_read_string(in, state, &length, "character literal", &has_errors);
+                in = next_char(state);
+                if (text == NULL) {
+                    ++state->error_count;
+                    return FALSE;
+                } else if (length == 0) {
+                    lexer_error(state, &start.origin, "empty character literal");
+                    has_errors = TRUE;
+                    break;
+                }
                 int text_pos = 0;
                 int cp = utf8_next_char(text, &text_pos);
-                if (text[text_pos] != 0) {
-                    report_error(&start.origin, "character literal too long");
+                if ((size_t)text_pos != length) {
+                    lexer_error(state, &start.origin, "character literal too long");
                     has_errors = 1;
                 }
-                free(text);
-                a_token = new_rawint_token(cp, &start);
-                add_token(tokens, a_token);
-            }
-        } else {
-            if (in >= 32 && in <= 127) {
-                report_error(&state->origin, "unexpected character '%c' (%d).", in, in);
-            } else {
-                report_error(&state->origin, "unexpected character code %d", in);
-            }
-            has_errors = 1;
-            in = next_char(state);
+                new_rawint_token(tokens, cp, &start);
+                break; }
+
+            default:
+                if (in >= 32 && in <= 127) {
+                    lexer_error(state, &state->origin, "unexpected character '%c' (%d).", in, in);
+                } else {
+                    lexer_error(state, &state->origin, "unexpected character code %d", in);
+                }
+                has_errors = 1;
+                in = next_char(state);
         }
     }
 
-    if (has_errors) {
-        free_token_list(tokens);
-        return NULL;
-    } else {
-        add_token(tokens, new_token(tt_eol, NULL, state));
-        return tokens;
-    }
+    state->error_count += has_errors;
+    return FALSE;
 }
@@ -0,0 +1,96 @@
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200809L
+#define HAVE_MMAP 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "mapfile.h"
+#include "vbuffer.h"
+
+static int mapfile_buffered(struct mapped_file *file, const char *filename);
+
+/* Reads the entire file into a vbuffer. Used for stdin and for anything that
+ * cannot be mapped.
+ */
+static int mapfile_buffered(struct mapped_file *file, const char *filename) {
+    file->buffer = vbuffer_new();
+    if (!file->buffer) return 0;
+
+    if (!vbuffer_readfile(file->buffer, filename)) {
+        vbuffer_free(file->buffer);
+        file->buffer = NULL;
+        return 0;
+    }
+    file->data = file->buffer->data;
+    file->length = file->buffer->length;
+    return 1;
+}
+
+/* Opens *filename* for reading. If *filename* is NULL, stdin is read instead.
+ * Returns 1 on success and 0 on failure.
+ */
+int mapfile_open(struct mapped_file *file, const char *filename) {
+    file->data = NULL;
+    file->length = 0;
+    file->is_mapped = 0;
+    file->buffer = NULL;
+
+    if (filename == NULL) {
+        return mapfile_buffered(file, NULL);
+    }
+
+#ifdef HAVE_MMAP
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    if (S_ISREG(info.st_mode)) {
+        if (info.st_size == 0) {
+            // mmap refuses zero length mappings
+            close(fd);
+            file->data = "";
+            return 1;
+        }
+
+        void *map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map != MAP_FAILED) {
+            file->data = map;
+            file->length = info.st_size;
+            file->is_mapped = 1;
+            return 1;
+        }
+    } else {
+        close(fd);
+    }
+#endif
+
+    return mapfile_buffered(file, filename);
+}
+
+void mapfile_close(struct mapped_file *file) {
+#ifdef HAVE_MMAP
+    if (file->is_mapped) {
+        munmap((void*)file->data, file->length);
+    }
+#endif
+    vbuffer_free(file->buffer);
+    file->data = NULL;
+    file->length = 0;
+    file->is_mapped = 0;
+    file->buffer = NULL;
+}
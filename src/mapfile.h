@@ -0,0 +1,23 @@
+#ifndef MAPFILE_H
+#define MAPFILE_H
+
+#include <stddef.h>
+
+struct vbuffer;
+
+/* Read-only view of the contents of a file. Regular files are mapped into
+ * memory where the platform supports it; anything else (stdin, pipes, or
+ * platforms without mmap) is read into a vbuffer instead. The data is NOT
+ * NUL terminated; users must respect the length.
+ */
+struct mapped_file {
+    const char *data;
+    size_t length;
+    int is_mapped;
+    struct vbuffer *buffer;
+};
+
+int mapfile_open(struct mapped_file *file, const char *filename);
+void mapfile_close(struct mapped_file *file);
+
+#endif
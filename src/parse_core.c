@@ -5,31 +5,28 @@
 #include <string.h>
 
 #include "assemble.h"
+#include "vbuffer.h"
 
 
 int expect_eol(struct token **current) {
     struct token *here = *current;
 
-    if (here == NULL || here->next == NULL) {
+    if (here->type == tt_eof || here[1].type == tt_eof) {
         return TRUE;
     }
 
-    here = here->next;
+    ++here;
     if (here->type != tt_eol) {
         report_error(&here->origin,
                      "expected EOL, but found %s (ignoring excess tokens)",
                      token_name(here));
-        while (here && here->type != tt_eol) {
-            here = here->next;
+        while (here->type != tt_eol && here->type != tt_eof) {
+            ++here;
         }
         return FALSE;
     }
 
-    if (here) {
-        *current = here->next;
-    } else {
-        *current = NULL;
-    }
+    *current = here + 1;
     return TRUE;
 }
 
@@ -44,70 +41,88 @@ int expect_type(struct token *current, enum token_type type) {
 /*
     Removes all tokens from the list beginning at *start* and ending at the
     next EOL token (or the end of the token list if not EOL token is found).
-    Returns the next token after the removed EOL token, or NULL if there are
-    no more tokens in the list.
+    Returns the next token after the removed EOL token, which will be the end
+    of list marker if there are no more tokens in the list.
 */
 struct token* remove_line(struct token_list *list, struct token *start) {
-    struct token *next = NULL, *current = start;
+    struct token *current = start;
 
-    while (current && current->type != tt_eol) {
-        next = current->next;
-        remove_token(list, current);
-        free_token(current);
-        current = next;
+    while (current->type != tt_eol && current->type != tt_eof) {
+        ++current;
     }
-
-
-    if (current == NULL) {
-        if (list->first == start) {
-            // we've removed all the tokens
-            list->first = list->last = NULL;
-        }
-        return NULL;
+    if (current->type == tt_eol) {
+        ++current;
     }
 
-
-    next = current->next;
-    if (list->first == start) {
-        list->first = next;
-    }
-    remove_token(list, current);
-    free_token(current);
-    return next;
+    size_t start_index = start - list->tokens;
+    remove_tokens(list, start_index, current - start);
+    return &list->tokens[start_index];
 }
 
 void skip_line(struct token **current) {
     struct token *here = *current;
 
-    while (here && here->type != tt_eol) {
-        here = here->next;
+    while (here->type != tt_eol && here->type != tt_eof) {
+        ++here;
     }
 
-    if (here) {
-        *current = here->next;
-    } else {
-        *current = NULL;
+    if (here->type == tt_eol) {
+        ++here;
     }
+    *current = here;
 }
 
 void report_error(struct origin *origin, const char *err_text, ...) {
+    va_list args;
+    va_start(args, err_text);
+    vreport_error(NULL, origin, err_text, args);
+    va_end(args);
+}
+
+/* As report_error, but if *log* is not NULL the message is added to the end
+ * of it instead of being printed. This lets work done off the main thread
+ * hold its errors back until they can be printed in a predictable order.
+ */
+void vreport_error(struct vbuffer *log, struct origin *origin, const char *err_text, va_list args) {
+    if (!log) {
+        if (origin) {
+            fputs(origin->filename, stderr);
+            if (origin->line >= 0) {
+                fprintf(stderr, ":%d:%d", origin->line, origin->column);
+            }
+            fputc(' ', stderr);
+        }
+        vfprintf(stderr, err_text, args);
+        fputc('\n', stderr);
+        return;
+    }
+
+    char message[1024];
+    int length = 0;
     if (origin) {
-        fputs(origin->filename, stderr);
         if (origin->line >= 0) {
-            fprintf(stderr, ":%d:%d", origin->line, origin->column);
+            length = snprintf(message, sizeof(message), "%s:%d:%d ",
+                              origin->filename, origin->line, origin->column);
+        } else {
+            length = snprintf(message, sizeof(message), "%s ", origin->filename);
+        }
+        if (length < 0 || (size_t)length >= sizeof(message)) {
+            length = 0;
         }
-        fputc(' ', stderr);
     }
-
-    va_list args;
-    va_start(args, err_text);
-    vfprintf(stderr, err_text, args);
-    va_end(args);
-    fputc('\n', stderr);
+    int message_length = vsnprintf(&message[length], sizeof(message) - length, err_text, args);
+    if (message_length > 0) {
+        length += message_length;
+    }
+    if ((size_t)length >= sizeof(message)) {
+        length = sizeof(message) - 1;
+    }
+    vbuffer_append(log, message, length);
+    vbuffer_pushchar(log, '\n');
 }
 
-int matches_text(struct token *token, enum token_type type, const char *text) {
-    if (!token || token->type != type || strcmp(token->text, text) != 0) {
+int matches_symbol(struct token *token, enum token_type type, int symbol) {
+    if (!token || token->type != type || token->i != symbol) {
         return FALSE;
     }
     return TRUE;
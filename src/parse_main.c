@@ -7,16 +7,24 @@
 #include "assemble.h"
 #include "vbuffer.h"
 
-#define EVAL_KNOWN      1
-#define EVAL_UNKNOWN    0
-#define EVAL_INVALID    -1
-
-static void write_byte(FILE *out, uint8_t value);
-static void write_short(FILE *out, uint16_t value);
-static void write_word(FILE *out, uint32_t value);
+/* A use of an identifier that was still undefined when backpatches were
+ * resolved.
+ */
+struct unresolved_name {
+    const char *name;
+    struct origin origin;
+};
+
+static void write_byte(struct vbuffer *image, uint8_t value);
+static void write_short(struct vbuffer *image, uint16_t value);
+static void write_word(struct vbuffer *image, uint32_t value);
+static void write_bytes(struct vbuffer *image, const char *data, int length);
+static void write_zeroes(struct vbuffer *image, int count);
+static void store_variable(struct vbuffer *image, int position, uint32_t value, int width);
 static void write_variable(struct output_state *output, uint32_t value, int width);
 
 static int value_fits(uint32_t value, int width);
+static int value_fits_signed(int value, int width);
 
 static int parse_string_data(struct token *first,
                              struct output_state *output,
@@ -27,70 +35,133 @@ static int parse_pad(struct token *first, struct output_state *output);
 static int parse_zeroes(struct token *first, struct output_state *output);
 static int parse_bytes(struct token *first, struct output_state *output, int width);
 static int parse_function(struct token *first, struct output_state *output);
-static void free_function_locals(struct output_state *output);
+static int reset_function_locals(struct output_state *output);
+static void begin_local_scope(struct output_state *output);
+static int end_local_scope(struct output_state *output);
+static int add_layout_local_label(struct layout_state *layout, struct arena *arena, int symbol, int pos);
+static int local_labels_moved(struct layout_state *layout);
+static int add_function_local(struct output_state *output, int symbol);
+static int find_function_local(struct output_state *output, int symbol);
+static void* grow_scope_array(struct arena *arena, void *array, int *capacity, size_t item_size, int needed);
+static int grow_symbol_index(int **index, int *size, int needed);
+static void free_symbol_indexes(struct output_state *output);
+static int is_local_label(struct output_state *output, int symbol);
+static int add_local_label(struct output_state *output, int symbol, int pos);
+static int find_local_label(struct output_state *output, int symbol);
+static int add_local_label_use(struct output_state *output, int offset);
+static void bind_local_label(struct operand *op, int pos);
+static int define_label(struct output_state *output, int symbol, int value);
+static struct define_slot* get_define_slot(struct output_state *output, int symbol, int create);
+static int add_pending_define(struct output_state *output, int symbol, int value,
+                              struct origin *origin);
+static struct pending_define* take_waiting(struct output_state *output, int symbol,
+                                           struct pending_define *ready);
+static void resolve_defines(struct output_state *output, struct pending_define *ready);
+static int finish_defines(struct output_state *output, struct unresolved_name **names,
+                          int *count, int *capacity);
+static void report_define_cycle(struct output_state *output, struct pending_define *start);
+
+static int parse_define(struct token *here, struct output_state *output);
+static int parse_cstring(struct token *here, struct output_state *output);
+static int parse_string(struct token *here, struct output_state *output);
+static int parse_encoded(struct token *here, struct output_state *output);
+static int parse_byte(struct token *here, struct output_state *output);
+static int parse_short(struct token *here, struct output_state *output);
+static int parse_word(struct token *here, struct output_state *output);
+static int parse_end_header(struct token *here, struct output_state *output);
+static int parse_extra_memory(struct token *here, struct output_state *output);
+static int parse_stack_size(struct token *here, struct output_state *output);
+static int parse_include(struct token *here, struct output_state *output);
+static int parse_include_binary(struct token *here, struct output_state *output);
+static int parse_string_table(struct token *here, struct output_state *output);
 
 struct operand* parse_operand_constant(struct token **from, struct output_state *output, int require_known);
 struct operand* parse_operand(struct token **from, struct output_state *output);
 struct operand* parse_unary_operand(struct token **from, struct output_state *output);
 struct operand* parse_operand_expr(struct token **from, struct output_state *output);
-int eval_operand(struct operand *op, struct output_state *output, int report_unknown_identifiers);
-static int operand_size(const struct operand *op);
-
-
-struct operand* new_operand() {
-    struct operand *o = calloc(sizeof(struct operand), 1);
+static int operator_precedence(enum operator_type op_type);
+static struct operand* parse_binary_expr(struct token **from, struct output_state *output, int min_precedence);
+static struct operand* fold_operand(struct operand *op, struct output_state *output);
+int eval_operand(struct operand *op, struct output_state *output);
+static int compile_operand(struct operand *root, struct output_state *output);
+static int add_unresolved(int code, struct origin *origin, struct output_state *output,
+                          struct unresolved_name **names, int *count, int *capacity);
+static int compare_unresolved(const void *a, const void *b);
+static void report_unresolved(struct unresolved_name *names, int count);
+static int value_size(enum operand_type type, int value);
+static int size_bytes(int size);
+static int is_return_offset(int offset);
+static int estimate_symbol(void *context, int symbol, int *value);
+static int settle_operand_size(struct output_state *output, struct operand *op, int relative_end);
+static int grow_operand_size(struct layout_state *layout, int number);
+static void begin_layout_pass(struct program_info *info);
+static void end_layout_pass(struct program_info *info, int is_last);
+
+
+struct operand* new_operand(struct arena *arena) {
+    struct operand *o = arena_calloc(arena, sizeof(struct operand));
     if (!o) return NULL;
     o->type = ot_constant;
     o->op_type = op_value;
+    o->symbol = -1;
     return o;
 }
 
-void free_operands(struct operand *first_operand) {
-    while (first_operand) {
-        struct operand *next = first_operand->next;
-        if (!first_operand->dont_free) {
-            // free(first_operand);
-        } else {
-            first_operand->next = NULL;
-        }
-        first_operand = next;
-    }
-}
-
 /* ************************************************************************** *
  * BINARY OUTPUT FUNCTIONS                                                    *
  * ************************************************************************** */
 
-static void write_byte(FILE *out, uint8_t value) {
-    fputc(  value        & 0xFF, out);
+/* The program is built up in memory and written out once it is complete.
+ * If memory runs out the image is left short, which parse_finish notices
+ * by comparing its length with output->code_position.
+ */
+static void write_byte(struct vbuffer *image, uint8_t value) {
+    vbuffer_pushchar(image, value);
+}
+
+static void write_short(struct vbuffer *image, uint16_t value) {
+    vbuffer_pushshort(image, value);
 }
 
-static void write_short(FILE *out, uint16_t value) {
-    fputc( (value >> 8)  & 0xFF, out);
-    fputc(  value        & 0xFF, out);
+static void write_word(struct vbuffer *image, uint32_t value) {
+    vbuffer_pushword(image, value);
 }
 
-static void write_word(FILE *out, uint32_t value) {
-    fputc( (value >> 24) & 0xFF, out);
-    fputc( (value >> 16) & 0xFF, out);
-    fputc( (value >> 8)  & 0xFF, out);
-    fputc(  value        & 0xFF, out);
+static void write_bytes(struct vbuffer *image, const char *data, int length) {
+    vbuffer_append(image, data, length);
+}
+
+static void write_zeroes(struct vbuffer *image, int count) {
+    if (count > 0) {
+        vbuffer_fill(image, 0, count);
+    }
 }
 
 static void write_variable(struct output_state *output, uint32_t value, int width) {
     switch(width) {
         case 1:
-            write_byte(output->out, value);
+            write_byte(output->image, value);
             break;
         case 2:
-            write_short(output->out, value);
+            write_short(output->image, value);
             break;
         case 4:
-            write_word(output->out, value);
+            write_word(output->image, value);
             break;
     }
 }
 
+/* Overwrites the *width* bytes at *position* in the image, which must
+ * already have been written, with *value*.
+ */
+static void store_variable(struct vbuffer *image, int position, uint32_t value, int width) {
+    unsigned char *dest = (unsigned char*)image->data + position;
+    for (int i = width - 1; i >= 0; --i) {
+        dest[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
 static int value_fits(uint32_t value, int width) {
     switch(width) {
         case 1:
@@ -104,6 +175,22 @@ static int value_fits(uint32_t value, int width) {
     }
 }
 
+/* As value_fits, for a value that will be read back sign extended. */
+static int value_fits_signed(int value, int width) {
+    switch(width) {
+        case 0:
+            return value == 0;
+        case 1:
+            return value >= -128 && value <= 0x7F;
+        case 2:
+            return value >= -32768 && value <= 0x7FFF;
+        case 4:
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
 
 /* ************************************************************************** *
  * DIRECTIVE PARSING                                                          *
@@ -112,7 +199,7 @@ static int value_fits(uint32_t value, int width) {
 static int parse_string_data(struct token *first,
                         struct output_state *output,
                         int add_type_byte) {
-    struct token *here = first->next;
+    struct token *here = first + 1;
 
     if (!expect_type(here, tt_string)) {
         return FALSE;
@@ -120,20 +207,16 @@ static int parse_string_data(struct token *first,
 
     if (output->info->debug_out) {
         fprintf(output->info->debug_out, "0x%08X string ~", output->code_position);
-        dump_string(output->info->debug_out, here->text, 32);
+        dump_string(output->info->debug_out, here->text, here->i, 32);
         fprintf(output->info->debug_out, "~\n");
     }
 
     if (add_type_byte) {
-        fputc(0xE0, output->out);
+        write_byte(output->image, 0xE0);
     }
-    int pos = 0;
-    while (here->text[pos] != 0) {
-        fputc(here->text[pos], output->out);
-        ++pos;
-    }
-    fputc(0, output->out);
-    output->code_position += pos + 1;
+    write_bytes(output->image, here->text, here->i);
+    write_byte(output->image, 0);
+    output->code_position += here->i + 1;
     if (add_type_byte) {
         ++output->code_position;
     }
@@ -144,7 +227,7 @@ static int parse_string_data(struct token *first,
 
 static int parse_unicode_data(struct token *first,
                               struct output_state *output) {
-    struct token *here = first->next;
+    struct token *here = first + 1;
 
     if (!expect_type(here, tt_string)) {
         return FALSE;
@@ -152,22 +235,17 @@ static int parse_unicode_data(struct token *first,
 
     if (output->info->debug_out) {
         fprintf(output->info->debug_out, "0x%08X unicode ~", output->code_position);
-        dump_string(output->info->debug_out, here->text, 32);
+        dump_string(output->info->debug_out, here->text, here->i, 32);
         fprintf(output->info->debug_out, "~\n");
     }
-    fputc(0xE2, output->out);
-    fputc(0, output->out);
-    fputc(0, output->out);
-    fputc(0, output->out);
+    write_word(output->image, 0xE2000000);
 
     int pos = 0, length = 0;
-    int codepoint = utf8_next_char(here->text, &pos);
-    while (codepoint != 0) {
-        write_word(output->out, codepoint);
+    while (pos < here->i) {
+        write_word(output->image, utf8_next_char(here->text, &pos));
         ++length;
-        codepoint = utf8_next_char(here->text, &pos);
     }
-    write_word(output->out, 0);
+    write_word(output->image, 0);
     output->code_position += length * 4 + 8;
 
     expect_eol(&here);
@@ -175,17 +253,14 @@ static int parse_unicode_data(struct token *first,
 }
 
 static int parse_pad(struct token *first, struct output_state *output) {
-    struct token *here = first->next;
+    struct token *here = first + 1;
 
     if (!expect_type(here, tt_integer)) {
         return FALSE;
     }
 
-    int count = 0;
-    while(ftell(output->out) % here->i != 0) {
-        fputc(0, output->out);
-        ++count;
-    }
+    int count = (here->i - output->code_position % here->i) % here->i;
+    write_zeroes(output->image, count);
 
     if (output->info->debug_out) {
         fprintf(output->info->debug_out, "0x%08X %d bytes padding\n", output->code_position, count);
@@ -196,7 +271,7 @@ static int parse_pad(struct token *first, struct output_state *output) {
 }
 
 static int parse_zeroes(struct token *first, struct output_state *output) {
-    struct token *here = first->next;
+    struct token *here = first + 1;
 
     if (!expect_type(here, tt_integer)) {
         return FALSE;
@@ -205,9 +280,7 @@ static int parse_zeroes(struct token *first, struct output_state *output) {
     if (output->info->debug_out) {
         fprintf(output->info->debug_out, "0x%08X zeroes (%d)\n", output->code_position, here->i);
     }
-    for (int i = 0; i < here->i; ++i) {
-        fputc(0, output->out);
-    }
+    write_zeroes(output->image, here->i);
     output->code_position += here->i;
     expect_eol(&here);
     return TRUE;
@@ -215,12 +288,12 @@ static int parse_zeroes(struct token *first, struct output_state *output) {
 
 static int parse_bytes(struct token *first, struct output_state *output, int width) {
     int has_errors = FALSE;
-    struct token *here = first->next;
+    struct token *here = first + 1;
     if (output->info->debug_out) {
         fprintf(output->info->debug_out, "0x%08X data(%d)", output->code_position, width);
     }
 
-    while (here && here->type != tt_eol) {
+    while (here->type != tt_eol && here->type != tt_eof) {
         struct token *op_start = here;
         struct operand *operand = parse_operand_constant(&here, output, FALSE);
         if (operand) {
@@ -231,21 +304,25 @@ static int parse_bytes(struct token *first, struct output_state *output, int wid
                 if (!value_fits(operand->value, width)) {
                     report_error(&op_start->origin, "value is larger than storage specification");
                     has_errors = TRUE;
-                    free_operands(operand);
                     continue;
                 }
                 write_variable(output, operand->value, width);
                 output->code_position += width;
-                free_operands(operand);
             } else {
-                struct backpatch *patch = malloc(sizeof(struct backpatch));
+                int code = compile_operand(operand, output);
+                if (code < 0) {
+                    has_errors = TRUE;
+                    continue;
+                }
+                struct backpatch *patch = arena_alloc(output->info->arena, sizeof(struct backpatch));
                 patch->next = 0;
                 patch->max_width = width;
+                patch->sign_extended = FALSE;
                 copy_origin(&patch->origin, &op_start->origin);
                 patch->position = output->code_position;
                 patch->position_after = 0;
-                patch->operand_chain = operand;
-                operand->dont_free = TRUE;
+                patch->operand_number = -1;
+                patch->code = code;
                 if (output->info->patch_list) {
                     patch->next = output->info->patch_list;
                 }
@@ -266,57 +343,60 @@ static int parse_bytes(struct token *first, struct output_state *output, int wid
 static int parse_function(struct token *first, struct output_state *output) {
     int stack_based = FALSE;
     int found_errors = FALSE;
-    struct token *here = first->next; // skip ".function"
-    free_function_locals(output);
+    struct token *here = first + 1; // skip ".function"
+    if (!reset_function_locals(output)) {
+        found_errors = TRUE;
+    }
     int start_pos = output->code_position;
 
-    if (here && here->type == tt_identifier && strcmp(here->text, "stk") == 0) {
+    if (matches_symbol(here, tt_identifier, sym_stk)) {
         stack_based = TRUE;
-        here = here->next;
+        ++here;
     }
 
     int name_count = 0;
     if (here->type != tt_eol) {
         struct local_list *last = NULL;
-        while (here && here->type != tt_eol) {
+        while (here->type != tt_eol && here->type != tt_eof) {
             if (!expect_type(here, tt_identifier)) {
                 found_errors = TRUE;
             } else {
-                if (get_label(output->info->first_label, here->text)) {
+                if (get_label(output->info, here->i)) {
                     report_error(&here->origin,
                                     "local variable %s shadowed by global value of same name.",
                                     here->text);
                     found_errors = TRUE;
                 }
-                struct local_list *local = output->local_names;
-                while (local) {
-                    if (strcmp(local->name, here->text) == 0) {
-                        report_error(&here->origin,
-                                    "duplicate named local \"%s\".",
-                                    here->text);
-                        found_errors = TRUE;
-                    }
-                    local = local->next;
-                }
-                local = malloc(sizeof(struct local_list));
-                local->name = str_dup(here->text);
-                local->next = NULL;
-                if (last) {
-                    last->next = local;
+                struct local_list *local = NULL;
+                if (find_function_local(output, here->i) >= 0) {
+                    report_error(&here->origin,
+                                "duplicate named local \"%s\".",
+                                here->text);
+                    found_errors = TRUE;
+                } else if ((local = arena_alloc(output->info->arena, sizeof(struct local_list))) == NULL
+                        || !add_function_local(output, here->i)) {
+                    report_error(&here->origin, "could not create local (out of memory?)");
+                    found_errors = TRUE;
                 } else {
-                    output->local_names = local;
+                    local->symbol = here->i;
+                    local->next = NULL;
+                    if (last) {
+                        last->next = local;
+                    } else {
+                        output->local_names = local;
+                    }
+                    last = local;
                 }
-                last = local;
                 ++name_count;
             }
-            here = here->next;
+            ++here;
         }
     }
 
     if (stack_based) {
-        fputc(0xC0, output->out);
+        write_byte(output->image, 0xC0);
     } else {
-        fputc(0xC1, output->out);
+        write_byte(output->image, 0xC1);
     }
     output->code_position += 3;
 
@@ -332,7 +412,7 @@ static int parse_function(struct token *first, struct output_state *output) {
             while (cur) {
                 fprintf(output->info->debug_out,
                         " %s",
-                        cur->name);
+                        symbol_name(output->info->symbols, cur->symbol));
                 cur = cur->next;
             }
         }
@@ -341,33 +421,196 @@ static int parse_function(struct token *first, struct output_state *output) {
 
     while (name_count > 0) {
         if (name_count > 255) {
-            write_byte(output->out, 4);
-            write_byte(output->out, 255);
+            write_byte(output->image, 4);
+            write_byte(output->image, 255);
         } else {
-            write_byte(output->out, 4);
-            write_byte(output->out, name_count);
+            write_byte(output->image, 4);
+            write_byte(output->image, name_count);
         }
         output->code_position += 2;
         name_count -= 255;
     }
     // write terminator for local count
-    write_byte(output->out, 0);
-    write_byte(output->out, 0);
+    write_byte(output->image, 0);
+    write_byte(output->image, 0);
 
     return !found_errors;
 }
 
-static void free_function_locals(struct output_state *output) {
-    struct local_list *cur = output->local_names;
-    while (cur) {
-        struct local_list *next = cur->next;
-        free(cur->name);
-        free(cur);
-        cur = next;
+/* Locals are found through output->local_index, which is indexed by symbol
+ * ID like the label index. Only the entries for the current function's
+ * locals are ever set, so clearing them is enough to reset the scope.
+ *
+ * Local labels, whose names begin with '@', work the same way through
+ * output->local_label_index. Uses of local labels not yet defined are kept
+ * as offsets into the expression code until the end of the function, when
+ * they are rewritten as the labels' positions; any left over are reported
+ * with the other unknown identifiers.
+ */
+static int reset_function_locals(struct output_state *output) {
+    for (struct local_list *local = output->local_names; local; local = local->next) {
+        output->local_index[local->symbol] = 0;
+    }
+    for (int i = 0; i < output->local_label_use_count; ++i) {
+        int offset = output->local_label_uses[i];
+        int label = find_local_label(output, exprcode_symbol_at(&output->code, offset));
+        if (label >= 0) {
+            exprcode_bind(&output->code, offset, output->local_labels[label].pos);
+        }
+    }
+    for (int i = 0; i < output->local_label_count; ++i) {
+        output->local_label_index[output->local_labels[i].symbol] = 0;
     }
     output->current_function = NULL;
     output->local_names = NULL;
     output->local_count = 0;
+    output->local_label_count = 0;
+    output->local_label_use_count = 0;
+
+    if (!end_local_scope(output)) {
+        report_error(NULL, "Could not allocate memory for local labels.");
+        return FALSE;
+    }
+    begin_local_scope(output);
+    return TRUE;
+}
+
+/* Returns a copy of *array*, which holds *capacity* items of *item_size*
+ * bytes, with room for at least *needed* items, or NULL if memory runs out.
+ * The capacity is at least doubled and the new items are zeroed.
+ */
+static void* grow_scope_array(struct arena *arena, void *array, int *capacity, size_t item_size, int needed) {
+    int new_capacity = *capacity ? *capacity * 2 : 256;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    void *new_array = arena_calloc(arena, item_size * new_capacity);
+    if (!new_array) return NULL;
+    if (array) {
+        memcpy(new_array, array, item_size * *capacity);
+    }
+    *capacity = new_capacity;
+    return new_array;
+}
+
+/* Grows *index*, a heap array of *size* ints indexed by symbol ID, to hold
+ * at least *needed* entries, zeroing the new ones. The symbol indexes live
+ * on the heap so that growing them leaves nothing behind in the arena;
+ * free_symbol_indexes releases them at the end of each pass.
+ */
+static int grow_symbol_index(int **index, int *size, int needed) {
+    int new_size = *size ? *size * 2 : 256;
+    while (new_size < needed) {
+        new_size *= 2;
+    }
+    int *new_index = realloc(*index, sizeof(int) * new_size);
+    if (!new_index) return FALSE;
+    memset(new_index + *size, 0, sizeof(int) * (new_size - *size));
+    *index = new_index;
+    *size = new_size;
+    return TRUE;
+}
+
+static void free_symbol_indexes(struct output_state *output) {
+    free(output->local_index);
+    free(output->local_label_index);
+    free(output->local_estimate_index);
+    output->local_index = NULL;
+    output->local_label_index = NULL;
+    output->local_estimate_index = NULL;
+    output->local_index_size = 0;
+    output->local_label_index_size = 0;
+    output->local_estimate_index_size = 0;
+}
+
+/* Makes *symbol* the next local of the current function. Returns FALSE if
+ * the index could not be grown to hold it.
+ */
+static int add_function_local(struct output_state *output, int symbol) {
+    if (symbol >= output->local_index_size
+            && !grow_symbol_index(&output->local_index, &output->local_index_size, symbol + 1)) {
+        return FALSE;
+    }
+    ++output->local_count;
+    output->local_index[symbol] = output->local_count;
+    return TRUE;
+}
+
+/* Returns the number of the current function's local named by *symbol*,
+ * counting from zero, or -1 if there is no such local.
+ */
+static int find_function_local(struct output_state *output, int symbol) {
+    if (symbol < 0 || symbol >= output->local_index_size) {
+        return -1;
+    }
+    return output->local_index[symbol] - 1;
+}
+
+static int is_local_label(struct output_state *output, int symbol) {
+    const char *name = symbol_name(output->info->symbols, symbol);
+    return name && name[0] == '@';
+}
+
+/* Defines the local label *symbol* at *pos* in the current function.
+ * Returns FALSE if it is already defined or memory runs out.
+ */
+static int add_local_label(struct output_state *output, int symbol, int pos) {
+    if (find_local_label(output, symbol) >= 0) {
+        return FALSE;
+    }
+    if (symbol >= output->local_label_index_size
+            && !grow_symbol_index(&output->local_label_index, &output->local_label_index_size,
+                                  symbol + 1)) {
+        return FALSE;
+    }
+    if (output->local_label_count >= output->local_label_capacity) {
+        struct local_label *new_labels = grow_scope_array(output->info->arena, output->local_labels,
+                                                          &output->local_label_capacity,
+                                                          sizeof(struct local_label),
+                                                          output->local_label_count + 1);
+        if (!new_labels) return FALSE;
+        output->local_labels = new_labels;
+    }
+    struct local_label *label = &output->local_labels[output->local_label_count];
+    label->symbol = symbol;
+    label->pos = pos;
+    ++output->local_label_count;
+    output->local_label_index[symbol] = output->local_label_count;
+    return add_layout_local_label(&output->info->layout, output->info->arena, symbol, pos);
+}
+
+/* Returns the position in output->local_labels of the local label
+ * *symbol*, or -1 if it is not defined in the current function.
+ */
+static int find_local_label(struct output_state *output, int symbol) {
+    if (symbol < 0 || symbol >= output->local_label_index_size) {
+        return -1;
+    }
+    return output->local_label_index[symbol] - 1;
+}
+
+/* Remembers that the expression code at *offset* names a local label not
+ * yet defined, so that it can be bound at the end of the function.
+ */
+static int add_local_label_use(struct output_state *output, int offset) {
+    if (output->local_label_use_count >= output->local_label_use_capacity) {
+        int *new_uses = grow_scope_array(output->info->arena, output->local_label_uses,
+                                         &output->local_label_use_capacity, sizeof(int),
+                                         output->local_label_use_count + 1);
+        if (!new_uses) return FALSE;
+        output->local_label_uses = new_uses;
+    }
+    output->local_label_uses[output->local_label_use_count] = offset;
+    ++output->local_label_use_count;
+    return TRUE;
+}
+
+/* Replaces the local label named by *op* with its position. */
+static void bind_local_label(struct operand *op, int pos) {
+    op->value = op->op_type == op_negate ? exprcode_negate(pos) : pos;
+    op->op_type = op_value;
+    op->symbol = -1;
+    op->known_value = TRUE;
 }
 
 struct operand* parse_operand_constant(struct token **from, struct output_state *output, int require_known) {
@@ -376,12 +619,10 @@ struct operand* parse_operand_constant(struct token **from, struct output_state
     if (!op) return NULL;
     if (op->type != ot_constant) {
         report_error(&start->origin, "value must be constant");
-        free_operands(op);
         return FALSE;
     }
     if (require_known && !op->known_value) {
         report_error(&start->origin, "value must be previously defined");
-        free_operands(op);
         return FALSE;
     }
     return op;
@@ -395,20 +636,20 @@ struct operand* parse_operand(struct token **from, struct output_state *output)
     if (here->type == tt_indirect) {
         is_indirect = TRUE;
         the_type = ot_indirect;
-        here = here->next;
+        ++here;
     }
 
+    struct origin *origin = &here->origin;
     struct operand *op = parse_operand_expr(&here, output);
-
-    int result = eval_operand(op, output, FALSE);
-    if (result == EVAL_INVALID) {
-        free(op);
+    if (!op) {
         return NULL;
     }
+    // report problems with the whole operand at its start, not at the last
+    // operator of its expression
+    op->origin = *origin;
     if (is_indirect) {
         if (op->type != ot_constant) {
             report_error(&op->origin, "cannot indirect reference operand (is it a local variable?)");
-            free(op);
             return NULL;
         }
         op->type = the_type;
@@ -420,13 +661,14 @@ struct operand* parse_operand(struct token **from, struct output_state *output)
 
 struct operand* parse_unary_operand(struct token **from, struct output_state *output) {
     struct token *here = *from;
+    struct token *sign = here;
     enum operator_type op_type = op_value;
 
     if (here->type == tt_operator) {
         if (here->i == op_add) {
-            here = here->next;
+            ++here;
         } else if (here->i == op_subtract) {
-            here = here->next;
+            ++here;
             op_type = op_negate;
         } else {
             report_error(&here->origin, "operator is not unary");
@@ -434,434 +676,1169 @@ struct operand* parse_unary_operand(struct token **from, struct output_state *ou
         }
     }
 
-    struct operand *op = new_operand();
-    op->dont_free = FALSE;
+    if (here->type == tt_open_paren) {
+        ++here;
+        struct operand *inner = parse_operand_expr(&here, output);
+        if (!inner) {
+            return NULL;
+        }
+        if (here->type != tt_close_paren) {
+            report_error(&here->origin, "expected closing parenthesis but found %s", token_name(here));
+            return NULL;
+        }
+        *from = here + 1;
+        if (op_type != op_negate) {
+            return inner;
+        }
+
+        // negating an expression is subtracting it from zero
+        struct operand *zero = new_operand(output->operands);
+        struct operand *op = new_operand(output->operands);
+        if (!zero || !op) return NULL;
+        zero->origin = sign->origin;
+        zero->known_value = TRUE;
+        op->origin = sign->origin;
+        op->op_type = op_subtract;
+        op->left = zero;
+        op->right = inner;
+        return fold_operand(op, output);
+    }
+
+    struct operand *op = new_operand(output->operands);
     op->type = ot_constant;
     op->origin = here->origin;
     op->op_type = op_type;
     op->next = NULL;
-    op->name = NULL;
+    op->symbol = -1;
     op->known_value = FALSE;
-    op->force_4byte = FALSE;
+    op->size = 0;
+    op->code = -1;
 
     if (here->type == tt_integer) {
-        op->value = here->i;
+        // fold negation now, so that evaluating the operand again cannot
+        // negate it a second time
+        op->value = op_type == op_negate ? exprcode_negate(here->i) : here->i;
+        op->op_type = op_value;
         op->known_value = TRUE;
     } else if (here->type == tt_identifier) {
-        if (strcmp(here->text, "sp") == 0) {
+        if (here->i == sym_sp) {
             op->type = ot_stack;
             op->value = 0;
             op->known_value = TRUE;
         } else {
-            op->name = here->text;
+            op->symbol = here->i;
             op->value = 0;
             op->known_value = FALSE;
+            if (is_local_label(output, here->i)) {
+                // labels later in the function are bound once its end is
+                // reached; see compile_operand
+                int label = find_local_label(output, here->i);
+                if (label >= 0) {
+                    bind_local_label(op, output->local_labels[label].pos);
+                }
+            } else if (eval_operand(op, output) == EVAL_INVALID) {
+                return NULL;
+            }
         }
     } else {
         report_error(&here->origin, "unexpected %s token found", token_name(here));
-        free(op);
         return NULL;
     }
 
-    *from = here->next;
+    *from = here + 1;
     return op;
 }
 
+/* Returns how tightly the binary operator *op_type* binds, following C:
+ * higher values bind more tightly and zero means it is not a binary
+ * operator.
+ */
+static int operator_precedence(enum operator_type op_type) {
+    switch(op_type) {
+        case op_multiply:
+        case op_divide:         return 6;
+        case op_add:
+        case op_subtract:       return 5;
+        case op_shift_left:
+        case op_shift_right:    return 4;
+        case op_bit_and:        return 3;
+        case op_bit_xor:        return 2;
+        case op_bit_or:         return 1;
+        default:                return 0;
+    }
+}
+
 struct operand* parse_operand_expr(struct token **from, struct output_state *output) {
+    return parse_binary_expr(from, output, 1);
+}
+
+/* Parses an expression containing only binary operators that bind at least
+ * as tightly as *min_precedence*, using precedence climbing. Operators of
+ * equal precedence group to the left. Each operation whose operands are
+ * known is folded into a single value as soon as it is parsed.
+ */
+static struct operand* parse_binary_expr(struct token **from, struct output_state *output, int min_precedence) {
     struct operand *left = parse_unary_operand(from, output);
-    struct token *here = *from;
-    if (here && here->type == tt_operator) {
-        enum operator_type op_type = here->i;
-        struct origin *origin = &here->origin;
-        here = here->next;
-        struct operand *right = parse_operand_expr(&here, output);
+    if (!left) {
+        return NULL;
+    }
+
+    while ((*from)->type == tt_operator) {
+        struct token *operator = *from;
+        int precedence = operator_precedence(operator->i);
+        if (precedence < min_precedence) {
+            break;
+        }
+        ++*from;
+        struct operand *right = parse_binary_expr(from, output, precedence + 1);
         if (!right) {
-            free_operands(left);
             return NULL;
         }
-        *from = here;
 
-        struct operand *op = new_operand();
-        copy_origin(&op->origin, origin);
-        op->op_type = op_type;
+        struct operand *op = new_operand(output->operands);
+        if (!op) return NULL;
+        copy_origin(&op->origin, &operator->origin);
+        op->op_type = operator->i;
         op->left = left;
         op->right = right;
+        left = fold_operand(op, output);
+        if (!left) {
+            return NULL;
+        }
+    }
+    return left;
+}
+
+/* Replaces the operation *op* by its value if both of its operands are
+ * known, so that only operations that depend on names not yet defined are
+ * kept for later. Returns NULL if the operation is invalid.
+ */
+static struct operand* fold_operand(struct operand *op, struct output_state *output) {
+    if (!op->left->known_value || !op->right->known_value) {
         return op;
-    } else {
-        return left;
     }
+    if (eval_operand(op, output) != EVAL_KNOWN) {
+        return NULL;
+    }
+    op->left = NULL;
+    op->right = NULL;
+    return op;
 }
 
-int eval_operand(struct operand *op, struct output_state *output, int report_unknown_identifiers) {
+/* Works out the value of *op* as far as possible. Identifiers are looked up
+ * by their symbol ID, in the label index and then among the current
+ * function's locals, so a lookup costs the same however many labels exist.
+ * Returns EVAL_UNKNOWN if some identifier is not yet defined.
+ */
+int eval_operand(struct operand *op, struct output_state *output) {
     struct label_def *label;
     if (!op) return EVAL_INVALID;
 
     if (op->op_type == op_negate || op->op_type == op_value) {
-        if (op->name) {
-            label = get_label(output->info->first_label, op->name);
+        if (op->symbol >= 0) {
+            label = get_label(output->info, op->symbol);
             if (label) {
                 op->value = label->pos;
                 op->known_value = EVAL_KNOWN;
             } else {
-                struct local_list *local = output->local_names;
-                int counter = 0;
-                while (local) {
-                    if (strcmp(local->name, op->name) == 0) {
-                        op->type = ot_local;
-                        op->value = counter * 4;
-                        op->known_value = EVAL_KNOWN;
-                        break;
-                    }
-                    local = local->next;
-                    ++counter;
+                int local = find_function_local(output, op->symbol);
+                if (local >= 0) {
+                    op->type = ot_local;
+                    op->value = local * 4;
+                    op->known_value = EVAL_KNOWN;
                 }
             }
         }
         if (!op->known_value) {
-            if (report_unknown_identifiers) {
-                report_error(&op->origin, "unknown identifier ~%s~",
-                    op->name);
-            }
             return EVAL_UNKNOWN;
         } else {
             if (op->op_type == op_value) {
                 // do nothing in this case
             } else if (op->type != ot_constant) {
-                report_error(&op->origin, "unary operators may only function on constant values",
-                    op->name);
+                report_error(&op->origin, "unary operators may only function on constant values");
                 return EVAL_INVALID;
             } else if (op->op_type == op_negate) {
-                op->value = -op->value;
+                op->value = exprcode_negate(op->value);
             }
             return EVAL_KNOWN;
         }
     }
 
-    int r1 = eval_operand(op->left, output, report_unknown_identifiers);
-    int r2 = eval_operand(op->right, output, report_unknown_identifiers);
+    int r1 = eval_operand(op->left, output);
+    int r2 = eval_operand(op->right, output);
     if (r1 == EVAL_INVALID || r2 == EVAL_INVALID) return EVAL_INVALID;
     if (r1 == EVAL_UNKNOWN || r2 == EVAL_UNKNOWN) return EVAL_UNKNOWN;
-    switch(op->op_type) {
-        case op_add:
-            op->value = op->left->value + op->right->value;
-            break;
-        case op_subtract:
-            op->value = op->left->value - op->right->value;
-            break;
-        case op_multiply:
-            op->value = op->left->value * op->right->value;
-            break;
-        case op_divide:
-            op->value = op->left->value / op->right->value;
-            break;
-        case op_shift_left:
-            op->value = op->left->value << op->right->value;
-            break;
-        case op_shift_right:
-            op->value = op->left->value >> op->right->value;
-            break;
-        case op_bit_and:
-            op->value = op->left->value & op->right->value;
-            break;
-        case op_bit_or:
-            op->value = op->left->value | op->right->value;
-            break;
-        case op_bit_xor:
-            op->value = op->left->value ^ op->right->value;
-            break;
-        default:
+    if (op->left->type != ot_constant || op->right->type != ot_constant) {
+        report_error(&op->origin, "operators may only function on constant values");
+        return EVAL_INVALID;
+    }
+    if (!exprcode_apply(op->op_type, op->left->value, op->right->value, &op->value)) {
+        const char *message = exprcode_apply_error(op->op_type, op->right->value);
+        if (message) {
+            report_error(&op->origin, "%s", message);
+        } else {
             report_error(&op->origin, "unhandled operation type");
-            return EVAL_INVALID;
+        }
+        return EVAL_INVALID;
     }
     op->op_type = op_value;
     op->known_value = TRUE;
     return EVAL_KNOWN;
 }
 
+/* Stores the expression *root*, which depends on names not yet defined,
+ * as expression code and returns its offset, or -1 after reporting an
+ * error. The tree is walked in postorder with a stack of its own, so it is
+ * no longer needed once this returns. Local labels not yet defined are
+ * recorded so that they can be bound at the end of the function; other
+ * expressions share the code of any identical expression stored before.
+ */
+static int compile_operand(struct operand *root, struct output_state *output) {
+    struct expr_code *code = &output->code;
+    struct operand **stack = NULL;
+    int depth = 0, capacity = 0;
+    int start = exprcode_length(code);
+    int local_label_uses = output->local_label_use_count;
+    struct operand *op = root, *last = NULL;
+
+    while (op || depth > 0) {
+        if (op) {
+            if (depth >= capacity) {
+                struct operand **new_stack = grow_scope_array(output->operands, stack, &capacity,
+                                                              sizeof(struct operand*), depth + 1);
+                if (!new_stack) {
+                    report_error(&root->origin, "could not store expression (out of memory?)");
+                    return -1;
+                }
+                stack = new_stack;
+            }
+            stack[depth++] = op;
+            op = op->left;
+            continue;
+        }
+
+        struct operand *top = stack[depth - 1];
+        if (top->right && last != top->right) {
+            op = top->right;
+            continue;
+        }
+        --depth;
+        last = top;
+
+        int result;
+        if (top->left) {
+            result = exprcode_operator(code, top->op_type);
+        } else if (top->known_value) {
+            if (top->type != ot_constant) {
+                report_error(&top->origin, "operators may only function on constant values");
+                return -1;
+            }
+            result = exprcode_constant(code, top->value);
+        } else {
+            result = exprcode_symbol(code, top->symbol);
+            if (result >= 0 && is_local_label(output, top->symbol)
+                    && !add_local_label_use(output, result)) {
+                result = -1;
+            }
+            if (result >= 0 && top->op_type == op_negate) {
+                result = exprcode_operator(code, op_negate);
+            }
+        }
+        if (result < 0) {
+            report_error(&root->origin, "could not store expression (out of memory?)");
+            return -1;
+        }
+    }
+
+    if (exprcode_end(code) < 0) {
+        report_error(&root->origin, "could not store expression (out of memory?)");
+        return -1;
+    }
+    if (output->local_label_use_count != local_label_uses) {
+        return start;
+    }
+    return exprcode_share(code, start);
+}
 
-static int operand_size(const struct operand *op) {
-    if (!op->known_value || op->force_4byte) {
-        return 3;
+/* Adds each identifier in the expression code at *code* that is still
+ * undefined to *names*, which is grown as needed, as a use at *origin*.
+ * Names given by a .define that could not be resolved are left out, since
+ * the .define itself has been reported. Returns FALSE if memory runs out.
+ */
+static int add_unresolved(int code, struct origin *origin, struct output_state *output,
+                          struct unresolved_name **names, int *count, int *capacity) {
+    int symbol;
+    while ((symbol = exprcode_next_symbol(&output->code, &code)) >= 0) {
+        struct define_slot *slot = get_define_slot(output, symbol, FALSE);
+        if (get_label(output->info, symbol) || (slot && slot->define)) {
+            continue;
+        }
+        if (*count >= *capacity) {
+            int new_capacity = *capacity ? *capacity * 2 : 64;
+            struct unresolved_name *new_names = realloc(*names, sizeof(struct unresolved_name) * new_capacity);
+            if (!new_names) return FALSE;
+            *names = new_names;
+            *capacity = new_capacity;
+        }
+        (*names)[*count].name = symbol_name(output->info->symbols, symbol);
+        (*names)[*count].origin = *origin;
+        ++*count;
     }
+    return TRUE;
+}
+
+/* Orders unresolved names by name and then by where they were used. */
+static int compare_unresolved(const void *a, const void *b) {
+    const struct unresolved_name *first = a;
+    const struct unresolved_name *second = b;
+    int result = strcmp(first->name, second->name);
+    if (result) return result;
+    result = strcmp(first->origin.filename ? first->origin.filename : "",
+                    second->origin.filename ? second->origin.filename : "");
+    if (result) return result;
+    if (first->origin.line != second->origin.line) {
+        return first->origin.line < second->origin.line ? -1 : 1;
+    }
+    if (first->origin.column != second->origin.column) {
+        return first->origin.column < second->origin.column ? -1 : 1;
+    }
+    return 0;
+}
 
-    switch(op->type) {
+/* Reports each unresolved name once, in alphabetical order, at the first
+ * place it was used.
+ */
+static void report_unresolved(struct unresolved_name *names, int count) {
+    if (count == 0) return;
+    qsort(names, count, sizeof(struct unresolved_name), compare_unresolved);
+    int i = 0;
+    while (i < count) {
+        int uses = 1;
+        while (i + uses < count && strcmp(names[i].name, names[i + uses].name) == 0) {
+            ++uses;
+        }
+        if (uses > 1) {
+            report_error(&names[i].origin, "unknown identifier ~%s~ (used %d times)", names[i].name, uses);
+        } else {
+            report_error(&names[i].origin, "unknown identifier ~%s~", names[i].name);
+        }
+        i += uses;
+    }
+}
+
+
+/* Returns the smallest encoding of a *type* operand that holds *value*: 0,
+ * 1 or 2 bytes, or 3 for four bytes. Constants are sign extended when they
+ * are read; addresses are not.
+ */
+static int value_size(enum operand_type type, int value) {
+    switch(type) {
         case ot_stack:
             return 0;
         case ot_constant:
-            if (op->value == 0)                             return 0;
-            if (op->value >= -128   && op->value <= 0x7F)   return 1;
-            if (op->value >= -32768 && op->value <= 0x7FFF) return 2;
-            else                                            return 3;
+            if (value == 0)                         return 0;
+            if (value >= -128   && value <= 0x7F)   return 1;
+            if (value >= -32768 && value <= 0x7FFF) return 2;
+            else                                    return 3;
         case ot_local:
         case ot_indirect:
         case ot_afterram:
-            if (op->value <= 0xFF)      return 1;
-            if (op->value <= 0xFFFF)    return 2;
-            else                                          return 3;
+            if ((unsigned)value <= 0xFF)    return 1;
+            if ((unsigned)value <= 0xFFFF)  return 2;
+            else                            return 3;
     }
-    return 4;
+    return 3;
+}
+
+/* Returns the number of bytes taken by an operand of encoding *size*. */
+static int size_bytes(int size) {
+    return size == 3 ? 4 : size;
+}
+
+/* Returns TRUE if *offset* cannot be used as a branch offset: glulx reads
+ * offsets of 0 and 1 as returning that value rather than as branches.
+ */
+static int is_return_offset(int offset) {
+    return offset == 0 || offset == 1;
 }
 
 
 /* ************************************************************************** *
- * DIRECTIVE PROCESSING                                                       *
+ * OPERAND SIZING                                                             *
  * ************************************************************************** */
-int parse_directives(struct token *here, struct output_state *output) {
-    if (strcmp(here->text, ".define") == 0) {
-        here = here->next;
 
-        if (!expect_type(here, tt_identifier)) {
-            return FALSE;
-        }
-        const char *name = here->text;
-        here = here->next;
-
-        if (get_label(output->info->first_label, name) != NULL) {
-            report_error(&here->origin, "name %s already in use", name);
-            return FALSE;
-        }
+/* Instruction operands are given the smallest encoding that holds their
+ * value. Values not known when an operand is reached, usually those of
+ * forward references, are estimated from the previous pass over the
+ * program; the first pass has no estimates and assumes one byte. A pass in
+ * which any label moves is followed by another (see parse_next_pass), and
+ * since the encoding of an operand never shrinks from one pass to the
+ * next, labels only ever move forward and the passes settle. In the last
+ * pass every estimate is exact, so every value fits its encoding.
+ */
+
+/* Finds a likely value for a name the current pass has not defined yet:
+ * a local label of the current scope, or any other label, as it was in the
+ * previous pass. *context* is the output_state.
+ */
+static int estimate_symbol(void *context, int symbol, int *value) {
+    struct output_state *output = context;
+    if (symbol >= 0 && symbol < output->local_estimate_index_size
+            && output->local_estimate_index[symbol]) {
+        int local = output->local_estimate_index[symbol] - 1;
+        *value = output->info->layout.previous_local_labels[local].pos;
+        output->estimate_is_exact = FALSE;
+        return TRUE;
+    }
+    struct label_def *label = get_label(output->info, symbol);
+    if (!label) {
+        label = get_previous_label(output->info, symbol);
+        output->estimate_is_exact = FALSE;
+    }
+    if (!label) return FALSE;
+    *value = label->pos;
+    return TRUE;
+}
 
-        struct operand *operand = parse_operand_constant(&here, output, TRUE);
-        if (operand) {
-            if (!add_label(&output->info->first_label, name, operand->value)) {
-                report_error(&here->origin, "error creating constant");
-                free_operands(operand);
-                return FALSE;
-            }
-            free_operands(operand);
-            if (!expect_type(here, tt_eol)) {
-                return FALSE;
+/* Chooses the encoding of *op*, the next instruction operand of the pass.
+ * If *relative_end* is not negative the operand is relative to the end of
+ * its instruction, which is at *relative_end* plus the operand's own size,
+ * and an encoding that would make it a return offset is passed over. That
+ * is only done for exact values; an estimate from the previous pass is
+ * usually a little short, and parse_finish grows the operand if the real
+ * value turns out to be a return offset as well.
+ */
+static int settle_operand_size(struct output_state *output, struct operand *op, int relative_end) {
+    struct layout_state *layout = &output->info->layout;
+    int number = output->operand_number++;
+    int size = number < layout->operand_size_count ? layout->operand_sizes[number] : 0;
+
+    int value = op->value;
+    output->estimate_is_exact = TRUE;
+    int estimated = op->known_value
+                 || (op->code >= 0
+                     && exprcode_estimate(&output->code, op->code, estimate_symbol, output, &value));
+    while (size < 3) {
+        if (!estimated) {
+            if (size >= 1) break;
+        } else {
+            int encoded = value;
+            if (relative_end >= 0) {
+                encoded = value - (relative_end + size_bytes(size)) + 2;
+                if (is_return_offset(encoded) && output->estimate_is_exact) {
+                    ++size;
+                    continue;
+                }
             }
-            return TRUE;
+            if (value_size(op->type, encoded) <= size) break;
         }
-        return FALSE;
+        ++size;
     }
 
-    if (strcmp(here->text, ".cstring") == 0) {
-        return parse_string_data(here, output, FALSE);
+    if (number >= layout->operand_size_capacity) {
+        unsigned char *new_sizes = grow_scope_array(output->info->arena, layout->operand_sizes,
+                                                    &layout->operand_size_capacity, 1, number + 1);
+        if (!new_sizes) {
+            // not remembered, so the largest size is the only safe one
+            return 3;
+        }
+        layout->operand_sizes = new_sizes;
     }
-
-    if (strcmp(here->text, ".string") == 0) {
-        return parse_string_data(here, output, TRUE);
+    layout->operand_sizes[number] = size;
+    if (number >= layout->operand_size_count) {
+        layout->operand_size_count = number + 1;
     }
+    return size;
+}
 
-    if (strcmp(here->text, ".unicode") == 0) {
-        return parse_unicode_data(here, output);
+/* Moves operand *number* to its next larger encoding, to take effect from
+ * the next pass. Returns FALSE if it has none.
+ */
+static int grow_operand_size(struct layout_state *layout, int number) {
+    if (number < 0 || number >= layout->operand_size_count || layout->operand_sizes[number] >= 3) {
+        return FALSE;
     }
+    ++layout->operand_sizes[number];
+    return TRUE;
+}
 
-    if (strcmp(here->text, ".encoded") == 0) {
-        here = here->next;
-        if (!expect_type(here, tt_string)) {
-            return FALSE;
+/* Prepares *info* for another pass over the program, keeping what the
+ * previous pass learned about the layout. The debug listing of the pass is
+ * written to a scratch file, kept by end_layout_pass only if the pass turns
+ * out to be the last.
+ */
+static void begin_layout_pass(struct program_info *info) {
+    struct layout_state *layout = &info->layout;
+    if (layout->pass == 0) {
+        layout->debug_file = info->debug_out;
+    }
+    if (layout->debug_file) {
+        end_layout_pass(info, FALSE);
+        info->debug_out = tmpfile();
+        if (!info->debug_out) {
+            // the listing then has every pass in it
+            info->debug_out = layout->debug_file;
         }
-        int size = encode_string(output->out, &output->info->strings, here->text);
-        if (size < 0) return FALSE;
-        output->code_position += size;
-        return expect_eol(&here);
     }
+    ++layout->pass;
+    layout->changed = FALSE;
+    layout->previous_local_labels = layout->local_labels;
+    layout->previous_local_label_count = layout->local_label_count;
+    layout->local_labels = NULL;
+    layout->local_label_count = 0;
+    layout->local_label_capacity = 0;
+    labels_begin_pass(info);
+    info->patch_list = NULL;
+    // strings are encoded again by each pass
+    info->strings.input_bytes = 0;
+    info->strings.output_bytes = 0;
+}
 
-    if (strcmp(here->text, ".byte") == 0) {
-        return parse_bytes(here, output, 1);
+/* Closes the scratch listing of the pass just finished, first copying it
+ * to the debug file if *is_last*.
+ */
+static void end_layout_pass(struct program_info *info, int is_last) {
+    FILE *listing = info->debug_out;
+    FILE *debug_file = info->layout.debug_file;
+    if (!listing || listing == debug_file) return;
+    if (is_last) {
+        char buffer[4096];
+        size_t count;
+        rewind(listing);
+        while ((count = fread(buffer, 1, sizeof(buffer), listing)) > 0) {
+            fwrite(buffer, 1, count, debug_file);
+        }
     }
-    if (strcmp(here->text, ".short") == 0) {
-        return parse_bytes(here, output, 2);
+    fclose(listing);
+    info->debug_out = debug_file;
+}
+
+/* Records that the local label *symbol* is at *pos*, or with a symbol of
+ * -1 that a scope has ended. Returns FALSE if memory runs out.
+ */
+static int add_layout_local_label(struct layout_state *layout, struct arena *arena, int symbol, int pos) {
+    if (layout->local_label_count >= layout->local_label_capacity) {
+        struct local_label *new_labels = grow_scope_array(arena, layout->local_labels,
+                                                          &layout->local_label_capacity,
+                                                          sizeof(struct local_label),
+                                                          layout->local_label_count + 1);
+        if (!new_labels) return FALSE;
+        layout->local_labels = new_labels;
+    }
+    layout->local_labels[layout->local_label_count].symbol = symbol;
+    layout->local_labels[layout->local_label_count].pos = pos;
+    ++layout->local_label_count;
+    return TRUE;
+}
+
+/* Returns TRUE if the local labels of this pass differ from those of the
+ * previous pass.
+ */
+static int local_labels_moved(struct layout_state *layout) {
+    if (layout->local_label_count != layout->previous_local_label_count) {
+        return TRUE;
     }
-    if (strcmp(here->text, ".word") == 0) {
-        return parse_bytes(here, output, 4);
+    for (int i = 0; i < layout->local_label_count; ++i) {
+        if (layout->local_labels[i].symbol != layout->previous_local_labels[i].symbol
+                || layout->local_labels[i].pos != layout->previous_local_labels[i].pos) {
+            return TRUE;
+        }
     }
+    return FALSE;
+}
 
-    if (strcmp(here->text, ".pad") == 0) {
-        return parse_pad(here, output);
+/* Makes the local labels that the previous pass found in the scope now
+ * starting available to estimate_symbol.
+ */
+static void begin_local_scope(struct output_state *output) {
+    struct layout_state *layout = &output->info->layout;
+    for (int i = output->previous_scope; i < layout->previous_local_label_count; ++i) {
+        int symbol = layout->previous_local_labels[i].symbol;
+        if (symbol < 0) break;
+        // without an estimate the label is taken to be near
+        if (symbol >= output->local_estimate_index_size
+                && !grow_symbol_index(&output->local_estimate_index,
+                                      &output->local_estimate_index_size, symbol + 1)) {
+            continue;
+        }
+        output->local_estimate_index[symbol] = i + 1;
     }
-    if (strcmp(here->text, ".zero") == 0) {
-        return parse_zeroes(here, output);
+}
+
+/* Clears the estimates of the scope that is ending and marks its end in
+ * the layout. Returns FALSE if memory runs out.
+ */
+static int end_local_scope(struct output_state *output) {
+    struct layout_state *layout = &output->info->layout;
+    int i = output->previous_scope;
+    while (i < layout->previous_local_label_count && layout->previous_local_labels[i].symbol >= 0) {
+        int symbol = layout->previous_local_labels[i].symbol;
+        if (symbol < output->local_estimate_index_size) {
+            output->local_estimate_index[symbol] = 0;
+        }
+        ++i;
     }
+    output->previous_scope = i + 1;
+    return add_layout_local_label(layout, output->info->arena, -1, 0);
+}
+
 
-    if (strcmp(here->text, ".function") == 0) {
-        return parse_function(here, output);
+/* ************************************************************************** *
+ * DEFERRED CONSTANTS                                                         *
+ * ************************************************************************** */
+
+/* A .define may use names that are defined later. Such a define waits, in
+ * the define slot of the first undefined name in its value, until that name
+ * is defined; it is then tried again, and either defined or moved to wait on
+ * the next undefined name. Constants are therefore defined as soon as their
+ * value can be known, and operands that come after that point can use the
+ * value directly. Any defines still waiting at the end of the source are
+ * resolved once more, and what remains is reported either as a cycle or
+ * through the unknown names it uses.
+ */
+
+/* Adds a label or constant, as add_label does, and defines any pending
+ * defines that were waiting on it. Returns FALSE if the name is in use.
+ */
+static int define_label(struct output_state *output, int symbol, int value) {
+    struct define_slot *slot = get_define_slot(output, symbol, FALSE);
+    if (slot && slot->define) {
+        return FALSE;
     }
+    if (!add_label(output->info, symbol, value)) {
+        return FALSE;
+    }
+    resolve_defines(output, take_waiting(output, symbol, NULL));
+    return TRUE;
+}
 
-    if (strcmp(here->text, ".end_header") == 0) {
-        if (!output->in_header) {
-            report_error(&here->origin, "ended header when not in header");
-            return FALSE;
+/* Returns the define slot for *symbol*. If *create* is set the slots are
+ * grown to include it; otherwise NULL is returned for a symbol that has
+ * never been used by a pending define.
+ */
+static struct define_slot* get_define_slot(struct output_state *output, int symbol, int create) {
+    if (symbol < 0) return NULL;
+    if (symbol >= output->define_slot_count) {
+        if (!create) return NULL;
+        struct define_slot *new_slots = grow_scope_array(output->info->arena, output->define_slots,
+                                                         &output->define_slot_count,
+                                                         sizeof(struct define_slot), symbol + 1);
+        if (!new_slots) return NULL;
+        output->define_slots = new_slots;
+    }
+    struct define_slot *slot = &output->define_slots[symbol];
+    if (!create && !slot->define && !slot->waiting) return NULL;
+    return slot;
+}
+
+/* Records a .define of *symbol* whose value, stored as expression code at
+ * *value*, is not yet known and tries to resolve it. Returns FALSE if
+ * memory runs out.
+ */
+static int add_pending_define(struct output_state *output, int symbol, int value,
+                              struct origin *origin) {
+    struct define_slot *slot = get_define_slot(output, symbol, TRUE);
+    struct pending_define *define = arena_calloc(output->info->arena, sizeof(struct pending_define));
+    if (!slot || !define) return FALSE;
+    define->symbol = symbol;
+    define->value = value;
+    define->waiting_on = -1;
+    define->origin = *origin;
+    define->next = output->first_define;
+    output->first_define = define;
+    slot->define = define;
+    resolve_defines(output, define);
+    return TRUE;
+}
+
+/* Moves the pending defines waiting on *symbol* onto the front of the
+ * *ready* list, returning the new list.
+ */
+static struct pending_define* take_waiting(struct output_state *output, int symbol,
+                                           struct pending_define *ready) {
+    struct define_slot *slot = get_define_slot(output, symbol, FALSE);
+    if (!slot) return ready;
+    struct pending_define *define = slot->waiting;
+    slot->waiting = NULL;
+    while (define) {
+        struct pending_define *next = define->next_waiting;
+        define->next_waiting = ready;
+        ready = define;
+        define = next;
+    }
+    return ready;
+}
+
+/* Tries each define on the *ready* list. A define whose value is now known
+ * is added as a constant and the defines waiting on it are added to the
+ * list; the others go back to waiting. Works through a list rather than
+ * recursing, so long chains of constants cannot exhaust the stack.
+ */
+static void resolve_defines(struct output_state *output, struct pending_define *ready) {
+    while (ready) {
+        struct pending_define *define = ready;
+        ready = define->next_waiting;
+        define->next_waiting = NULL;
+
+        int value, unknown;
+        int result = exprcode_eval(&output->code, output->info, define->value, &define->origin,
+                                   &value, &unknown);
+        if (result == EVAL_UNKNOWN) {
+            // if no slot can be had, the define is tried again at the end
+            define->waiting_on = unknown;
+            struct define_slot *slot = get_define_slot(output, unknown, TRUE);
+            if (slot) {
+                define->next_waiting = slot->waiting;
+                slot->waiting = define;
+            }
+            continue;
         }
 
-        while (output->code_position % 256 != 0) {
-            fputc(0, output->out);
-            ++output->code_position;
+        define->resolved = TRUE;
+        if (result == EVAL_INVALID) {
+            define->failed = TRUE;
+        } else if (!add_label(output->info, define->symbol, value)) {
+            report_error(&define->origin, "error creating constant");
+            define->failed = TRUE;
+        } else {
+            ready = take_waiting(output, define->symbol, ready);
         }
-        output->in_header = FALSE;
-        output->info->ram_start = output->code_position;
-        add_label(&output->info->first_label, "_RAMSTART", output->info->ram_start);
-        return expect_eol(&here);
     }
+}
 
-    if (strcmp(here->text, ".extra_memory") == 0) {
-        here = here->next;
-        if (!expect_type(here, tt_integer)) {
-            return FALSE;
+/* Makes a last attempt at each pending define, once every label is known,
+ * and reports those that still cannot be resolved. Undefined names they use
+ * are added to *names*. Returns FALSE if any define failed.
+ */
+static int finish_defines(struct output_state *output, struct unresolved_name **names,
+                          int *count, int *capacity) {
+    // take every unresolved define off its waiting list and try it again
+    for (struct pending_define *define = output->first_define; define; define = define->next) {
+        if (!define->resolved) {
+            struct define_slot *slot = get_define_slot(output, define->waiting_on, FALSE);
+            if (slot) {
+                slot->waiting = NULL;
+            }
         }
-        if (here->i % 256) {
-            report_error(&here->origin, "extra memory must be multiple of 256 (currently %d, next multiple %d)",
-                        here->i,
-                        (here->i / 256 + 1) * 256);
-            return FALSE;
+    }
+    struct pending_define *ready = NULL;
+    for (struct pending_define *define = output->first_define; define; define = define->next) {
+        if (!define->resolved) {
+            define->next_waiting = ready;
+            ready = define;
         }
-        output->info->extended_memory = here->i;
-        return expect_eol(&here);
     }
-
-    if (strcmp(here->text, ".stack_size") == 0) {
-        here = here->next;
-        if (!expect_type(here, tt_integer)) {
-            return FALSE;
+    resolve_defines(output, ready);
+
+    int ok = TRUE;
+    int walk = 0;
+    for (struct pending_define *define = output->first_define; define; define = define->next) {
+        if (define->failed) ok = FALSE;
+        if (define->resolved) continue;
+        ok = FALSE;
+
+        // follow the chain of defines waiting on each other until it reaches
+        // one waiting on an undefined name or comes back on itself
+        ++walk;
+        struct pending_define *here = define;
+        while (here && !here->resolved) {
+            if (here->visited == walk) {
+                report_define_cycle(output, here);
+                break;
+            }
+            here->visited = walk;
+            struct define_slot *slot = get_define_slot(output, here->waiting_on, FALSE);
+            struct pending_define *next = slot ? slot->define : NULL;
+            if (!next || next->resolved) {
+                if (!add_unresolved(here->value, &here->origin, output, names, count, capacity)) {
+                    report_error(&here->origin, "could not record unknown identifier (out of memory?)");
+                }
+                break;
+            }
+            here = next;
         }
-        if (here->i % 256) {
-            report_error(&here->origin, "stack size must be multiple of 256 (currently %d, next multiple %d)",
-                        here->i,
-                        (here->i / 256 + 1) * 256);
-            return FALSE;
+        for (here = define; here && !here->resolved; ) {
+            here->resolved = TRUE;
+            here->failed = TRUE;
+            struct define_slot *slot = get_define_slot(output, here->waiting_on, FALSE);
+            here = slot ? slot->define : NULL;
         }
-        output->info->stack_size = here->i;
-        return expect_eol(&here);
+    }
+    return ok;
+}
+
+/* Reports the cycle of defines that includes *start*, listing each name in
+ * the order they depend on one another if there is memory to do so.
+ */
+static void report_define_cycle(struct output_state *output, struct pending_define *start) {
+    struct vbuffer *path = vbuffer_new();
+    if (!path) {
+        report_error(NULL, "Could not allocate memory for define cycle.");
+        report_error(&start->origin, "constant ~%s~ depends on itself",
+                     symbol_name(output->info->symbols, start->symbol));
+        return;
+    }
+    struct pending_define *here = start;
+    do {
+        const char *name = symbol_name(output->info->symbols, here->symbol);
+        vbuffer_append(path, name, strlen(name));
+        vbuffer_append(path, " -> ", 4);
+        here = get_define_slot(output, here->waiting_on, FALSE)->define;
+    } while (here != start);
+    report_error(&start->origin, "constant ~%s~ depends on itself (%.*s%s)",
+                 symbol_name(output->info->symbols, start->symbol),
+                 (int)path->length, path->data,
+                 symbol_name(output->info->symbols, start->symbol));
+    vbuffer_free(path);
+}
+
+
+/* ************************************************************************** *
+ * DIRECTIVE PROCESSING                                                       *
+ * ************************************************************************** */
+static int parse_define(struct token *here, struct output_state *output) {
+    ++here;
+
+    if (!expect_type(here, tt_identifier)) {
+        return FALSE;
+    }
+    const char *name = here->text;
+    int symbol = here->i;
+    ++here;
+
+    if (is_local_label(output, symbol)) {
+        report_error(&here[-1].origin, "local label name %s cannot be used for a constant", name);
+        return FALSE;
     }
 
-    if (strcmp(here->text, ".include") == 0) {
-        report_error(&here->origin,
-                    "(internal) encountered %s directive after pre-processing",
-                    here->text);
+    struct define_slot *slot = get_define_slot(output, symbol, FALSE);
+    if (get_label(output->info, symbol) != NULL || (slot && slot->define)) {
+        report_error(&here->origin, "name %s already in use", name);
         return FALSE;
     }
 
-    if (strcmp(here->text, ".include_binary") == 0) {
-        here = here->next;
-        if (!expect_type(here, tt_string)) {
+    struct origin *origin = &here->origin;
+    struct operand *operand = parse_operand_constant(&here, output, FALSE);
+    if (!operand) {
+        return FALSE;
+    }
+    if (!expect_type(here, tt_eol)) {
+        return FALSE;
+    }
+    if (!operand->known_value) {
+        int value = compile_operand(operand, output);
+        if (value < 0) {
             return FALSE;
         }
-
-        struct vbuffer *buffer = vbuffer_new();
-        int result = vbuffer_readfile(buffer, here->text);
-        if (!result) {
-            report_error(&here->origin, "Could not read binary file ~%s~.", here->text);
-            vbuffer_free(buffer);
+        if (!add_pending_define(output, symbol, value, origin)) {
+            report_error(origin, "error creating constant");
             return FALSE;
         }
-        fwrite(buffer->data, buffer->length, 1, output->out);
+    } else if (!define_label(output, symbol, operand->value)) {
+        report_error(origin, "error creating constant");
+        return FALSE;
+    }
+    return TRUE;
+}
 
-        if (output->info->debug_out) {
-            fprintf(output->info->debug_out, "0x%08X BINARY FILE ~%s~ (%d bytes)\n",
-                    output->code_position,
-                    here->text,
-                    buffer->length);
-        }
+static int parse_cstring(struct token *here, struct output_state *output) {
+    return parse_string_data(here, output, FALSE);
+}
 
-        vbuffer_free(buffer);
-        output->code_position += buffer->length;
-        return expect_eol(&here);
+static int parse_string(struct token *here, struct output_state *output) {
+    return parse_string_data(here, output, TRUE);
+}
+
+static int parse_encoded(struct token *here, struct output_state *output) {
+    ++here;
+    if (!expect_type(here, tt_string)) {
+        return FALSE;
     }
+    int size = encode_string(output->image, &output->info->strings, here->text, here->i);
+    if (size < 0) return FALSE;
+    output->code_position += size;
+    return expect_eol(&here);
+}
 
-    if (strcmp(here->text, ".string_table") == 0) {
-        if (!expect_eol(&here)) {
-            return FALSE;
-        }
-        if (output->info->strings.first == NULL) {
-            return TRUE;
-        }
+static int parse_byte(struct token *here, struct output_state *output) {
+    return parse_bytes(here, output, 1);
+}
 
-        output->info->string_table = output->code_position;
-        int table_start = output->code_position + 12;
+static int parse_short(struct token *here, struct output_state *output) {
+    return parse_bytes(here, output, 2);
+}
 
-        int table_size = 12;
-        struct string_node *node = output->info->strings.first;
-        while (node) {
-            table_size += node_size(node);
-            node = node->next;
-        }
+static int parse_word(struct token *here, struct output_state *output) {
+    return parse_bytes(here, output, 4);
+}
 
-        write_word(output->out, table_size); // table size (bytes)
-        write_word(output->out, node_list_size(output->info->strings.first)); // table size (nodes)
-        write_word(output->out, output->info->strings.root->position + table_start); // root node
-        output->code_position += 12;
+static int parse_end_header(struct token *here, struct output_state *output) {
+    if (!output->in_header) {
+        report_error(&here->origin, "ended header when not in header");
+        return FALSE;
+    }
 
-        node = output->info->strings.first;
-        while (node) {
-            switch(node->type) {
-                case nt_end:
-                    write_byte(output->out, 1);
-                    break;
-                case nt_branch:
-                    write_byte(output->out, 0);
-                    write_word(output->out, node->d.branch.left->position + table_start);
-                    write_word(output->out, node->d.branch.right->position + table_start);
-                    break;
-                case nt_char:
-                    write_byte(output->out, 2);
-                    write_byte(output->out, node->d.a_char.c);
-                    break;
-                case nt_unichar:
-                    write_byte(output->out, 4);
-                    write_word(output->out, node->d.a_char.c);
-                    break;
-            }
-            output->code_position += node_size(node);
-            node = node->next;
-        }
-        return TRUE;
+    int padding = (256 - output->code_position % 256) % 256;
+    write_zeroes(output->image, padding);
+    output->code_position += padding;
+    output->in_header = FALSE;
+    output->info->ram_start = output->code_position;
+    define_label(output, sym_ramstart, output->info->ram_start);
+    return expect_eol(&here);
+}
+
+static int parse_extra_memory(struct token *here, struct output_state *output) {
+    ++here;
+    if (!expect_type(here, tt_integer)) {
+        return FALSE;
     }
+    if (here->i % 256) {
+        report_error(&here->origin, "extra memory must be multiple of 256 (currently %d, next multiple %d)",
+                    here->i,
+                    (here->i / 256 + 1) * 256);
+        return FALSE;
+    }
+    output->info->extended_memory = here->i;
+    return expect_eol(&here);
+}
+
+static int parse_stack_size(struct token *here, struct output_state *output) {
+    ++here;
+    if (!expect_type(here, tt_integer)) {
+        return FALSE;
+    }
+    if (here->i % 256) {
+        report_error(&here->origin, "stack size must be multiple of 256 (currently %d, next multiple %d)",
+                    here->i,
+                    (here->i / 256 + 1) * 256);
+        return FALSE;
+    }
+    output->info->stack_size = here->i;
+    return expect_eol(&here);
+}
 
-    report_error(&here->origin, "unknown directive %s", here->text);
+static int parse_include(struct token *here, struct output_state *output) {
+    report_error(&here->origin,
+                "(internal) encountered %s directive after pre-processing",
+                here->text);
     return FALSE;
 }
 
+static int parse_include_binary(struct token *here, struct output_state *output) {
+    ++here;
+    if (!expect_type(here, tt_string)) {
+        return FALSE;
+    }
+
+    // the file is read straight onto the end of the image
+    const char *filename = arena_strndup(output->info->arena, here->text, here->i);
+    size_t start = output->image->length;
+    int result = filename && vbuffer_readfile(output->image, filename);
+    if (!result) {
+        report_error(&here->origin, "Could not read binary file ~%.*s~.", here->i, here->text);
+        output->image->length = start;
+        return FALSE;
+    }
+    int length = output->image->length - start;
+
+    if (output->info->debug_out) {
+        fprintf(output->info->debug_out, "0x%08X BINARY FILE ~%s~ (%d bytes)\n",
+                output->code_position,
+                filename,
+                length);
+    }
+
+    output->code_position += length;
+    return expect_eol(&here);
+}
+
+static int parse_string_table(struct token *here, struct output_state *output) {
+    if (!expect_eol(&here)) {
+        return FALSE;
+    }
+    if (output->info->strings.first == NULL) {
+        return TRUE;
+    }
+
+    output->info->string_table = output->code_position;
+    int table_start = output->code_position + 12;
+
+    int table_size = 12;
+    struct string_node *node = output->info->strings.first;
+    while (node) {
+        table_size += node_size(node);
+        node = node->next;
+    }
+
+    write_word(output->image, table_size); // table size (bytes)
+    write_word(output->image, node_list_size(output->info->strings.first)); // table size (nodes)
+    write_word(output->image, output->info->strings.root->position + table_start); // root node
+    output->code_position += 12;
+
+    node = output->info->strings.first;
+    while (node) {
+        switch(node->type) {
+            case nt_end:
+                write_byte(output->image, 1);
+                break;
+            case nt_branch:
+                write_byte(output->image, 0);
+                write_word(output->image, node->d.branch.left->position + table_start);
+                write_word(output->image, node->d.branch.right->position + table_start);
+                break;
+            case nt_char:
+                write_byte(output->image, 2);
+                write_byte(output->image, node->d.a_char.c);
+                break;
+            case nt_unichar:
+                write_byte(output->image, 4);
+                write_word(output->image, node->d.a_char.c);
+                break;
+        }
+        output->code_position += node_size(node);
+        node = node->next;
+    }
+    return TRUE;
+}
+
+/* Handlers for each directive, indexed by the directive's builtin symbol.
+ * The lexer has already resolved directive names to their symbols, so
+ * dispatching costs the same for every directive.
+ */
+static int (*const directive_handlers[sym_last_directive + 1])(struct token*, struct output_state*) = {
+    [sym_define]            = parse_define,
+    [sym_cstring]           = parse_cstring,
+    [sym_string]            = parse_string,
+    [sym_unicode]           = parse_unicode_data,
+    [sym_encoded]           = parse_encoded,
+    [sym_byte]              = parse_byte,
+    [sym_short]             = parse_short,
+    [sym_word]              = parse_word,
+    [sym_pad]               = parse_pad,
+    [sym_zero]              = parse_zeroes,
+    [sym_function]          = parse_function,
+    [sym_end_header]        = parse_end_header,
+    [sym_extra_memory]      = parse_extra_memory,
+    [sym_stack_size]        = parse_stack_size,
+    [sym_include]           = parse_include,
+    [sym_include_binary]    = parse_include_binary,
+    [sym_include_once]      = parse_include,
+    [sym_string_table]      = parse_string_table,
+};
+
+int parse_directives(struct token *here, struct output_state *output) {
+    if (here->i < 0 || here->i > sym_last_directive || !directive_handlers[here->i]) {
+        report_error(&here->origin, "unknown directive %s", here->text);
+        return FALSE;
+    }
+    return directive_handlers[here->i](here, output);
+}
+
 /* ************************************************************************** *
  * PARSE_TOKENS FUNCTION                                                      *
  * ************************************************************************** */
 int parse_tokens(struct token_list *list, struct program_info *info) {
-    struct output_state output = { info, TRUE };
-    int has_errors = 0;
+    int result;
+    do {
+        struct output_state output = { info, TRUE };
+        int has_errors = 0;
+
+        if (!parse_begin(&output)) {
+            return FALSE;
+        }
 
-    FILE *out = fopen(info->output_file, "wb+");
-    output.out = out;
-    if (!out) {
-        fprintf(stderr, "Could not open output file \"%s\".\n", info->output_file);
+        struct token *here = list->tokens;
+        while (here->type != tt_eof) {
+            if (!parse_line(&here, &output)) {
+                has_errors = TRUE;
+            }
+        }
+
+        result = parse_finish(&output, has_errors);
+    } while (result && parse_next_pass(info));
+    return result;
+}
+
+/* Returns TRUE if the program must be assembled again because the layout
+ * changed during the pass just finished.
+ */
+int parse_next_pass(struct program_info *info) {
+    return info->layout.changed;
+}
+
+/* Starts the program image with a placeholder header. Lines can then be
+ * handed to parse_line one at a time, followed by a call to parse_finish,
+ * which writes the output file. This makes up one pass over the program;
+ * parse_next_pass says whether another is needed.
+ */
+int parse_begin(struct output_state *output) {
+    begin_layout_pass(output->info);
+    begin_local_scope(output);
+    output->image = vbuffer_new();
+    output->operands = arena_new();
+    if (!output->image || !output->operands) {
+        fprintf(stderr, "Could not allocate memory for output.\n");
+        vbuffer_free(output->image);
+        arena_free(output->operands);
+        free_symbol_indexes(output);
+        end_layout_pass(output->info, TRUE);
         return FALSE;
     }
 
     // write empty header
-    for (int i = 0; i < HEADER_SIZE; ++i) {
-        fputc(0, out);
-        ++output.code_position;
-    }
+    write_zeroes(output->image, HEADER_SIZE);
+    output->code_position += HEADER_SIZE;
+    return TRUE;
+}
+
+/* Assembles the line starting at *current, which is left pointing at the
+ * start of the following line. Returns FALSE if the line contained errors.
+ */
+int parse_line(struct token **current, struct output_state *output) {
+    struct program_info *info = output->info;
+    struct vbuffer *image = output->image;
+    struct token *here = *current;
+    int has_errors = 0;
+    arena_reset(output->operands);
 
-    struct token *here = list->first;
-    while (here) {
+    while (TRUE) {
         if (here->type == tt_eol) {
-            here = here->next;
-            continue;
+            ++here;
+            break;
+        }
+        if (here->type == tt_eof) {
+            break;
         }
 
         if (here->type == tt_directive) {
-            int result = parse_directives(here, &output);
+            int result = parse_directives(here, output);
             if (!result) {
                 has_errors = TRUE;
             }
             skip_line(&here);
-            continue;
+            break;
         }
 
         if (!expect_type(here, tt_identifier)) {
             has_errors = TRUE;
             skip_line(&here);
-            continue;
+            break;
         }
 
-        if (here->next && here->next->type == tt_colon) {
-            if (!add_label(&output.info->first_label, here->text, output.code_position)) {
+        if (here[1].type == tt_colon && is_local_label(output, here->i)) {
+            if (!add_local_label(output, here->i, output->code_position)) {
+                report_error(&here->origin, "could not create local label (already exists?)");
+                has_errors = TRUE;
+            }
+            here += 2;
+            continue;
+        }
+        if (here[1].type == tt_colon) {
+            if (!define_label(output, here->i, output->code_position)) {
                 report_error(&here->origin, "could not create label (already exists?)");
                 has_errors = TRUE;
             }
-            here = here->next->next;
+            here += 2;
             continue;
         }
 
@@ -869,67 +1846,65 @@ int parse_tokens(struct token_list *list, struct program_info *info) {
  * MNEMONIC PROCESSING                                                        *
  * ************************************************************************** */
         struct mnemonic customCode = { "custom opcode", -1, -1, FALSE };
-        struct mnemonic *m = codes;
+        struct mnemonic *m = NULL;
         struct token *mnemonic_start = here;
-        if (strcmp(here->text, "opcode") == 0) {
+        if (here->i == sym_opcode) {
             m = &customCode;
-            here = here->next;
-            if (matches_text(here, tt_identifier, "rel")) {
-                here = here->next;
+            ++here;
+            if (matches_symbol(here, tt_identifier, sym_rel)) {
+                ++here;
                 customCode.last_operand_is_relative = TRUE;
             }
-            struct operand *operand = parse_operand_constant(&here, &output, TRUE);
+            struct operand *operand = parse_operand_constant(&here, output, TRUE);
             if (!operand) {
                 customCode.opcode = 0;
                 has_errors = TRUE;
             } else {
-                customCode.opcode = here->i;
+                customCode.opcode = operand->value;
             }
         } else {
-            while (m->name && strcmp(m->name, here->text) != 0) {
-                ++m;
-            }
-            if (m->name == NULL) {
+            m = symbol_mnemonic(info->symbols, here->i);
+            if (m == NULL) {
                 report_error(&mnemonic_start->origin, "unknown mnemonic %s", here->text);
                 has_errors = TRUE;
                 skip_line(&here);
-                continue;
+                break;
             }
         }
 
-        if (output.info->debug_out) {
-            fprintf(output.info->debug_out, "0x%08X ~%s~ %d/0x%x   (at 0x%lx)  ",
-                    output.code_position,
+        if (output->info->debug_out) {
+            fprintf(output->info->debug_out, "0x%08X ~%s~ %d/0x%x   (at 0x%x)  ",
+                    output->code_position,
                     here->text,
                     m->opcode,
                     m->opcode,
-                    ftell(output.out));
+                    (unsigned)output->image->length);
         }
 
         if (m->opcode <= 0x7F) {
-            write_byte(output.out, m->opcode);
-            output.code_position += 1;
+            write_byte(output->image, m->opcode);
+            output->code_position += 1;
         } else if (m->opcode <= 0x3FFF) {
-            write_short(output.out, m->opcode | 0x8000);
-            output.code_position += 2;
+            write_short(output->image, m->opcode | 0x8000);
+            output->code_position += 2;
         } else {
-            write_word(output.out, m->opcode | 0xC0000000);
-            output.code_position += 4;
+            write_word(output->image, m->opcode | 0xC0000000);
+            output->code_position += 4;
         }
 
         if (m != &customCode) {
-            here = here->next;
+            ++here;
         }
         int operand_count = 0, operand_error = FALSE;
         struct operand *op_list = NULL, *op_end = NULL;
-        while (here && here->type != tt_eol && !operand_error) {
+        while (here->type != tt_eol && here->type != tt_eof && !operand_error) {
             if (operand_count > 0) {
                 if (here->type != tt_comma) {
                     report_error(&here->origin, "expected comma between operands");
                     has_errors = TRUE;
                 } else {
-                    here = here->next;
-                    if (!here || here->type == tt_eol) {
+                    ++here;
+                    if (here->type == tt_eol || here->type == tt_eof) {
                         report_error(&here->origin, "expected operand");
                         has_errors = TRUE;
                         continue;
@@ -937,7 +1912,7 @@ int parse_tokens(struct token_list *list, struct program_info *info) {
                 }
             }
             ++operand_count;
-            struct operand *op = parse_operand(&here, &output);
+            struct operand *op = parse_operand(&here, output);
             if (op == NULL) {
                 has_errors = operand_error = TRUE;
                 continue;
@@ -956,41 +1931,41 @@ int parse_tokens(struct token_list *list, struct program_info *info) {
             report_error(&mnemonic_start->origin,
                         "bad operand count for %s; expected %d, but found %d.",
                         m->name, m->operand_count, operand_count);
-            free_operands(op_list);
             has_errors = TRUE;
             skip_line(&here);
-            continue;
+            break;
         }
 
-        int after_pos = 0;
-        if (m->last_operand_is_relative) {
-            // find the end of the current instruction
-            after_pos = output.code_position;
-            int type_count = 0;
-            struct operand *op = op_list;
-            while (op) {
-                if (type_count) {
-                    type_count = 0;
-                    ++after_pos;
-                } else {
-                    type_count = 1;
-                }
-                if (op == op_end) {
-                    op->force_4byte = TRUE;
-                    after_pos += 4;
-                } else {
-                    after_pos += operand_size(op);
-                }
-                op = op->next;
+        // choose an encoding for each operand; a relative operand is sized
+        // last, once the rest of the instruction is known
+        int after_pos = output->code_position + (operand_count + 1) / 2;
+        struct operand *relative = m->last_operand_is_relative ? op_end : NULL;
+        for (struct operand *op = op_list; op; op = op->next) {
+            if (!op->known_value && (op->code = compile_operand(op, output)) < 0) {
+                has_errors = TRUE;
+                op->code = -1;
             }
-            if (type_count) ++after_pos;
-            if (op_end->known_value) {
-                op_end->value = op_end->value - after_pos + 2;
+            if (op != relative) {
+                op->size = settle_operand_size(output, op, -1);
+                after_pos += size_bytes(op->size);
             }
         }
+        if (relative) {
+            relative->size = settle_operand_size(output, relative, after_pos);
+            after_pos += size_bytes(relative->size);
+            if (relative->known_value) {
+                relative->value = relative->value - after_pos + 2;
+                if (is_return_offset(relative->value)) {
+                    report_error(&relative->origin, "branch target lies inside the branch instruction");
+                    has_errors = TRUE;
+                }
+            }
+        } else {
+            after_pos = 0;
+        }
 
-        if (output.info->debug_out) {
-            fprintf(output.info->debug_out, " types");
+        if (output->info->debug_out) {
+            fprintf(output->info->debug_out, " types");
         }
 
         // write operand types to file
@@ -1017,14 +1992,14 @@ int parse_tokens(struct token_list *list, struct program_info *info) {
                     my_type = 8;
                     break;
             }
-            my_type += operand_size(cur_op);
+            my_type += cur_op->size;
             if (type_count) {
                 type_count = 0;
                 type_byte |= my_type << 4;
-                fputc(type_byte, out);
-                ++output.code_position;
-                if (output.info->debug_out) {
-                    fprintf(output.info->debug_out, " %X", type_byte);
+                write_byte(image, type_byte);
+                ++output->code_position;
+                if (output->info->debug_out) {
+                    fprintf(output->info->debug_out, " %X", type_byte);
                 }
             } else {
                 type_count = 1;
@@ -1034,10 +2009,10 @@ int parse_tokens(struct token_list *list, struct program_info *info) {
             cur_op = cur_op->next;
         }
         if (type_count) {
-            fputc(type_byte, out);
-            ++output.code_position;
-            if (output.info->debug_out) {
-                fprintf(output.info->debug_out, " %X", type_byte);
+            write_byte(image, type_byte);
+            ++output->code_position;
+            if (output->info->debug_out) {
+                fprintf(output->info->debug_out, " %X", type_byte);
             }
         }
 
@@ -1045,193 +2020,251 @@ int parse_tokens(struct token_list *list, struct program_info *info) {
         // write operands to file
         cur_op = op_list;
         while (cur_op) {
-            if (!cur_op->known_value) {
-                struct backpatch *patch = malloc(sizeof(struct backpatch));
+            if (!cur_op->known_value && cur_op->code >= 0) {
+                struct backpatch *patch = arena_alloc(info->arena, sizeof(struct backpatch));
                 patch->next = 0;
-                patch->max_width = 4;
+                patch->max_width = size_bytes(cur_op->size);
+                patch->sign_extended = cur_op->type == ot_constant;
                 copy_origin(&patch->origin, &cur_op->origin);
-                patch->position = output.code_position;
-                patch->position_after = after_pos;
-                patch->operand_chain = cur_op;
-                cur_op->dont_free = TRUE;
-                if (output.info->patch_list) {
-                    patch->next = output.info->patch_list;
+                patch->position = output->code_position;
+                // only the relative operand counts from the end of the
+                // instruction, which is the last operand to be sized
+                if (cur_op == relative) {
+                    patch->position_after = after_pos;
+                    patch->operand_number = output->operand_number - 1;
+                } else {
+                    patch->position_after = 0;
+                    patch->operand_number = -1;
                 }
-                output.info->patch_list = patch;
+                patch->code = cur_op->code;
+                if (output->info->patch_list) {
+                    patch->next = output->info->patch_list;
+                }
+                output->info->patch_list = patch;
             }
 
-            switch(operand_size(cur_op)) {
+            switch(cur_op->size) {
                 case 0:
                     break;
                 case 1:
-                    write_byte(out, cur_op->value);
-                    output.code_position += 1;
+                    write_byte(image, cur_op->value);
+                    output->code_position += 1;
                     break;
                 case 2:
-                    write_short(out, cur_op->value);
-                    output.code_position += 2;
+                    write_short(image, cur_op->value);
+                    output->code_position += 2;
                     break;
                 case 3:
-                    write_word(out, cur_op->value);
-                    output.code_position += 4;
+                    write_word(image, cur_op->value);
+                    output->code_position += 4;
                     break;
                 default:
                     report_error(&here->origin, "(internal) Bad operand size");
                     has_errors = TRUE;
             }
-            if (output.info->debug_out) {
+            if (output->info->debug_out) {
                 if (cur_op->type == ot_stack) {
-                    fprintf(output.info->debug_out, " STACK");
+                    fprintf(output->info->debug_out, " STACK");
                 } else {
                     switch(cur_op->type) {
-                        case ot_constant:   fputs(" c:", output.info->debug_out);   break;
-                        case ot_local:      fputs(" l:", output.info->debug_out);   break;
-                        case ot_indirect:   fputs(" i:", output.info->debug_out);   break;
-                        case ot_afterram:   fputs(" a:", output.info->debug_out);   break;
+                        case ot_constant:   fputs(" c:", output->info->debug_out);   break;
+                        case ot_local:      fputs(" l:", output->info->debug_out);   break;
+                        case ot_indirect:   fputs(" i:", output->info->debug_out);   break;
+                        case ot_afterram:   fputs(" a:", output->info->debug_out);   break;
                         default:
-                            fprintf(output.info->debug_out, " (bad operand type %d", cur_op->type);
+                            fprintf(output->info->debug_out, " (bad operand type %d", cur_op->type);
                     }
                     if (cur_op->known_value) {
-                        fprintf(output.info->debug_out, "%d", cur_op->value);
+                        fprintf(output->info->debug_out, "%d", cur_op->value);
                     } else {
-                        fprintf(output.info->debug_out, "???");
+                        fprintf(output->info->debug_out, "???");
                     }
                 }
             }
             cur_op = cur_op->next;
         }
-        free_operands(op_list);
 
-        if (output.info->debug_out) {
-            fprintf(output.info->debug_out, "\n");
+        if (output->info->debug_out) {
+            fprintf(output->info->debug_out, "\n");
         }
         skip_line(&here);
-        continue;
+        break;
     }
-    free_function_locals(&output);
+
+    *current = here;
+    return !has_errors;
+}
+
+/* Pads out the end of memory, resolves backpatches, fills in the header and
+ * checksum and writes the output file. *has_errors* is the combined result
+ * of every call to parse_line; if set, nothing further is done.
+ */
+int parse_finish(struct output_state *output, int has_errors) {
+    struct program_info *info = output->info;
+    struct vbuffer *image = output->image;
+
+    if (!reset_function_locals(output)) {
+        has_errors = TRUE;
+    }
+    arena_free(output->operands);
+    output->operands = NULL;
 
     if (has_errors) {
+        exprcode_free(&output->code);
+        free_symbol_indexes(output);
+        vbuffer_free(image);
+        end_layout_pass(info, TRUE);
         return FALSE;
     }
 
 
-    struct origin objectfile_origin = { (char*)info->output_file, -1 };
+    struct origin objectfile_origin = { info->output_file, -1 };
 /* ************************************************************************** *
  * FINAL BINARY OUPUT                                                         *
  * ************************************************************************** */
-    if (output.in_header) {
+    if (output->in_header) {
         report_error(&objectfile_origin, "missing .end_header directive\n");
         has_errors = TRUE;
     }
 
-    while (output.code_position % 256 != 0) {
-        fputc(0, output.out);
-        ++output.code_position;
+    int padding = (256 - output->code_position % 256) % 256;
+    write_zeroes(image, padding);
+    output->code_position += padding;
+    if (image->length != (size_t)output->code_position) {
+        report_error(&objectfile_origin, "could not allocate memory for output");
+        exprcode_free(&output->code);
+        free_symbol_indexes(output);
+        vbuffer_free(image);
+        end_layout_pass(info, TRUE);
+        return FALSE;
     }
-    output.info->end_memory = output.code_position;
-    add_label(&output.info->first_label, "_EXTSTART", output.info->end_memory);
-    add_label(&output.info->first_label, "_ENDMEM", output.info->end_memory + output.info->extended_memory);
+    output->info->end_memory = output->code_position;
+    define_label(output, sym_extstart, output->info->end_memory);
+    define_label(output, sym_endmem, output->info->end_memory + output->info->extended_memory);
 
 
 /* ************************************************************************** *
  * PROCESS BACKPATCH LIST                                                     *
  * ************************************************************************** */
-    free_function_locals(&output);
-    struct backpatch *patch = output.info->patch_list;
+    if (!reset_function_locals(output)) {
+        has_errors = TRUE;
+    }
+    struct unresolved_name *unresolved = NULL;
+    int unresolved_count = 0, unresolved_capacity = 0;
+    if (!finish_defines(output, &unresolved, &unresolved_count, &unresolved_capacity)) {
+        has_errors = TRUE;
+    }
+    // if anything moved, this pass's output is thrown away and there is no
+    // point in writing out its backpatches
+    info->layout.changed = labels_moved(info) || local_labels_moved(&info->layout);
+    struct backpatch *patch = output->info->patch_list;
     while (patch) {
-        int result = eval_operand(patch->operand_chain, &output, TRUE);
+        int value, unknown;
+        int result = exprcode_eval(&output->code, info, patch->code, &patch->origin, &value, &unknown);
         if (result == EVAL_KNOWN) {
-            patch->value_final = patch->operand_chain->value;
+            patch->value_final = value;
 
             if (patch->position_after) {
                 patch->value_final = patch->value_final - patch->position_after + 2;
             }
 
-            fseek(out, patch->position, SEEK_SET);
-            if (!value_fits(patch->value_final, patch->max_width)) {
-                report_error(&patch->origin,
-                        "(warning) value is larger than storage specification and will be truncated\n");
+            int fits = patch->sign_extended
+                     ? value_fits_signed(patch->value_final, patch->max_width)
+                     : value_fits(patch->value_final, patch->max_width);
+            if (!info->layout.changed) {
+                if (patch->position_after && is_return_offset(patch->value_final)) {
+                    // sized from an estimate; a larger encoding moves the
+                    // end of the instruction away from the target
+                    if (grow_operand_size(&info->layout, patch->operand_number)) {
+                        info->layout.changed = TRUE;
+                    } else {
+                        report_error(&patch->origin, "branch target lies inside the branch instruction");
+                        has_errors = TRUE;
+                    }
+                } else if (!fits) {
+                    report_error(&patch->origin,
+                            "(warning) value is larger than storage specification and will be truncated\n");
+                }
+                store_variable(image, patch->position, patch->value_final, patch->max_width);
             }
-            write_variable(&output, patch->value_final, patch->max_width);
         } else {
+            if (result == EVAL_UNKNOWN
+                    && !add_unresolved(patch->code, &patch->origin, output,
+                                       &unresolved, &unresolved_count, &unresolved_capacity)) {
+                report_error(&patch->origin, "could not record unknown identifier (out of memory?)");
+            }
             has_errors = TRUE;
         }
-        patch->operand_chain->dont_free = FALSE;
-        free_operands(patch->operand_chain);
 
         patch = patch->next;
     }
+    report_unresolved(unresolved, unresolved_count);
+    free(unresolved);
+    exprcode_free(&output->code);
+    free_symbol_indexes(output);
+    if (info->layout.changed && !has_errors) {
+        vbuffer_free(image);
+        end_layout_pass(info, FALSE);
+        return TRUE;
+    }
+    end_layout_pass(info, TRUE);
 
 
 /* ************************************************************************** *
  * WRITE FILE HEADER                                                          *
  * ************************************************************************** */
-    // WRITE HEADER
-    fseek(output.out, 0, SEEK_SET);
-    // magic number
-    fputc(0x47, output.out);
-    fputc(0x6C, output.out);
-    fputc(0x75, output.out);
-    fputc(0x6C, output.out);
-    // glulx version
-    fputc(0x00, output.out);
-    fputc(0x03, output.out);
-    fputc(0x01, output.out);
-    fputc(0x02, output.out);
+    // magic number and glulx version
+    store_variable(image, 0, 0x476C756C, 4);
+    store_variable(image, 4, 0x00030102, 4);
     // other fields
-    write_word(out, output.info->ram_start);
-    write_word(out, output.info->end_memory);
-    write_word(out, output.info->end_memory + output.info->extended_memory);
-    write_word(out, output.info->stack_size);
+    store_variable(image, 8, output->info->ram_start, 4);
+    store_variable(image, 12, output->info->end_memory, 4);
+    store_variable(image, 16, output->info->end_memory + output->info->extended_memory, 4);
+    store_variable(image, 20, output->info->stack_size, 4);
 
-    struct label_def *label = get_label(output.info->first_label, output.info->start_label);
+    int start_symbol = symbol_lookup(info->symbols, info->start_label, strlen(info->start_label));
+    struct label_def *label = get_label(info, start_symbol);
     if (label) {
-        unsigned start_address = label->pos;
-        write_word(out, start_address);
+        store_variable(image, 24, label->pos, 4);
     } else {
-        write_word(out, 0);
         report_error(&objectfile_origin, "missing start label", info->output_file);
         has_errors = TRUE;
     }
 
-    if (output.info->string_table == 0) {
-        write_word(out, 0);
-        if (output.info->strings.first != NULL) {
+    if (output->info->string_table == 0) {
+        if (output->info->strings.first != NULL) {
             report_error(&objectfile_origin, "source contains encoded strings but does not include .string_table directive");
         }
     } else {
-        write_word(out, output.info->string_table);
+        store_variable(image, 28, output->info->string_table, 4);
     }
-    write_word(out, 0); // checksum placeholder
     // gasm marker
-    fputc('g', output.out);
-    fputc('a', output.out);
-    fputc('s', output.out);
-    fputc('m', output.out);
+    store_variable(image, 36, 0x6761736D, 4);
     // twelve-byte timestamp
     for (int i = 0; i < MAX_TIMESTAMP_SIZE - 1; ++i) {
-        write_byte(output.out, output.info->timestamp[i]);
+        store_variable(image, 40 + i, output->info->timestamp[i], 1);
     }
 
 /* ************************************************************************** *
- * CALCULATE AND WRITE CHECKSUM                                               *
+ * CALCULATE CHECKSUM AND WRITE FILE                                          *
  * ************************************************************************** */
-    fseek(out, 0, SEEK_SET);
-    int checksum = 0;
-    while (1) {
-        int b1 = fgetc(out);
-        if (feof(out)) {
-            break;
+    // the image is a whole number of pages, so it divides into words
+    const unsigned char *data = (const unsigned char*)image->data;
+    uint32_t checksum = 0;
+    for (size_t i = 0; i < image->length; i += 4) {
+        checksum += ((uint32_t)data[i] << 24) | (data[i + 1] << 16) | (data[i + 2] << 8) | data[i + 3];
+    }
+    store_variable(image, 32, checksum, 4);
+
+    if (!has_errors) {
+        // "-" sends the program to stdout
+        const char *filename = strcmp(info->output_file, "-") == 0 ? NULL : info->output_file;
+        if (!vbuffer_writefile(image, filename)) {
+            fprintf(stderr, "Could not write output file \"%s\".\n", info->output_file);
+            has_errors = TRUE;
         }
-        int b2 = fgetc(out);
-        int b3 = fgetc(out);
-        int b4 = fgetc(out);
-        int value = (b1 << 24) + (b2 << 16) + (b3 << 8) + b4;
-        checksum += value;
     }
-    fseek(out, 32, SEEK_SET);
-    write_word(out, checksum); // checksum placeholder
-
-    fclose(out);
+    vbuffer_free(image);
+    output->image = NULL;
     return !has_errors;
 }
@@ -6,83 +6,116 @@
 
 #include "assemble.h"
 
+/* Adds the text of the .encoded directive at *here* to the string
+ * frequency table.
+ */
+int preprocess_encoded(struct token *here, struct program_info *info) {
+    ++here;
+    if (!expect_type(here, tt_string)) {
+        return FALSE;
+    }
+
+    string_add_to_frequencies(&info->strings, here->text, here->i);
+    return TRUE;
+}
+
+/* Checks that the .include directive at *here* is followed by the name of a
+ * file and nothing else. Problems are only reported if *report* is TRUE.
+ */
+int preprocess_check_include(struct token *here, int report) {
+    ++here;
+
+    if (here->type != tt_string) {
+        if (report) expect_type(here, tt_string);
+        return FALSE;
+    }
+
+    if (here[1].type != tt_eol && here[1].type != tt_eof) {
+        if (report) report_error(&here[1].origin, "Expected EOL");
+        return FALSE;
+    }
+    if (here->i == 1 && here->text[0] == '-') {
+        if (report) report_error(&here[1].origin, "Including from STDIN is not permitted.");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Returns TRUE if *here* is an .include or .include_once directive.
+ */
+int is_include_directive(struct token *here) {
+    return matches_symbol(here, tt_directive, sym_include)
+        || matches_symbol(here, tt_directive, sym_include_once);
+}
 
 int parse_preprocess(struct token_list *tokens, struct program_info *info) {
     int found_errors = FALSE;
-    struct token *here = tokens->first;
+    struct token *here = tokens->tokens;
+
+    // every included file is lexed up front, in parallel, and then spliced
+    // in below in the order the directives are reached
+    struct include_set *includes = lex_includes(tokens, info);
+    if (!includes) {
+        report_error(NULL, "Could not allocate memory for included files.");
+        return FALSE;
+    }
 
-    while (here) {
+    while (here->type != tt_eof) {
 
         // skip labels
-        if (here->type == tt_identifier && here->next && here->next->type == tt_colon) {
-            here = here->next->next;
+        if (here->type == tt_identifier && here[1].type == tt_colon) {
+            here += 2;
             continue;
         }
 
         // encoded strings
-        if (matches_text(here, tt_directive, ".encoded")) {
-            here = here->next;
-            if (!expect_type(here, tt_string)) {
-                skip_line(&here);
+        if (matches_symbol(here, tt_directive, sym_encoded)) {
+            if (!preprocess_encoded(here, info)) {
                 found_errors = TRUE;
-                continue;
             }
-
-            string_add_to_frequencies(&info->strings, here->text);
             skip_line(&here);
             continue;
         }
 
         // included files
-        if (matches_text(here, tt_directive, ".include")) {
-            struct token *before = here->prev;
-            struct token *start = here;
+        if (is_include_directive(here)) {
+            size_t start = here - tokens->tokens;
             struct token_list *new_tokens = NULL;
 
-            if (!here->next) {
+            if (here[1].type == tt_eof) {
                 report_error(&here->origin, "Unexpected end of tokens");
+                include_set_free(includes, info);
                 return FALSE;
             }
-            here = here->next;
 
-            if (!expect_type(here, tt_string)) {
-                skip_line(&here);
-                found_errors = TRUE;
-                continue;
-            }
-
-            if (here->next && here->next->type != tt_eol) {
-                report_error(&here->next->origin, "Expected EOL");
-                skip_line(&here);
-                found_errors = TRUE;
-                continue;
-            }
-            if (strcmp(here->text, "-") == 0) {
-                report_error(&here->next->origin, "Including from STDIN is not permitted.");
+            if (!preprocess_check_include(here, TRUE)) {
                 skip_line(&here);
                 found_errors = TRUE;
                 continue;
             }
 
-            new_tokens = lex_file(here->text);
+            new_tokens = include_next(includes, here, info);
 
-            struct token *start_next = start->next;
-            remove_token(tokens, start_next);
-            free_token(start_next);
-            remove_token(tokens, start);
-            free_token(start);
+            // drop the directive and filename, but keep the EOL so the
+            // included file starts on a line of its own
+            remove_tokens(tokens, start, 2);
+            here = &tokens->tokens[start];
 
             if (new_tokens == NULL) {
                 skip_line(&here);
                 found_errors = TRUE;
                 continue;
             }
-            merge_token_list(tokens, new_tokens, before);
-            if (before) {
-                here = before->next;
-            } else {
-                here = tokens->first;
+            if (!merge_token_list(tokens, new_tokens, start)) {
+                report_error(&here->origin, "Could not allocate memory for included tokens.");
+                free_token_list(new_tokens);
+                include_set_free(includes, info);
+                return FALSE;
             }
+            free_token_list(new_tokens);
+
+            // continue with the first of the newly included tokens
+            here = &tokens->tokens[start];
             continue;
         }
 
@@ -91,7 +124,6 @@ int parse_preprocess(struct token_list *tokens, struct program_info *info) {
 
     }
 
+    include_set_free(includes, info);
     return !found_errors;
 }
-
-
@@ -0,0 +1,183 @@
+#include "scan.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_VECTOR 1
+#define VEC_WIDTH 32
+typedef __m256i vec_t;
+#define vec_load(p)         _mm256_loadu_si256((const __m256i*)(p))
+#define vec_splat(c)        _mm256_set1_epi8(c)
+#define vec_eq(a, b)        _mm256_cmpeq_epi8((a), (b))
+#define vec_lt(a, b)        _mm256_cmpgt_epi8((b), (a))
+#define vec_or(a, b)        _mm256_or_si256((a), (b))
+#define vec_add(a, b)       _mm256_add_epi8((a), (b))
+#define vec_mask(v)         ((unsigned)_mm256_movemask_epi8(v))
+#define FULL_MASK           0xFFFFFFFFu
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_VECTOR 1
+#define VEC_WIDTH 16
+typedef __m128i vec_t;
+#define vec_load(p)         _mm_loadu_si128((const __m128i*)(p))
+#define vec_splat(c)        _mm_set1_epi8(c)
+#define vec_eq(a, b)        _mm_cmpeq_epi8((a), (b))
+#define vec_lt(a, b)        _mm_cmplt_epi8((a), (b))
+#define vec_or(a, b)        _mm_or_si128((a), (b))
+#define vec_add(a, b)       _mm_add_epi8((a), (b))
+#define vec_mask(v)         ((unsigned)_mm_movemask_epi8(v))
+#define FULL_MASK           0xFFFFu
+#endif
+
+static int is_blank(int ch);
+static int is_identifier_char(int ch);
+#ifdef SCAN_VECTOR
+static unsigned first_bit(unsigned mask);
+static unsigned last_bit(unsigned mask);
+static unsigned count_bits(unsigned mask);
+static unsigned blank_mask(vec_t chunk);
+static unsigned identifier_mask(vec_t chunk);
+#endif
+
+static int is_blank(int ch) {
+    return ch == ' ' || ch == '\t' || ch == '\v' || ch == '\f';
+}
+
+static int is_identifier_char(int ch) {
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z')
+            || (ch >= '0' && ch <= '9') || ch == '_';
+}
+
+#ifdef SCAN_VECTOR
+
+#ifdef __GNUC__
+static unsigned first_bit(unsigned mask) {
+    return __builtin_ctz(mask);
+}
+static unsigned last_bit(unsigned mask) {
+    return 31 - __builtin_clz(mask);
+}
+static unsigned count_bits(unsigned mask) {
+    return __builtin_popcount(mask);
+}
+#else
+static unsigned first_bit(unsigned mask) {
+    unsigned bit = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        ++bit;
+    }
+    return bit;
+}
+static unsigned last_bit(unsigned mask) {
+    unsigned bit = 0;
+    while (mask >>= 1) ++bit;
+    return bit;
+}
+static unsigned count_bits(unsigned mask) {
+    unsigned count = 0;
+    for (; mask; mask &= mask - 1) ++count;
+    return count;
+}
+#endif
+
+/* Bit n of the result is set if byte n of the chunk is a space, tab,
+ * vertical tab or form feed.
+ */
+static unsigned blank_mask(vec_t chunk) {
+    vec_t blanks = vec_or(vec_or(vec_eq(chunk, vec_splat(' ')),
+                                 vec_eq(chunk, vec_splat('\t'))),
+                          vec_or(vec_eq(chunk, vec_splat('\v')),
+                                 vec_eq(chunk, vec_splat('\f'))));
+    return vec_mask(blanks);
+}
+
+/* Bit n of the result is set if byte n of the chunk is an ASCII letter,
+ * digit or underscore. There are no unsigned byte comparisons before AVX-512,
+ * so each range is shifted to start at -128 and tested with a signed compare.
+ */
+static unsigned identifier_mask(vec_t chunk) {
+    vec_t lower = vec_or(chunk, vec_splat(0x20));
+    vec_t letters = vec_lt(vec_add(lower, vec_splat((char)(128 - 'a'))),
+                           vec_splat((char)(-128 + 26)));
+    vec_t digits = vec_lt(vec_add(chunk, vec_splat((char)(128 - '0'))),
+                          vec_splat((char)(-128 + 10)));
+    vec_t underscore = vec_eq(chunk, vec_splat('_'));
+    return vec_mask(vec_or(vec_or(letters, digits), underscore));
+}
+
+#endif
+
+size_t scan_blanks(const char *text, size_t pos, size_t length) {
+#ifdef SCAN_VECTOR
+    while (pos + VEC_WIDTH <= length) {
+        unsigned stop = ~blank_mask(vec_load(&text[pos])) & FULL_MASK;
+        if (stop) return pos + first_bit(stop);
+        pos += VEC_WIDTH;
+    }
+#endif
+    while (pos < length && is_blank((unsigned char)text[pos])) {
+        ++pos;
+    }
+    return pos;
+}
+
+size_t scan_identifier(const char *text, size_t pos, size_t length) {
+#ifdef SCAN_VECTOR
+    while (pos + VEC_WIDTH <= length) {
+        unsigned stop = ~identifier_mask(vec_load(&text[pos])) & FULL_MASK;
+        if (stop) return pos + first_bit(stop);
+        pos += VEC_WIDTH;
+    }
+#endif
+    while (pos < length && is_identifier_char((unsigned char)text[pos])) {
+        ++pos;
+    }
+    return pos;
+}
+
+/* Finds the newline that ends the current line. Used to skip comments.
+ */
+size_t scan_line(const char *text, size_t pos, size_t length) {
+    return scan_until(text, pos, length, '\n', '\n');
+}
+
+/* Finds the next occurrence of either *first* or *second*.
+ */
+size_t scan_until(const char *text, size_t pos, size_t length, char first, char second) {
+#ifdef SCAN_VECTOR
+    vec_t first_v = vec_splat(first);
+    vec_t second_v = vec_splat(second);
+    while (pos + VEC_WIDTH <= length) {
+        vec_t chunk = vec_load(&text[pos]);
+        unsigned stop = vec_mask(vec_or(vec_eq(chunk, first_v), vec_eq(chunk, second_v)));
+        if (stop) return pos + first_bit(stop);
+        pos += VEC_WIDTH;
+    }
+#endif
+    while (pos < length && text[pos] != first && text[pos] != second) {
+        ++pos;
+    }
+    return pos;
+}
+
+size_t scan_newlines(const char *text, size_t pos, size_t end, size_t *last_newline) {
+    size_t count = 0;
+#ifdef SCAN_VECTOR
+    vec_t newline = vec_splat('\n');
+    while (pos + VEC_WIDTH <= end) {
+        unsigned found = vec_mask(vec_eq(vec_load(&text[pos]), newline));
+        if (found) {
+            count += count_bits(found);
+            *last_newline = pos + last_bit(found);
+        }
+        pos += VEC_WIDTH;
+    }
+#endif
+    for (; pos < end; ++pos) {
+        if (text[pos] == '\n') {
+            ++count;
+            *last_newline = pos;
+        }
+    }
+    return count;
+}
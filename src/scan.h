@@ -0,0 +1,22 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+/* Bulk character scanning used by the lexer. Each function examines
+ * text[pos..length) and returns the index of the first character that ends
+ * the run (or length if the run reaches the end of the text). On x86-64 the
+ * text is examined 16 (SSE2) or 32 (AVX2) bytes at a time; other platforms
+ * use a plain scalar loop.
+ */
+size_t scan_blanks(const char *text, size_t pos, size_t length);
+size_t scan_identifier(const char *text, size_t pos, size_t length);
+size_t scan_line(const char *text, size_t pos, size_t length);
+size_t scan_until(const char *text, size_t pos, size_t length, char first, char second);
+
+/* Counts the newlines in text[pos..end). If any are found, *last_newline is
+ * set to the index of the final one.
+ */
+size_t scan_newlines(const char *text, size_t pos, size_t end, size_t *last_newline);
+
+#endif
@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assemble.h"
+#include "mapfile.h"
+
+/* One file on the stack of files being read. */
+struct stream_frame {
+    struct lexer_state state;
+    struct mapped_file source;
+    const char *canonical_name;
+    struct stream_frame *parent;
+};
+
+/* A file that has been read by the stream, for .include_once. */
+struct stream_name {
+    const char *canonical_name;
+    struct stream_name *next;
+};
+
+static int stream_push(struct source_stream *stream, const char *filename, struct origin *origin);
+static int stream_seen(struct source_stream *stream, const char *canonical_name);
+static void stream_pop(struct source_stream *stream);
+static void stream_release(struct source_stream *stream);
+static int stream_handle_include(struct source_stream *stream);
+
+/* ************************************************************************** *
+ * SOURCE STREAMS                                                             *
+ * ************************************************************************** */
+
+/* Opens *filename* so that its lines are read next. *origin* is where the
+ * file was included from, or NULL for the main file.
+ */
+static int stream_push(struct source_stream *stream, const char *filename, struct origin *origin) {
+    const char *canonical_name = include_canonical_name(filename, stream->arena);
+    int seen = canonical_name && stream_seen(stream, canonical_name);
+    struct stream_name *name = NULL;
+    if (canonical_name && !seen) {
+        name = arena_alloc(stream->arena, sizeof(struct stream_name));
+    }
+    if (!canonical_name || (!seen && !name)) {
+        report_error(origin, "Could not allocate memory for source file ~%s~.", filename);
+        return FALSE;
+    }
+    for (struct stream_frame *open = stream->top; open; open = open->parent) {
+        if (strcmp(open->canonical_name, canonical_name) == 0) {
+            report_error(origin, "File ~%s~ includes itself.", filename);
+            return FALSE;
+        }
+    }
+
+    struct stream_frame *frame = malloc(sizeof(struct stream_frame));
+    if (!frame) {
+        report_error(origin, "Could not allocate memory for source file ~%s~.", filename);
+        return FALSE;
+    }
+
+    frame->state.diagnostics = NULL;
+    if (!lex_open(&frame->state, &frame->source, filename, stream->arena, stream->symbols)) {
+        free(frame);
+        return FALSE;
+    }
+    // filenames must outlive the stream, but token text only has to last
+    // until the next line is read
+    frame->state.arena = stream->scratch;
+    frame->canonical_name = canonical_name;
+    if (name) {
+        name->canonical_name = canonical_name;
+        name->next = stream->included;
+        stream->included = name;
+    }
+
+    frame->parent = stream->top;
+    stream->top = frame;
+    return TRUE;
+}
+
+static int stream_seen(struct source_stream *stream, const char *canonical_name) {
+    for (struct stream_name *name = stream->included; name; name = name->next) {
+        if (strcmp(name->canonical_name, canonical_name) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Removes the innermost file from the stream. The tokens of the line just
+ * read may still point into its text, so it isn't closed until the next
+ * line is requested.
+ */
+static void stream_pop(struct source_stream *stream) {
+    struct stream_frame *frame = stream->top;
+    stream->top = frame->parent;
+    stream_release(stream);
+    stream->finished = frame;
+}
+
+static void stream_release(struct source_stream *stream) {
+    if (stream->finished) {
+        mapfile_close(&stream->finished->source);
+        free(stream->finished);
+        stream->finished = NULL;
+    }
+}
+
+/* Looks for an .include directive on the current line. If one is found it is
+ * removed from the line and the file it names is pushed onto the stream so
+ * that its lines are read next, unless it is an .include_once of a file that
+ * has already been read. Any labels before the directive are left in place.
+ */
+static int stream_handle_include(struct source_stream *stream) {
+    struct token_list *line = stream->line;
+    struct token *here = line->tokens;
+
+    while (here->type == tt_identifier && here[1].type == tt_colon) {
+        here += 2;
+    }
+    if (!is_include_directive(here)) {
+        return TRUE;
+    }
+
+    size_t start = here - line->tokens;
+    if (!preprocess_check_include(here, TRUE)) {
+        remove_line(line, here);
+        return FALSE;
+    }
+
+    // the filename lives in the scratch arena, which stream_push leaves alone
+    const char *filename = arena_strndup(stream->scratch, here[1].text, here[1].i);
+    if (!filename) {
+        report_error(&here->origin, "Could not allocate memory for filename.");
+        remove_line(line, here);
+        return FALSE;
+    }
+    struct origin origin = here->origin;
+    int once = here->i == sym_include_once;
+    remove_tokens(line, start, 2);
+    if (once) {
+        const char *canonical_name = include_canonical_name(filename, stream->scratch);
+        if (canonical_name && stream_seen(stream, canonical_name)) {
+            return TRUE;
+        }
+    }
+    return stream_push(stream, filename, &origin);
+}
+
+int stream_open(struct source_stream *stream, const char *filename,
+                struct arena *arena, struct symbol_table *symbols) {
+    stream->top = NULL;
+    stream->finished = NULL;
+    stream->arena = arena;
+    stream->symbols = symbols;
+    stream->error_count = 0;
+    stream->included = NULL;
+    stream->scratch = arena_new();
+    stream->line = init_token_list(stream->scratch);
+    if (!stream->scratch || !stream->line) {
+        report_error(NULL, "Could not allocate memory for source stream.");
+        stream_close(stream);
+        return FALSE;
+    }
+
+    if (!stream_push(stream, filename, NULL)) {
+        stream_close(stream);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Returns the tokens of the next line of the program, ending with a tt_eol,
+ * or NULL once every file has been read. Lines containing lexer errors are
+ * reported and skipped; the errors are counted in stream->error_count.
+ */
+struct token_list* stream_next_line(struct source_stream *stream) {
+    struct token_list *line = stream->line;
+
+    while (stream->top) {
+        remove_tokens(line, 0, line->count);
+        arena_reset(stream->scratch);
+        stream_release(stream);
+
+        struct lexer_state *state = &stream->top->state;
+        int old_errors = state->error_count;
+        int more = lex_line(state, line);
+        if (!more && line->count > 0 && line->tokens[line->count - 1].type != tt_eol) {
+            new_token(line, tt_eol, NULL, state);
+        }
+        int bad_line = state->error_count != old_errors;
+
+        if (!more) {
+            stream_pop(stream);
+        }
+        if (bad_line) {
+            ++stream->error_count;
+            continue;
+        }
+
+        if (!stream_handle_include(stream)) {
+            ++stream->error_count;
+        }
+        if (line->count > 1 || (line->count == 1 && line->tokens[0].type != tt_eol)) {
+            return line;
+        }
+    }
+    return NULL;
+}
+
+void stream_close(struct source_stream *stream) {
+    while (stream->top) {
+        stream_pop(stream);
+    }
+    stream_release(stream);
+    free_token_list(stream->line);
+    arena_free(stream->scratch);
+    stream->line = NULL;
+    stream->scratch = NULL;
+}
+
+/* ************************************************************************** *
+ * STREAMED ASSEMBLY                                                          *
+ * ************************************************************************** */
+
+/* First pass over a streamed program. Nothing is kept from each line other
+ * than the text of .encoded strings, which is added to the frequency table
+ * so the string tree can be built before any code is generated.
+ */
+int stream_preprocess(const char *filename, struct program_info *info) {
+    struct source_stream stream;
+    int found_errors = FALSE;
+
+    if (!stream_open(&stream, filename, info->arena, info->symbols)) {
+        return FALSE;
+    }
+
+    struct token_list *line;
+    while ((line = stream_next_line(&stream)) != NULL) {
+        struct token *here = line->tokens;
+        while (here->type == tt_identifier && here[1].type == tt_colon) {
+            here += 2;
+        }
+        if (matches_symbol(here, tt_directive, sym_encoded)) {
+            if (!preprocess_encoded(here, info)) {
+                found_errors = TRUE;
+            }
+        }
+    }
+
+    if (stream.error_count > 0) {
+        found_errors = TRUE;
+    }
+    stream_close(&stream);
+    return !found_errors;
+}
+
+/* Second pass over a streamed program; each line is assembled as soon as it
+ * has been lexed. The program is read again for each pass parse_next_pass
+ * asks for. If *tokens_out* is not NULL, every line is dumped to it during
+ * the first of these passes.
+ */
+int stream_parse(const char *filename, struct program_info *info, FILE *tokens_out) {
+    int result;
+    do {
+        struct output_state output = { info, TRUE };
+        struct source_stream stream;
+        int has_errors = FALSE;
+
+        if (!stream_open(&stream, filename, info->arena, info->symbols)) {
+            return FALSE;
+        }
+        if (!parse_begin(&output)) {
+            stream_close(&stream);
+            return FALSE;
+        }
+
+        struct token_list *line;
+        while ((line = stream_next_line(&stream)) != NULL) {
+            if (tokens_out) {
+                dump_token_list(tokens_out, line);
+            }
+
+            struct token *here = line->tokens;
+            while (here->type != tt_eof) {
+                if (!parse_line(&here, &output)) {
+                    has_errors = TRUE;
+                }
+            }
+        }
+
+        if (stream.error_count > 0) {
+            has_errors = TRUE;
+        }
+        stream_close(&stream);
+        result = parse_finish(&output, has_errors);
+        tokens_out = NULL;
+    } while (result && parse_next_pass(info));
+    return result;
+}
@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "assemble.h"
+#include "vbuffer.h"
 
 void free_string_table(struct string_table *table) {
     for (int i = 0; i < STRING_TABLE_BUCKETS; ++i) {
@@ -48,13 +49,12 @@ void string_table_add(struct string_table *table, unsigned c) {
     }
 }
 
-void string_add_to_frequencies(struct string_table *table, const char *string) {
+void string_add_to_frequencies(struct string_table *table, const char *string, size_t length) {
     int pos = 0;
-    int c = 0;
-    do {
-        c = utf8_next_char(string, &pos);
-        string_table_add(table, c);
-    } while (c != 0);
+    while ((size_t)pos < length) {
+        string_table_add(table, utf8_next_char(string, &pos));
+    }
+    string_table_add(table, 0);
 }
 
 static void node_list_add(struct string_node **first, struct string_node *node) {
@@ -177,7 +177,7 @@ static unsigned char reverse_byte(unsigned char b) {
    return b;
 }
 
-static void step_byte(FILE *out, int *byte, int *byte_position, int *size, int flag) {
+static void step_byte(struct vbuffer *out, int *byte, int *byte_position, int *size, int flag) {
     if (flag == 2) {
         // make sure buffer is flushed
         if (*byte_position != 0) {
@@ -185,7 +185,7 @@ static void step_byte(FILE *out, int *byte, int *byte_position, int *size, int f
                 *byte_position += 1;
                 *byte <<= 1;
             }
-            fputc(reverse_byte(*byte), out);
+            vbuffer_pushchar(out, reverse_byte(*byte));
             *size += 1;
         }
         return ;
@@ -199,21 +199,25 @@ static void step_byte(FILE *out, int *byte, int *byte_position, int *size, int f
     if (*byte_position == 8) {
         *byte_position = 0;
         *size += 1;
-        fputc(reverse_byte(*byte), out);
+        vbuffer_pushchar(out, reverse_byte(*byte));
         *byte = 0;
     }
 }
 
-int encode_string(FILE *out, struct string_table *table, const char *text) {
+int encode_string(struct vbuffer *out, struct string_table *table, const char *text, size_t length) {
     int size = 1;
     int byte = 0, byte_position = 0;
     int text_position = 0;
 
-    table->input_bytes += strlen(text) + 1;
+    table->input_bytes += length + 1;
 
-    fputc(0xE1, out);
+    vbuffer_pushchar(out, (char)0xE1);
     while (TRUE) {
-        int c = utf8_next_char(text, &text_position);
+        // the string is terminated by the 0 character, which isn't in the text
+        int c = 0;
+        if ((size_t)text_position < length) {
+            c = utf8_next_char(text, &text_position);
+        }
 
         struct string_node *node = table->root;
         while (node->type == nt_branch) {
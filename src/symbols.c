@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "assemble.h"
+
+#define INITIAL_SYMBOL_CAPACITY 256
+
+static const char *builtin_names[] = {
+    ".define", ".cstring", ".string", ".unicode", ".encoded", ".byte",
+    ".short", ".word", ".pad", ".zero", ".function", ".end_header",
+    ".extra_memory", ".stack_size", ".include", ".include_binary",
+    ".include_once", ".string_table",
+    "sp", "stk", "opcode", "rel",
+    "_RAMSTART", "_EXTSTART", "_ENDMEM"
+};
+
+static unsigned symbol_hash(const char *text, size_t length);
+static int symbol_grow(struct symbol_table *table);
+static int symbol_add(struct symbol_table *table, const char *name, size_t length, unsigned hash);
+
+/* ************************************************************************** *
+ * SYMBOL TABLE                                                               *
+ * ************************************************************************** */
+
+/* FNV-1a */
+static unsigned symbol_hash(const char *text, size_t length) {
+    unsigned hash = 2166136261u;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (unsigned char)text[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Doubles the number of symbols the table can hold and rebuilds the hash
+ * buckets, which are kept at no more than half full.
+ */
+static int symbol_grow(struct symbol_table *table) {
+    int new_capacity = table->capacity * 2;
+    struct symbol *new_symbols = realloc(table->symbols, sizeof(struct symbol) * new_capacity);
+    if (!new_symbols) return FALSE;
+    table->symbols = new_symbols;
+
+    int *new_buckets = malloc(sizeof(int) * new_capacity * 2);
+    if (!new_buckets) return FALSE;
+    for (int i = 0; i < new_capacity * 2; ++i) {
+        new_buckets[i] = -1;
+    }
+    free(table->buckets);
+    table->buckets = new_buckets;
+    table->bucket_mask = new_capacity * 2 - 1;
+    table->capacity = new_capacity;
+
+    for (int i = 0; i < table->count; ++i) {
+        unsigned bucket = table->symbols[i].hash & table->bucket_mask;
+        while (table->buckets[bucket] >= 0) {
+            bucket = (bucket + 1) & table->bucket_mask;
+        }
+        table->buckets[bucket] = i;
+    }
+    return TRUE;
+}
+
+/* Creates a new symbol table. The names of symbols are stored in *arena*.
+ * The builtin symbols and the mnemonics are entered first, so every table
+ * gives them the same IDs.
+ */
+struct symbol_table* symbol_table_new(struct arena *arena) {
+    struct symbol_table *table = malloc(sizeof(struct symbol_table));
+    if (!table) return NULL;
+    table->arena = arena;
+    table->count = 0;
+    table->capacity = INITIAL_SYMBOL_CAPACITY / 2;
+    table->symbols = NULL;
+    table->buckets = NULL;
+    if (!symbol_grow(table)) {
+        symbol_table_free(table);
+        return NULL;
+    }
+
+    // these names are static, so they are entered without being copied;
+    // none of them is repeated, so there is no need to look them up first
+    for (int i = 0; i < sym_first_mnemonic; ++i) {
+        size_t length = strlen(builtin_names[i]);
+        symbol_add(table, builtin_names[i], length, symbol_hash(builtin_names[i], length));
+    }
+    for (struct mnemonic *m = codes; m->name; ++m) {
+        size_t length = strlen(m->name);
+        symbol_add(table, m->name, length, symbol_hash(m->name, length));
+    }
+    table->mnemonic_end = table->count;
+    return table;
+}
+
+void symbol_table_free(struct symbol_table *table) {
+    if (!table) return;
+    free(table->symbols);
+    free(table->buckets);
+    free(table);
+}
+
+/* Returns the ID of the symbol named by the *length* bytes at *text*, or -1
+ * if there is no such symbol.
+ */
+int symbol_lookup(struct symbol_table *table, const char *text, size_t length) {
+    unsigned hash = symbol_hash(text, length);
+    unsigned bucket = hash & table->bucket_mask;
+
+    while (table->buckets[bucket] >= 0) {
+        struct symbol *symbol = &table->symbols[table->buckets[bucket]];
+        if (symbol->hash == hash && symbol->length == length
+                && memcmp(symbol->name, text, length) == 0) {
+            return table->buckets[bucket];
+        }
+        bucket = (bucket + 1) & table->bucket_mask;
+    }
+    return -1;
+}
+
+/* As symbol_lookup, but adds the symbol if it does not already exist. Returns
+ * -1 only if memory could not be allocated.
+ */
+int symbol_intern(struct symbol_table *table, const char *text, size_t length) {
+    int existing = symbol_lookup(table, text, length);
+    if (existing >= 0) return existing;
+
+    char *name = arena_alloc(table->arena, length + 1);
+    if (!name) return -1;
+    memcpy(name, text, length);
+    name[length] = 0;
+    return symbol_add(table, name, length, symbol_hash(text, length));
+}
+
+/* Adds a symbol that is known not to be in the table yet. *name* must be NUL
+ * terminated and last as long as the table does.
+ */
+static int symbol_add(struct symbol_table *table, const char *name, size_t length, unsigned hash) {
+    if (table->count >= table->capacity && !symbol_grow(table)) {
+        return -1;
+    }
+
+    int id = table->count++;
+    struct symbol *symbol = &table->symbols[id];
+    symbol->name = name;
+    symbol->length = length;
+    symbol->hash = hash;
+
+    unsigned bucket = symbol->hash & table->bucket_mask;
+    while (table->buckets[bucket] >= 0) {
+        bucket = (bucket + 1) & table->bucket_mask;
+    }
+    table->buckets[bucket] = id;
+    return id;
+}
+
+const char* symbol_name(struct symbol_table *table, int id) {
+    if (id < 0 || id >= table->count) return NULL;
+    return table->symbols[id].name;
+}
+
+/* Returns the mnemonic a symbol names, or NULL if it isn't one.
+ */
+struct mnemonic* symbol_mnemonic(struct symbol_table *table, int id) {
+    if (id < sym_first_mnemonic || id >= table->mnemonic_end) return NULL;
+    return &codes[id - sym_first_mnemonic];
+}
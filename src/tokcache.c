@@ -0,0 +1,444 @@
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200809L
+#define HAVE_MKSTEMP 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_MKSTEMP
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <stdint.h>
+#include <time.h>
+#endif
+
+#include "assemble.h"
+#include "mapfile.h"
+#include "vbuffer.h"
+
+/* Token cache files hold the tokens lexed from one source file, so that a
+ * file that hasn't changed doesn't have to be lexed again. A cache file is
+ * named after a hash of the source it was made from and starts with a
+ * header giving that hash and the source length, which are checked before
+ * the file is used, along with a checksum of the rest of the file. All
+ * values are stored as big-endian words, as in the output file.
+ *
+ * The header is followed by a table of texts (each a word giving its length
+ * followed by its bytes) and then by five words per token: its type and text
+ * kind, its value, its text, and its line and column. Names are stored once
+ * each however many tokens use them and are interned again when the file is
+ * loaded. String tokens that are a slice of the source are stored as an
+ * offset into it, so they still refer to the source once loaded.
+ */
+
+#define TOKCACHE_MAGIC          0x47415443  // "GATC"
+#define TOKCACHE_VERSION        2           // change if tokens change
+#define TOKCACHE_HEADER_SIZE    36
+#define TOKCACHE_TOKEN_SIZE     20
+#define TOKCACHE_NAME_LENGTH    32          // "/", 16 hex digits, ".gtc", NUL
+#define NO_TEXT                 0xFFFFFFFF
+#define CHECKSUM_START          2166136261u
+
+enum text_kind {
+    tk_none,
+    tk_name,        // text table entry, entered into the symbol table
+    tk_text,        // text table entry, copied as it is
+    tk_source       // offset into the source text
+};
+
+struct cache_header {
+    unsigned magic;
+    unsigned version;
+    unsigned hash_high, hash_low;
+    unsigned source_length;
+    unsigned token_count;
+    unsigned text_count;
+    unsigned payload_length;
+    unsigned checksum;
+};
+
+/* The texts in a cache file, as read when it is loaded. */
+struct cache_texts {
+    const char **text;
+    unsigned *length;
+    int *symbol;            // symbol ID of each name, once interned
+};
+
+static unsigned long long source_hash(const char *text, size_t length);
+static unsigned checksum_add(unsigned checksum, const char *data, size_t length);
+static char* cache_filename(const char *cache_dir, unsigned long long hash);
+static unsigned read_word(const char *data);
+static void read_header(struct cache_header *header, const char *data);
+static int read_texts(struct cache_texts *texts, struct cache_header *header,
+                      const char *payload, size_t *pos);
+static int read_token(struct lexer_state *state, struct cache_header *header,
+                      struct cache_texts *texts, const char *data, struct token *token);
+static struct token_list* read_tokens(struct lexer_state *state, struct cache_header *header,
+                                      const char *payload);
+static int add_text(struct vbuffer *texts, const char *text, size_t length);
+static int write_tokens(struct lexer_state *state, struct token_list *tokens,
+                        struct vbuffer *texts, struct vbuffer *data, unsigned *text_count);
+static int write_cache_file(const char *filename, struct vbuffer *header,
+                            struct vbuffer *texts, struct vbuffer *data);
+
+/* ************************************************************************** *
+ * CACHE FILES                                                                *
+ * ************************************************************************** */
+
+/* FNV-1a, 64 bit */
+static unsigned long long source_hash(const char *text, size_t length) {
+    unsigned long long hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (unsigned char)text[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/* FNV-1a, 32 bit, continuing from *checksum* so that data held in separate
+ * pieces can be checked as one. Start from CHECKSUM_START.
+ */
+static unsigned checksum_add(unsigned checksum, const char *data, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        checksum ^= (unsigned char)data[i];
+        checksum *= 16777619u;
+    }
+    return checksum & 0xFFFFFFFF;
+}
+
+/* Returns the name of the cache file for source text with *hash*. The
+ * caller must free the name.
+ */
+static char* cache_filename(const char *cache_dir, unsigned long long hash) {
+    size_t length = strlen(cache_dir) + TOKCACHE_NAME_LENGTH;
+    char *filename = malloc(length);
+    if (!filename) return NULL;
+    snprintf(filename, length, "%s/%08x%08x.gtc", cache_dir,
+             (unsigned)(hash >> 32), (unsigned)(hash & 0xFFFFFFFF));
+    return filename;
+}
+
+/* Returns the name of the file in *cache_dir* that tokens lexed from *text*
+ * are saved in. The caller must free the name.
+ */
+char* tokcache_filename(const char *cache_dir, const char *text, size_t text_length) {
+    return cache_filename(cache_dir, source_hash(text, text_length));
+}
+
+static unsigned read_word(const char *data) {
+    const unsigned char *bytes = (const unsigned char*)data;
+    return ((unsigned)bytes[0] << 24) | ((unsigned)bytes[1] << 16)
+         | ((unsigned)bytes[2] << 8) | bytes[3];
+}
+
+static void read_header(struct cache_header *header, const char *data) {
+    header->magic = read_word(&data[0]);
+    header->version = read_word(&data[4]);
+    header->hash_high = read_word(&data[8]);
+    header->hash_low = read_word(&data[12]);
+    header->source_length = read_word(&data[16]);
+    header->token_count = read_word(&data[20]);
+    header->text_count = read_word(&data[24]);
+    header->payload_length = read_word(&data[28]);
+    header->checksum = read_word(&data[32]);
+}
+
+/* ************************************************************************** *
+ * LOADING TOKENS                                                             *
+ * ************************************************************************** */
+
+/* Reads the table of texts at the start of a cache file's payload, leaving
+ * *pos* just past it.
+ */
+static int read_texts(struct cache_texts *texts, struct cache_header *header,
+                      const char *payload, size_t *pos) {
+    size_t length = header->payload_length;
+    for (unsigned i = 0; i < header->text_count; ++i) {
+        if (length - *pos < 4) return FALSE;
+        texts->length[i] = read_word(&payload[*pos]);
+        *pos += 4;
+        if (length - *pos < texts->length[i]) return FALSE;
+        texts->text[i] = &payload[*pos];
+        texts->symbol[i] = -1;
+        *pos += texts->length[i];
+    }
+    return TRUE;
+}
+
+/* Reads the token stored at *data*. Every reference to a text or to the
+ * source is checked, so a damaged file can't lead outside either.
+ */
+static int read_token(struct lexer_state *state, struct cache_header *header,
+                      struct cache_texts *texts, const char *data, struct token *token) {
+    unsigned type_kind = read_word(&data[0]);
+    unsigned text = read_word(&data[8]);
+    token->type = type_kind & 0xFF;
+    token->i = read_word(&data[4]);
+    token->text = NULL;
+    token->origin.filename = state->origin.filename;
+    token->origin.line = read_word(&data[12]);
+    token->origin.column = read_word(&data[16]);
+    if (token->type >= tt_eof) return FALSE;
+
+    switch (type_kind >> 8) {
+        case tk_none:
+            return TRUE;
+        case tk_name:
+            if (text >= header->text_count
+                    || (token->type != tt_identifier && token->type != tt_directive)) {
+                return FALSE;
+            }
+            if (texts->symbol[text] < 0) {
+                texts->symbol[text] = symbol_intern(state->symbols, texts->text[text], texts->length[text]);
+                if (texts->symbol[text] < 0) return FALSE;
+            }
+            token->i = texts->symbol[text];
+            token->text = symbol_name(state->symbols, token->i);
+            return TRUE;
+        case tk_text:
+            if (text >= header->text_count) return FALSE;
+            token->text = arena_strndup(state->arena, texts->text[text], texts->length[text]);
+            return token->text != NULL;
+        case tk_source:
+            if (token->type != tt_string || token->i < 0 || text > state->text_length
+                    || (size_t)token->i > state->text_length - text) {
+                return FALSE;
+            }
+            token->text = &state->text[text];
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
+/* Builds the token list described by a cache file's payload. Returns NULL
+ * if anything in it is out of place.
+ */
+static struct token_list* read_tokens(struct lexer_state *state, struct cache_header *header,
+                                      const char *payload) {
+    struct cache_texts texts;
+    texts.text = malloc(sizeof(const char*) * (header->text_count + 1));
+    texts.length = malloc(sizeof(unsigned) * (header->text_count + 1));
+    texts.symbol = malloc(sizeof(int) * (header->text_count + 1));
+    struct token_list *tokens = NULL;
+    size_t pos = 0;
+
+    if (texts.text && texts.length && texts.symbol
+            && read_texts(&texts, header, payload, &pos)
+            && (header->payload_length - pos) % TOKCACHE_TOKEN_SIZE == 0
+            && (header->payload_length - pos) / TOKCACHE_TOKEN_SIZE == header->token_count) {
+        tokens = init_token_list(state->arena);
+    }
+    if (tokens && !token_list_reserve(tokens, header->token_count)) {
+        free_token_list(tokens);
+        tokens = NULL;
+    }
+
+    for (unsigned i = 0; tokens && i < header->token_count; ++i) {
+        struct token token;
+        if (!read_token(state, header, &texts, &payload[pos], &token)) {
+            free_token_list(tokens);
+            tokens = NULL;
+            break;
+        }
+        add_token(tokens, &token);
+        pos += TOKCACHE_TOKEN_SIZE;
+    }
+
+    free(texts.text);
+    free(texts.length);
+    free(texts.symbol);
+    return tokens;
+}
+
+/* Looks in *cache_dir* for tokens saved from the text *state* is pointing
+ * to. The tokens are given the origins, arena and symbols of *state*.
+ * Returns NULL if there are no saved tokens, or if the cache file is out of
+ * date or damaged; the caller should then lex the text as usual.
+ */
+struct token_list* tokcache_load(const char *cache_dir, struct lexer_state *state) {
+    unsigned long long hash = source_hash(state->text, state->text_length);
+    char *filename = cache_filename(cache_dir, hash);
+    if (!filename) return NULL;
+
+    struct mapped_file cache;
+    int opened = mapfile_open(&cache, filename);
+    free(filename);
+    if (!opened) return NULL;
+
+    struct token_list *tokens = NULL;
+    struct cache_header header;
+    if (cache.length >= TOKCACHE_HEADER_SIZE) {
+        read_header(&header, cache.data);
+        const char *payload = &cache.data[TOKCACHE_HEADER_SIZE];
+        if (header.magic == TOKCACHE_MAGIC
+                && header.version == TOKCACHE_VERSION
+                && header.hash_high == (unsigned)(hash >> 32)
+                && header.hash_low == (unsigned)(hash & 0xFFFFFFFF)
+                && header.source_length == state->text_length
+                && header.payload_length == cache.length - TOKCACHE_HEADER_SIZE
+                && header.text_count <= header.payload_length / 4
+                && header.token_count <= header.payload_length / TOKCACHE_TOKEN_SIZE
+                && header.checksum == checksum_add(CHECKSUM_START, payload, header.payload_length)) {
+            tokens = read_tokens(state, &header, payload);
+        }
+    }
+    mapfile_close(&cache);
+    return tokens;
+}
+
+/* ************************************************************************** *
+ * SAVING TOKENS                                                              *
+ * ************************************************************************** */
+
+static int add_text(struct vbuffer *texts, const char *text, size_t length) {
+    return vbuffer_pushword(texts, length) && vbuffer_append(texts, text, length);
+}
+
+/* Adds *tokens* to *data*, and the texts they use to *texts*.
+ */
+static int write_tokens(struct lexer_state *state, struct token_list *tokens,
+                        struct vbuffer *texts, struct vbuffer *data, unsigned *text_count) {
+    int *name_texts = malloc(sizeof(int) * state->symbols->count);
+    if (!name_texts) return FALSE;
+    for (int i = 0; i < state->symbols->count; ++i) {
+        name_texts[i] = -1;
+    }
+
+    *text_count = 0;
+    for (size_t i = 0; i < tokens->count; ++i) {
+        struct token *token = &tokens->tokens[i];
+        unsigned kind = tk_none;
+        unsigned text = NO_TEXT;
+
+        if (token->text == NULL) {
+            // nothing to store
+        } else if (token->type == tt_identifier || token->type == tt_directive) {
+            // each name is stored once, however often it is used
+            kind = tk_name;
+            if (name_texts[token->i] < 0) {
+                if (!add_text(texts, token->text, strlen(token->text))) break;
+                name_texts[token->i] = (*text_count)++;
+            }
+            text = name_texts[token->i];
+        } else if (token->type == tt_string && token->text >= state->text
+                   && token->text < state->text + state->text_length) {
+            kind = tk_source;
+            text = token->text - state->text;
+        } else {
+            kind = tk_text;
+            size_t length = token->type == tt_string ? (size_t)token->i : strlen(token->text);
+            if (!add_text(texts, token->text, length)) break;
+            text = (*text_count)++;
+        }
+
+        unsigned fields[] = {
+            (kind << 8) | token->type, token->i, text, token->origin.line, token->origin.column
+        };
+        vbuffer_pushwords(data, fields, 5);
+    }
+
+    free(name_texts);
+    return data->length == tokens->count * TOKCACHE_TOKEN_SIZE;
+}
+
+/* Creates a file with a name no other writer is using, starting with
+ * *filename*, and stores that name in *temp_filename*, which has room for
+ * TEMP_SUFFIX_LENGTH more characters. Two threads of one run, or two runs
+ * sharing a cache directory, can be saving the same cache file at once.
+ */
+#define TEMP_SUFFIX_LENGTH  40
+static FILE* open_temp_file(const char *filename, char *temp_filename) {
+#ifdef HAVE_MKSTEMP
+    sprintf(temp_filename, "%s.XXXXXX", filename);
+    int fd = mkstemp(temp_filename);
+    if (fd < 0) return NULL;
+    // mkstemp gives only the owner access
+    fchmod(fd, 0644);
+    FILE *out = fdopen(fd, "wb");
+    if (!out) {
+        close(fd);
+        remove(temp_filename);
+    }
+    return out;
+#else
+    // the address of a local differs between threads, and the time and
+    // clock are unlikely to be the same for two runs
+    int here;
+    sprintf(temp_filename, "%s.%lx.%lx.%lx.tmp", filename, (unsigned long)(uintptr_t)&here,
+            (unsigned long)time(NULL), (unsigned long)clock());
+    return fopen(temp_filename, "wb");
+#endif
+}
+
+/* Writes a cache file under a temporary name and then renames it, so a run
+ * that is interrupted never leaves a partial cache file behind and a
+ * reader only ever sees a whole one.
+ */
+static int write_cache_file(const char *filename, struct vbuffer *header,
+                            struct vbuffer *texts, struct vbuffer *data) {
+    char *temp_filename = malloc(strlen(filename) + TEMP_SUFFIX_LENGTH + 1);
+    if (!temp_filename) return FALSE;
+
+    int result = FALSE;
+    FILE *out = open_temp_file(filename, temp_filename);
+    if (out) {
+        result = fwrite(header->data, 1, header->length, out) == header->length
+              && fwrite(texts->data, 1, texts->length, out) == texts->length
+              && fwrite(data->data, 1, data->length, out) == data->length;
+        result = fclose(out) == 0 && result;
+#ifndef HAVE_MKSTEMP
+        // rename won't replace an existing file everywhere; elsewhere it
+        // replaces it in one step, so it is left alone until then
+        if (result) {
+            remove(filename);
+        }
+#endif
+        result = result && rename(temp_filename, filename) == 0;
+        if (!result) {
+            remove(temp_filename);
+        }
+    }
+    free(temp_filename);
+    return result;
+}
+
+/* Saves *tokens*, which were lexed from the text *state* is pointing to, in
+ * *cache_dir*. Returns FALSE if the file could not be written; this is not
+ * an error, since the tokens can always be lexed again.
+ */
+int tokcache_save(const char *cache_dir, struct lexer_state *state, struct token_list *tokens) {
+    if (state->text_length > 0xFFFFFFFF || tokens->count > 0xFFFFFFFF / TOKCACHE_TOKEN_SIZE) {
+        return FALSE;
+    }
+    unsigned long long hash = source_hash(state->text, state->text_length);
+    struct vbuffer *header = vbuffer_new();
+    struct vbuffer *texts = vbuffer_new();
+    struct vbuffer *data = vbuffer_new();
+    char *filename = cache_filename(cache_dir, hash);
+    unsigned text_count;
+    int result = FALSE;
+
+    if (header && texts && data && filename
+            && write_tokens(state, tokens, texts, data, &text_count)) {
+        unsigned checksum = checksum_add(CHECKSUM_START, texts->data, texts->length);
+        checksum = checksum_add(checksum, data->data, data->length);
+        unsigned fields[] = {
+            TOKCACHE_MAGIC, TOKCACHE_VERSION, hash >> 32, hash & 0xFFFFFFFF,
+            state->text_length, tokens->count, text_count,
+            texts->length + data->length, checksum
+        };
+        vbuffer_pushwords(header, fields, 9);
+        result = header->length == TOKCACHE_HEADER_SIZE
+              && write_cache_file(filename, header, texts, data);
+    }
+
+    vbuffer_free(header);
+    vbuffer_free(texts);
+    vbuffer_free(data);
+    free(filename);
+    return result;
+}
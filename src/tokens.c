@@ -5,25 +5,25 @@
 
 #include "assemble.h"
 
+static struct token* append_token(struct token_list *list);
+static void update_sentinel(struct token_list *list);
+
 /* ************************************************************************* *
  * Manipulate origins                                                        *
  * ************************************************************************* */
 void no_origin(struct origin *dest) {
     dest->line = 0;
     dest->column = 0;
-    dest->filename = str_dup("no source");
-    dest->dynamic = TRUE;
+    dest->filename = "no source";
 }
 
+/* Filenames are owned by whoever created the original origin (normally the
+ * arena used by the lexer), so copying an origin just shares the name.
+ */
 void copy_origin(struct origin *dest, struct origin *src) {
     dest->line = src->line;
     dest->column = src->column;
-    dest->filename = str_dup(src->filename);
-    dest->dynamic = FALSE;
-}
-
-void free_origin(struct origin *origin) {
-    free(origin->filename);
+    dest->filename = src->filename;
 }
 
 
@@ -31,22 +31,52 @@ void free_origin(struct origin *origin) {
  * Token Manipulation                                                        *
  * ************************************************************************* */
 
-struct token* new_token(enum token_type type, const char *text, struct lexer_state *state) {
-    struct token *current = malloc(sizeof(struct token));
+/* Makes space for one more token at the end of the list and returns it. The
+ * returned pointer (and every other pointer into the list) is only valid
+ * until the list is next grown.
+ */
+static struct token* append_token(struct token_list *list) {
+    if (!token_list_reserve(list, list->count + 1)) {
+        return NULL;
+    }
+    struct token *current = &list->tokens[list->count];
+    ++list->count;
+    return current;
+}
+
+/* Keeps the end-of-list marker pointing somewhere sensible for any errors
+ * reported against it.
+ */
+static void update_sentinel(struct token_list *list) {
+    struct token *sentinel = &list->tokens[list->count];
+    sentinel->type = tt_eof;
+    sentinel->text = NULL;
+    sentinel->i = 0;
+    if (list->count > 0) {
+        sentinel->origin = list->tokens[list->count - 1].origin;
+    } else {
+        no_origin(&sentinel->origin);
+    }
+}
+
+struct token* new_token(struct token_list *list, enum token_type type, const char *text, struct lexer_state *state) {
+    struct token *current = append_token(list);
     if (!current) return NULL;
 
     if (state)  copy_origin(&current->origin, &state->origin);
     else        no_origin(&current->origin);
-    current->next = NULL;
 
     current->type = type;
+    current->i = 0;
     if (text) {
-        current->text = str_dup(text);
+        current->text = arena_strdup(list->arena, text);
     } else {
         current->text = NULL;
     }
 
-    if (type == tt_integer) {
+    if (type == tt_string) {
+        current->i = strlen(text);
+    } else if (type == tt_integer) {
         char *endptr;
         if (text[0] == '$') {
             current->i = strtol(&text[1], &endptr, 16);
@@ -55,7 +85,8 @@ struct token* new_token(enum token_type type, const char *text, struct lexer_sta
         }
         if (*endptr != 0) {
             // bad integer value
-            free(current);
+            --list->count;
+            update_sentinel(list);
             return NULL;
         }
     } else if (type == tt_float) {
@@ -68,27 +99,46 @@ struct token* new_token(enum token_type type, const char *text, struct lexer_sta
         punning.f = strtof(text, &endptr);
         if (*endptr != 0) {
             // bad float value
-            free(current);
+            --list->count;
+            update_sentinel(list);
             return NULL;
         } else {
             current->i = punning.i;
         }
     }
 
+    update_sentinel(list);
     return current;
 }
 
-struct token* new_rawint_token(int value, struct lexer_state *state) {
-    struct token *current = malloc(sizeof(struct token));
+struct token* new_rawint_token(struct token_list *list, int value, struct lexer_state *state) {
+    struct token *current = append_token(list);
     if (!current) return NULL;
 
     if (state)  copy_origin(&current->origin, &state->origin);
     else        no_origin(&current->origin);
-    current->next = NULL;
     current->type = tt_integer;
     current->text = NULL;
     current->i = value;
 
+    update_sentinel(list);
+    return current;
+}
+
+/* Adds a token that refers to *text* without copying it, so the text must
+ * last at least as long as the token list does. *i* is stored as given.
+ */
+struct token* new_text_token(struct token_list *list, enum token_type type, const char *text, int i, struct lexer_state *state) {
+    struct token *current = append_token(list);
+    if (!current) return NULL;
+
+    if (state)  copy_origin(&current->origin, &state->origin);
+    else        no_origin(&current->origin);
+    current->type = type;
+    current->text = text;
+    current->i = i;
+
+    update_sentinel(list);
     return current;
 }
 
@@ -102,6 +152,7 @@ const char *token_type_name(enum token_type type) {
         case tt_bad:            return "bad token";
         case tt_colon:          return "colon";
         case tt_eol:            return "EOL";
+        case tt_eof:            return "end of tokens";
         case tt_identifier:     return "identifier";
         case tt_directive:      return "directive";
         case tt_operator:       return "operator";
@@ -110,6 +161,8 @@ const char *token_type_name(enum token_type type) {
         case tt_integer:        return "integer";
         case tt_string:         return "string";
         case tt_comma:          return "comma";
+        case tt_open_paren:     return "opening parenthesis";
+        case tt_close_paren:    return "closing parenthesis";
         default:                return "unknown token type";
     }
 }
@@ -118,107 +171,117 @@ const char *token_type_name(enum token_type type) {
  * Token List Manipulation                                                   *
  * ************************************************************************* */
 
-struct token_list* init_token_list(void) {
+struct token_list* init_token_list(struct arena *arena) {
     struct token_list *list = malloc(sizeof(struct token_list));
-    list->first = NULL;
-    list->last = NULL;
+    if (!list) return NULL;
+    list->arena = arena;
+    list->count = 0;
+    list->capacity = INITIAL_TOKEN_CAPACITY;
+    list->tokens = malloc(sizeof(struct token) * (list->capacity + 1));
+    if (!list->tokens) {
+        free(list);
+        return NULL;
+    }
+    update_sentinel(list);
     return list;
 }
 
-void add_token(struct token_list *list, struct token *new_token) {
-    if (list == NULL || new_token == NULL) return;
-
-    new_token->next = NULL;
-    if (list->first == NULL) {
-        new_token->prev = NULL;
-        list->first = new_token;
-        list->last = new_token;
-    } else {
-        new_token->prev = list->last;
-        list->last->next = new_token;
-        list->last = new_token;
-    }
+void free_token_list(struct token_list *list) {
+    if (list == NULL) return;
+    free(list->tokens);
+    free(list);
 }
 
-void remove_token(struct token_list *list, struct token *token) {
-    if (list->first == token) {
-        list->first = token->next;
-    }
-    if (list->last == token) {
-        list->last = token->prev;
-    }
-
-    if (token->prev) {
-        token->prev->next = token->next;
-    }
-    if (token->next) {
-        token->next->prev = token->prev;
+/* Creates a new list holding the same tokens as *list*. The token text is
+ * shared rather than copied.
+ */
+struct token_list* copy_token_list(struct token_list *list) {
+    struct token_list *copy = init_token_list(list->arena);
+    if (!copy) return NULL;
+    if (!token_list_reserve(copy, list->count)) {
+        free_token_list(copy);
+        return NULL;
     }
+    memcpy(copy->tokens, list->tokens, sizeof(struct token) * list->count);
+    copy->count = list->count;
+    update_sentinel(copy);
+    return copy;
 }
 
-void free_token(struct token *token) {
-    free(token->text);
-    free_origin(&token->origin);
-    free(token);
+/* Ensures the list has room for at least *capacity* tokens (plus the end of
+ * list marker).
+ */
+int token_list_reserve(struct token_list *list, size_t capacity) {
+    if (capacity <= list->capacity) return TRUE;
+
+    size_t new_capacity = list->capacity * 2;
+    if (new_capacity < capacity) new_capacity = capacity;
+    struct token *new_tokens = realloc(list->tokens, sizeof(struct token) * (new_capacity + 1));
+    if (!new_tokens) return FALSE;
+    list->tokens = new_tokens;
+    list->capacity = new_capacity;
+    return TRUE;
 }
 
-void free_token_list(struct token_list *list) {
-    if (list == NULL || list->first == NULL) return;
+struct token* add_token(struct token_list *list, const struct token *token) {
+    if (list == NULL || token == NULL) return NULL;
 
-    struct token *current = list->first;
+    struct token *current = append_token(list);
+    if (!current) return NULL;
+    *current = *token;
+    update_sentinel(list);
+    return current;
+}
 
-    while (current) {
-        struct token *next = current->next;
-        free_token(current);
-        current = next;
+/* Removes *count* tokens from the list starting with the token at index
+ * *start*.
+ */
+void remove_tokens(struct token_list *list, size_t start, size_t count) {
+    if (start >= list->count) return;
+    if (count > list->count - start) {
+        count = list->count - start;
     }
 
-    free(list);
+    memmove(&list->tokens[start],
+            &list->tokens[start + count],
+            sizeof(struct token) * (list->count - start - count));
+    list->count -= count;
+    update_sentinel(list);
 }
 
-void merge_token_list(struct token_list *dest, struct token_list *src, struct token *after) {
+/* Inserts all the tokens from *src* into *dest* so that the first of them
+ * ends up at index *position*. *src* is left empty. Both lists should share
+ * the same arena, since the token text is not copied.
+ */
+int merge_token_list(struct token_list *dest, struct token_list *src, size_t position) {
     // don't try to merge a list with itself
-    if (dest == src) return;
+    if (dest == src) return FALSE;
     // don't try to merge an empty list
-    if (src->first == NULL) {
-        free_token_list(src);
-        return;
-    }
-    // if dest list is empty, just transfer list over
-    if (dest->first == NULL) {
-        dest->first = src->first;
-        dest->last = src->last;
-        src->first = src->last = NULL;
-        free_token_list(src);
-    }
-    // only otherwise do an actual merge
-    if (after == NULL) {
-        src->last->next = dest->first;
-        dest->first->prev = src->last;
-        dest->first = src->first;
-    } else {
-        struct token *old_next = after->next;
-        after->next = src->first;
-        src->first->prev = after;
+    if (src->count == 0) return TRUE;
+    if (position > dest->count) position = dest->count;
 
-        if (old_next) {
-            src->last->next = old_next;
-            old_next->prev = src->last;
-        } else {
-            dest->last = src->last;
-        }
+    if (!token_list_reserve(dest, dest->count + src->count)) {
+        return FALSE;
     }
-
-    src->first = src->last = NULL;
-    free_token_list(src);
+    memmove(&dest->tokens[position + src->count],
+            &dest->tokens[position],
+            sizeof(struct token) * (dest->count - position));
+    memcpy(&dest->tokens[position],
+           src->tokens,
+           sizeof(struct token) * src->count);
+    dest->count += src->count;
+    update_sentinel(dest);
+
+    src->count = 0;
+    update_sentinel(src);
+    return TRUE;
 }
 
 void dump_token_list(FILE *dest, struct token_list *list) {
-    if (list == NULL || list->first == NULL) return;
+    if (list == NULL) return;
 
-    struct token *current = list->first;
-
-    while (current) {
+    for (size_t i = 0; i < list->count; ++i) {
+        struct token *current = &list->tokens[i];
         fprintf(dest, "%s:%d:%d  :  %s ",
                current->origin.filename,
                current->origin.line,
@@ -228,7 +291,8 @@ void dump_token_list(FILE *dest, struct token_list *list) {
             fprintf(dest, "(null)");
         } else {
             fputc('~', dest);
-            dump_string(dest, current->text, 2000000000);
+            size_t length = current->type == tt_string ? (size_t)current->i : strlen(current->text);
+            dump_string(dest, current->text, length, 2000000000);
             fputc('~', dest);
         }
         if (current->type == tt_integer) {
@@ -237,7 +301,5 @@ void dump_token_list(FILE *dest, struct token_list *list) {
             fprintf(dest, "  o:%d", current->i);
         }
         fprintf(dest, "\n");
-
-        current = current->next;
     }
 }
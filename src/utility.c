@@ -5,6 +5,8 @@
 
 #include "utility.h"
 
+static int hex_digit_value(int ch);
+
 char *str_dup(const char *source) {
     size_t length = strlen(source);
     char *new_str = malloc(length + 1);
@@ -14,68 +16,120 @@ char *str_dup(const char *source) {
 }
 
 
-int cleanup_string(char *text) {
-    // remove newlines originating from original source code
-    size_t length = strlen(text);
-    for (size_t i = 0; i < length; ++i) {
-        if (text[i] == '\n') {
-            size_t start = i + 1;
-            size_t end = i + 1;
-            while (start > 0 && isspace(text[start - 1])) {
-                --start;
+static int hex_digit_value(int ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+/* Decodes the *length* bytes at *text* into *out* in a single pass. Escape
+ * codes are replaced by the characters they represent, and each line break,
+ * together with the whitespace around it, becomes a single space (or is
+ * dropped entirely if it follows a \n escape). The result is never longer
+ * than the source and is NUL terminated, so *out* needs room for *length* + 1
+ * bytes; it may be the same as *text*.
+ *
+ * Returns the length of the decoded text. If an invalid escape is found, -1
+ * is returned and *bad_pos* is set to the offset of its backslash.
+ */
+int decode_string(const char *text, size_t length, char *out, size_t *bad_pos) {
+    size_t in = 0, pos = 0;
+    size_t content_end = 0;     // end of output that isn't source whitespace
+    int after_newline_code = 0;
+
+    while (in < length) {
+        unsigned char ch = text[in];
+
+        if (ch == '\n') {
+            pos = content_end;
+            while (in < length && isspace((unsigned char)text[in])) {
+                ++in;
             }
-            while (end < length && isspace(text[end])) {
-                ++end;
+            if (!after_newline_code) {
+                out[pos++] = ' ';
             }
+            continue;
+        }
 
-            if (start > 1 && text[start - 1] == 'n' && text[start - 2] == '\\') {
-                memmove(&text[start], &text[end], length - start);
-            } else {
-                memmove(&text[start + 1], &text[end], length - start - 1);
-                text[start] = ' ';
+        if (ch != '\\') {
+            out[pos++] = ch;
+            ++in;
+            if (!isspace(ch)) {
+                content_end = pos;
+                after_newline_code = 0;
             }
-            i = start;
+            continue;
         }
-    }
-
-    // handle string escapes
-    length = strlen(text);
-    for (size_t i = 0; i < length; ++i) {
 
-        if (text[i] != '\\') continue;
-
-        ++i;
-        switch(text[i]) {
+        size_t escape_start = in;
+        int codepoint = -1;
+        if (in + 1 >= length) {
+            *bad_pos = escape_start;
+            return -1;
+        }
+        in += 2;
+        switch (text[escape_start + 1]) {
             case '"':
             case '\'':
             case '\\':
-                text[i - 1] = text[i];
+                codepoint = text[escape_start + 1];
                 break;
             case 'n':
-                text[i - 1] = '\n';
+                codepoint = '\n';
+                break;
+            case 't':
+                codepoint = '\t';
+                break;
+            case 'x':
+                if (in + 2 <= length && hex_digit_value(text[in]) >= 0
+                        && hex_digit_value(text[in + 1]) >= 0) {
+                    codepoint = hex_digit_value(text[in]) * 16 + hex_digit_value(text[in + 1]);
+                    in += 2;
+                }
+                break;
+            case 'u':
+                if (in < length && text[in] == '{') {
+                    size_t digits = 0;
+                    int value = 0;
+                    ++in;
+                    while (in < length && digits < 6 && hex_digit_value(text[in]) >= 0) {
+                        value = value * 16 + hex_digit_value(text[in]);
+                        ++digits;
+                        ++in;
+                    }
+                    if (digits > 0 && in < length && text[in] == '}') {
+                        codepoint = value;
+                        ++in;
+                    }
+                }
                 break;
-            default:
-                return i;
         }
 
-        for (size_t j = i; j < length; ++j) {
-            text[j] = text[j + 1];
+        // a NUL would end the string early, and surrogates and values past
+        // the end of Unicode can't be encoded
+        if (codepoint <= 0 || codepoint > 0x10FFFF
+                || (codepoint >= 0xD800 && codepoint <= 0xDFFF)) {
+            *bad_pos = escape_start;
+            return -1;
         }
-        --i;
+        pos += utf8_encode(&out[pos], codepoint);
+        content_end = pos;
+        after_newline_code = codepoint == '\n';
     }
 
-    return 0;
+    out[pos] = 0;
+    return pos;
 }
 
 
-void dump_string(FILE *dest, const char *text, unsigned max_length) {
+void dump_string(FILE *dest, const char *text, size_t length, unsigned max_length) {
     if (text == NULL) {
         fputs("(null)", dest);
         return;
     }
 
     int was_truncated = 0;
-    size_t length = strlen(text);
     if (length > max_length) {
         length = max_length;
         was_truncated = 1;
@@ -105,6 +159,30 @@ void dump_string(FILE *dest, const char *text, unsigned max_length) {
     }
 }
 
+/* Writes the UTF-8 encoding of *codepoint* to *out* and returns the number
+ * of bytes written (1 to 4).
+ */
+int utf8_encode(char *out, int codepoint) {
+    if (codepoint < 0x80) {
+        out[0] = codepoint;
+        return 1;
+    } else if (codepoint < 0x800) {
+        out[0] = 0xC0 | (codepoint >> 6);
+        out[1] = 0x80 | (codepoint & 0x3F);
+        return 2;
+    } else if (codepoint < 0x10000) {
+        out[0] = 0xE0 | (codepoint >> 12);
+        out[1] = 0x80 | ((codepoint >> 6) & 0x3F);
+        out[2] = 0x80 | (codepoint & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | (codepoint >> 18);
+    out[1] = 0x80 | ((codepoint >> 12) & 0x3F);
+    out[2] = 0x80 | ((codepoint >> 6) & 0x3F);
+    out[3] = 0x80 | (codepoint & 0x3F);
+    return 4;
+}
+
 int utf8_next_char(const char *text, int *pos) {
     unsigned char first_byte, b1, b2, b3, b4;
     int length = 0;
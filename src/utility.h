@@ -6,8 +6,9 @@
 #define UTF8_REPLACEMENT_CHAR 0xFFFD
 
 char *str_dup(const char *source);
-int cleanup_string(char *text);
-void dump_string(FILE *dest, const char *text, unsigned max_length);
+int decode_string(const char *text, size_t length, char *out, size_t *bad_pos);
+void dump_string(FILE *dest, const char *text, size_t length, unsigned max_length);
+int utf8_encode(char *out, int codepoint);
 int utf8_next_char(const char *text, int *pos);
 
 #endif
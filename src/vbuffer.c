@@ -1,8 +1,24 @@
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200809L
+#define HAVE_WRITE 1
+#endif
+
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_WRITE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "vbuffer.h"
 
+// how much more room vbuffer_readfile asks for before each read
+#define READ_CHUNK_SIZE 65536
+
 struct vbuffer* vbuffer_new(void) {
     struct vbuffer *buf = malloc(sizeof(struct vbuffer));
     if (!buf) return NULL;
@@ -22,58 +38,113 @@ void vbuffer_free(struct vbuffer *buffer) {
     free(buffer);
 }
 
-int vbuffer_pad_by(struct vbuffer *buffer, char with, int amount) {
-    for (int i = 0; i < amount; ++i) {
-        vbuffer_pushchar(buffer, with);
+/* Grows *buffer* so that at least *extra* more bytes fit after its current
+ * contents without it having to grow again. Returns 0 if memory runs out.
+ */
+int vbuffer_reserve(struct vbuffer *buffer, size_t extra) {
+    if (!buffer) return 0;
+    if (extra <= buffer->capacity - buffer->length) {
+        return 1;
+    }
+    if (extra > SIZE_MAX - buffer->length) {
+        return 0;
     }
+    size_t needed = buffer->length + extra;
+    size_t new_capacity = buffer->capacity;
+    while (new_capacity < needed) {
+        new_capacity = new_capacity > SIZE_MAX / 2 ? needed : new_capacity * 2;
+    }
+    char *new_buffer = realloc(buffer->data, new_capacity);
+    if (!new_buffer) {
+        return 0;
+    }
+    buffer->data = new_buffer;
+    buffer->capacity = new_capacity;
     return 1;
 }
 
-int vbuffer_pad_to(struct vbuffer *buffer, char with, int multipleOf) {
-    while (buffer->length == 0 || buffer->length % multipleOf != 0) {
-        vbuffer_pushchar(buffer, with);
+/* Adds the *length* bytes at *data* to the end of *buffer*. */
+int vbuffer_append(struct vbuffer *buffer, const void *data, size_t length) {
+    if (!vbuffer_reserve(buffer, length)) return 0;
+    if (length > 0) {
+        memcpy(buffer->data + buffer->length, data, length);
     }
+    buffer->length += length;
+    return 1;
+}
+
+/* Adds *count* copies of the byte *with* to the end of *buffer*. */
+int vbuffer_fill(struct vbuffer *buffer, char with, size_t count) {
+    if (!vbuffer_reserve(buffer, count)) return 0;
+    memset(buffer->data + buffer->length, with, count);
+    buffer->length += count;
     return 1;
 }
 
+int vbuffer_pad_by(struct vbuffer *buffer, char with, size_t amount) {
+    return vbuffer_fill(buffer, with, amount);
+}
+
+int vbuffer_pad_to(struct vbuffer *buffer, char with, size_t multipleOf) {
+    if (!buffer) return 0;
+    size_t remainder = buffer->length % multipleOf;
+    size_t amount = buffer->length == 0 ? multipleOf : (multipleOf - remainder) % multipleOf;
+    return vbuffer_fill(buffer, with, amount);
+}
+
 int vbuffer_pushchar(struct vbuffer *buffer, char c) {
     if (!buffer) return 0;
-    if (buffer->length >= buffer->capacity) {
-        int new_capacity = buffer->capacity * 2;
-        char *new_buffer = realloc(buffer->data, new_capacity);
-        if (!new_buffer) {
-            return 0;
-        }
-        buffer->data = new_buffer;
-        buffer->capacity = new_capacity;
-    }
+    if (buffer->length == buffer->capacity && !vbuffer_reserve(buffer, 1)) return 0;
     buffer->data[buffer->length] = c;
     ++buffer->length;
     return 1;
 }
 
 int vbuffer_pushshort(struct vbuffer *buffer, unsigned c) {
-    if (!buffer) return 0;
-    c &= 0xFFFF;
-    vbuffer_pushchar(buffer, (c & 0xFF00) >> 8);
-    vbuffer_pushchar(buffer, c & 0xFF);
+    if (!vbuffer_reserve(buffer, 2)) return 0;
+    char *dest = buffer->data + buffer->length;
+    dest[0] = (c & 0xFF00) >> 8;
+    dest[1] = c & 0xFF;
+    buffer->length += 2;
     return 1;
 }
 
 int vbuffer_pushword(struct vbuffer *buffer, unsigned c) {
-    if (!buffer) return 0;
-    vbuffer_pushchar(buffer, (c & 0xFF000000) >> 24);
-    vbuffer_pushchar(buffer, (c & 0xFF0000) >> 16);
-    vbuffer_pushchar(buffer, (c & 0xFF00) >> 8);
-    vbuffer_pushchar(buffer, c & 0xFF);
+    if (!vbuffer_reserve(buffer, 4)) return 0;
+    char *dest = buffer->data + buffer->length;
+    dest[0] = (c & 0xFF000000) >> 24;
+    dest[1] = (c & 0xFF0000) >> 16;
+    dest[2] = (c & 0xFF00) >> 8;
+    dest[3] = c & 0xFF;
+    buffer->length += 4;
+    return 1;
+}
+
+/* Adds each of the *count* values in *words* to the end of *buffer* as a
+ * big-endian word, growing the buffer at most once.
+ */
+int vbuffer_pushwords(struct vbuffer *buffer, const unsigned *words, size_t count) {
+    if (count > SIZE_MAX / 4) return 0;
+    if (!vbuffer_reserve(buffer, count * 4)) return 0;
+    char *dest = buffer->data + buffer->length;
+    for (size_t i = 0; i < count; ++i) {
+        unsigned c = words[i];
+        dest[0] = (c & 0xFF000000) >> 24;
+        dest[1] = (c & 0xFF0000) >> 16;
+        dest[2] = (c & 0xFF00) >> 8;
+        dest[3] = c & 0xFF;
+        dest += 4;
+    }
+    buffer->length += count * 4;
     return 1;
 }
 
-int vbuffer_setshort(struct vbuffer *buffer, unsigned new_value, unsigned position) {
+int vbuffer_setshort(struct vbuffer *buffer, unsigned new_value, size_t position) {
     if (!buffer) return 0;
     new_value &= 0xFFFF;
-    while (position + 2 > buffer->length) {
-        vbuffer_pushchar(buffer, 0);
+    if (position + 2 > buffer->length
+            && !vbuffer_fill(buffer, 0, position + 2 - buffer->length)) {
+        return 0;
     }
 
     buffer->data[position] = (new_value & 0xFF00) >> 8;
@@ -81,10 +152,11 @@ int vbuffer_setshort(struct vbuffer *buffer, unsigned new_value, unsigned positi
     return 1;
 }
 
-int vbuffer_setword(struct vbuffer *buffer, unsigned new_value, unsigned position) {
+int vbuffer_setword(struct vbuffer *buffer, unsigned new_value, size_t position) {
     if (!buffer) return 0;
-    while (position + 4 > buffer->length) {
-        vbuffer_pushchar(buffer, 0);
+    if (position + 4 > buffer->length
+            && !vbuffer_fill(buffer, 0, position + 4 - buffer->length)) {
+        return 0;
     }
 
     buffer->data[position]     = (new_value & 0xFF000000) >> 24;
@@ -101,21 +173,63 @@ int vbuffer_readfile(struct vbuffer *buffer, const char *filename) {
     else            source = stdin;
     if (!source) return 0;
 
+    // read straight into the buffer, a block at a time
+    int success = 1;
     while (1) {
-        int c = getc(source);
-        if (c == EOF) break;
-        vbuffer_pushchar(buffer, c);
+        if (!vbuffer_reserve(buffer, READ_CHUNK_SIZE)) {
+            success = 0;
+            break;
+        }
+        size_t count = fread(buffer->data + buffer->length, 1,
+                             buffer->capacity - buffer->length, source);
+        buffer->length += count;
+        if (count == 0) break;
+    }
+    if (ferror(source)) {
+        success = 0;
     }
 
     if (source != stdin) {
         fclose(source);
     }
-    return 1;
+    return success;
 }
 
+/* Writes the contents of *buffer* to *filename*, or to stdout if *filename*
+ * is NULL. Where possible this is a single write() of the whole buffer, so
+ * the destination need not be seekable. Returns 1 on success and 0 on
+ * failure.
+ */
 int vbuffer_writefile(struct vbuffer *buffer, const char *filename) {
-    int success = 1;
     if (!buffer) return 0;
+#ifdef HAVE_WRITE
+    int fd = STDOUT_FILENO;
+    if (filename) {
+        fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) return 0;
+    }
+
+    int success = 1;
+    const char *data = buffer->data;
+    size_t remaining = buffer->length;
+    while (remaining > 0) {
+        // pipes and interrupted calls can take less than everything
+        ssize_t count = write(fd, data, remaining);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            success = 0;
+            break;
+        }
+        data += count;
+        remaining -= count;
+    }
+
+    if (filename && close(fd) != 0) {
+        success = 0;
+    }
+    return success;
+#else
+    int success = 1;
     FILE *source = NULL;
     if (filename)   source = fopen(filename, "wb");
     else            source = stdout;
@@ -130,4 +244,5 @@ int vbuffer_writefile(struct vbuffer *buffer, const char *filename) {
         fclose(source);
     }
     return success;
+#endif
 }
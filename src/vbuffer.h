@@ -1,23 +1,29 @@
 #ifndef VBUFFER_H
 #define VBUFFER_H
 
+#include <stddef.h>
+
 #define INITIAL_BUFFER_CAPACITY 8
 
 struct vbuffer {
     char *data;
-    int length;
-    int capacity;
+    size_t length;
+    size_t capacity;
 };
 
 struct vbuffer* vbuffer_new(void);
 void vbuffer_free(struct vbuffer *buffer);
-int vbuffer_pad_by(struct vbuffer *buffer, char with, int amount);
-int vbuffer_pad_to(struct vbuffer *buffer, char with, int multipleOf);
+int vbuffer_reserve(struct vbuffer *buffer, size_t extra);
+int vbuffer_append(struct vbuffer *buffer, const void *data, size_t length);
+int vbuffer_fill(struct vbuffer *buffer, char with, size_t count);
+int vbuffer_pad_by(struct vbuffer *buffer, char with, size_t amount);
+int vbuffer_pad_to(struct vbuffer *buffer, char with, size_t multipleOf);
 int vbuffer_pushchar(struct vbuffer *buffer, char c);
 int vbuffer_pushshort(struct vbuffer *buffer, unsigned c);
 int vbuffer_pushword(struct vbuffer *buffer, unsigned c);
-int vbuffer_setshort(struct vbuffer *buffer, unsigned new_value, unsigned position);
-int vbuffer_setword(struct vbuffer *buffer, unsigned new_value, unsigned position);
+int vbuffer_pushwords(struct vbuffer *buffer, const unsigned *words, size_t count);
+int vbuffer_setshort(struct vbuffer *buffer, unsigned new_value, size_t position);
+int vbuffer_setword(struct vbuffer *buffer, unsigned new_value, size_t position);
 int vbuffer_readfile(struct vbuffer *buffer, const char *filename);
 int vbuffer_writefile(struct vbuffer *buffer, const char *filename);
 
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/arena.h"
+#include "test.h"
+
+
+const char* test_new_arena(void) {
+    struct arena *arena = arena_new();
+
+    ASSERT_TRUE(arena, "arena is created");
+    ASSERT_TRUE(arena->current, "initial block allocated");
+    ASSERT_TRUE(arena->total_allocated == 0, "nothing allocated yet");
+
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_arena_alloc_aligned(void) {
+    struct arena *arena = arena_new();
+    ASSERT_TRUE(arena, "arena is created");
+
+    char *first = arena_alloc(arena, 3);
+    char *second = arena_alloc(arena, 5);
+    ASSERT_TRUE(first && second, "allocations succeeded");
+    ASSERT_TRUE(first != second, "allocations are distinct");
+    ASSERT_TRUE(((size_t)first) % ARENA_ALIGNMENT == 0, "first allocation is aligned");
+    ASSERT_TRUE(((size_t)second) % ARENA_ALIGNMENT == 0, "second allocation is aligned");
+    ASSERT_TRUE(second - first >= 3, "allocations do not overlap");
+
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_arena_alloc_many_blocks(void) {
+    struct arena *arena = arena_new();
+    ASSERT_TRUE(arena, "arena is created");
+
+    int *values[10000];
+    for (int i = 0; i < 10000; ++i) {
+        values[i] = arena_alloc(arena, 32);
+        ASSERT_TRUE(values[i], "allocation succeeded");
+        *values[i] = i;
+    }
+    ASSERT_TRUE(arena->current->next, "more blocks were added");
+    for (int i = 0; i < 10000; ++i) {
+        ASSERT_TRUE(*values[i] == i, "earlier allocations are unchanged");
+    }
+
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_arena_alloc_oversized(void) {
+    struct arena *arena = arena_new();
+    ASSERT_TRUE(arena, "arena is created");
+
+    struct arena_block *first_block = arena->current;
+    char *small = arena_alloc(arena, 16);
+    char *large = arena_alloc(arena, ARENA_BLOCK_SIZE * 2);
+    ASSERT_TRUE(small && large, "allocations succeeded");
+    memset(large, 0x55, ARENA_BLOCK_SIZE * 2);
+    ASSERT_TRUE(arena->current == first_block, "current block is still in use");
+    char *after = arena_alloc(arena, 16);
+    ASSERT_TRUE(after == small + 16, "small allocations continue in current block");
+
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_arena_reset(void) {
+    struct arena *arena = arena_new();
+    ASSERT_TRUE(arena, "arena is created");
+
+    for (int i = 0; i < 10000; ++i) {
+        ASSERT_TRUE(arena_alloc(arena, 32), "allocation succeeded");
+    }
+    ASSERT_TRUE(arena_alloc(arena, ARENA_BLOCK_SIZE * 2), "oversized allocation succeeded");
+    struct arena_block *kept = arena->current;
+
+    arena_reset(arena);
+    ASSERT_TRUE(arena->current == kept, "current block is kept");
+    ASSERT_TRUE(arena->current->next == NULL, "other blocks are released");
+    ASSERT_TRUE(arena->total_allocated == 0, "nothing allocated after reset");
+
+    char *first = arena_alloc(arena, 16);
+    ASSERT_TRUE(first, "allocation succeeded after reset");
+    ASSERT_TRUE(arena->current->used == 16, "allocations restart at start of block");
+
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_arena_calloc(void) {
+    struct arena *arena = arena_new();
+    ASSERT_TRUE(arena, "arena is created");
+
+    unsigned char *data = arena_calloc(arena, 100);
+    ASSERT_TRUE(data, "allocation succeeded");
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_TRUE(data[i] == 0, "memory was cleared");
+    }
+
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_arena_strdup(void) {
+    struct arena *arena = arena_new();
+    const char *source = "Hello World!\n";
+    char *copy = arena_strdup(arena, source);
+
+    ASSERT_TRUE(copy != NULL, "copy is non-NULL");
+    ASSERT_TRUE(copy != source, "copy is distinct");
+    ASSERT_TRUE(strcmp(copy, source) == 0, "copy has same content");
+
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_arena_strndup(void) {
+    struct arena *arena = arena_new();
+    const char *source = "Hello World!\n";
+    char *copy = arena_strndup(arena, source, 5);
+
+    ASSERT_TRUE(copy != NULL, "copy is non-NULL");
+    ASSERT_TRUE(strcmp(copy, "Hello") == 0, "copy is truncated and terminated");
+
+    arena_free(arena);
+    return NULL;
+}
+
+const char *test_suite_name = "arena.c";
+struct test_def test_list[] = {
+    {   "new_arena",                                test_new_arena },
+    {   "arena_alloc_aligned",                      test_arena_alloc_aligned },
+    {   "arena_alloc_many_blocks",                  test_arena_alloc_many_blocks },
+    {   "arena_alloc_oversized",                    test_arena_alloc_oversized },
+    {   "arena_reset",                              test_arena_reset },
+    {   "arena_calloc",                             test_arena_calloc },
+    {   "arena_strdup",                             test_arena_strdup },
+    {   "arena_strndup",                            test_arena_strndup },
+
+    {   NULL,                                       NULL }
+};
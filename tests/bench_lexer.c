@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/assemble.h"
+#include "../src/vbuffer.h"
+
+/* Lexer throughput benchmark. Builds a synthetic source file resembling
+ * generated assembly and reports how quickly lex_core gets through it.
+ * Usage: bench_lexer [lines] [repeats]
+ */
+
+static void build_source(struct vbuffer *source, int lines);
+
+static void build_source(struct vbuffer *source, int lines) {
+    char line[256];
+    for (int i = 0; i < lines; ++i) {
+        switch (i % 8) {
+            case 0:
+                snprintf(line, sizeof(line), "label_%d:\n", i);
+                break;
+            case 1:
+                snprintf(line, sizeof(line), "    ; comment describing what happens in block %d\n", i);
+                break;
+            case 2:
+                snprintf(line, sizeof(line), "    add local_%d $%X result_%d\n", i, i, i);
+                break;
+            case 3:
+                snprintf(line, sizeof(line), "    copy value_%d + 4 * 2 sp            ; trailing comment\n", i);
+                break;
+            case 4:
+                snprintf(line, sizeof(line), "    streamstr \"message number %d\\n\"\n", i);
+                break;
+            case 5:
+                snprintf(line, sizeof(line), "    .word %d %d %d %d\n", i, i + 1, i + 2, i + 3);
+                break;
+            case 6:
+                snprintf(line, sizeof(line), "    jlt local_%d 'x' label_%d\n", i, i - 6);
+                break;
+            default:
+                snprintf(line, sizeof(line), "\n");
+        }
+        vbuffer_append(source, line, strlen(line));
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int lines = argc > 1 ? atoi(argv[1]) : 200000;
+    int repeats = argc > 2 ? atoi(argv[2]) : 5;
+
+    struct vbuffer *source = vbuffer_new();
+    build_source(source, lines);
+
+    clock_t start = clock();
+    size_t token_count = 0;
+    for (int i = 0; i < repeats; ++i) {
+        struct arena *arena = arena_new();
+        struct symbol_table *symbols = symbol_table_new(arena);
+        struct lexer_state state = { { "(benchmark)", 1, 1 } };
+        state.text = source->data;
+        state.text_length = source->length;
+        state.arena = arena;
+        state.symbols = symbols;
+
+        struct token_list *tokens = lex_core(&state);
+        if (!tokens) {
+            printf("lexing failed\n");
+            return 1;
+        }
+        token_count = tokens->count;
+        free_token_list(tokens);
+        symbol_table_free(symbols);
+        arena_free(arena);
+    }
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    double megabytes = (double)source->length * repeats / (1024 * 1024);
+    printf("lexed %.1f MiB (%zu tokens per pass) in %.3fs: %.1f MiB/s\n",
+            megabytes, token_count, seconds, megabytes / seconds);
+
+    vbuffer_free(source);
+    return 0;
+}
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/assemble.h"
+#include "../src/mapfile.h"
+
+/* Mnemonic lookup benchmark. Collects the instruction names used in the
+ * given source files and times finding each of them by scanning codes[]
+ * with strcmp, as the parser used to, against finding it through the symbol
+ * table, as the lexer does now.
+ * Usage: bench_mnemonics [repeats] [files...]
+ */
+
+#define MAX_NAMES   100000
+
+static const char *default_files[] = {
+    "demos/basic.ga", "demos/complex.ga", "demos/expressions.ga",
+    "demos/gamesys.ga", "demos/glk.ga", "demos/minimal.ga",
+    "demos/model.ga", "demos/mountain.ga", NULL
+};
+
+static int collect_names(const char *filename, struct arena *arena, struct symbol_table *symbols,
+                         const char **names, int count);
+static struct mnemonic* find_linear(const char *name);
+
+/* Adds the name at the start of each instruction line in *filename* to
+ * *names*, returning the new number of names.
+ */
+static int collect_names(const char *filename, struct arena *arena, struct symbol_table *symbols,
+                         const char **names, int count) {
+    struct mapped_file source;
+    struct lexer_state state;
+    state.diagnostics = NULL;
+    if (!lex_open(&state, &source, filename, arena, symbols)) {
+        return count;
+    }
+    struct token_list *tokens = lex_core(&state);
+    if (tokens) {
+        struct token *here = tokens->tokens;
+        while (here->type != tt_eof) {
+            while (here->type == tt_identifier && here[1].type == tt_colon) {
+                here += 2;
+            }
+            if (here->type == tt_identifier && symbol_mnemonic(symbols, here->i) && count < MAX_NAMES) {
+                names[count++] = here->text;
+            }
+            skip_line(&here);
+        }
+    }
+    free_token_list(tokens);
+    mapfile_close(&source);
+    return count;
+}
+
+static struct mnemonic* find_linear(const char *name) {
+    for (struct mnemonic *m = codes; m->name; ++m) {
+        if (strcmp(m->name, name) == 0) {
+            return m;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int repeats = argc > 1 ? atoi(argv[1]) : 200;
+    const char **files = argc > 2 ? (const char**)&argv[2] : default_files;
+    int file_count = 0;
+    while (argc > 2 ? file_count < argc - 2 : files[file_count] != NULL) {
+        ++file_count;
+    }
+
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    const char **names = malloc(sizeof(const char*) * MAX_NAMES);
+    int count = 0;
+    for (int i = 0; i < file_count; ++i) {
+        count = collect_names(files[i], arena, symbols, names, count);
+    }
+    if (count == 0) {
+        printf("no instructions found\n");
+        return 1;
+    }
+
+    size_t found = 0;
+    clock_t start = clock();
+    for (int r = 0; r < repeats; ++r) {
+        for (int i = 0; i < count; ++i) {
+            found += find_linear(names[i])->opcode;
+        }
+    }
+    double linear_seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (int r = 0; r < repeats; ++r) {
+        for (int i = 0; i < count; ++i) {
+            int symbol = symbol_lookup(symbols, names[i], strlen(names[i]));
+            found -= symbol_mnemonic(symbols, symbol)->opcode;
+        }
+    }
+    double hashed_seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    double lookups = (double)count * repeats;
+    printf("%d instructions in %d files, %d repeats (check %zu)\n", count, file_count, repeats, found);
+    printf("linear scan:  %.3fs (%.1f ns per lookup)\n", linear_seconds, linear_seconds * 1e9 / lookups);
+    printf("symbol table: %.3fs (%.1f ns per lookup)\n", hashed_seconds, hashed_seconds * 1e9 / lookups);
+
+    free(names);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return 0;
+}
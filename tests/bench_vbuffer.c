@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/vbuffer.h"
+
+/* vbuffer throughput benchmark. Builds buffers of the given size a byte at a
+ * time with vbuffer_pushchar, as the assembler used to, and in bulk with
+ * vbuffer_append, vbuffer_pad_by and vbuffer_pushwords, and reports how long
+ * each takes.
+ * Usage: bench_vbuffer [megabytes] [repeats]
+ */
+
+#define BLOCK_SIZE  4096
+#define WORD_COUNT  1024
+
+static double seconds_since(clock_t start);
+static void report(const char *name, double seconds, size_t bytes);
+
+static double seconds_since(clock_t start) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void report(const char *name, double seconds, size_t bytes) {
+    double megabytes = (double)bytes / (1024 * 1024);
+    printf("%-10s %.3fs (%.1f MiB/s)\n", name, seconds, seconds > 0 ? megabytes / seconds : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+    int megabytes = argc > 1 ? atoi(argv[1]) : 32;
+    int repeats = argc > 2 ? atoi(argv[2]) : 4;
+    if (megabytes <= 0 || repeats <= 0) {
+        printf("usage: bench_vbuffer [megabytes] [repeats]\n");
+        return 1;
+    }
+    size_t size = (size_t)megabytes * 1024 * 1024;
+    size_t total = size * repeats;
+
+    char block[BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(block); ++i) {
+        block[i] = i * 7;
+    }
+    unsigned words[WORD_COUNT];
+    for (unsigned i = 0; i < WORD_COUNT; ++i) {
+        words[i] = i * 0x01010101;
+    }
+
+    size_t check = 0;
+    clock_t start = clock();
+    for (int r = 0; r < repeats; ++r) {
+        struct vbuffer *buffer = vbuffer_new();
+        for (size_t i = 0; i < size; ++i) {
+            vbuffer_pushchar(buffer, block[i % BLOCK_SIZE]);
+        }
+        check += buffer->length;
+        vbuffer_free(buffer);
+    }
+    double pushchar_seconds = seconds_since(start);
+
+    start = clock();
+    for (int r = 0; r < repeats; ++r) {
+        struct vbuffer *buffer = vbuffer_new();
+        for (size_t i = 0; i < size; i += BLOCK_SIZE) {
+            vbuffer_append(buffer, block, BLOCK_SIZE);
+        }
+        check += buffer->length;
+        vbuffer_free(buffer);
+    }
+    double append_seconds = seconds_since(start);
+
+    start = clock();
+    for (int r = 0; r < repeats; ++r) {
+        struct vbuffer *buffer = vbuffer_new();
+        vbuffer_pad_by(buffer, 0x5A, size);
+        check += buffer->length;
+        vbuffer_free(buffer);
+    }
+    double pad_seconds = seconds_since(start);
+
+    start = clock();
+    for (int r = 0; r < repeats; ++r) {
+        struct vbuffer *buffer = vbuffer_new();
+        for (size_t i = 0; i < size; i += sizeof(words)) {
+            vbuffer_pushwords(buffer, words, WORD_COUNT);
+        }
+        check += buffer->length;
+        vbuffer_free(buffer);
+    }
+    double pushwords_seconds = seconds_since(start);
+
+    printf("%d MiB buffers, %d repeats (check %zu)\n", megabytes, repeats, check);
+    report("pushchar:", pushchar_seconds, total);
+    report("append:", append_seconds, total);
+    report("pad_by:", pad_seconds, total);
+    report("pushwords:", pushwords_seconds, total);
+    return 0;
+}
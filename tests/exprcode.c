@@ -0,0 +1,356 @@
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+#include "fixtures.h"
+
+const char* test_exprcode_constants(void);
+const char* test_exprcode_symbols(void);
+const char* test_exprcode_bind(void);
+const char* test_exprcode_next_symbol(void);
+const char* test_exprcode_division_by_zero(void);
+const char* test_exprcode_division_overflow(void);
+const char* test_exprcode_shift_range(void);
+const char* test_exprcode_wraps(void);
+const char* test_exprcode_deep(void);
+const char* test_exprcode_share(void);
+const char* test_exprcode_share_many(void);
+const char* test_exprcode_known_folded(void);
+
+
+const char *test_suite_name = "exprcode.c";
+struct test_def test_list[] = {
+    {   "exprcode_constants",                       test_exprcode_constants },
+    {   "exprcode_symbols",                         test_exprcode_symbols },
+    {   "exprcode_bind",                            test_exprcode_bind },
+    {   "exprcode_next_symbol",                     test_exprcode_next_symbol },
+    {   "exprcode_division_by_zero",                test_exprcode_division_by_zero },
+    {   "exprcode_division_overflow",               test_exprcode_division_overflow },
+    {   "exprcode_shift_range",                     test_exprcode_shift_range },
+    {   "exprcode_wraps",                           test_exprcode_wraps },
+    {   "exprcode_deep",                            test_exprcode_deep },
+    {   "exprcode_share",                           test_exprcode_share },
+    {   "exprcode_share_many",                      test_exprcode_share_many },
+    {   "exprcode_known_folded",                    test_exprcode_known_folded },
+
+    {   NULL,                                       NULL }
+};
+
+
+const char* test_exprcode_constants(void) {
+    struct program_info info;
+    struct expr_code code = { NULL };
+    struct origin origin = { "test", 1, 1 };
+    ASSERT_TRUE(setup_program(&info), "set up program");
+
+    // (2 + 3) * -4
+    int start = exprcode_constant(&code, 2);
+    ASSERT_TRUE(start == 0, "first expression at start of code");
+    exprcode_constant(&code, 3);
+    exprcode_operator(&code, op_add);
+    exprcode_constant(&code, 4);
+    exprcode_operator(&code, op_negate);
+    exprcode_operator(&code, op_multiply);
+    exprcode_end(&code);
+
+    // a second expression after the first
+    int second = exprcode_constant(&code, -7);
+    ASSERT_TRUE(second == exprcode_length(&code) - 5, "second expression follows first");
+    exprcode_end(&code);
+
+    int value = 0, unknown = -1;
+    ASSERT_TRUE(exprcode_eval(&code, &info, start, &origin, &value, &unknown) == EVAL_KNOWN, "expression evaluated");
+    ASSERT_TRUE(value == -20, "expression has correct value");
+    ASSERT_TRUE(exprcode_eval(&code, &info, second, &origin, &value, &unknown) == EVAL_KNOWN, "second evaluated");
+    ASSERT_TRUE(value == -7, "negative constant stored");
+
+    exprcode_free(&code);
+    cleanup_program(&info);
+    return NULL;
+}
+
+const char* test_exprcode_symbols(void) {
+    struct program_info info;
+    struct expr_code code = { NULL };
+    struct origin origin = { "test", 1, 1 };
+    ASSERT_TRUE(setup_program(&info), "set up program");
+    int base = symbol_intern(info.symbols, "base", 4);
+    int size = symbol_intern(info.symbols, "size", 4);
+
+    // base + size << 2
+    int start = exprcode_symbol(&code, base);
+    exprcode_symbol(&code, size);
+    exprcode_constant(&code, 2);
+    exprcode_operator(&code, op_shift_left);
+    exprcode_operator(&code, op_add);
+    exprcode_end(&code);
+
+    int value = 0, unknown = -1;
+    ASSERT_TRUE(exprcode_eval(&code, &info, start, &origin, &value, &unknown) == EVAL_UNKNOWN, "unknown at first");
+    ASSERT_TRUE(unknown == base, "first undefined name given");
+    ASSERT_TRUE(add_label(&info, base, 0x100), "base defined");
+    ASSERT_TRUE(exprcode_eval(&code, &info, start, &origin, &value, &unknown) == EVAL_UNKNOWN, "still unknown");
+    ASSERT_TRUE(unknown == size, "next undefined name given");
+    ASSERT_TRUE(add_label(&info, size, 3), "size defined");
+    ASSERT_TRUE(exprcode_eval(&code, &info, start, &origin, &value, &unknown) == EVAL_KNOWN, "known once defined");
+    ASSERT_TRUE(value == 0x10C, "expression has correct value");
+
+    exprcode_free(&code);
+    cleanup_program(&info);
+    return NULL;
+}
+
+const char* test_exprcode_bind(void) {
+    struct program_info info;
+    struct expr_code code = { NULL };
+    struct origin origin = { "test", 1, 1 };
+    ASSERT_TRUE(setup_program(&info), "set up program");
+    int local = symbol_intern(info.symbols, "@loop", 5);
+
+    // -@loop + 1
+    int start = exprcode_symbol(&code, local);
+    exprcode_operator(&code, op_negate);
+    exprcode_constant(&code, 1);
+    exprcode_operator(&code, op_add);
+    exprcode_end(&code);
+
+    ASSERT_TRUE(exprcode_symbol_at(&code, start) == local, "symbol found at offset");
+    exprcode_bind(&code, start, 50);
+    ASSERT_TRUE(exprcode_symbol_at(&code, start) == -1, "bound symbol is no longer a symbol");
+
+    int value = 0, unknown = -1;
+    ASSERT_TRUE(exprcode_eval(&code, &info, start, &origin, &value, &unknown) == EVAL_KNOWN, "bound expression known");
+    ASSERT_TRUE(value == -49, "bound value used");
+
+    exprcode_free(&code);
+    cleanup_program(&info);
+    return NULL;
+}
+
+const char* test_exprcode_next_symbol(void) {
+    struct expr_code code = { NULL };
+    int start = exprcode_constant(&code, 1);
+    exprcode_symbol(&code, 10);
+    exprcode_operator(&code, op_subtract);
+    exprcode_symbol(&code, 20);
+    exprcode_operator(&code, op_bit_or);
+    exprcode_end(&code);
+    exprcode_symbol(&code, 30);
+    exprcode_end(&code);
+
+    int offset = start;
+    ASSERT_TRUE(exprcode_next_symbol(&code, &offset) == 10, "first symbol found");
+    ASSERT_TRUE(exprcode_next_symbol(&code, &offset) == 20, "second symbol found");
+    ASSERT_TRUE(exprcode_next_symbol(&code, &offset) == -1, "stops at end of expression");
+    ASSERT_TRUE(exprcode_next_symbol(&code, &offset) == -1, "stays at end of expression");
+
+    exprcode_free(&code);
+    return NULL;
+}
+
+const char* test_exprcode_division_by_zero(void) {
+    struct program_info info;
+    struct expr_code code = { NULL };
+    struct origin origin = { "test", 1, 1 };
+    ASSERT_TRUE(setup_program(&info), "set up program");
+
+    int start = exprcode_constant(&code, 8);
+    exprcode_constant(&code, 0);
+    exprcode_operator(&code, op_divide);
+    exprcode_end(&code);
+
+    int value = 0, unknown = -1;
+    ASSERT_TRUE(exprcode_eval(&code, &info, start, &origin, &value, &unknown) == EVAL_INVALID, "division by zero is invalid");
+    ASSERT_TRUE(exprcode_apply(op_divide, 8, 2, &value) && value == 4, "division applied");
+    ASSERT_TRUE(!exprcode_apply(op_negate, 8, 2, &value), "unary operator not applied");
+
+    exprcode_free(&code);
+    cleanup_program(&info);
+    return NULL;
+}
+
+const char* test_exprcode_division_overflow(void) {
+    struct program_info info;
+    struct expr_code code = { NULL };
+    struct origin origin = { "test", 1, 1 };
+    ASSERT_TRUE(setup_program(&info), "set up program");
+
+    int start = exprcode_constant(&code, INT_MIN);
+    exprcode_constant(&code, -1);
+    exprcode_operator(&code, op_divide);
+    exprcode_end(&code);
+
+    int value = 0, unknown = -1;
+    ASSERT_TRUE(exprcode_eval(&code, &info, start, &origin, &value, &unknown) == EVAL_INVALID, "overflowing division is invalid");
+    ASSERT_TRUE(!exprcode_apply(op_divide, INT_MIN, -1, &value), "overflowing division not applied");
+    ASSERT_TRUE(strcmp(exprcode_apply_error(op_divide, -1), "division overflow") == 0, "overflow described");
+    ASSERT_TRUE(strcmp(exprcode_apply_error(op_divide, 0), "division by zero") == 0, "division by zero described");
+    ASSERT_TRUE(exprcode_apply(op_divide, INT_MIN, 1, &value) && value == INT_MIN, "smallest value divided");
+
+    exprcode_free(&code);
+    cleanup_program(&info);
+    return NULL;
+}
+
+const char* test_exprcode_shift_range(void) {
+    struct program_info info;
+    struct expr_code code = { NULL };
+    struct origin origin = { "test", 1, 1 };
+    ASSERT_TRUE(setup_program(&info), "set up program");
+
+    int start = exprcode_constant(&code, 5);
+    exprcode_constant(&code, 33);
+    exprcode_operator(&code, op_shift_left);
+    exprcode_end(&code);
+
+    int value = 0, unknown = -1;
+    ASSERT_TRUE(exprcode_eval(&code, &info, start, &origin, &value, &unknown) == EVAL_INVALID, "long shift is invalid");
+    ASSERT_TRUE(!exprcode_apply(op_shift_left, 5, 32, &value), "shift left by 32 not applied");
+    ASSERT_TRUE(!exprcode_apply(op_shift_left, 5, -1, &value), "negative shift left not applied");
+    ASSERT_TRUE(!exprcode_apply(op_shift_right, 5, 32, &value), "shift right by 32 not applied");
+    ASSERT_TRUE(!exprcode_apply(op_shift_right, 5, -1, &value), "negative shift right not applied");
+    ASSERT_TRUE(strcmp(exprcode_apply_error(op_shift_left, 33), "shift count out of range") == 0, "shift described");
+    ASSERT_TRUE(exprcode_apply(op_shift_left, 1, 31, &value) && value == INT_MIN, "shift into sign bit");
+    ASSERT_TRUE(exprcode_apply(op_shift_left, -1, 4, &value) && value == -16, "negative value shifted");
+    ASSERT_TRUE(exprcode_apply(op_shift_right, -16, 4, &value) && value == -1, "shift right keeps sign");
+
+    exprcode_free(&code);
+    cleanup_program(&info);
+    return NULL;
+}
+
+const char* test_exprcode_wraps(void) {
+    struct program_info info;
+    struct expr_code code = { NULL };
+    struct origin origin = { "test", 1, 1 };
+    ASSERT_TRUE(setup_program(&info), "set up program");
+
+    // -$80000000, which is $80000000 again
+    int start = exprcode_constant(&code, INT_MIN);
+    exprcode_operator(&code, op_negate);
+    exprcode_end(&code);
+
+    int value = 0, unknown = -1;
+    ASSERT_TRUE(exprcode_eval(&code, &info, start, &origin, &value, &unknown) == EVAL_KNOWN, "negation known");
+    ASSERT_TRUE(value == INT_MIN, "negation wraps");
+    ASSERT_TRUE(exprcode_negate(INT_MIN) == INT_MIN, "negate wraps");
+    ASSERT_TRUE(exprcode_negate(5) == -5, "negate");
+    ASSERT_TRUE(exprcode_apply(op_add, INT_MAX, 1, &value) && value == INT_MIN, "addition wraps");
+    ASSERT_TRUE(exprcode_apply(op_subtract, INT_MIN, 1, &value) && value == INT_MAX, "subtraction wraps");
+    ASSERT_TRUE(exprcode_apply(op_multiply, 0x10000, 0x10000, &value) && value == 0, "multiplication wraps");
+
+    exprcode_free(&code);
+    cleanup_program(&info);
+    return NULL;
+}
+
+const char* test_exprcode_deep(void) {
+    struct program_info info;
+    struct expr_code code = { NULL };
+    struct origin origin = { "test", 1, 1 };
+    ASSERT_TRUE(setup_program(&info), "set up program");
+    int name = symbol_intern(info.symbols, "name", 4);
+
+    // 1 + (1 + (1 + ... (1 + name))), which needs a deep stack
+    int start = -1;
+    for (int i = 0; i < 100000; ++i) {
+        int offset = exprcode_constant(&code, 1);
+        if (start < 0) start = offset;
+    }
+    exprcode_symbol(&code, name);
+    for (int i = 0; i < 100000; ++i) {
+        exprcode_operator(&code, op_add);
+    }
+    exprcode_end(&code);
+
+    int value = 0, unknown = -1;
+    ASSERT_TRUE(exprcode_eval(&code, &info, start, &origin, &value, &unknown) == EVAL_UNKNOWN, "unknown at first");
+    ASSERT_TRUE(add_label(&info, name, 5), "name defined");
+    ASSERT_TRUE(exprcode_eval(&code, &info, start, &origin, &value, &unknown) == EVAL_KNOWN, "deep expression known");
+    ASSERT_TRUE(value == 100005, "deep expression has correct value");
+
+    exprcode_free(&code);
+    cleanup_program(&info);
+    return NULL;
+}
+
+const char* test_exprcode_share(void) {
+    struct expr_code code = { NULL };
+
+    // table + 12, twice, then table + 16
+    int first = exprcode_symbol(&code, 40);
+    exprcode_constant(&code, 12);
+    exprcode_operator(&code, op_add);
+    exprcode_end(&code);
+    ASSERT_TRUE(exprcode_share(&code, first) == first, "new expression kept");
+    int length = exprcode_length(&code);
+
+    int second = exprcode_symbol(&code, 40);
+    exprcode_constant(&code, 12);
+    exprcode_operator(&code, op_add);
+    exprcode_end(&code);
+    ASSERT_TRUE(exprcode_share(&code, second) == first, "repeated expression shared");
+    ASSERT_TRUE(exprcode_length(&code) == length, "repeated code discarded");
+
+    int third = exprcode_symbol(&code, 40);
+    exprcode_constant(&code, 16);
+    exprcode_operator(&code, op_add);
+    exprcode_end(&code);
+    ASSERT_TRUE(exprcode_share(&code, third) == third, "different expression kept");
+    ASSERT_TRUE(exprcode_length(&code) > length, "different code kept");
+
+    exprcode_free(&code);
+    return NULL;
+}
+
+const char* test_exprcode_share_many(void) {
+    struct expr_code code = { NULL };
+    int offsets[1000];
+
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 0; i < 1000; ++i) {
+            int start = exprcode_symbol(&code, i);
+            exprcode_constant(&code, i * 4);
+            exprcode_operator(&code, op_subtract);
+            exprcode_end(&code);
+            int shared = exprcode_share(&code, start);
+            if (round == 0) {
+                ASSERT_TRUE(shared == start, "first use kept");
+                offsets[i] = shared;
+            } else {
+                ASSERT_TRUE(shared == offsets[i], "later use shared after table growth");
+            }
+        }
+    }
+    ASSERT_TRUE(code.entry_count == 1000, "one entry per distinct expression");
+
+    exprcode_free(&code);
+    return NULL;
+}
+
+const char* test_exprcode_known_folded(void) {
+    struct program_info info;
+    struct expr_code code = { NULL };
+    struct origin origin = { "test", 1, 1 };
+    ASSERT_TRUE(setup_program(&info), "set up program");
+    int name = symbol_intern(info.symbols, "name", 4);
+
+    int start = exprcode_symbol(&code, name);
+    exprcode_constant(&code, 3);
+    exprcode_operator(&code, op_multiply);
+    exprcode_end(&code);
+
+    int value = 0, unknown = -1;
+    ASSERT_TRUE(add_label(&info, name, 7), "name defined");
+    ASSERT_TRUE(exprcode_eval(&code, &info, start, &origin, &value, &unknown) == EVAL_KNOWN, "expression known");
+    ASSERT_TRUE(value == 21, "expression has correct value");
+    int offset = start;
+    ASSERT_TRUE(exprcode_next_symbol(&code, &offset) == -1, "known expression replaced by its value");
+    ASSERT_TRUE(exprcode_eval(&code, &info, start, &origin, &value, &unknown) == EVAL_KNOWN, "still known");
+    ASSERT_TRUE(value == 21, "value kept");
+
+    exprcode_free(&code);
+    cleanup_program(&info);
+    return NULL;
+}
@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "fixtures.h"
+
+/* Writes *text* to *filename*, replacing anything already there. */
+int write_file(const char *filename, const char *text) {
+    FILE *out = fopen(filename, "wb");
+    if (!out) return FALSE;
+    fputs(text, out);
+    fclose(out);
+    return TRUE;
+}
+
+/* Clears *info* and gives it an arena and a symbol table. */
+int setup_program(struct program_info *info) {
+    memset(info, 0, sizeof(struct program_info));
+    info->arena = arena_new();
+    info->symbols = symbol_table_new(info->arena);
+    return info->arena && info->symbols;
+}
+
+/* Frees what setup_program allocated, the label indexes and anything in
+ * the arena.
+ */
+void cleanup_program(struct program_info *info) {
+    labels_free(info);
+    symbol_table_free(info->symbols);
+    arena_free(info->arena);
+}
@@ -0,0 +1,12 @@
+#ifndef FIXTURES_H
+#define FIXTURES_H
+
+#include "../src/assemble.h"
+
+/* Set-up shared by the test suites that need files or a program_info. */
+
+int write_file(const char *filename, const char *text);
+int setup_program(struct program_info *info);
+void cleanup_program(struct program_info *info);
+
+#endif
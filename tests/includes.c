@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+#include "fixtures.h"
+
+#define MAIN_FILE       "test_includes_main.ga"
+#define FIRST_FILE      "test_includes_first.ga"
+#define SECOND_FILE     "test_includes_second.ga"
+#define NESTED_FILE     "test_includes_nested.ga"
+
+static void cleanup_includes(struct program_info *info);
+
+const char* test_includes_in_order(void);
+const char* test_includes_threads_agree(void);
+const char* test_includes_shared_symbols(void);
+const char* test_includes_missing_file(void);
+const char* test_includes_lexed_once(void);
+const char* test_includes_once(void);
+const char* test_includes_loop(void);
+
+
+const char *test_suite_name = "includes.c";
+struct test_def test_list[] = {
+    {   "includes_in_order",                        test_includes_in_order },
+    {   "includes_threads_agree",                   test_includes_threads_agree },
+    {   "includes_shared_symbols",                  test_includes_shared_symbols },
+    {   "includes_missing_file",                    test_includes_missing_file },
+    {   "includes_lexed_once",                      test_includes_lexed_once },
+    {   "includes_once",                            test_includes_once },
+    {   "includes_loop",                            test_includes_loop },
+
+    {   NULL,                                       NULL }
+};
+
+
+static void cleanup_includes(struct program_info *info) {
+    lex_close_sources(info);
+    cleanup_program(info);
+    remove(MAIN_FILE);
+    remove(FIRST_FILE);
+    remove(SECOND_FILE);
+    remove(NESTED_FILE);
+}
+
+const char* test_includes_in_order(void) {
+    struct program_info info;
+    ASSERT_TRUE(setup_program(&info), "set up program");
+    ASSERT_TRUE(write_file(MAIN_FILE, ".include \"" FIRST_FILE "\"\n"
+                                      "bad: .include 7\n"
+                                      "label: .include \"" SECOND_FILE "\"\n"), "wrote main file");
+    ASSERT_TRUE(write_file(FIRST_FILE, "first\n.include \"" NESTED_FILE "\"\n"), "wrote first file");
+    ASSERT_TRUE(write_file(SECOND_FILE, "second\n"), "wrote second file");
+    ASSERT_TRUE(write_file(NESTED_FILE, "nested\n"), "wrote nested file");
+
+    struct token_list *tokens = lex_file(MAIN_FILE, &info);
+    ASSERT_TRUE(tokens, "main file lexed");
+    struct include_set *set = lex_includes(tokens, &info);
+    ASSERT_TRUE(set, "includes lexed");
+
+    // files are handed out depth first, skipping the invalid directive
+    const char *expected[] = { "first", "nested", "second" };
+    for (int i = 0; i < 3; ++i) {
+        struct token_list *included = include_next(set, &tokens->tokens[0], &info);
+        ASSERT_TRUE(included, "included file lexed");
+        ASSERT_TRUE(strcmp(included->tokens[0].text, expected[i]) == 0, "included files in order");
+        free_token_list(included);
+    }
+
+    include_set_free(set, &info);
+    free_token_list(tokens);
+    cleanup_includes(&info);
+    return NULL;
+}
+
+const char* test_includes_threads_agree(void) {
+    int symbols[2][12];
+    for (int run = 0; run < 2; ++run) {
+        struct program_info info;
+        ASSERT_TRUE(setup_program(&info), "set up program");
+        info.thread_count = run == 0 ? 1 : 4;
+        ASSERT_TRUE(write_file(MAIN_FILE, ".include \"" FIRST_FILE "\"\n"
+                                          ".include \"" SECOND_FILE "\"\n"
+                                          ".include \"" FIRST_FILE "\"\n"), "wrote main file");
+        ASSERT_TRUE(write_file(FIRST_FILE, "one two\n.include \"" NESTED_FILE "\"\n"), "wrote first file");
+        ASSERT_TRUE(write_file(SECOND_FILE, "three one\n"), "wrote second file");
+        ASSERT_TRUE(write_file(NESTED_FILE, "four two\n"), "wrote nested file");
+
+        struct token_list *tokens = lex_file(MAIN_FILE, &info);
+        ASSERT_TRUE(tokens, "main file lexed");
+        struct include_set *set = lex_includes(tokens, &info);
+        ASSERT_TRUE(set, "includes lexed");
+        int count = 0;
+        for (int i = 0; i < 5; ++i) {
+            struct token_list *included = include_next(set, &tokens->tokens[0], &info);
+            ASSERT_TRUE(included, "included file lexed");
+            for (size_t j = 0; j < included->count; ++j) {
+                if (included->tokens[j].type == tt_identifier && count < 12) {
+                    symbols[run][count++] = included->tokens[j].i;
+                }
+            }
+            free_token_list(included);
+        }
+        ASSERT_TRUE(count == 10, "all identifiers found");
+
+        include_set_free(set, &info);
+        free_token_list(tokens);
+        cleanup_includes(&info);
+    }
+    ASSERT_TRUE(memcmp(symbols[0], symbols[1], sizeof(int) * 10) == 0,
+                "symbols numbered the same with any number of threads");
+    return NULL;
+}
+
+const char* test_includes_shared_symbols(void) {
+    struct program_info info;
+    ASSERT_TRUE(setup_program(&info), "set up program");
+    ASSERT_TRUE(write_file(MAIN_FILE, "shared\n.include \"" FIRST_FILE "\"\n"), "wrote main file");
+    ASSERT_TRUE(write_file(FIRST_FILE, "shared .define fresh\n"), "wrote first file");
+
+    struct token_list *tokens = lex_file(MAIN_FILE, &info);
+    ASSERT_TRUE(tokens, "main file lexed");
+    struct include_set *set = lex_includes(tokens, &info);
+    ASSERT_TRUE(set, "includes lexed");
+    struct token_list *included = include_next(set, &tokens->tokens[0], &info);
+    ASSERT_TRUE(included, "included file lexed");
+
+    ASSERT_TRUE(included->tokens[0].i == tokens->tokens[0].i, "name used in both files has one symbol");
+    ASSERT_TRUE(included->tokens[0].text == tokens->tokens[0].text, "name used in both files has one text");
+    ASSERT_TRUE(included->tokens[1].i == sym_define, "builtin symbol kept");
+    ASSERT_TRUE(symbol_lookup(info.symbols, "fresh", 5) == included->tokens[2].i, "new name added to program");
+
+    free_token_list(included);
+    include_set_free(set, &info);
+    free_token_list(tokens);
+    cleanup_includes(&info);
+    return NULL;
+}
+
+const char* test_includes_missing_file(void) {
+    struct program_info info;
+    ASSERT_TRUE(setup_program(&info), "set up program");
+    ASSERT_TRUE(write_file(MAIN_FILE, ".include \"test_includes_missing.ga\"\n"
+                                      ".include \"" SECOND_FILE "\"\n"), "wrote main file");
+    ASSERT_TRUE(write_file(SECOND_FILE, "second\n"), "wrote second file");
+    remove("test_includes_missing.ga");
+
+    struct token_list *tokens = lex_file(MAIN_FILE, &info);
+    ASSERT_TRUE(tokens, "main file lexed");
+    struct include_set *set = lex_includes(tokens, &info);
+    ASSERT_TRUE(set, "includes lexed");
+    ASSERT_TRUE(include_next(set, &tokens->tokens[0], &info) == NULL, "missing file fails");
+    struct token_list *included = include_next(set, &tokens->tokens[3], &info);
+    ASSERT_TRUE(included && strcmp(included->tokens[0].text, "second") == 0, "later file still found");
+
+    free_token_list(included);
+    include_set_free(set, &info);
+    free_token_list(tokens);
+    cleanup_includes(&info);
+    return NULL;
+}
+
+const char* test_includes_lexed_once(void) {
+    struct program_info info;
+    ASSERT_TRUE(setup_program(&info), "set up program");
+    ASSERT_TRUE(write_file(MAIN_FILE, ".include \"" FIRST_FILE "\"\n"
+                                      ".include \"./" FIRST_FILE "\"\n"), "wrote main file");
+    ASSERT_TRUE(write_file(FIRST_FILE, "\"text\"\n"), "wrote first file");
+
+    struct token_list *tokens = lex_file(MAIN_FILE, &info);
+    ASSERT_TRUE(tokens, "main file lexed");
+    struct include_set *set = lex_includes(tokens, &info);
+    ASSERT_TRUE(set, "includes lexed");
+    struct token_list *first = include_next(set, &tokens->tokens[0], &info);
+    struct token_list *second = include_next(set, &tokens->tokens[3], &info);
+    ASSERT_TRUE(first && second && first != second, "file handed out twice");
+    ASSERT_TRUE(first->count == second->count, "both copies have all tokens");
+    ASSERT_TRUE(first->tokens[0].text == second->tokens[0].text, "file was only lexed once");
+
+    free_token_list(first);
+    free_token_list(second);
+    include_set_free(set, &info);
+    free_token_list(tokens);
+    cleanup_includes(&info);
+    return NULL;
+}
+
+const char* test_includes_once(void) {
+    struct program_info info;
+    ASSERT_TRUE(setup_program(&info), "set up program");
+    ASSERT_TRUE(write_file(MAIN_FILE, ".include_once \"" FIRST_FILE "\"\n"
+                                      ".include_once \"" SECOND_FILE "\"\n"), "wrote main file");
+    ASSERT_TRUE(write_file(FIRST_FILE, "first\n.include_once \"" SECOND_FILE "\"\n"), "wrote first file");
+    ASSERT_TRUE(write_file(SECOND_FILE, "second\n.include_once \"" FIRST_FILE "\"\n"), "wrote second file");
+
+    struct token_list *tokens = lex_file(MAIN_FILE, &info);
+    ASSERT_TRUE(tokens, "main file lexed");
+    struct include_set *set = lex_includes(tokens, &info);
+    ASSERT_TRUE(set, "includes lexed");
+
+    // first, then second from within first; the rest are skipped
+    const char *expected[] = { "first", "second", NULL, NULL };
+    for (int i = 0; i < 4; ++i) {
+        struct token_list *included = include_next(set, &tokens->tokens[0], &info);
+        ASSERT_TRUE(included, "include handled");
+        if (expected[i]) {
+            ASSERT_TRUE(strcmp(included->tokens[0].text, expected[i]) == 0, "files included in order");
+        } else {
+            ASSERT_TRUE(included->count == 0, "file included only once");
+        }
+        free_token_list(included);
+    }
+
+    include_set_free(set, &info);
+    free_token_list(tokens);
+    cleanup_includes(&info);
+    return NULL;
+}
+
+const char* test_includes_loop(void) {
+    struct program_info info;
+    ASSERT_TRUE(setup_program(&info), "set up program");
+    ASSERT_TRUE(write_file(MAIN_FILE, ".include \"" FIRST_FILE "\"\n"), "wrote main file");
+    ASSERT_TRUE(write_file(FIRST_FILE, ".include \"" MAIN_FILE "\"\n"), "wrote first file");
+
+    struct token_list *tokens = lex_file(MAIN_FILE, &info);
+    ASSERT_TRUE(tokens, "main file lexed");
+    struct include_set *set = lex_includes(tokens, &info);
+    ASSERT_TRUE(set, "includes lexed");
+    struct token_list *included = include_next(set, &tokens->tokens[0], &info);
+    ASSERT_TRUE(included, "first file included");
+    ASSERT_TRUE(include_next(set, &included->tokens[0], &info) == NULL, "loop refused");
+
+    free_token_list(included);
+    include_set_free(set, &info);
+    free_token_list(tokens);
+    cleanup_includes(&info);
+    return NULL;
+}
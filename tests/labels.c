@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+#include "fixtures.h"
+
+const char* test_label_add_and_get(void);
+const char* test_label_duplicate(void);
+const char* test_label_many(void);
+const char* test_label_dump_order(void);
+const char* test_label_passes(void);
+
+
+const char *test_suite_name = "labels.c";
+struct test_def test_list[] = {
+    {   "label_add_and_get",                        test_label_add_and_get },
+    {   "label_duplicate",                          test_label_duplicate },
+    {   "label_many",                               test_label_many },
+    {   "label_dump_order",                         test_label_dump_order },
+    {   "label_passes",                             test_label_passes },
+
+    {   NULL,                                       NULL }
+};
+
+
+const char* test_label_add_and_get(void) {
+    struct program_info info;
+    ASSERT_TRUE(setup_program(&info), "set up program");
+    int symbol = symbol_intern(info.symbols, "start", 5);
+    int other = symbol_intern(info.symbols, "other", 5);
+
+    ASSERT_TRUE(get_label(&info, symbol) == NULL, "label not defined yet");
+    ASSERT_TRUE(add_label(&info, symbol, 42), "label added");
+    struct label_def *label = get_label(&info, symbol);
+    ASSERT_TRUE(label && label->pos == 42, "label found with value");
+    ASSERT_TRUE(strcmp(label->name, "start") == 0, "label has name");
+    ASSERT_TRUE(get_label(&info, other) == NULL, "other label not defined");
+    ASSERT_TRUE(get_label(&info, other + 100000) == NULL, "unknown symbol not defined");
+
+    cleanup_program(&info);
+    return NULL;
+}
+
+const char* test_label_duplicate(void) {
+    struct program_info info;
+    ASSERT_TRUE(setup_program(&info), "set up program");
+    int symbol = symbol_intern(info.symbols, "start", 5);
+
+    ASSERT_TRUE(add_label(&info, symbol, 1), "label added");
+    ASSERT_TRUE(!add_label(&info, symbol, 2), "duplicate refused");
+    ASSERT_TRUE(get_label(&info, symbol)->pos == 1, "original value kept");
+
+    cleanup_program(&info);
+    return NULL;
+}
+
+const char* test_label_many(void) {
+    struct program_info info;
+    ASSERT_TRUE(setup_program(&info), "set up program");
+    char name[32];
+    for (int i = 0; i < 5000; ++i) {
+        sprintf(name, "label_%d", i);
+        int symbol = symbol_intern(info.symbols, name, strlen(name));
+        ASSERT_TRUE(add_label(&info, symbol, i), "label added");
+    }
+    for (int i = 0; i < 5000; ++i) {
+        sprintf(name, "label_%d", i);
+        int symbol = symbol_lookup(info.symbols, name, strlen(name));
+        struct label_def *label = get_label(&info, symbol);
+        ASSERT_TRUE(label && label->pos == i, "label found after growth");
+    }
+
+    cleanup_program(&info);
+    return NULL;
+}
+
+const char* test_label_dump_order(void) {
+    struct program_info info;
+    ASSERT_TRUE(setup_program(&info), "set up program");
+    add_label(&info, symbol_intern(info.symbols, "first", 5), 1);
+    add_label(&info, symbol_intern(info.symbols, "second", 6), 2);
+    add_label(&info, sym_endmem, 3);
+
+    ASSERT_TRUE(info.first_label->pos == 3, "newest label listed first");
+    ASSERT_TRUE(info.first_label->next->pos == 2, "labels listed newest first");
+    ASSERT_TRUE(info.first_label->next->next->pos == 1, "oldest label listed last");
+    ASSERT_TRUE(info.first_label->next->next->next == NULL, "list ends");
+
+    cleanup_program(&info);
+    return NULL;
+}
+
+const char* test_label_passes(void) {
+    struct program_info info;
+    ASSERT_TRUE(setup_program(&info), "set up program");
+    int start = symbol_intern(info.symbols, "start", 5);
+    int other = symbol_intern(info.symbols, "other", 5);
+
+    ASSERT_TRUE(add_label(&info, start, 10), "label added in first pass");
+    ASSERT_TRUE(add_label(&info, other, 20), "other added in first pass");
+    ASSERT_TRUE(labels_moved(&info), "labels new in first pass have moved");
+
+    labels_begin_pass(&info);
+    ASSERT_TRUE(get_label(&info, start) == NULL, "new pass starts without labels");
+    struct label_def *previous = get_previous_label(&info, start);
+    ASSERT_TRUE(previous && previous->pos == 10, "label of previous pass kept");
+    ASSERT_TRUE(add_label(&info, start, 10), "label added again");
+    ASSERT_TRUE(add_label(&info, other, 24), "other added again");
+    ASSERT_TRUE(labels_moved(&info), "moved label noticed");
+
+    labels_begin_pass(&info);
+    ASSERT_TRUE(add_label(&info, start, 10), "label added in third pass");
+    ASSERT_TRUE(add_label(&info, other, 24), "other added in third pass");
+    ASSERT_TRUE(!labels_moved(&info), "labels settled");
+    ASSERT_TRUE(get_previous_label(&info, other + 100000) == NULL, "unknown symbol has no previous label");
+
+    cleanup_program(&info);
+    return NULL;
+}
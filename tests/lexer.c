@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+#include "../src/assemble.h"
+
+
+static struct token_list* lex_string(struct arena *arena, struct symbol_table *symbols,
+                                     const char *text);
+
+const char* test_lex_operators(void);
+const char* test_lex_single_char_operators(void);
+const char* test_lex_indirect(void);
+const char* test_lex_trailing_blanks(void);
+const char* test_lex_line_continuation(void);
+const char* test_lex_origins(void);
+const char* test_lex_numbers(void);
+const char* test_lex_symbols(void);
+const char* test_lex_string_slices(void);
+const char* test_lex_local_labels(void);
+const char* test_lex_parentheses(void);
+
+
+const char *test_suite_name = "lexer.c";
+struct test_def test_list[] = {
+    {   "lex_operators",                            test_lex_operators },
+    {   "lex_single_char_operators",                test_lex_single_char_operators },
+    {   "lex_indirect",                             test_lex_indirect },
+    {   "lex_trailing_blanks",                      test_lex_trailing_blanks },
+    {   "lex_line_continuation",                    test_lex_line_continuation },
+    {   "lex_origins",                              test_lex_origins },
+    {   "lex_numbers",                              test_lex_numbers },
+    {   "lex_symbols",                              test_lex_symbols },
+    {   "lex_string_slices",                        test_lex_string_slices },
+    {   "lex_local_labels",                         test_lex_local_labels },
+    {   "lex_parentheses",                          test_lex_parentheses },
+
+    {   NULL,                                       NULL }
+};
+
+
+static struct token_list* lex_string(struct arena *arena, struct symbol_table *symbols,
+                                     const char *text) {
+    struct lexer_state state = { { "test", 1, 1 } };
+    state.text = text;
+    state.text_length = strlen(text);
+    state.arena = arena;
+    state.symbols = symbols;
+    return lex_core(&state);
+}
+
+const char* test_lex_operators(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct token_list *list = lex_string(arena, symbols, "+ - * / << >> && | ^");
+    ASSERT_TRUE(list, "source was lexed");
+    ASSERT_TRUE(list->count == 10, "correct number of tokens");
+
+    enum operator_type expected[] = {
+        op_add, op_subtract, op_multiply, op_divide, op_shift_left,
+        op_shift_right, op_bit_and, op_bit_or, op_bit_xor
+    };
+    for (int i = 0; i < 9; ++i) {
+        ASSERT_TRUE(list->tokens[i].type == tt_operator, "token is operator");
+        ASSERT_TRUE(list->tokens[i].i == (int)expected[i], "operator is correct");
+    }
+    ASSERT_TRUE(list->tokens[9].type == tt_eol, "list ends with eol");
+
+    free_token_list(list);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_lex_single_char_operators(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct token_list *list = lex_string(arena, symbols, "1|2^3");
+    ASSERT_TRUE(list, "source was lexed");
+    ASSERT_TRUE(list->count == 6, "operators take one character");
+    ASSERT_TRUE(list->tokens[0].i == 1, "first value correct");
+    ASSERT_TRUE(list->tokens[1].i == op_bit_or, "first operator correct");
+    ASSERT_TRUE(list->tokens[2].i == 2, "second value correct");
+    ASSERT_TRUE(list->tokens[3].i == op_bit_xor, "second operator correct");
+    ASSERT_TRUE(list->tokens[4].i == 3, "third value correct");
+
+    free_token_list(list);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_lex_indirect(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct token_list *list = lex_string(arena, symbols, "&label");
+    ASSERT_TRUE(list, "source was lexed");
+    ASSERT_TRUE(list->count == 3, "correct number of tokens");
+    ASSERT_TRUE(list->tokens[0].type == tt_indirect, "indirect marker found");
+    ASSERT_TRUE(list->tokens[1].type == tt_identifier, "identifier follows");
+    ASSERT_TRUE(strcmp(list->tokens[1].text, "label") == 0, "identifier text correct");
+
+    free_token_list(list);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_lex_trailing_blanks(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct token_list *list = lex_string(arena, symbols, "nop  \t \n  nop ; comment\nnop");
+    ASSERT_TRUE(list, "source was lexed");
+    ASSERT_TRUE(list->count == 6, "correct number of tokens");
+    ASSERT_TRUE(list->tokens[0].type == tt_identifier, "first line instruction");
+    ASSERT_TRUE(list->tokens[1].type == tt_eol, "trailing blanks keep end of line");
+    ASSERT_TRUE(list->tokens[2].type == tt_identifier, "second line instruction");
+    ASSERT_TRUE(list->tokens[3].type == tt_eol, "comment keeps end of line");
+    ASSERT_TRUE(list->tokens[4].type == tt_identifier, "third line instruction");
+
+    free_token_list(list);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_lex_line_continuation(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct token_list *list = lex_string(arena, symbols, "copy 1 \\\n  sp\n");
+    ASSERT_TRUE(list, "source was lexed");
+    ASSERT_TRUE(list->count == 5, "correct number of tokens");
+    ASSERT_TRUE(list->tokens[2].type == tt_identifier, "continued line joined");
+    ASSERT_TRUE(list->tokens[2].origin.line == 2, "continued line has correct line number");
+
+    free_token_list(list);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_lex_origins(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct token_list *list = lex_string(arena, symbols, "\n  first \"a\nb\"  second\n\tthird");
+    ASSERT_TRUE(list, "source was lexed");
+    ASSERT_TRUE(list->count == 7, "correct number of tokens");
+    ASSERT_TRUE(list->tokens[1].origin.line == 2, "first line correct");
+    ASSERT_TRUE(list->tokens[1].origin.column == 3, "first column correct");
+    ASSERT_TRUE(list->tokens[2].type == tt_string, "string found");
+    ASSERT_TRUE(list->tokens[2].origin.column == 9, "string column correct");
+    ASSERT_TRUE(list->tokens[3].origin.line == 3, "line after string correct");
+    ASSERT_TRUE(list->tokens[3].origin.column == 5, "column after string correct");
+    ASSERT_TRUE(list->tokens[5].origin.line == 4, "last line correct");
+    ASSERT_TRUE(list->tokens[5].origin.column == 2, "last column correct");
+
+    free_token_list(list);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_lex_numbers(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct token_list *list = lex_string(arena, symbols, "42 $1F 1.5 'A'");
+    ASSERT_TRUE(list, "source was lexed");
+    ASSERT_TRUE(list->count == 5, "correct number of tokens");
+    ASSERT_TRUE(list->tokens[0].type == tt_integer && list->tokens[0].i == 42, "decimal integer");
+    ASSERT_TRUE(list->tokens[1].type == tt_integer && list->tokens[1].i == 0x1F, "hex integer");
+    ASSERT_TRUE(list->tokens[2].type == tt_integer && list->tokens[2].i == 0x3fc00000, "float");
+    ASSERT_TRUE(list->tokens[3].type == tt_integer && list->tokens[3].i == 'A', "character literal");
+
+    free_token_list(list);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_lex_symbols(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct token_list *list = lex_string(arena, symbols, "nop .define name name");
+    ASSERT_TRUE(list, "source was lexed");
+    ASSERT_TRUE(list->count == 5, "correct number of tokens");
+    ASSERT_TRUE(list->tokens[0].i == sym_first_mnemonic, "mnemonic has fixed symbol");
+    ASSERT_TRUE(list->tokens[1].i == sym_define, "directive has fixed symbol");
+    ASSERT_TRUE(list->tokens[2].i >= symbols->mnemonic_end, "new name has new symbol");
+    ASSERT_TRUE(list->tokens[2].i == list->tokens[3].i, "same name has same symbol");
+
+    free_token_list(list);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_lex_string_slices(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    const char *source = ".string \"plain\" \"esc\\\"aped\" \"two\n  lines\"";
+    struct token_list *list = lex_string(arena, symbols, source);
+    ASSERT_TRUE(list, "source was lexed");
+    ASSERT_TRUE(list->count == 5, "correct number of tokens");
+
+    ASSERT_TRUE(list->tokens[1].text == source + 9, "plain string refers to source");
+    ASSERT_TRUE(list->tokens[1].i == 5, "plain string has correct length");
+    ASSERT_TRUE(list->tokens[2].text < source || list->tokens[2].text > source + strlen(source),
+                "escaped string is a copy");
+    ASSERT_TRUE(list->tokens[2].i == 8 && memcmp(list->tokens[2].text, "esc\"aped", 8) == 0,
+                "escaped string is decoded");
+    ASSERT_TRUE(list->tokens[3].i == 9 && memcmp(list->tokens[3].text, "two lines", 9) == 0,
+                "line break in string is decoded");
+    ASSERT_TRUE(list->tokens[0].text == symbol_name(symbols, sym_string), "directive text is symbol name");
+
+    free_token_list(list);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_lex_local_labels(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct token_list *list = lex_string(arena, symbols, "@loop: jump @loop");
+    ASSERT_TRUE(list, "source was lexed");
+    ASSERT_TRUE(list->count == 5, "correct number of tokens");
+    ASSERT_TRUE(list->tokens[0].type == tt_identifier, "local label is identifier");
+    ASSERT_TRUE(strcmp(list->tokens[0].text, "@loop") == 0, "prefix is part of name");
+    ASSERT_TRUE(list->tokens[1].type == tt_colon, "colon follows label");
+    ASSERT_TRUE(list->tokens[3].i == list->tokens[0].i, "uses share a symbol");
+
+    free_token_list(list);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_lex_parentheses(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct token_list *list = lex_string(arena, symbols, "-(a+1)*2");
+    ASSERT_TRUE(list, "source was lexed");
+    ASSERT_TRUE(list->count == 9, "correct number of tokens");
+    ASSERT_TRUE(list->tokens[1].type == tt_open_paren, "opening parenthesis found");
+    ASSERT_TRUE(list->tokens[5].type == tt_close_paren, "closing parenthesis found");
+    ASSERT_TRUE(list->tokens[6].type == tt_operator && list->tokens[6].i == op_multiply,
+                "operator after parenthesis found");
+
+    free_token_list(list);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
@@ -27,126 +27,103 @@ struct test_def test_list[] = {
 };
 
 const char* test_remove_line_middle(void) {
-    struct token_list *list = init_token_list();
+    struct arena *arena = arena_new();
+    struct token_list *list = init_token_list(arena);
 
-    struct token *t1 = new_rawint_token(1, NULL);
-    add_token(list, t1);
+    new_rawint_token(list, 1, NULL);
+    new_rawint_token(list, 2, NULL);
+    new_rawint_token(list, 3, NULL);
+    new_token(list, tt_eol, NULL, NULL);
+    new_rawint_token(list, 4, NULL);
 
-    struct token *t2 = new_rawint_token(2, NULL);
-    add_token(list, t2);
+    struct token *next = remove_line(list, &list->tokens[1]);
 
-    struct token *t3 = new_rawint_token(3, NULL);
-    add_token(list, t3);
-
-    struct token *t4 = new_token(tt_eol, NULL, NULL);
-    add_token(list, t4);
-
-    struct token *t5 = new_rawint_token(4, NULL);
-    add_token(list, t5);
-
-    remove_line(list, t2);
-
-    ASSERT_TRUE(list->first == t1, "first token is unchanged");
-    ASSERT_TRUE(list->last == t5, "last token is unchanged");
-    ASSERT_TRUE(list->first->next == t5, "next token after first is last token");
-    ASSERT_TRUE(list->last->prev == t1, "prev token before last is first token");
+    ASSERT_TRUE(list->count == 2, "line was removed");
+    ASSERT_TRUE(list->tokens[0].i == 1, "first token is unchanged");
+    ASSERT_TRUE(list->tokens[1].i == 4, "last token follows first token");
+    ASSERT_TRUE(list->tokens[2].type == tt_eof, "end marker follows last token");
+    ASSERT_TRUE(next == &list->tokens[1], "returns token after removed line");
 
     free_token_list(list);
+    arena_free(arena);
     return NULL;
 }
 
 const char* test_remove_line_start(void) {
-    struct token_list *list = init_token_list();
-
-    struct token *t1 = new_rawint_token(1, NULL);
-    add_token(list, t1);
-
-    struct token *t2 = new_rawint_token(2, NULL);
-    add_token(list, t2);
-
-    struct token *t3 = new_token(tt_eol, NULL, NULL);
-    add_token(list, t3);
-
-    struct token *t4 = new_rawint_token(3, NULL);
-    add_token(list, t4);
+    struct arena *arena = arena_new();
+    struct token_list *list = init_token_list(arena);
 
-    struct token *t5 = new_rawint_token(4, NULL);
-    add_token(list, t5);
+    new_rawint_token(list, 1, NULL);
+    new_rawint_token(list, 2, NULL);
+    new_rawint_token(list, 3, NULL);
+    new_token(list, tt_eol, NULL, NULL);
+    new_rawint_token(list, 4, NULL);
 
-    remove_line(list, t1);
+    struct token *next = remove_line(list, &list->tokens[0]);
 
-    ASSERT_TRUE(list->first == t4, "first token is moved forward");
-    ASSERT_TRUE(list->last == t5, "last token is unchanged");
-    ASSERT_TRUE(list->first->prev == NULL, "not token before first token");
+    ASSERT_TRUE(list->count == 1, "line was removed");
+    ASSERT_TRUE(list->tokens[0].i == 4, "first token is moved forward");
+    ASSERT_TRUE(list->tokens[1].type == tt_eof, "end marker follows last token");
+    ASSERT_TRUE(next == &list->tokens[0], "returns token after removed line");
 
     free_token_list(list);
+    arena_free(arena);
     return NULL;
 }
 
 const char* test_remove_line_end_noeol(void) {
-    struct token_list *list = init_token_list();
+    struct arena *arena = arena_new();
+    struct token_list *list = init_token_list(arena);
 
-    struct token *t1 = new_rawint_token(1, NULL);
-    add_token(list, t1);
+    new_rawint_token(list, 1, NULL);
+    new_rawint_token(list, 2, NULL);
+    new_rawint_token(list, 3, NULL);
 
-    struct token *t2 = new_rawint_token(2, NULL);
-    add_token(list, t2);
+    struct token *next = remove_line(list, &list->tokens[1]);
 
-    struct token *t3 = new_rawint_token(3, NULL);
-    add_token(list, t3);
-
-    remove_line(list, t2);
-
-    ASSERT_TRUE(list->first == t1, "first token is unchanged");
-    ASSERT_TRUE(list->last == t1, "last token is first token");
-    ASSERT_TRUE(list->first->next == NULL, "no token after first token");
+    ASSERT_TRUE(list->count == 1, "line was removed");
+    ASSERT_TRUE(list->tokens[0].i == 1, "first token is unchanged");
+    ASSERT_TRUE(next->type == tt_eof, "no token after first token");
 
     free_token_list(list);
+    arena_free(arena);
     return NULL;
 }
 
 const char* test_remove_line_end_w_eol(void) {
-    struct token_list *list = init_token_list();
-
-    struct token *t1 = new_rawint_token(1, NULL);
-    add_token(list, t1);
-
-    struct token *t2 = new_rawint_token(2, NULL);
-    add_token(list, t2);
+    struct arena *arena = arena_new();
+    struct token_list *list = init_token_list(arena);
 
-    struct token *t3 = new_rawint_token(3, NULL);
-    add_token(list, t3);
+    new_rawint_token(list, 1, NULL);
+    new_rawint_token(list, 2, NULL);
+    new_rawint_token(list, 3, NULL);
+    new_token(list, tt_eol, NULL, NULL);
 
-    struct token *t4 = new_token(tt_eol, NULL, NULL);
-    add_token(list, t4);
+    struct token *next = remove_line(list, &list->tokens[1]);
 
-    remove_line(list, t2);
-
-    ASSERT_TRUE(list->first == t1, "first token is unchanged");
-    ASSERT_TRUE(list->last == t1, "last token is first token");
-    ASSERT_TRUE(list->first->next == NULL, "no token after first token");
+    ASSERT_TRUE(list->count == 1, "line was removed");
+    ASSERT_TRUE(list->tokens[0].i == 1, "first token is unchanged");
+    ASSERT_TRUE(next->type == tt_eof, "no token after first token");
 
     free_token_list(list);
+    arena_free(arena);
     return NULL;
 }
 
 const char* test_remove_line_all_tokens(void) {
-    struct token_list *list = init_token_list();
-
-    struct token *t1 = new_rawint_token(1, NULL);
-    add_token(list, t1);
-
-    struct token *t2 = new_rawint_token(2, NULL);
-    add_token(list, t2);
+    struct arena *arena = arena_new();
+    struct token_list *list = init_token_list(arena);
 
-    struct token *t3 = new_rawint_token(3, NULL);
-    add_token(list, t3);
+    new_rawint_token(list, 1, NULL);
+    new_rawint_token(list, 2, NULL);
+    new_rawint_token(list, 3, NULL);
 
-    remove_line(list, t1);
+    struct token *next = remove_line(list, &list->tokens[0]);
 
-    ASSERT_TRUE(list->first == NULL, "no first token");
-    ASSERT_TRUE(list->last == NULL, "no last token");
+    ASSERT_TRUE(list->count == 0, "no tokens remain");
+    ASSERT_TRUE(next->type == tt_eof, "only end marker remains");
 
     free_token_list(list);
+    arena_free(arena);
     return NULL;
 }
@@ -0,0 +1,385 @@
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200809L
+#define HAVE_DUP 1
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_DUP
+#include <unistd.h>
+#endif
+
+#include "test.h"
+#include "fixtures.h"
+
+#define MAIN_FILE       "test_parse_main.ga"
+#define OUTPUT_FILE     "test_parse_main.ulx"
+#define ERRORS_FILE     "test_parse_main_errors.txt"
+
+static int assemble(const char *text, int streamed);
+static int assemble_text(const char *text, int streamed, unsigned char *image, size_t size);
+static int assemble_errors(const char *text, int streamed, char *errors, size_t size);
+static int first_instruction(const unsigned char *image);
+
+const char* test_parse_branch_to_self(void);
+const char* test_parse_branch_to_next(void);
+const char* test_parse_branch_to_next_estimated(void);
+const char* test_parse_fold_overflow(void);
+const char* test_parse_define_forward_chain(void);
+const char* test_parse_define_resolved_before_use(void);
+const char* test_parse_define_cycle(void);
+const char* test_parse_local_label_reused(void);
+const char* test_parse_local_label_other_function(void);
+const char* test_parse_local_label_duplicate(void);
+const char* test_parse_local_label_not_shared(void);
+const char* test_parse_unknown_identifiers(void);
+const char* test_parse_unknown_directive(void);
+
+
+const char *test_suite_name = "parse_main.c";
+struct test_def test_list[] = {
+    {   "parse_branch_to_self",                     test_parse_branch_to_self },
+    {   "parse_branch_to_next",                     test_parse_branch_to_next },
+    {   "parse_branch_to_next_estimated",           test_parse_branch_to_next_estimated },
+    {   "parse_fold_overflow",                      test_parse_fold_overflow },
+    {   "parse_define_forward_chain",               test_parse_define_forward_chain },
+    {   "parse_define_resolved_before_use",         test_parse_define_resolved_before_use },
+    {   "parse_define_cycle",                       test_parse_define_cycle },
+    {   "parse_local_label_reused",                 test_parse_local_label_reused },
+    {   "parse_local_label_other_function",         test_parse_local_label_other_function },
+    {   "parse_local_label_duplicate",              test_parse_local_label_duplicate },
+    {   "parse_local_label_not_shared",             test_parse_local_label_not_shared },
+    {   "parse_unknown_identifiers",                test_parse_unknown_identifiers },
+    {   "parse_unknown_directive",                  test_parse_unknown_directive },
+
+    {   NULL,                                       NULL }
+};
+
+
+/* Assembles *text* as a whole program, either read into memory first or
+ * streamed a line at a time, as assemble.c does. Returns TRUE if the output
+ * file was written.
+ */
+static int assemble(const char *text, int streamed) {
+    struct program_info info;
+    int result = FALSE;
+    if (!write_file(MAIN_FILE, text) || !setup_program(&info)) return FALSE;
+    info.output_file = OUTPUT_FILE;
+    info.start_label = "start";
+    info.stack_size = 2048;
+
+    if (streamed) {
+        if (stream_preprocess(MAIN_FILE, &info)) {
+            string_build_tree(&info.strings);
+            result = stream_parse(MAIN_FILE, &info, NULL);
+        }
+    } else {
+        struct token_list *tokens = lex_file(MAIN_FILE, &info);
+        if (tokens && parse_preprocess(tokens, &info)) {
+            string_build_tree(&info.strings);
+            result = parse_tokens(tokens, &info);
+        }
+        free_token_list(tokens);
+    }
+
+    free_string_table(&info.strings);
+    lex_close_sources(&info);
+    cleanup_program(&info);
+    remove(MAIN_FILE);
+    return result;
+}
+
+/* As assemble, then reads the start of the output into *image*. */
+static int assemble_text(const char *text, int streamed, unsigned char *image, size_t size) {
+    int result = assemble(text, streamed);
+    if (result) {
+        FILE *in = fopen(OUTPUT_FILE, "rb");
+        result = in && fread(image, 1, size, in) == size;
+        if (in) fclose(in);
+    }
+    remove(OUTPUT_FILE);
+    return result;
+}
+
+/* As assemble, but with the errors reported read into *errors* rather than
+ * printed. Returns FALSE if the program assembled or the errors could not
+ * be read.
+ */
+static int assemble_errors(const char *text, int streamed, char *errors, size_t size) {
+#ifdef HAVE_DUP
+    fflush(stderr);
+    int saved = dup(fileno(stderr));
+    if (saved < 0 || !freopen(ERRORS_FILE, "w", stderr)) return FALSE;
+    int result = assemble(text, streamed);
+    fflush(stderr);
+    dup2(saved, fileno(stderr));
+    close(saved);
+    remove(OUTPUT_FILE);
+
+    FILE *in = fopen(ERRORS_FILE, "rb");
+    if (!in) return FALSE;
+    size_t length = fread(errors, 1, size - 1, in);
+    errors[length] = 0;
+    fclose(in);
+    remove(ERRORS_FILE);
+    return !result;
+#else
+    return FALSE;
+#endif
+}
+
+/* Returns the position of the first instruction of the start function,
+ * which has no locals.
+ */
+static int first_instruction(const unsigned char *image) {
+    int start = (image[24] << 24) | (image[25] << 16) | (image[26] << 8) | image[27];
+    return start + 3;
+}
+
+const char* test_parse_branch_to_self(void) {
+    unsigned char image[256];
+    for (int streamed = 0; streamed < 2; ++streamed) {
+        ASSERT_TRUE(assemble_text("start: .function\n"
+                                  "spin: jump spin\n"
+                                  ".end_header\n", streamed, image, sizeof(image)), "assembled program");
+
+        // offsets of 0 and 1 would return instead of branching
+        const unsigned char *jump = &image[first_instruction(image)];
+        ASSERT_TRUE(jump[0] == 0x20, "jump opcode");
+        ASSERT_TRUE(jump[1] == 0x01, "offset takes one byte");
+        ASSERT_TRUE(jump[2] == 0xFF, "offset leads back to the jump");
+    }
+    return NULL;
+}
+
+const char* test_parse_branch_to_next(void) {
+    unsigned char image[256];
+    for (int streamed = 0; streamed < 2; ++streamed) {
+        ASSERT_TRUE(assemble_text("start: .function\n"
+                                  "back: jz 0, back2\n"
+                                  "back2: jump next\n"
+                                  "next: return 0\n"
+                                  ".end_header\n", streamed, image, sizeof(image)), "assembled program");
+
+        const unsigned char *jz = &image[first_instruction(image)];
+        ASSERT_TRUE(jz[0] == 0x22, "jz opcode");
+        ASSERT_TRUE(jz[1] == 0x10, "offset takes one byte");
+        ASSERT_TRUE(jz[2] == 0x02, "offset leads to the next instruction");
+        const unsigned char *jump = &image[first_instruction(image) + 3];
+        ASSERT_TRUE(jump[0] == 0x20, "jump opcode");
+        ASSERT_TRUE(jump[1] == 0x01, "offset takes one byte");
+        ASSERT_TRUE(jump[2] == 0x02, "offset leads to the next instruction");
+        ASSERT_TRUE(jump[3] == 0x31, "return follows");
+    }
+    return NULL;
+}
+
+const char* test_parse_branch_to_next_estimated(void) {
+    unsigned char image[256];
+    for (int streamed = 0; streamed < 2; ++streamed) {
+        // the copy grows once far is known, so the estimate for next made
+        // in the first pass is a byte short in the second
+        ASSERT_TRUE(assemble_text("start: .function\n"
+                                  "copy far, 0\n"
+                                  "jump next\n"
+                                  "next: return 0\n"
+                                  ".zero 300\n"
+                                  "far:\n"
+                                  ".end_header\n", streamed, image, sizeof(image)), "assembled program");
+
+        const unsigned char *jump = &image[first_instruction(image) + 4];
+        ASSERT_TRUE(jump[0] == 0x20, "jump opcode");
+        ASSERT_TRUE(jump[1] == 0x01, "offset takes one byte");
+        ASSERT_TRUE(jump[2] == 0x02, "offset leads to the next instruction");
+    }
+    return NULL;
+}
+
+const char* test_parse_fold_overflow(void) {
+    char errors[1024];
+    for (int streamed = 0; streamed < 2; ++streamed) {
+        ASSERT_TRUE(assemble_errors("start: .function\n"
+                                    "return $80000000 / -1\n"
+                                    "return 5 << 33\n"
+                                    "return 1 >> -1\n"
+                                    "return 8 / 0\n"
+                                    ".end_header\n", streamed, errors, sizeof(errors)), "program refused");
+        ASSERT_TRUE(strcmp(errors, MAIN_FILE ":2:18 division overflow\n"
+                                   MAIN_FILE ":3:10 shift count out of range\n"
+                                   MAIN_FILE ":4:10 shift count out of range\n"
+                                   MAIN_FILE ":5:10 division by zero\n") == 0, "each error reported");
+
+        unsigned char image[256];
+        ASSERT_TRUE(assemble_text("start: .function\n"
+                                  "return -$80000000\n"
+                                  ".end_header\n", streamed, image, sizeof(image)), "negation assembled");
+        const unsigned char *ret = &image[first_instruction(image)];
+        ASSERT_TRUE(ret[0] == 0x31 && ret[1] == 0x03, "value takes four bytes");
+        ASSERT_TRUE(ret[2] == 0x80 && ret[3] == 0 && ret[4] == 0 && ret[5] == 0, "negation wraps");
+    }
+    return NULL;
+}
+
+const char* test_parse_define_forward_chain(void) {
+    unsigned char image[256];
+    for (int streamed = 0; streamed < 2; ++streamed) {
+        // each constant depends on one defined after it
+        ASSERT_TRUE(assemble_text("start: .function\n"
+                                  "return C\n"
+                                  ".define C B + 1\n"
+                                  ".define B A * 2\n"
+                                  ".define A end - start\n"
+                                  "end:\n"
+                                  ".end_header\n", streamed, image, sizeof(image)), "assembled program");
+
+        // end is six bytes after start: the function header and the return
+        const unsigned char *ret = &image[first_instruction(image)];
+        ASSERT_TRUE(ret[0] == 0x31 && ret[1] == 0x01, "return of a one byte constant");
+        ASSERT_TRUE(ret[2] == 13, "chain of constants resolved");
+    }
+    return NULL;
+}
+
+const char* test_parse_define_resolved_before_use(void) {
+    unsigned char image[256];
+    for (int streamed = 0; streamed < 2; ++streamed) {
+        ASSERT_TRUE(assemble_text("start: .function\n"
+                                  ".define B A + 1\n"
+                                  ".define A 3\n"
+                                  "return B\n"
+                                  "return B + 200\n"
+                                  ".end_header\n", streamed, image, sizeof(image)), "assembled program");
+
+        const unsigned char *ret = &image[first_instruction(image)];
+        ASSERT_TRUE(ret[0] == 0x31 && ret[1] == 0x01 && ret[2] == 4, "one byte constant");
+        ASSERT_TRUE(ret[3] == 0x31 && ret[4] == 0x02, "two byte constant");
+        ASSERT_TRUE(ret[5] == 0 && ret[6] == 204, "constant has its value");
+    }
+    return NULL;
+}
+
+const char* test_parse_define_cycle(void) {
+    char errors[1024];
+    for (int streamed = 0; streamed < 2; ++streamed) {
+        ASSERT_TRUE(assemble_errors("start: .function\n"
+                                    "return 0\n"
+                                    ".define A B\n"
+                                    ".define B C\n"
+                                    ".define C A\n"
+                                    ".end_header\n", streamed, errors, sizeof(errors)), "program refused");
+        ASSERT_TRUE(strstr(errors, "constant ~C~ depends on itself (C -> A -> B -> C)\n") != NULL,
+                    "cycle reported in order");
+        ASSERT_TRUE(strstr(errors, "unknown identifier") == NULL, "names of the cycle not unknown");
+    }
+    return NULL;
+}
+
+const char* test_parse_local_label_reused(void) {
+    unsigned char image[256];
+    for (int streamed = 0; streamed < 2; ++streamed) {
+        ASSERT_TRUE(assemble_text("start: .function\n"
+                                  "jump @done\n"
+                                  "return 5\n"
+                                  "@done: return 1\n"
+                                  "other: .function\n"
+                                  "jump @done\n"
+                                  "@done: return 2\n"
+                                  ".end_header\n", streamed, image, sizeof(image)), "assembled program");
+
+        const unsigned char *first = &image[first_instruction(image)];
+        ASSERT_TRUE(first[0] == 0x20 && first[1] == 0x01, "first jump");
+        ASSERT_TRUE(first[2] == 5, "first jump skips the return");
+        ASSERT_TRUE(first[6] == 0x31 && first[8] == 1, "first @done");
+        const unsigned char *second = &first[12];
+        ASSERT_TRUE(second[0] == 0x20 && second[1] == 0x01, "second jump");
+        ASSERT_TRUE(second[2] == 2, "second jump to its own @done");
+        ASSERT_TRUE(second[3] == 0x31 && second[5] == 2, "second @done");
+    }
+    return NULL;
+}
+
+const char* test_parse_local_label_other_function(void) {
+    char errors[1024];
+    for (int streamed = 0; streamed < 2; ++streamed) {
+        ASSERT_TRUE(assemble_errors("start: .function\n"
+                                    "@a: return 0\n"
+                                    "other: .function\n"
+                                    "jump @a\n"
+                                    ".end_header\n", streamed, errors, sizeof(errors)), "program refused");
+        ASSERT_TRUE(strcmp(errors, MAIN_FILE ":4:6 unknown identifier ~@a~\n") == 0,
+                    "other function's label unknown");
+    }
+    return NULL;
+}
+
+const char* test_parse_local_label_duplicate(void) {
+    char errors[1024];
+    for (int streamed = 0; streamed < 2; ++streamed) {
+        ASSERT_TRUE(assemble_errors("start: .function\n"
+                                    "@a: nop\n"
+                                    "@a: return 0\n"
+                                    ".end_header\n", streamed, errors, sizeof(errors)), "program refused");
+        ASSERT_TRUE(strcmp(errors, MAIN_FILE ":3:1 could not create local label (already exists?)\n") == 0,
+                    "duplicate reported");
+    }
+    return NULL;
+}
+
+const char* test_parse_local_label_not_shared(void) {
+    unsigned char image[256];
+    for (int streamed = 0; streamed < 2; ++streamed) {
+        // the same expression, naming a different label in each function
+        // and used twice in the first
+        ASSERT_TRUE(assemble_text("start: .function\n"
+                                  "copy @x + 1, 0\n"
+                                  "copy @x + 1, 0\n"
+                                  "nop\n"
+                                  "@x: return 0\n"
+                                  "other: .function\n"
+                                  "copy @x + 1, 0\n"
+                                  "@x: return 0\n"
+                                  ".end_header\n", streamed, image, sizeof(image)), "assembled program");
+
+        int first = first_instruction(image);
+        ASSERT_TRUE(image[first] == 0x40 && image[first + 1] == 0x01, "first copy");
+        ASSERT_TRUE(image[first + 2] == first + 8, "first copy uses its own label");
+        ASSERT_TRUE(image[first + 3] == 0x40 && image[first + 4] == 0x01, "repeated copy");
+        ASSERT_TRUE(image[first + 5] == first + 8, "repeated copy uses the same label");
+        int second = first + 12;
+        ASSERT_TRUE(image[second] == 0x40 && image[second + 1] == 0x01, "second copy");
+        ASSERT_TRUE(image[second + 2] == second + 4, "second copy uses its own label");
+    }
+    return NULL;
+}
+
+const char* test_parse_unknown_identifiers(void) {
+    char errors[1024];
+    for (int streamed = 0; streamed < 2; ++streamed) {
+        ASSERT_TRUE(assemble_errors("start: .function a b\n"
+                                    "copy zed, a\n"
+                                    "copy zed, b\n"
+                                    "copy alpha, 0\n"
+                                    "other: .function\n"
+                                    "copy a, 0\n"
+                                    ".end_header\n", streamed, errors, sizeof(errors)), "program refused");
+        ASSERT_TRUE(strcmp(errors, MAIN_FILE ":6:6 unknown identifier ~a~\n"
+                                   MAIN_FILE ":4:6 unknown identifier ~alpha~\n"
+                                   MAIN_FILE ":2:6 unknown identifier ~zed~ (used 2 times)\n") == 0,
+                    "sorted and counted report");
+    }
+    return NULL;
+}
+
+const char* test_parse_unknown_directive(void) {
+    char errors[1024];
+    for (int streamed = 0; streamed < 2; ++streamed) {
+        ASSERT_TRUE(assemble_errors("start: .function\n"
+                                    "return 0\n"
+                                    ".bogus 1\n"
+                                    ".end_header\n", streamed, errors, sizeof(errors)), "program refused");
+        ASSERT_TRUE(strcmp(errors, MAIN_FILE ":3:1 unknown directive .bogus\n") == 0,
+                    "unknown directive reported");
+    }
+    return NULL;
+}
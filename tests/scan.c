@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/scan.h"
+#include "test.h"
+
+
+const char* test_scan_blanks_short(void) {
+    const char *text = " \t x";
+    ASSERT_TRUE(scan_blanks(text, 0, strlen(text)) == 3, "stops at first non-blank");
+    ASSERT_TRUE(scan_blanks(text, 3, strlen(text)) == 3, "no blanks gives start position");
+    return NULL;
+}
+
+const char* test_scan_blanks_long(void) {
+    char text[200];
+    memset(text, ' ', sizeof(text));
+    text[150] = '\t';
+    text[170] = 'x';
+    ASSERT_TRUE(scan_blanks(text, 0, sizeof(text)) == 170, "skips blanks across many chunks");
+    ASSERT_TRUE(scan_blanks(text, 171, sizeof(text)) == sizeof(text), "stops at end of text");
+    return NULL;
+}
+
+const char* test_scan_blanks_newline(void) {
+    const char *text = "                         \n   ";
+    ASSERT_TRUE(scan_blanks(text, 0, strlen(text)) == 25, "stops at newline");
+    text = "                         \r\n   ";
+    ASSERT_TRUE(scan_blanks(text, 0, strlen(text)) == 25, "stops at carriage return");
+    return NULL;
+}
+
+const char* test_scan_identifier(void) {
+    const char *text = "abc_XYZ_0123456789_abcdefghijklmnopqrstuvwxyz_ABCDEFGHIJKLMNOPQRSTUVWXYZ: rest";
+    size_t colon = strchr(text, ':') - text;
+    ASSERT_TRUE(scan_identifier(text, 0, strlen(text)) == colon, "stops at end of identifier");
+    ASSERT_TRUE(scan_identifier(text, 5, strlen(text)) == colon, "scans from middle");
+    ASSERT_TRUE(scan_identifier(text, colon, strlen(text)) == colon, "non-identifier gives start position");
+    return NULL;
+}
+
+const char* test_scan_identifier_boundaries(void) {
+    // characters just outside each accepted range
+    const char *stops = "@[`{/:\x80\xc1\xe1 .-";
+    char text[40];
+    for (size_t i = 0; stops[i]; ++i) {
+        memset(text, 'a', sizeof(text));
+        text[20] = stops[i];
+        ASSERT_TRUE(scan_identifier(text, 0, sizeof(text)) == 20, "stops at non-identifier character");
+    }
+    return NULL;
+}
+
+const char* test_scan_line(void) {
+    char text[100];
+    memset(text, ';', sizeof(text));
+    text[90] = '\n';
+    ASSERT_TRUE(scan_line(text, 0, sizeof(text)) == 90, "finds end of line");
+    ASSERT_TRUE(scan_line(text, 91, sizeof(text)) == sizeof(text), "stops at end of text");
+    ASSERT_TRUE(scan_line(text, 0, 50) == 50, "respects length");
+    return NULL;
+}
+
+const char* test_scan_until(void) {
+    const char *text = "a long string with an \\\" escape and a closing quote\" tail";
+    ASSERT_TRUE(scan_until(text, 0, strlen(text), '"', '\\') == 22, "finds first of either character");
+    ASSERT_TRUE(scan_until(text, 24, strlen(text), '"', '\\') == 51, "finds closing quote");
+    return NULL;
+}
+
+const char* test_scan_newlines(void) {
+    char text[100];
+    size_t last = 0;
+    memset(text, 'x', sizeof(text));
+    ASSERT_TRUE(scan_newlines(text, 0, sizeof(text), &last) == 0, "no newlines found");
+    ASSERT_TRUE(last == 0, "last newline unchanged");
+
+    text[3] = '\n';
+    text[40] = '\n';
+    text[41] = '\n';
+    text[97] = '\n';
+    ASSERT_TRUE(scan_newlines(text, 0, sizeof(text), &last) == 4, "all newlines counted");
+    ASSERT_TRUE(last == 97, "last newline found");
+    ASSERT_TRUE(scan_newlines(text, 4, 41, &last) == 1, "range is respected");
+    ASSERT_TRUE(last == 40, "last newline in range found");
+    return NULL;
+}
+
+
+const char *test_suite_name = "scan.c";
+struct test_def test_list[] = {
+    {   "scan_blanks_short",                        test_scan_blanks_short },
+    {   "scan_blanks_long",                         test_scan_blanks_long },
+    {   "scan_blanks_newline",                      test_scan_blanks_newline },
+    {   "scan_identifier",                          test_scan_identifier },
+    {   "scan_identifier_boundaries",               test_scan_identifier_boundaries },
+    {   "scan_line",                                test_scan_line },
+    {   "scan_until",                               test_scan_until },
+    {   "scan_newlines",                            test_scan_newlines },
+
+    {   NULL,                                       NULL }
+};
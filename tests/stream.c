@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+#include "fixtures.h"
+
+#define MAIN_FILE       "test_stream_main.ga"
+#define INCLUDED_FILE   "test_stream_included.ga"
+
+const char* test_stream_lines(void);
+const char* test_stream_include(void);
+const char* test_stream_label_before_include(void);
+const char* test_stream_missing_include(void);
+const char* test_stream_include_once(void);
+const char* test_stream_include_loop(void);
+
+
+const char *test_suite_name = "stream.c";
+struct test_def test_list[] = {
+    {   "stream_lines",                             test_stream_lines },
+    {   "stream_include",                           test_stream_include },
+    {   "stream_label_before_include",              test_stream_label_before_include },
+    {   "stream_missing_include",                   test_stream_missing_include },
+    {   "stream_include_once",                      test_stream_include_once },
+    {   "stream_include_loop",                      test_stream_include_loop },
+
+    {   NULL,                                       NULL }
+};
+
+
+const char* test_stream_lines(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct source_stream stream;
+    struct token_list *line;
+    ASSERT_TRUE(write_file(MAIN_FILE, "first 1\n\n; comment\nsecond 2 3"), "wrote source file");
+    ASSERT_TRUE(stream_open(&stream, MAIN_FILE, arena, symbols), "opened stream");
+
+    line = stream_next_line(&stream);
+    ASSERT_TRUE(line && line->count == 3, "first line read");
+    ASSERT_TRUE(strcmp(line->tokens[0].text, "first") == 0, "first line has correct text");
+    ASSERT_TRUE(line->tokens[2].type == tt_eol, "first line ends with eol");
+
+    line = stream_next_line(&stream);
+    ASSERT_TRUE(line && line->count == 4, "blank lines skipped");
+    ASSERT_TRUE(strcmp(line->tokens[0].text, "second") == 0, "second line has correct text");
+    ASSERT_TRUE(line->tokens[0].origin.line == 4, "second line has correct line number");
+    ASSERT_TRUE(line->tokens[3].type == tt_eol, "final line is given an eol");
+
+    ASSERT_TRUE(stream_next_line(&stream) == NULL, "stream ends");
+    ASSERT_TRUE(stream.error_count == 0, "no errors found");
+
+    stream_close(&stream);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    remove(MAIN_FILE);
+    return NULL;
+}
+
+const char* test_stream_include(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct source_stream stream;
+    struct token_list *line;
+    ASSERT_TRUE(write_file(MAIN_FILE, "before\n.include \"" INCLUDED_FILE "\"\nafter\n"), "wrote source file");
+    ASSERT_TRUE(write_file(INCLUDED_FILE, "inside\n"), "wrote included file");
+    ASSERT_TRUE(stream_open(&stream, MAIN_FILE, arena, symbols), "opened stream");
+
+    line = stream_next_line(&stream);
+    ASSERT_TRUE(line && strcmp(line->tokens[0].text, "before") == 0, "line before include");
+    line = stream_next_line(&stream);
+    ASSERT_TRUE(line && strcmp(line->tokens[0].text, "inside") == 0, "included line");
+    ASSERT_TRUE(strcmp(line->tokens[0].origin.filename, INCLUDED_FILE) == 0, "included line has correct file");
+    line = stream_next_line(&stream);
+    ASSERT_TRUE(line && strcmp(line->tokens[0].text, "after") == 0, "line after include");
+    ASSERT_TRUE(strcmp(line->tokens[0].origin.filename, MAIN_FILE) == 0, "line after include has correct file");
+    ASSERT_TRUE(stream_next_line(&stream) == NULL, "stream ends");
+    ASSERT_TRUE(stream.error_count == 0, "no errors found");
+
+    stream_close(&stream);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    remove(MAIN_FILE);
+    remove(INCLUDED_FILE);
+    return NULL;
+}
+
+const char* test_stream_label_before_include(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct source_stream stream;
+    struct token_list *line;
+    ASSERT_TRUE(write_file(MAIN_FILE, "label: .include \"" INCLUDED_FILE "\"\n"), "wrote source file");
+    ASSERT_TRUE(write_file(INCLUDED_FILE, "inside\n"), "wrote included file");
+    ASSERT_TRUE(stream_open(&stream, MAIN_FILE, arena, symbols), "opened stream");
+
+    line = stream_next_line(&stream);
+    ASSERT_TRUE(line && line->count == 3, "label kept");
+    ASSERT_TRUE(strcmp(line->tokens[0].text, "label") == 0, "label has correct text");
+    ASSERT_TRUE(line->tokens[1].type == tt_colon, "label has colon");
+    line = stream_next_line(&stream);
+    ASSERT_TRUE(line && strcmp(line->tokens[0].text, "inside") == 0, "included line follows label");
+    ASSERT_TRUE(stream_next_line(&stream) == NULL, "stream ends");
+
+    stream_close(&stream);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    remove(MAIN_FILE);
+    remove(INCLUDED_FILE);
+    return NULL;
+}
+
+const char* test_stream_missing_include(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct source_stream stream;
+    struct token_list *line;
+    ASSERT_TRUE(write_file(MAIN_FILE, ".include \"no_such_file.ga\"\nafter\n"), "wrote source file");
+    ASSERT_TRUE(stream_open(&stream, MAIN_FILE, arena, symbols), "opened stream");
+
+    line = stream_next_line(&stream);
+    ASSERT_TRUE(line && strcmp(line->tokens[0].text, "after") == 0, "reading continues after include");
+    ASSERT_TRUE(stream_next_line(&stream) == NULL, "stream ends");
+    ASSERT_TRUE(stream.error_count == 1, "error was counted");
+
+    stream_close(&stream);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    remove(MAIN_FILE);
+    return NULL;
+}
+
+const char* test_stream_include_once(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct source_stream stream;
+    struct token_list *line;
+    ASSERT_TRUE(write_file(MAIN_FILE, ".include \"" INCLUDED_FILE "\"\n"
+                                      ".include_once \"./" INCLUDED_FILE "\"\n"
+                                      "after\n"), "wrote source file");
+    ASSERT_TRUE(write_file(INCLUDED_FILE, "inside\n"), "wrote included file");
+    ASSERT_TRUE(stream_open(&stream, MAIN_FILE, arena, symbols), "opened stream");
+
+    line = stream_next_line(&stream);
+    ASSERT_TRUE(line && strcmp(line->tokens[0].text, "inside") == 0, "included line");
+    line = stream_next_line(&stream);
+    ASSERT_TRUE(line && strcmp(line->tokens[0].text, "after") == 0, "file included only once");
+    ASSERT_TRUE(stream_next_line(&stream) == NULL, "stream ends");
+    ASSERT_TRUE(stream.error_count == 0, "no errors found");
+
+    stream_close(&stream);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    remove(MAIN_FILE);
+    remove(INCLUDED_FILE);
+    return NULL;
+}
+
+const char* test_stream_include_loop(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct source_stream stream;
+    struct token_list *line;
+    ASSERT_TRUE(write_file(MAIN_FILE, ".include \"" INCLUDED_FILE "\"\nafter\n"), "wrote source file");
+    ASSERT_TRUE(write_file(INCLUDED_FILE, "inside\n.include \"" MAIN_FILE "\"\n"), "wrote included file");
+    ASSERT_TRUE(stream_open(&stream, MAIN_FILE, arena, symbols), "opened stream");
+
+    line = stream_next_line(&stream);
+    ASSERT_TRUE(line && strcmp(line->tokens[0].text, "inside") == 0, "included line");
+    line = stream_next_line(&stream);
+    ASSERT_TRUE(line && strcmp(line->tokens[0].text, "after") == 0, "loop not followed");
+    ASSERT_TRUE(stream_next_line(&stream) == NULL, "stream ends");
+    ASSERT_TRUE(stream.error_count == 1, "loop reported");
+
+    stream_close(&stream);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    remove(MAIN_FILE);
+    remove(INCLUDED_FILE);
+    return NULL;
+}
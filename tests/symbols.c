@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+#include "../src/assemble.h"
+
+
+const char* test_symbol_builtins(void);
+const char* test_symbol_mnemonics(void);
+const char* test_symbol_intern(void);
+const char* test_symbol_lookup(void);
+const char* test_symbol_many(void);
+
+
+const char *test_suite_name = "symbols.c";
+struct test_def test_list[] = {
+    {   "symbol_builtins",                          test_symbol_builtins },
+    {   "symbol_mnemonics",                         test_symbol_mnemonics },
+    {   "symbol_intern",                            test_symbol_intern },
+    {   "symbol_lookup",                            test_symbol_lookup },
+    {   "symbol_many",                              test_symbol_many },
+
+    {   NULL,                                       NULL }
+};
+
+
+const char* test_symbol_builtins(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    ASSERT_TRUE(symbols, "symbol table created");
+
+    ASSERT_TRUE(symbol_lookup(symbols, ".define", 7) == sym_define, "first directive has fixed ID");
+    ASSERT_TRUE(symbol_lookup(symbols, ".string_table", 13) == sym_string_table, "last directive has fixed ID");
+    ASSERT_TRUE(symbol_lookup(symbols, "sp", 2) == sym_sp, "keyword has fixed ID");
+    ASSERT_TRUE(symbol_lookup(symbols, "_ENDMEM", 7) == sym_endmem, "special label has fixed ID");
+    ASSERT_TRUE(strcmp(symbol_name(symbols, sym_stk), "stk") == 0, "name of builtin is correct");
+
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_symbol_mnemonics(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    ASSERT_TRUE(symbols, "symbol table created");
+
+    for (int i = 0; codes[i].name; ++i) {
+        int id = symbol_lookup(symbols, codes[i].name, strlen(codes[i].name));
+        ASSERT_TRUE(id == sym_first_mnemonic + i, "mnemonic has fixed ID");
+        ASSERT_TRUE(symbol_mnemonic(symbols, id) == &codes[i], "symbol maps back to mnemonic");
+        ASSERT_TRUE(symbol_name(symbols, id) == codes[i].name, "mnemonic name is not copied");
+    }
+    ASSERT_TRUE(symbol_mnemonic(symbols, sym_sp) == NULL, "builtin is not a mnemonic");
+    int other = symbol_intern(symbols, "other", 5);
+    ASSERT_TRUE(symbol_mnemonic(symbols, other) == NULL, "new symbol is not a mnemonic");
+
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_symbol_intern(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    ASSERT_TRUE(symbols, "symbol table created");
+
+    int first = symbol_intern(symbols, "first_name", 10);
+    int second = symbol_intern(symbols, "second_name", 11);
+    ASSERT_TRUE(first >= 0 && second >= 0, "symbols created");
+    ASSERT_TRUE(first != second, "different names have different IDs");
+    ASSERT_TRUE(symbol_intern(symbols, "first_name", 10) == first, "same name has same ID");
+    ASSERT_TRUE(symbol_intern(symbols, "first_name_and_more", 10) == first, "length is respected");
+    ASSERT_TRUE(strcmp(symbol_name(symbols, second), "second_name") == 0, "name is stored");
+
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_symbol_lookup(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    ASSERT_TRUE(symbols, "symbol table created");
+
+    int count = symbols->count;
+    ASSERT_TRUE(symbol_lookup(symbols, "missing", 7) == -1, "unknown name not found");
+    ASSERT_TRUE(symbols->count == count, "lookup does not add symbols");
+    ASSERT_TRUE(symbol_name(symbols, -1) == NULL, "invalid ID has no name");
+
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_symbol_many(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    ASSERT_TRUE(symbols, "symbol table created");
+
+    char name[32];
+    int ids[5000];
+    for (int i = 0; i < 5000; ++i) {
+        sprintf(name, "label_%d", i);
+        ids[i] = symbol_intern(symbols, name, strlen(name));
+        ASSERT_TRUE(ids[i] >= 0, "symbol created");
+    }
+    for (int i = 0; i < 5000; ++i) {
+        sprintf(name, "label_%d", i);
+        ASSERT_TRUE(symbol_lookup(symbols, name, strlen(name)) == ids[i], "symbol found after growth");
+        ASSERT_TRUE(strcmp(symbol_name(symbols, ids[i]), name) == 0, "name kept after growth");
+    }
+    ASSERT_TRUE(symbol_lookup(symbols, "nop", 3) == sym_first_mnemonic, "builtins found after growth");
+
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "../src/assemble.h"
+
+#define CACHE_DIR       "."
+#define SOURCE_TEXT     "label: .string \"plain\" \"esc\\taped\"\n" \
+                        "  add $1F, 2.5, sp\n"                       \
+                        "  label ; comment\n"
+
+static void setup_state(struct lexer_state *state, struct arena *arena,
+                        struct symbol_table *symbols, const char *text);
+static int same_tokens(struct token_list *first, struct token_list *second);
+static int damage_file(const char *filename, long position);
+
+const char* test_tokcache_round_trip(void);
+const char* test_tokcache_new_symbols(void);
+const char* test_tokcache_changed_source(void);
+const char* test_tokcache_damaged_file(void);
+const char* test_tokcache_truncated_file(void);
+const char* test_tokcache_missing_dir(void);
+
+
+const char *test_suite_name = "tokcache.c";
+struct test_def test_list[] = {
+    {   "tokcache_round_trip",                      test_tokcache_round_trip },
+    {   "tokcache_new_symbols",                     test_tokcache_new_symbols },
+    {   "tokcache_changed_source",                  test_tokcache_changed_source },
+    {   "tokcache_damaged_file",                    test_tokcache_damaged_file },
+    {   "tokcache_truncated_file",                  test_tokcache_truncated_file },
+    {   "tokcache_missing_dir",                     test_tokcache_missing_dir },
+
+    {   NULL,                                       NULL }
+};
+
+
+static void setup_state(struct lexer_state *state, struct arena *arena,
+                        struct symbol_table *symbols, const char *text) {
+    memset(state, 0, sizeof(struct lexer_state));
+    state->origin.filename = "test";
+    state->origin.line = 1;
+    state->origin.column = 1;
+    state->text = text;
+    state->text_length = strlen(text);
+    state->arena = arena;
+    state->symbols = symbols;
+}
+
+static int same_tokens(struct token_list *first, struct token_list *second) {
+    if (first->count != second->count) return FALSE;
+    for (size_t i = 0; i < first->count; ++i) {
+        struct token *a = &first->tokens[i];
+        struct token *b = &second->tokens[i];
+        if (a->type != b->type || a->i != b->i
+                || a->origin.line != b->origin.line
+                || a->origin.column != b->origin.column
+                || strcmp(a->origin.filename, b->origin.filename) != 0) {
+            return FALSE;
+        }
+        if ((a->text == NULL) != (b->text == NULL)) return FALSE;
+        if (a->text) {
+            size_t length = a->type == tt_string ? (size_t)a->i : strlen(a->text) + 1;
+            if (memcmp(a->text, b->text, length) != 0) return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static int damage_file(const char *filename, long position) {
+    FILE *file = fopen(filename, "r+b");
+    if (!file) return FALSE;
+    fseek(file, position, SEEK_SET);
+    int c = fgetc(file);
+    fseek(file, position, SEEK_SET);
+    fputc(c ^ 0x01, file);
+    fclose(file);
+    return TRUE;
+}
+
+const char* test_tokcache_round_trip(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct lexer_state state;
+    char *filename = tokcache_filename(CACHE_DIR, SOURCE_TEXT, strlen(SOURCE_TEXT));
+    remove(filename);
+
+    setup_state(&state, arena, symbols, SOURCE_TEXT);
+    ASSERT_TRUE(tokcache_load(CACHE_DIR, &state) == NULL, "nothing cached at first");
+    struct token_list *lexed = lex_core(&state);
+    ASSERT_TRUE(lexed, "source lexed");
+    ASSERT_TRUE(tokcache_save(CACHE_DIR, &state, lexed), "tokens saved");
+
+    setup_state(&state, arena, symbols, SOURCE_TEXT);
+    struct token_list *loaded = tokcache_load(CACHE_DIR, &state);
+    ASSERT_TRUE(loaded, "tokens loaded");
+    ASSERT_TRUE(same_tokens(lexed, loaded), "loaded tokens match lexed tokens");
+    ASSERT_TRUE(loaded->tokens[3].text == &state.text[16], "plain string refers to source");
+    ASSERT_TRUE(loaded->tokens[0].text == lexed->tokens[0].text, "names are interned");
+
+    free_token_list(lexed);
+    free_token_list(loaded);
+    remove(filename);
+    free(filename);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_tokcache_new_symbols(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct lexer_state state;
+    char *filename = tokcache_filename(CACHE_DIR, SOURCE_TEXT, strlen(SOURCE_TEXT));
+
+    setup_state(&state, arena, symbols, SOURCE_TEXT);
+    struct token_list *lexed = lex_core(&state);
+    ASSERT_TRUE(lexed && tokcache_save(CACHE_DIR, &state, lexed), "tokens saved");
+    free_token_list(lexed);
+    symbol_table_free(symbols);
+    arena_free(arena);
+
+    // a later run has its own symbol table, with its own numbering
+    arena = arena_new();
+    symbols = symbol_table_new(arena);
+    int other = symbol_intern(symbols, "other", 5);
+    setup_state(&state, arena, symbols, SOURCE_TEXT);
+    struct token_list *loaded = tokcache_load(CACHE_DIR, &state);
+    ASSERT_TRUE(loaded, "tokens loaded");
+    ASSERT_TRUE(loaded->tokens[0].i == other + 1, "names entered into new table");
+    ASSERT_TRUE(strcmp(loaded->tokens[0].text, "label") == 0, "name text correct");
+    ASSERT_TRUE(loaded->tokens[13].i == loaded->tokens[0].i, "repeated name has one symbol");
+    ASSERT_TRUE(loaded->tokens[2].i == sym_string, "builtin keeps fixed symbol");
+
+    free_token_list(loaded);
+    remove(filename);
+    free(filename);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_tokcache_changed_source(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct lexer_state state;
+    char *filename = tokcache_filename(CACHE_DIR, SOURCE_TEXT, strlen(SOURCE_TEXT));
+
+    setup_state(&state, arena, symbols, SOURCE_TEXT);
+    struct token_list *lexed = lex_core(&state);
+    ASSERT_TRUE(lexed && tokcache_save(CACHE_DIR, &state, lexed), "tokens saved");
+
+    setup_state(&state, arena, symbols, SOURCE_TEXT "more\n");
+    ASSERT_TRUE(tokcache_load(CACHE_DIR, &state) == NULL, "changed source not loaded");
+
+    free_token_list(lexed);
+    remove(filename);
+    free(filename);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_tokcache_damaged_file(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct lexer_state state;
+    char *filename = tokcache_filename(CACHE_DIR, SOURCE_TEXT, strlen(SOURCE_TEXT));
+
+    setup_state(&state, arena, symbols, SOURCE_TEXT);
+    struct token_list *lexed = lex_core(&state);
+    ASSERT_TRUE(lexed, "source lexed");
+    long positions[] = { 0, 7, 20, 40, 100, 200 };
+    for (int i = 0; i < 6; ++i) {
+        ASSERT_TRUE(tokcache_save(CACHE_DIR, &state, lexed), "tokens saved");
+        ASSERT_TRUE(damage_file(filename, positions[i]), "cache file damaged");
+        ASSERT_TRUE(tokcache_load(CACHE_DIR, &state) == NULL, "damaged file not loaded");
+    }
+
+    free_token_list(lexed);
+    remove(filename);
+    free(filename);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_tokcache_truncated_file(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct lexer_state state;
+    char *filename = tokcache_filename(CACHE_DIR, SOURCE_TEXT, strlen(SOURCE_TEXT));
+
+    setup_state(&state, arena, symbols, SOURCE_TEXT);
+    struct token_list *lexed = lex_core(&state);
+    ASSERT_TRUE(lexed && tokcache_save(CACHE_DIR, &state, lexed), "tokens saved");
+    FILE *out = fopen(filename, "wb");
+    ASSERT_TRUE(out, "cache file replaced");
+    fputs("GATC", out);
+    fclose(out);
+    ASSERT_TRUE(tokcache_load(CACHE_DIR, &state) == NULL, "truncated file not loaded");
+
+    free_token_list(lexed);
+    remove(filename);
+    free(filename);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_tokcache_missing_dir(void) {
+    struct arena *arena = arena_new();
+    struct symbol_table *symbols = symbol_table_new(arena);
+    struct lexer_state state;
+
+    setup_state(&state, arena, symbols, SOURCE_TEXT);
+    struct token_list *lexed = lex_core(&state);
+    ASSERT_TRUE(lexed, "source lexed");
+    ASSERT_TRUE(!tokcache_save("test_tokcache_no_such_dir", &state, lexed), "save fails quietly");
+    ASSERT_TRUE(tokcache_load("test_tokcache_no_such_dir", &state) == NULL, "load fails quietly");
+
+    free_token_list(lexed);
+    symbol_table_free(symbols);
+    arena_free(arena);
+    return NULL;
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "test.h"
@@ -15,6 +16,7 @@ const char* test_new_token_float_positive(void);
 const char* test_new_token_float_negative(void);
 
 const char* test_basic_token_list(void);
+const char* test_token_list_growth(void);
 const char* test_token_list_remove_first(void);
 const char* test_token_list_remove_middle(void);
 const char* test_token_list_remove_last(void);
@@ -24,6 +26,7 @@ const char* test_token_list_merge_second_empty(void);
 const char* test_token_list_merge_first(void);
 const char* test_token_list_merge_middle(void);
 const char* test_token_list_merge_last(void);
+const char* test_token_list_copy(void);
 
 
 
@@ -39,6 +42,7 @@ struct test_def test_list[] = {
     {   "new_token_float_negative",                 test_new_token_float_negative },
 
     {   "basic_token_list",                         test_basic_token_list },
+    {   "token_list_growth",                        test_token_list_growth },
     {   "token_list_remove_first",                  test_token_list_remove_first },
     {   "token_list_remove_middle",                 test_token_list_remove_middle },
     {   "token_list_remove_last",                   test_token_list_remove_last },
@@ -48,6 +52,7 @@ struct test_def test_list[] = {
     {   "token_list_merge_first",                   test_token_list_merge_first },
     {   "token_list_merge_middle",                  test_token_list_merge_middle },
     {   "token_list_merge_last",                    test_token_list_merge_last },
+    {   "token_list_copy",                          test_token_list_copy },
 
     {   NULL,                                       NULL }
 };
@@ -55,329 +60,364 @@ struct test_def test_list[] = {
 
 
 const char* test_new_token_general(void) {
+    struct arena *arena = arena_new();
+    struct token_list *list = init_token_list(arena);
     const char *source_string = "source_string";
-    struct token *token = new_token(tt_identifier, source_string, NULL);
+    struct token *token = new_token(list, tt_identifier, source_string, NULL);
 
     ASSERT_TRUE(token->type == tt_identifier, "token has correct type");
     ASSERT_TRUE(token->text != source_string, "token has own copy of text");
     ASSERT_TRUE(strcmp(token->text, source_string) == 0, "token string is correct");
+    ASSERT_TRUE(list->count == 1, "token was added to list");
+    ASSERT_TRUE(token == &list->tokens[0], "token is stored in list");
 
-    free_token(token);
+    free_token_list(list);
+    arena_free(arena);
     return NULL;
 }
 
 const char* test_new_token_source_location(void) {
+    struct arena *arena = arena_new();
+    struct token_list *list = init_token_list(arena);
     char *filename = str_dup("source");
     struct lexer_state state = { { filename, 5, 2 } };
     const char *source_string = "source_string";
-    struct token *token = new_token(tt_identifier, source_string, &state);
+    struct token *token = new_token(list, tt_identifier, source_string, &state);
 
     ASSERT_TRUE(token->origin.line == 5, "token has correct line number");
     ASSERT_TRUE(token->origin.column == 2, "token has correct line number");
-    ASSERT_TRUE(token->origin.filename != filename, "token has own copy of source filename");
+    ASSERT_TRUE(token->origin.filename == filename, "token shares source filename");
     ASSERT_TRUE(strcmp(token->origin.filename, filename) == 0, "token filename is correct");
 
-    free_token(token);
+    free(filename);
+    free_token_list(list);
+    arena_free(arena);
     return NULL;
 }
 
 
 
 const char* test_new_rawint_token(void) {
+    struct arena *arena = arena_new();
+    struct token_list *list = init_token_list(arena);
     char *filename = str_dup("source");
     struct lexer_state state = { { filename, 5, 2 } };
 
-    struct token *token = new_rawint_token(69, &state);
+    struct token *token = new_rawint_token(list, 69, &state);
     ASSERT_TRUE(token->type == tt_integer, "token has correct type");
     ASSERT_TRUE(token->i == 69, "token has correct int value");
     ASSERT_TRUE(token->text == NULL, "token text is NULL");
     ASSERT_TRUE(token->origin.line == 5, "token has correct line number");
     ASSERT_TRUE(token->origin.column == 2, "token has correct line number");
-    ASSERT_TRUE(token->origin.filename != filename, "token has own copy of source filename");
+    ASSERT_TRUE(token->origin.filename == filename, "token shares source filename");
     ASSERT_TRUE(strcmp(token->origin.filename, filename) == 0, "token filename is correct");
 
-    free_token(token);
+    free(filename);
+    free_token_list(list);
+    arena_free(arena);
     return NULL;
 }
 
 const char* test_new_token_int_positive(void) {
+    struct arena *arena = arena_new();
+    struct token_list *list = init_token_list(arena);
     const char *int_string = "42";
-    struct token *token = new_token(tt_integer, int_string, NULL);
+    struct token *token = new_token(list, tt_integer, int_string, NULL);
 
     ASSERT_TRUE(token->type == tt_integer, "token has correct type");
     ASSERT_TRUE(token->i == 42, "token has correct int value");
     ASSERT_TRUE(token->text != int_string, "token has own copy of text");
     ASSERT_TRUE(strcmp(token->text, int_string) == 0, "token string is correct");
 
-    free_token(token);
+    free_token_list(list);
+    arena_free(arena);
     return NULL;
 }
 
 const char* test_new_token_int_negative(void) {
+    struct arena *arena = arena_new();
+    struct token_list *list = init_token_list(arena);
     const char *int_string = "-56";
-    struct token *token = new_token(tt_integer, int_string, NULL);
+    struct token *token = new_token(list, tt_integer, int_string, NULL);
 
     ASSERT_TRUE(token->type == tt_integer, "token has correct type");
     ASSERT_TRUE(token->i == -56, "token has correct int value");
     ASSERT_TRUE(token->text != int_string, "token has own copy of text");
     ASSERT_TRUE(strcmp(token->text, int_string) == 0, "token string is correct");
 
-    free_token(token);
+    free_token_list(list);
+    arena_free(arena);
     return NULL;
 }
 
 
 const char* test_new_token_float_positive(void) {
+    struct arena *arena = arena_new();
+    struct token_list *list = init_token_list(arena);
     const char *float_string = "3.789";
-    struct token *token = new_token(tt_float, float_string, NULL);
+    struct token *token = new_token(list, tt_float, float_string, NULL);
 
     ASSERT_TRUE(token->type == tt_integer, "token has correct type");
     ASSERT_TRUE(token->i == 0x40727efa, "token has correct floating point value");
     ASSERT_TRUE(token->text != float_string, "token has own copy of text");
     ASSERT_TRUE(strcmp(token->text, float_string) == 0, "token string is correct");
 
-    free_token(token);
+    free_token_list(list);
+    arena_free(arena);
     return NULL;
 }
 
 const char* test_new_token_float_negative(void) {
+    struct arena *arena = arena_new();
+    struct token_list *list = init_token_list(arena);
     const char *float_string = "-8.135";
-    struct token *token = new_token(tt_float, float_string, NULL);
+    struct token *token = new_token(list, tt_float, float_string, NULL);
 
     ASSERT_TRUE(token->type == tt_integer, "token has correct type");
     ASSERT_TRUE(token->i == 0xc10228f6, "token has correct floating point value");
     ASSERT_TRUE(token->text != float_string, "token has own copy of text");
     ASSERT_TRUE(strcmp(token->text, float_string) == 0, "token string is correct");
 
-    free_token(token);
+    free_token_list(list);
+    arena_free(arena);
     return NULL;
 }
 
 
 
 const char* test_basic_token_list(void) {
-    struct token *token = NULL, *first = NULL;
-    struct token_list *list = init_token_list();
+    struct arena *arena = arena_new();
+    struct token_list *list = init_token_list(arena);
 
     ASSERT_TRUE(list, "token list was allocated");
+    ASSERT_TRUE(list->count == 0, "list starts empty");
+    ASSERT_TRUE(list->tokens[0].type == tt_eof, "empty list has end marker");
+
+    ASSERT_TRUE(new_rawint_token(list, 10, NULL), "token was added");
+    ASSERT_TRUE(list->count == 1, "list has one token");
+    ASSERT_TRUE(list->tokens[1].type == tt_eof, "end marker follows first token");
+
+    ASSERT_TRUE(new_rawint_token(list, 20, NULL), "token was added");
+    ASSERT_TRUE(list->count == 2, "list has two tokens");
+    ASSERT_TRUE(list->tokens[2].type == tt_eof, "end marker follows second token");
+
+    ASSERT_TRUE(new_rawint_token(list, 30, NULL), "token was added");
+    ASSERT_TRUE(list->count == 3, "list has three tokens");
+    ASSERT_TRUE(list->tokens[3].type == tt_eof, "end marker follows third token");
+
+    ASSERT_TRUE(list->tokens[0].i == 10, "first token correct");
+    ASSERT_TRUE(list->tokens[1].i == 20, "second token correct");
+    ASSERT_TRUE(list->tokens[2].i == 30, "third token correct");
+
+    free_token_list(list);
+    arena_free(arena);
+    return NULL;
+}
+
+const char* test_token_list_growth(void) {
+    struct arena *arena = arena_new();
+    struct token_list *list = init_token_list(arena);
 
-    token = new_rawint_token(10, NULL);
-    ASSERT_TRUE(list, "token was allocated");
-    add_token(list, token);
-    first = list->first;
-    ASSERT_TRUE(list->first == token, "list first token correct");
-    ASSERT_TRUE(list->last == token, "list last token is correct");
-
-    token = new_rawint_token(20, NULL);
-    ASSERT_TRUE(list, "token was allocated");
-    add_token(list, token);
-    ASSERT_TRUE(list->first == first, "list first token correct");
-    ASSERT_TRUE(list->last == token, "list last token is correct");
-
-    token = new_rawint_token(30, NULL);
-    ASSERT_TRUE(list, "token was allocated");
-    add_token(list, token);
-    ASSERT_TRUE(list->first == first, "list first token correct");
-    ASSERT_TRUE(list->last == token, "list last token is correct");
-
-    first = list->first;
-    ASSERT_TRUE(first->i == 10, "first token correct");
-    first = first->next;
-    ASSERT_TRUE(first->i == 20, "second token correct");
-    first = first->next;
-    ASSERT_TRUE(first->i == 30, "third token correct");
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_TRUE(new_rawint_token(list, i, NULL), "token was added");
+    }
+    ASSERT_TRUE(list->count == 1000, "list has all tokens");
+    ASSERT_TRUE(list->capacity >= 1000, "list has grown");
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_TRUE(list->tokens[i].i == i, "token has correct value");
+    }
+    ASSERT_TRUE(list->tokens[1000].type == tt_eof, "end marker follows last token");
 
     free_token_list(list);
+    arena_free(arena);
     return NULL;
 }
 
 const char* test_token_list_remove_first(void) {
-    struct token_list *list = init_token_list();
-    struct token *first = new_rawint_token(10, NULL);
-    struct token *middle = new_rawint_token(10, NULL);
-    struct token *last = new_rawint_token(10, NULL);
-    add_token(list, first);
-    add_token(list, middle);
-    add_token(list, last);
-
-    remove_token(list, first);
-    ASSERT_TRUE(list->first == middle, "first token updated");
-    ASSERT_TRUE(list->last == last, "last token unchanged");
-    ASSERT_TRUE(middle->prev == NULL, "old middle has no prev token");
-    ASSERT_TRUE(middle->next == last, "old middle next is unchanged");
-    ASSERT_TRUE(last->prev == middle, "old last has no prev token");
-    ASSERT_TRUE(last->next == NULL, "old last next is unchanged");
-
-    free_token(first);
+    struct arena *arena = arena_new();
+    struct token_list *list = init_token_list(arena);
+    new_rawint_token(list, 10, NULL);
+    new_rawint_token(list, 20, NULL);
+    new_rawint_token(list, 30, NULL);
+
+    remove_tokens(list, 0, 1);
+    ASSERT_TRUE(list->count == 2, "list has two tokens");
+    ASSERT_TRUE(list->tokens[0].i == 20, "old middle is now first");
+    ASSERT_TRUE(list->tokens[1].i == 30, "old last is now second");
+    ASSERT_TRUE(list->tokens[2].type == tt_eof, "end marker is correct");
+
     free_token_list(list);
+    arena_free(arena);
     return NULL;
 }
 
 const char* test_token_list_remove_middle(void) {
-    struct token_list *list = init_token_list();
-    struct token *first = new_rawint_token(10, NULL);
-    struct token *middle = new_rawint_token(10, NULL);
-    struct token *last = new_rawint_token(10, NULL);
-    add_token(list, first);
-    add_token(list, middle);
-    add_token(list, last);
-
-    remove_token(list, middle);
-    ASSERT_TRUE(list->first == first, "first token unchanged");
-    ASSERT_TRUE(list->last == last, "last token unchanged");
-    ASSERT_TRUE(first->prev == NULL, "old first prev unchanged");
-    ASSERT_TRUE(first->next == last, "old first next updated");
-    ASSERT_TRUE(last->prev == first, "old last prev updated");
-    ASSERT_TRUE(last->next == NULL, "old last next is unchanged");
-
-    free_token(middle);
+    struct arena *arena = arena_new();
+    struct token_list *list = init_token_list(arena);
+    new_rawint_token(list, 10, NULL);
+    new_rawint_token(list, 20, NULL);
+    new_rawint_token(list, 30, NULL);
+
+    remove_tokens(list, 1, 1);
+    ASSERT_TRUE(list->count == 2, "list has two tokens");
+    ASSERT_TRUE(list->tokens[0].i == 10, "first token unchanged");
+    ASSERT_TRUE(list->tokens[1].i == 30, "old last is now second");
+    ASSERT_TRUE(list->tokens[2].type == tt_eof, "end marker is correct");
+
     free_token_list(list);
+    arena_free(arena);
     return NULL;
 }
 
 const char* test_token_list_remove_last(void) {
-    struct token_list *list = init_token_list();
-    struct token *first = new_rawint_token(10, NULL);
-    struct token *middle = new_rawint_token(10, NULL);
-    struct token *last = new_rawint_token(10, NULL);
-    add_token(list, first);
-    add_token(list, middle);
-    add_token(list, last);
-
-    remove_token(list, last);
-    ASSERT_TRUE(list->first == first, "first token unchaged");
-    ASSERT_TRUE(list->last == middle, "last token updated");
-    ASSERT_TRUE(first->prev == NULL, "old first prev unchanged");
-    ASSERT_TRUE(first->next == middle, "old first next is unchanged");
-    ASSERT_TRUE(middle->prev == first, "old middle prev unchanged");
-    ASSERT_TRUE(middle->next == NULL, "old middle next is updated");
-
-    free_token(last);
+    struct arena *arena = arena_new();
+    struct token_list *list = init_token_list(arena);
+    new_rawint_token(list, 10, NULL);
+    new_rawint_token(list, 20, NULL);
+    new_rawint_token(list, 30, NULL);
+
+    remove_tokens(list, 2, 1);
+    ASSERT_TRUE(list->count == 2, "list has two tokens");
+    ASSERT_TRUE(list->tokens[0].i == 10, "first token unchanged");
+    ASSERT_TRUE(list->tokens[1].i == 20, "middle token unchanged");
+    ASSERT_TRUE(list->tokens[2].type == tt_eof, "end marker is correct");
+
     free_token_list(list);
+    arena_free(arena);
     return NULL;
 }
 
 const char* test_token_list_merge_same_list(void) {
-    struct token_list *list_one = init_token_list();
-    struct token *one_first = new_rawint_token(10, NULL);
-    struct token *one_last = new_rawint_token(10, NULL);
-    add_token(list_one, one_first);
-    add_token(list_one, one_last);
+    struct arena *arena = arena_new();
+    struct token_list *list_one = init_token_list(arena);
+    new_rawint_token(list_one, 10, NULL);
+    new_rawint_token(list_one, 20, NULL);
 
-    merge_token_list(list_one, list_one, NULL);
-    ASSERT_TRUE(list_one->first == one_first, "list first unchanged");
-    ASSERT_TRUE(list_one->last == one_last, "list last unchanged");
+    int result = merge_token_list(list_one, list_one, 0);
+    ASSERT_TRUE(!result, "merge was refused");
+    ASSERT_TRUE(list_one->count == 2, "list size unchanged");
+    ASSERT_TRUE(list_one->tokens[0].i == 10, "list first unchanged");
+    ASSERT_TRUE(list_one->tokens[1].i == 20, "list last unchanged");
 
+    free_token_list(list_one);
+    arena_free(arena);
     return NULL;
 }
 
 const char* test_token_list_merge_second_empty(void) {
-    struct token_list *list_one = init_token_list();
-    struct token *one_first = new_rawint_token(10, NULL);
-    struct token *one_last = new_rawint_token(10, NULL);
-    add_token(list_one, one_first);
-    add_token(list_one, one_last);
+    struct arena *arena = arena_new();
+    struct token_list *list_one = init_token_list(arena);
+    new_rawint_token(list_one, 10, NULL);
+    new_rawint_token(list_one, 20, NULL);
 
-    struct token_list *list_two = init_token_list();
-    merge_token_list(list_one, list_two, NULL);
-    ASSERT_TRUE(list_one->first == one_first, "list first unchanged");
-    ASSERT_TRUE(list_one->last == one_last, "list last unchanged");
+    struct token_list *list_two = init_token_list(arena);
+    merge_token_list(list_one, list_two, 0);
+    ASSERT_TRUE(list_one->count == 2, "list size unchanged");
+    ASSERT_TRUE(list_one->tokens[0].i == 10, "list first unchanged");
+    ASSERT_TRUE(list_one->tokens[1].i == 20, "list last unchanged");
 
+    free_token_list(list_one);
+    free_token_list(list_two);
+    arena_free(arena);
     return NULL;
 }
 
 const char* test_token_list_merge_first(void) {
-    struct token_list *list_one = init_token_list();
-    struct token_list *list_two = init_token_list();
-
-    struct token *one_first = new_rawint_token(10, NULL);
-    struct token *one_last = new_rawint_token(10, NULL);
-    add_token(list_one, one_first);
-    add_token(list_one, one_last);
+    struct arena *arena = arena_new();
+    struct token_list *list_one = init_token_list(arena);
+    struct token_list *list_two = init_token_list(arena);
 
-    struct token *two_first = new_rawint_token(10, NULL);
-    struct token *two_last = new_rawint_token(10, NULL);
-    add_token(list_two, two_first);
-    add_token(list_two, two_last);
+    new_rawint_token(list_one, 1, NULL);
+    new_rawint_token(list_one, 2, NULL);
+    new_rawint_token(list_two, 3, NULL);
+    new_rawint_token(list_two, 4, NULL);
 
-    merge_token_list(list_one, list_two, NULL);
+    merge_token_list(list_one, list_two, 0);
 
-    ASSERT_TRUE(list_one->first == two_first, "list start is updated");
-    ASSERT_TRUE(list_one->last == one_last, "list end is correct");
-
-    ASSERT_TRUE(two_first->prev == NULL, "first token prev correct");
-    ASSERT_TRUE(two_first->next == two_last, "first token next correct");
-    ASSERT_TRUE(two_last->prev == two_first, "second token prev correct");
-    ASSERT_TRUE(two_last->next == one_first, "second token next correct");
-    ASSERT_TRUE(one_first->prev == two_last, "third token prev correct");
-    ASSERT_TRUE(one_first->next == one_last, "third token next correct");
-    ASSERT_TRUE(one_last->prev == one_first, "last token prev correct");
-    ASSERT_TRUE(one_last->next == NULL, "last token next correct");
+    ASSERT_TRUE(list_one->count == 4, "list has all tokens");
+    ASSERT_TRUE(list_one->tokens[0].i == 3, "first token correct");
+    ASSERT_TRUE(list_one->tokens[1].i == 4, "second token correct");
+    ASSERT_TRUE(list_one->tokens[2].i == 1, "third token correct");
+    ASSERT_TRUE(list_one->tokens[3].i == 2, "last token correct");
+    ASSERT_TRUE(list_one->tokens[4].type == tt_eof, "end marker is correct");
+    ASSERT_TRUE(list_two->count == 0, "merged list is empty");
 
     free_token_list(list_one);
+    free_token_list(list_two);
+    arena_free(arena);
     return NULL;
 }
 
 const char* test_token_list_merge_middle(void) {
-    struct token_list *list_one = init_token_list();
-    struct token_list *list_two = init_token_list();
-
-    struct token *one_first = new_rawint_token(10, NULL);
-    struct token *one_last = new_rawint_token(10, NULL);
-    add_token(list_one, one_first);
-    add_token(list_one, one_last);
+    struct arena *arena = arena_new();
+    struct token_list *list_one = init_token_list(arena);
+    struct token_list *list_two = init_token_list(arena);
 
-    struct token *two_first = new_rawint_token(10, NULL);
-    struct token *two_last = new_rawint_token(10, NULL);
-    add_token(list_two, two_first);
-    add_token(list_two, two_last);
+    new_rawint_token(list_one, 1, NULL);
+    new_rawint_token(list_one, 2, NULL);
+    new_rawint_token(list_two, 3, NULL);
+    new_rawint_token(list_two, 4, NULL);
 
-    merge_token_list(list_one, list_two, one_first);
+    merge_token_list(list_one, list_two, 1);
 
-    ASSERT_TRUE(list_one->first == one_first, "list start is correct");
-    ASSERT_TRUE(list_one->last == one_last, "list end is correct");
-
-    ASSERT_TRUE(one_first->prev == NULL, "first token prev correct");
-    ASSERT_TRUE(one_first->next == two_first, "first token next correct");
-    ASSERT_TRUE(two_first->prev == one_first, "second token prev correct");
-    ASSERT_TRUE(two_first->next == two_last, "second token next correct");
-    ASSERT_TRUE(two_last->prev == two_first, "third token prev correct");
-    ASSERT_TRUE(two_last->next == one_last, "third token next correct");
-    ASSERT_TRUE(one_last->prev == two_last, "last token prev correct");
-    ASSERT_TRUE(one_last->next == NULL, "last token next correct");
+    ASSERT_TRUE(list_one->count == 4, "list has all tokens");
+    ASSERT_TRUE(list_one->tokens[0].i == 1, "first token correct");
+    ASSERT_TRUE(list_one->tokens[1].i == 3, "second token correct");
+    ASSERT_TRUE(list_one->tokens[2].i == 4, "third token correct");
+    ASSERT_TRUE(list_one->tokens[3].i == 2, "last token correct");
+    ASSERT_TRUE(list_one->tokens[4].type == tt_eof, "end marker is correct");
+    ASSERT_TRUE(list_two->count == 0, "merged list is empty");
 
     free_token_list(list_one);
+    free_token_list(list_two);
+    arena_free(arena);
     return NULL;
 }
 
 const char* test_token_list_merge_last(void) {
-    struct token_list *list_one = init_token_list();
-    struct token_list *list_two = init_token_list();
+    struct arena *arena = arena_new();
+    struct token_list *list_one = init_token_list(arena);
+    struct token_list *list_two = init_token_list(arena);
+
+    new_rawint_token(list_one, 1, NULL);
+    new_rawint_token(list_one, 2, NULL);
+    new_rawint_token(list_two, 3, NULL);
+    new_rawint_token(list_two, 4, NULL);
 
-    struct token *one_first = new_rawint_token(10, NULL);
-    struct token *one_last = new_rawint_token(10, NULL);
-    add_token(list_one, one_first);
-    add_token(list_one, one_last);
+    merge_token_list(list_one, list_two, 2);
 
-    struct token *two_first = new_rawint_token(10, NULL);
-    struct token *two_last = new_rawint_token(10, NULL);
-    add_token(list_two, two_first);
-    add_token(list_two, two_last);
+    ASSERT_TRUE(list_one->count == 4, "list has all tokens");
+    ASSERT_TRUE(list_one->tokens[0].i == 1, "first token correct");
+    ASSERT_TRUE(list_one->tokens[1].i == 2, "second token correct");
+    ASSERT_TRUE(list_one->tokens[2].i == 3, "third token correct");
+    ASSERT_TRUE(list_one->tokens[3].i == 4, "last token correct");
+    ASSERT_TRUE(list_one->tokens[4].type == tt_eof, "end marker is correct");
+    ASSERT_TRUE(list_two->count == 0, "merged list is empty");
+
+    free_token_list(list_one);
+    free_token_list(list_two);
+    arena_free(arena);
+    return NULL;
+}
 
-    merge_token_list(list_one, list_two, one_last);
+const char* test_token_list_copy(void) {
+    struct arena *arena = arena_new();
+    struct token_list *list = init_token_list(arena);
 
-    ASSERT_TRUE(list_one->first == one_first, "list start is correct");
-    ASSERT_TRUE(list_one->last == two_last, "list end is correct");
+    for (int i = 0; i < INITIAL_TOKEN_CAPACITY + 1; ++i) {
+        new_rawint_token(list, i, NULL);
+    }
+    new_token(list, tt_identifier, "name", NULL);
+    struct token_list *copy = copy_token_list(list);
 
-    ASSERT_TRUE(one_first->prev == NULL, "first token prev correct");
-    ASSERT_TRUE(one_first->next == one_last, "first token next correct");
-    ASSERT_TRUE(one_last->prev == one_first, "second token prev correct");
-    ASSERT_TRUE(one_last->next == two_first, "second token next correct");
-    ASSERT_TRUE(two_first->prev == one_last, "third token prev correct");
-    ASSERT_TRUE(two_first->next == two_last, "third token next correct");
-    ASSERT_TRUE(two_last->prev == two_first, "last token prev correct");
-    ASSERT_TRUE(two_last->next == NULL, "last token next correct");
+    ASSERT_TRUE(copy && copy != list, "list copied");
+    ASSERT_TRUE(copy->count == list->count, "copy has all tokens");
+    ASSERT_TRUE(copy->tokens[INITIAL_TOKEN_CAPACITY].i == INITIAL_TOKEN_CAPACITY, "copied token correct");
+    ASSERT_TRUE(copy->tokens[copy->count - 1].text == list->tokens[list->count - 1].text, "token text is shared");
+    ASSERT_TRUE(copy->tokens[copy->count].type == tt_eof, "end marker is correct");
 
-    free_token_list(list_one);
+    free_token_list(copy);
+    free_token_list(list);
+    arena_free(arena);
     return NULL;
 }
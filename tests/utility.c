@@ -8,12 +8,18 @@
 
 const char* test_str_dup();
 
-const char* test_cleanup_string_escapes_midtext();
-const char* test_cleanup_string_escapes_initialfinal();
-const char* test_cleanup_string_escapes_codes();
-const char* test_cleanup_string_escapes_invalid_code();
-const char* test_cleanup_string_fix_multiline();
-const char* test_cleanup_string_fix_multiline_codes();
+const char* test_decode_string_escapes_midtext();
+const char* test_decode_string_escapes_initialfinal();
+const char* test_decode_string_escapes_codes();
+const char* test_decode_string_escapes_invalid_code();
+const char* test_decode_string_fix_multiline();
+const char* test_decode_string_fix_multiline_codes();
+const char* test_decode_string_new_codes();
+const char* test_decode_string_bad_numeric_codes();
+const char* test_decode_string_unterminated_source();
+const char* test_decode_string_many_codes();
+
+const char* test_utf8_encode();
 
 const char* test_utf8_next_char();
 const char* test_utf8_next_char_stray_continuation();
@@ -25,12 +31,18 @@ const char *test_suite_name = "utility.c";
 struct test_def test_list[] = {
     {   "str_dup",                              test_str_dup },
 
-    {   "cleanup_string_escapes_midtext",       test_cleanup_string_escapes_midtext },
-    {   "cleanup_string_escapes_initialfinal",  test_cleanup_string_escapes_initialfinal },
-    {   "cleanup_string_escapes_codes",         test_cleanup_string_escapes_codes },
-    {   "cleanup_string_escapes_invalid_code",  test_cleanup_string_escapes_invalid_code },
-    {   "cleanup_string_fix_multiline",         test_cleanup_string_fix_multiline },
-    {   "cleanup_string_fix_multiline_codes",   test_cleanup_string_fix_multiline_codes },
+    {   "decode_string_escapes_midtext",        test_decode_string_escapes_midtext },
+    {   "decode_string_escapes_initialfinal",   test_decode_string_escapes_initialfinal },
+    {   "decode_string_escapes_codes",          test_decode_string_escapes_codes },
+    {   "decode_string_escapes_invalid_code",   test_decode_string_escapes_invalid_code },
+    {   "decode_string_fix_multiline",          test_decode_string_fix_multiline },
+    {   "decode_string_fix_multiline_codes",    test_decode_string_fix_multiline_codes },
+    {   "decode_string_new_codes",              test_decode_string_new_codes },
+    {   "decode_string_bad_numeric_codes",      test_decode_string_bad_numeric_codes },
+    {   "decode_string_unterminated_source",    test_decode_string_unterminated_source },
+    {   "decode_string_many_codes",             test_decode_string_many_codes },
+
+    {   "utf8_encode",                          test_utf8_encode },
 
     {   "utf8_next_char",                       test_utf8_next_char },
     {   "utf8_next_char_stray_continuation",    test_utf8_next_char_stray_continuation },
@@ -52,10 +64,11 @@ const char* test_str_dup(void) {
 }
 
 
-const char* test_cleanup_string_escapes_midtext() {
+const char* test_decode_string_escapes_midtext() {
+    size_t bad_pos;
     char test_text[] = "text\\n\\nword";
-    int result = cleanup_string(test_text);
-    ASSERT_TRUE(result == 0,
+    int result = decode_string(test_text, strlen(test_text), test_text, &bad_pos);
+    ASSERT_TRUE(result == 10,
                 "correct return value");
     ASSERT_TRUE(strcmp(test_text, "text\n\nword") == 0,
                 "handled mid-text newlines");
@@ -63,10 +76,11 @@ const char* test_cleanup_string_escapes_midtext() {
     return NULL;
 }
 
-const char* test_cleanup_string_escapes_initialfinal() {
+const char* test_decode_string_escapes_initialfinal() {
+    size_t bad_pos;
     char test_text[] = "\\ntext word\\n";
-    int result = cleanup_string(test_text);
-    ASSERT_TRUE(result == 0,
+    int result = decode_string(test_text, strlen(test_text), test_text, &bad_pos);
+    ASSERT_TRUE(result == 11,
                 "correct return value");
     ASSERT_TRUE(strcmp(test_text, "\ntext word\n") == 0,
                 "handled initial and final newlines");
@@ -74,10 +88,11 @@ const char* test_cleanup_string_escapes_initialfinal() {
     return NULL;
 }
 
-const char* test_cleanup_string_escapes_codes() {
+const char* test_decode_string_escapes_codes() {
+    size_t bad_pos;
     char test_text[] = "\\\\\\n\\\"\\'";
-    int result = cleanup_string(test_text);
-    ASSERT_TRUE(result == 0,
+    int result = decode_string(test_text, strlen(test_text), test_text, &bad_pos);
+    ASSERT_TRUE(result == 4,
                 "correct return value");
     ASSERT_TRUE(strcmp(test_text, "\\\n\"\'") == 0,
                 "handled valid escape codes");
@@ -85,19 +100,23 @@ const char* test_cleanup_string_escapes_codes() {
     return NULL;
 }
 
-const char* test_cleanup_string_escapes_invalid_code() {
+const char* test_decode_string_escapes_invalid_code() {
+    size_t bad_pos;
     char test_text[] = "\\q";
-    int result = cleanup_string(test_text);
-    ASSERT_TRUE(result != 0,
+    int result = decode_string(test_text, strlen(test_text), test_text, &bad_pos);
+    ASSERT_TRUE(result < 0,
                 "correct return value");
+    ASSERT_TRUE(bad_pos == 0,
+                "correct error position");
 
     return NULL;
 }
 
-const char* test_cleanup_string_fix_multiline() {
+const char* test_decode_string_fix_multiline() {
+    size_t bad_pos;
     char test_text[] = "Hello there      \n\n     Everyone.";
-    int result = cleanup_string(test_text);
-    ASSERT_TRUE(result == 0,
+    int result = decode_string(test_text, strlen(test_text), test_text, &bad_pos);
+    ASSERT_TRUE(result == 21,
                 "correct return value");
     ASSERT_TRUE(strcmp(test_text, "Hello there Everyone.") == 0,
                 "correct resulting string");
@@ -105,10 +124,11 @@ const char* test_cleanup_string_fix_multiline() {
     return NULL;
 }
 
-const char* test_cleanup_string_fix_multiline_codes() {
+const char* test_decode_string_fix_multiline_codes() {
+    size_t bad_pos;
     char test_text[] = "Hello \\\"there\\\"      \n\n     \\\"Everyone\\\".";
-    int result = cleanup_string(test_text);
-    ASSERT_TRUE(result == 0,
+    int result = decode_string(test_text, strlen(test_text), test_text, &bad_pos);
+    ASSERT_TRUE(result == 25,
                 "correct return value");
     ASSERT_TRUE(strcmp(test_text, "Hello \"there\" \"Everyone\".") == 0,
                 "correct resulting string");
@@ -116,6 +136,85 @@ const char* test_cleanup_string_fix_multiline_codes() {
     return NULL;
 }
 
+const char* test_decode_string_new_codes() {
+    size_t bad_pos;
+    char test_text[] = "\\t\\x41\\u{e9}\\u{20AC}\\u{1F600}";
+    int result = decode_string(test_text, strlen(test_text), test_text, &bad_pos);
+    ASSERT_TRUE(result == 11,
+                "correct return value");
+    ASSERT_TRUE(strcmp(test_text, "\tA\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80") == 0,
+                "handled tab, hex and unicode escape codes");
+
+    return NULL;
+}
+
+const char* test_decode_string_bad_numeric_codes() {
+    const char *bad_codes[] = {
+        "ab\\x4", "ab\\xg1", "ab\\x00", "ab\\u41", "ab\\u{}", "ab\\u{41",
+        "ab\\u{110000}", "ab\\u{D800}", "ab\\u{1234567}", NULL
+    };
+    char out[32];
+    for (int i = 0; bad_codes[i]; ++i) {
+        size_t bad_pos = 0;
+        int result = decode_string(bad_codes[i], strlen(bad_codes[i]), out, &bad_pos);
+        ASSERT_TRUE(result < 0,
+                    "bad escape code rejected");
+        ASSERT_TRUE(bad_pos == 2,
+                    "position of bad escape code reported");
+    }
+
+    return NULL;
+}
+
+const char* test_decode_string_unterminated_source() {
+    size_t bad_pos;
+    const char *source = "one\\ttwo\\nthree";
+    char out[32];
+    int result = decode_string(source, 8, out, &bad_pos);
+    ASSERT_TRUE(result == 7,
+                "correct return value");
+    ASSERT_TRUE(strcmp(out, "one\ttwo") == 0,
+                "only the given length is decoded");
+
+    return NULL;
+}
+
+const char* test_decode_string_many_codes() {
+    static char test_text[200001];
+    size_t bad_pos;
+    for (int i = 0; i < 200000; i += 2) {
+        test_text[i] = '\\';
+        test_text[i + 1] = 'n';
+    }
+    test_text[200000] = 0;
+    int result = decode_string(test_text, 200000, test_text, &bad_pos);
+    ASSERT_TRUE(result == 100000,
+                "correct return value");
+    ASSERT_TRUE(test_text[0] == '\n' && test_text[99999] == '\n' && test_text[100000] == 0,
+                "all escape codes decoded");
+
+    return NULL;
+}
+
+const char* test_utf8_encode() {
+    const int codepoints[] = { 0x24, 0xA2, 0x20AC, 0x10348 };
+    const char *text = "\x24\xC2\xA2\xE2\x82\xAC\xF0\x90\x8D\x88";
+    char out[16];
+    int length = 0;
+    for (int i = 0; i < 4; ++i) {
+        length += utf8_encode(&out[length], codepoints[i]);
+    }
+    ASSERT_TRUE(length == 10, "correct encoded length");
+    ASSERT_TRUE(memcmp(out, text, 10) == 0, "correct encoded bytes");
+
+    int pos = 0;
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_TRUE(utf8_next_char(out, &pos) == codepoints[i], "encoding round trips");
+    }
+
+    return NULL;
+}
+
 const char* test_utf8_next_char() {
     const char *text = "\x24\xC2\xA2\xE2\x82\xAC\xF0\x90\x8D\x88";
     int pos = 0;
@@ -155,6 +155,91 @@ const char* test_vbuffer_readfile(void) {
     return NULL;
 }
 
+const char* test_vbuffer_writefile(void) {
+    struct vbuffer *buffer = vbuffer_new();
+    struct vbuffer *copy = vbuffer_new();
+    ASSERT_TRUE(buffer && copy, "buffers are created");
+
+    for (int i = 0; i < 100000; ++i) {
+        vbuffer_pushword(buffer, i * 2654435761u);
+    }
+    ASSERT_TRUE(vbuffer_writefile(buffer, "test_vbuffer_out.bin"), "reported success");
+    ASSERT_TRUE(vbuffer_readfile(copy, "test_vbuffer_out.bin"), "written file read back");
+    ASSERT_TRUE(copy->length == buffer->length, "whole buffer written");
+    ASSERT_TRUE(memcmp(copy->data, buffer->data, buffer->length) == 0, "file has buffer's contents");
+    remove("test_vbuffer_out.bin");
+
+    vbuffer_free(copy);
+    vbuffer_free(buffer);
+    return NULL;
+}
+
+const char* test_vbuffer_reserve(void) {
+    struct vbuffer *buffer = vbuffer_new();
+    ASSERT_TRUE(buffer, "buffer is created");
+
+    ASSERT_TRUE(vbuffer_reserve(buffer, 1000), "reported success");
+    ASSERT_TRUE(buffer->capacity >= 1000, "room made for reserved bytes");
+    ASSERT_TRUE(buffer->length == 0, "reserving adds no content");
+    char *data = buffer->data;
+    size_t capacity = buffer->capacity;
+    for (int i = 0; i < 1000; ++i) {
+        vbuffer_pushchar(buffer, i);
+    }
+    ASSERT_TRUE(buffer->data == data && buffer->capacity == capacity, "reserved room used without growing");
+    ASSERT_TRUE(vbuffer_reserve(buffer, 0), "reserving nothing succeeds");
+    ASSERT_TRUE(!vbuffer_reserve(buffer, (size_t)-1), "impossible size refused");
+    ASSERT_TRUE(buffer->length == 1000, "content kept after refusal");
+
+    vbuffer_free(buffer);
+    return NULL;
+}
+
+const char* test_vbuffer_append(void) {
+    struct vbuffer *buffer = vbuffer_new();
+    ASSERT_TRUE(buffer, "buffer is created");
+
+    ASSERT_TRUE(vbuffer_append(buffer, "glulx", 5), "reported success");
+    ASSERT_TRUE(vbuffer_append(buffer, NULL, 0), "empty append succeeds");
+    ASSERT_TRUE(vbuffer_append(buffer, "-assemble", 9), "second append succeeds");
+    ASSERT_TRUE(buffer->length == 14, "buffer is correct size");
+    ASSERT_TRUE(memcmp(buffer->data, "glulx-assemble", 14) == 0, "buffer has correct contents");
+
+    vbuffer_free(buffer);
+    return NULL;
+}
+
+const char* test_vbuffer_fill(void) {
+    struct vbuffer *buffer = vbuffer_new();
+    ASSERT_TRUE(buffer, "buffer is created");
+
+    vbuffer_pushchar(buffer, 1);
+    ASSERT_TRUE(vbuffer_fill(buffer, (char)0xAB, 300), "reported success");
+    ASSERT_TRUE(vbuffer_fill(buffer, 0x11, 0), "empty fill succeeds");
+    ASSERT_TRUE(buffer->length == 301, "buffer is correct size");
+    ASSERT_TRUE(buffer->data[0] == 1, "earlier content kept");
+    ASSERT_TRUE(buffer->data[1] == (char)0xAB && buffer->data[300] == (char)0xAB, "bytes filled");
+
+    vbuffer_free(buffer);
+    return NULL;
+}
+
+const char* test_vbuffer_pushwords(void) {
+    struct vbuffer *buffer = vbuffer_new();
+    ASSERT_TRUE(buffer, "buffer is created");
+    unsigned words[] = { 0x12345678, 0xDEADBEEF, 0 };
+
+    vbuffer_pushchar(buffer, 7);
+    ASSERT_TRUE(vbuffer_pushwords(buffer, words, 3), "reported success");
+    ASSERT_TRUE(buffer->length == 13, "buffer is correct size");
+    ASSERT_TRUE(buffer->data[1] == 0x12 && buffer->data[4] == 0x78, "first word is big-endian");
+    ASSERT_TRUE(buffer->data[5] == (char)0xDE && buffer->data[8] == (char)0xEF, "second word is big-endian");
+    ASSERT_TRUE(buffer->data[12] == 0, "last word written");
+
+    vbuffer_free(buffer);
+    return NULL;
+}
+
 const char* test_vbuffer_pad_by(void) {
     struct vbuffer *buffer = vbuffer_new();
     ASSERT_TRUE(buffer, "buffer is created");
@@ -200,8 +285,13 @@ struct test_def test_list[] = {
     {   "vbuffer_setshort",                         test_vbuffer_setshort },
     {   "vbuffer_setword",                          test_vbuffer_setword },
     {   "vbuffer_readfile",                         test_vbuffer_readfile },
+    {   "vbuffer_writefile",                        test_vbuffer_writefile },
     {   "vbuffer_pad_to",                           test_vbuffer_pad_to },
     {   "vbuffer_pad_by",                           test_vbuffer_pad_by },
+    {   "vbuffer_reserve",                          test_vbuffer_reserve },
+    {   "vbuffer_append",                           test_vbuffer_append },
+    {   "vbuffer_fill",                             test_vbuffer_fill },
+    {   "vbuffer_pushwords",                        test_vbuffer_pushwords },
 
     {   NULL,                                       NULL }
 };